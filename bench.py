@@ -0,0 +1,90 @@
+#!/usr/bin/python3
+
+# Runs src/unionfs-bench over a matrix of stacks and writes all results as
+# one JSON document, to be compared between commits or options, e.g.
+#
+#	./bench.py --out before.json
+#	./bench.py --options lookup_cache=10000 --out after.json
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+
+# branches, cow, whiteouts
+STACKS = [(b, cow, w) for b in (1, 2, 4, 16, 64) for cow in (False, True) for w in (0, 10000)]
+QUICK_STACKS = [(b, cow, w) for b in (1, 4, 16) for cow in (False, True) for w in (0, 1000)]
+
+READDIR_ENTRIES = [10**3, 10**4, 10**5, 10**6]
+QUICK_READDIR_ENTRIES = [10**3, 10**4]
+
+# getattr_threads runs 1, 2, 4 ... up to this many threads
+THREADS = 64
+QUICK_THREADS = 8
+
+# the caches and indexes shared by the threads
+SHARED_OPTIONS = ['cow', 'lookup_cache=100000', 'whiteout_index', 'xattr_cache=10000']
+
+
+def run(bench, branches, options, whiteouts=0, entries=1000, tests=None, quick=False, runs=5, size=None,
+		threads=None):
+	cmd = [bench, '-b', str(branches), '-w', str(whiteouts), '-e', str(entries), '-r', str(runs)]
+	if quick:
+		cmd += ['-n', '1000', '-f', '20', '-s', '4']
+	if size:
+		cmd += ['-s', str(size)]
+	if threads:
+		cmd += ['-j', str(threads)]
+	if tests:
+		cmd += ['-t', tests]
+	if options:
+		cmd += ['-o', ','.join(options)]
+
+	print(' '.join(cmd), file=sys.stderr)
+	return json.loads(subprocess.check_output(cmd))
+
+
+def main():
+	parser = argparse.ArgumentParser(description='unionfs microbenchmarks')
+	parser.add_argument('--bench', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'src', 'unionfs-bench'),
+			help='the unionfs-bench binary')
+	parser.add_argument('--options', action='append', default=[],
+			help='unionfs options for all stacks, e.g. lookup_cache=1000')
+	parser.add_argument('--runs', type=int, default=5, help='runs of every benchmark')
+	parser.add_argument('--size', type=int, help='MiB of the large files')
+	parser.add_argument('--quick', action='store_true', help='smaller stacks and fewer operations')
+	parser.add_argument('--out', help='write the JSON here instead of stdout')
+	args = parser.parse_args()
+
+	results = []
+	for (branches, cow, whiteouts) in (QUICK_STACKS if args.quick else STACKS):
+		options = args.options + (['cow'] if cow else [])
+		results.append(run(args.bench, branches, options, whiteouts=whiteouts,
+				quick=args.quick, runs=args.runs, size=args.size))
+
+	# readdir by directory size, where the entries are spread over the branches
+	for entries in (QUICK_READDIR_ENTRIES if args.quick else READDIR_ENTRIES):
+		for cow in (False, True):
+			options = args.options + (['cow'] if cow else [])
+			results.append(run(args.bench, 4, options, entries=entries, tests='readdir',
+					quick=args.quick, runs=args.runs))
+
+	# getattr scaling with the threads, without and with the shared caches
+	for shared in (False, True):
+		options = args.options + (SHARED_OPTIONS if shared else ['cow'])
+		results.append(run(args.bench, 4, options, whiteouts=1000, tests='getattr_threads',
+				quick=args.quick, runs=args.runs,
+				threads=QUICK_THREADS if args.quick else THREADS))
+
+	out = json.dumps({'benchmarks': results}, indent=2)
+	if args.out:
+		with open(args.out, 'w') as f:
+			f.write(out + '\n')
+	else:
+		print(out)
+
+
+if __name__ == '__main__':
+	main()
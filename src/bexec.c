@@ -0,0 +1,320 @@
+/*
+* Description: per-branch worker threads for the branch syscalls
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Usually the libfuse threads do the syscalls on the branches themselves,
+*	so a stalled branch (a hanging NFS server) takes one libfuse thread
+*	after the other until none is left for requests which only need the
+*	other branches. With -o branch_threads=number every branch gets its
+*	own workers and the syscalls of branchio.c, the reads and writes of
+*	open files and the copy-up of files are run by them. The caller waits
+*	for at most -o branch_timeout milliseconds and fails with ETIMEDOUT
+*	after that, the worker finishes the call on its own and throws the
+*	result away (the job owns copies of all arguments and buffers).
+*	Copy-ups are waited for without a timeout, they only share the workers.
+*	At most BEXEC_QUEUE_SIZE calls wait for the workers of a branch, more
+*	fail at once. A branch with a timed out call is degraded until one of
+*	its calls finishes in time again; while all its workers are busy, new
+*	calls then fail at once instead of waiting for the timeout as well.
+*	Calls made by a worker itself (e.g. path_create() during a copy-up)
+*	are done directly.
+*	The workers are started in init(), as threads do not survive
+*	daemonizing; until then all calls are done directly. They belong to
+*	the branch entry, so they move with the branch in the branch table
+*	(see btable.c), and stop once the branch was removed. A job holds a
+*	reference on the table of its caller and runs on it.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "bexec.h"
+#include "debug.h"
+#include "usyslog.h"
+
+struct bexec_branch {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		// a job was queued
+	pthread_cond_t done;		// a job finished
+	struct bexec_job *first, *last;	// queued jobs
+	unsigned int queued;
+	unsigned int busy;		// workers running a job
+	bool degraded;
+	uint64_t calls;
+	uint64_t timeouts;
+	uint64_t rejected;
+	unsigned int threads;		// workers running
+	bool stop;			// the branch was removed
+};
+
+static bool started = false;
+static __thread bool in_worker;
+
+static void free_branch(struct bexec_branch *b) {
+	pthread_cond_destroy(&b->done);
+	pthread_cond_destroy(&b->work);
+	pthread_mutex_destroy(&b->lock);
+	free(b);
+}
+
+static void *worker(void *arg) {
+	struct bexec_branch *b = arg;
+	in_worker = true;
+
+	pthread_mutex_lock(&b->lock);
+	while (1) {
+		while (!b->first && !b->stop) pthread_cond_wait(&b->work, &b->lock);
+		if (!b->first) break;
+
+		struct bexec_job *job = b->first;
+		b->first = job->next;
+		if (!b->first) b->last = NULL;
+		b->queued--;
+		b->busy++;
+		job->ran = true;
+		pthread_mutex_unlock(&b->lock);
+
+		// the caller frees job once it is done
+		struct btable *table = job->table;
+		struct btable *prev = btable_adopt(table);
+		job->res = job->fn(job);
+		job->err = errno;
+		btable_adopt(prev);
+
+		pthread_mutex_lock(&b->lock);
+		b->busy--;
+		if (job->abandoned) {
+			if (job->abandon) job->abandon(job);
+			free(job);
+		} else {
+			job->done = true;
+			b->degraded = false;
+			pthread_cond_broadcast(&b->done);
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		// might be the last reference on the branch, which stops us
+		btable_unref(table);
+
+		pthread_mutex_lock(&b->lock);
+	}
+
+	bool last = --b->threads == 0;
+	pthread_mutex_unlock(&b->lock);
+
+	if (last) free_branch(b);
+
+	return NULL;
+}
+
+/**
+ * Start the workers of branch, once bexec_start() was called. Returns 0 or
+ * -errno.
+ */
+int bexec_branch_start(branch_entry_t *branch) {
+	if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) return 0;
+
+	struct bexec_branch *b = calloc(1, sizeof(struct bexec_branch));
+	if (!b) return -ENOMEM;
+
+	pthread_condattr_t condattr;
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->work, NULL);
+	pthread_cond_init(&b->done, &condattr);
+	pthread_condattr_destroy(&condattr);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	int res = 0;
+	pthread_mutex_lock(&b->lock);
+	while (b->threads < uopt.branch_threads) {
+		pthread_t thread;
+		res = -pthread_create(&thread, &attr, worker, b);
+		if (res) break;
+		b->threads++;
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	pthread_attr_destroy(&attr);
+
+	if (res) {
+		USYSLOG(LOG_ERR, "Starting the workers of branch %s failed: %s\n",
+			branch->path, strerror(-res));
+		bexec_branch_stop(b);
+		return res;
+	}
+
+	branch->exec = b;
+	return 0;
+}
+
+/**
+ * Stop the workers of a removed branch, nobody can queue jobs anymore.
+ */
+void bexec_branch_stop(struct bexec_branch *b) {
+	pthread_mutex_lock(&b->lock);
+
+	b->stop = true;
+	pthread_cond_broadcast(&b->work);
+	bool none = b->threads == 0;
+
+	pthread_mutex_unlock(&b->lock);
+
+	if (none) free_branch(b);
+}
+
+/**
+ * Start -o branch_threads workers for every branch, from init().
+ */
+void bexec_start(void) {
+	if (!uopt.branch_threads) return;
+
+	__atomic_store_n(&started, true, __ATOMIC_RELEASE);
+
+	int i;
+	for (i = 0; i < NBRANCHES; i++) {
+		// a branch without workers would never finish a call
+		if (bexec_branch_start(&BRANCH(i))) {
+			USYSLOG(LOG_ERR, "No workers for branch %d, aborting!\n", i);
+			exit(1);
+		}
+	}
+}
+
+/**
+ * Whether the calls on branch are to be run by bexec_run().
+ */
+bool bexec_active(int branch) {
+	return !in_worker && branch >= 0 && branch < NBRANCHES && BRANCH(branch).exec;
+}
+
+/**
+ * Run job by a worker of branch. Returns true once the job is done, the
+ * caller then frees it. Otherwise errno is ETIMEDOUT and the job belongs
+ * to the workers now, job->abandon() is called once it is dropped, whether
+ * job->fn() ran or not.
+ * Without timeout job is waited for until it is done.
+ */
+bool bexec_run(int branch, struct bexec_job *job, bool timeout) {
+	struct bexec_branch *b = BRANCH(branch).exec;
+
+	job->next = NULL;
+	job->ran = false;
+	job->done = false;
+	job->abandoned = false;
+
+	pthread_mutex_lock(&b->lock);
+	b->calls++;
+
+	if (b->queued >= BEXEC_QUEUE_SIZE || (b->degraded && timeout && b->busy + b->queued >= uopt.branch_threads)) {
+		b->rejected++;
+		pthread_mutex_unlock(&b->lock);
+
+		DBG("branch %d rejected\n", branch);
+		if (job->abandon) job->abandon(job);
+		free(job);
+		errno = ETIMEDOUT;
+		return false;
+	}
+
+	job->table = btable_ref();
+	if (b->last)
+		b->last->next = job;
+	else
+		b->first = job;
+	b->last = job;
+	b->queued++;
+	pthread_cond_signal(&b->work);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += uopt.branch_timeout / 1000;
+	deadline.tv_nsec += (long)(uopt.branch_timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	while (!job->done) {
+		if (!timeout) {
+			pthread_cond_wait(&b->done, &b->lock);
+		} else if (pthread_cond_timedwait(&b->done, &b->lock, &deadline) == ETIMEDOUT && !job->done) {
+			break;
+		}
+	}
+
+	if (!job->done) {
+		b->timeouts++;
+		if (!b->degraded)
+			USYSLOG(LOG_WARNING, "Branch %s did not answer within %u ms, degraded\n",
+				BRANCH(branch).path, uopt.branch_timeout);
+		b->degraded = true;
+
+		struct bexec_job *prev = NULL, *j;
+		for (j = b->first; j && j != job; j = j->next) prev = j;
+		if (j) {
+			// still queued, nobody ran it
+			if (prev)
+				prev->next = job->next;
+			else
+				b->first = job->next;
+			if (b->last == job) b->last = prev;
+			b->queued--;
+		} else {
+			job->abandoned = true;
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		if (j) {
+			btable_unref(job->table);
+			if (job->abandon) job->abandon(job);
+			free(job);
+		}
+
+		errno = ETIMEDOUT;
+		return false;
+	}
+
+	pthread_mutex_unlock(&b->lock);
+	return true;
+}
+
+/**
+ * Add the state of the workers to stats.
+ */
+void bexec_get(struct unionfs_stats *stats) {
+	if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) return;
+
+	stats->branch_threads = uopt.branch_threads;
+
+	int i;
+	for (i = 0; i < NBRANCHES && i < STATS_BRANCHES; i++) {
+		struct bexec_branch *b = BRANCH(i).exec;
+		struct unionfs_branch_exec *e = &stats->branch_exec[i];
+		if (!b) continue;
+
+		pthread_mutex_lock(&b->lock);
+		e->queued = b->queued;
+		e->busy = b->busy;
+		e->degraded = b->degraded;
+		e->calls = b->calls;
+		e->timeouts = b->timeouts;
+		e->rejected = b->rejected;
+		pthread_mutex_unlock(&b->lock);
+	}
+}
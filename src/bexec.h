@@ -0,0 +1,40 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef BEXEC_H
+#define BEXEC_H
+
+#include <stdbool.h>
+
+#include "unionfs.h"
+#include "stats.h"
+
+#define BEXEC_DEFAULT_TIMEOUT 10000	// -o branch_timeout, milliseconds
+#define BEXEC_QUEUE_SIZE 64		// calls waiting for a worker of a branch, beyond they fail
+
+struct btable;
+
+// a call run by a worker of a branch, allocated by the caller
+struct bexec_job {
+	struct bexec_job *next;
+	struct btable *table;	// of the caller, the job runs on it
+	long (*fn)(struct bexec_job *job);
+	void (*abandon)(struct bexec_job *job); // the caller gave up, free what fn returned
+	long res;		// of fn
+	int err;		// errno after fn
+	bool ran;		// fn was called
+	bool done;
+	bool abandoned;
+};
+
+void bexec_start(void);
+int bexec_branch_start(branch_entry_t *branch);
+void bexec_branch_stop(struct bexec_branch *b);
+bool bexec_active(int branch);
+bool bexec_run(int branch, struct bexec_job *job, bool timeout);
+void bexec_get(struct unionfs_stats *stats);
+
+#endif
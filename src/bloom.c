@@ -0,0 +1,424 @@
+/*
+* Description: Bloom filters of the paths on read-only branches
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	With many read-only branches (image layers) most lookups probe branches
+*	which do not have the path: find_branch() does an lstat() for the path
+*	and for the whiteouts of every path component, readdir() an opendir(),
+*	on every branch down to the one with the path. With -o bloom we keep a
+*	Bloom filter of all paths of each ro-branch and skip these syscalls if
+*	the filter says the path is not there (see branchio.c). A filter has no
+*	false negatives, a false positive (~1%) just costs the syscall.
+*	The filters are built on mount by BLOOM_THREADS background threads,
+*	until then a branch is looked up as before. Branches with a prebuilt
+*	filter (BLOOM_FILE, written by unionfs-index) are not scanned.
+*	Branches added while mounted get no filter, a branch made writable
+*	loses its filter (see btable.c).
+*	lstat() follows symlinks of the parent directories, so the targets
+*	of symlinks are not known to the filter. We also record which paths are
+*	symlinks and do not trust the filter for paths below them.
+*	Read-only branches must not change while mounted, a path added behind
+*	our back would not be found. The same applies to prebuilt filters,
+*	which must be rebuilt whenever the branch changes.
+*/
+
+#if defined __linux__
+	// For *at() functions
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "bloom.h"
+#include "string.h"
+#include "debug.h"
+#include "usyslog.h"
+
+#define BLOOM_MIN_BITS_LOG2 6
+#define BLOOM_MAX_BITS_LOG2 40
+#define BLOOM_SYMLINK_SEED 0x9e3779b97f4a7c15ULL // key of "path is a symlink"
+
+struct bloom {
+	uint32_t hashes;
+	uint32_t bits_log2;
+	uint64_t keys;
+	uint64_t *bits;
+};
+
+// hashes collected while scanning a branch
+struct bloom_keys {
+	uint64_t *hashes;
+	size_t count;
+	size_t size;
+};
+
+static unsigned int next_branch;	// the next branch a builder thread takes
+
+static int add_key(struct bloom_keys *keys, uint64_t hash) {
+	if (keys->count == keys->size) {
+		size_t size = keys->size ? keys->size * 2 : 1024;
+		uint64_t *hashes = realloc(keys->hashes, size * sizeof(uint64_t));
+		if (!hashes) return -1;
+
+		keys->hashes = hashes;
+		keys->size = size;
+	}
+
+	keys->hashes[keys->count++] = hash;
+	return 0;
+}
+
+static uint64_t key_hash(const char *path, size_t len) {
+	return string_hash64(path, len);
+}
+
+static uint64_t symlink_hash(const char *path, size_t len) {
+	return string_hash64(path, len) ^ BLOOM_SYMLINK_SEED;
+}
+
+// the bits of a key are hash + i * step (double hashing)
+static uint64_t step(uint64_t hash) {
+	return (hash >> 32 | hash << 32) | 1;
+}
+
+static void set(struct bloom *bloom, uint64_t hash) {
+	uint64_t mask = ((uint64_t)1 << bloom->bits_log2) - 1;
+	uint64_t s = step(hash);
+
+	uint32_t i;
+	for (i = 0; i < bloom->hashes; i++, hash += s) {
+		uint64_t bit = hash & mask;
+		bloom->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+	}
+}
+
+static bool test(const struct bloom *bloom, uint64_t hash) {
+	uint64_t mask = ((uint64_t)1 << bloom->bits_log2) - 1;
+	uint64_t s = step(hash);
+
+	uint32_t i;
+	for (i = 0; i < bloom->hashes; i++, hash += s) {
+		uint64_t bit = hash & mask;
+		if (!(bloom->bits[bit / 64] & ((uint64_t)1 << (bit % 64)))) return false;
+	}
+	return true;
+}
+
+static size_t bits_bytes(const struct bloom *bloom) {
+	return ((size_t)1 << bloom->bits_log2) / 8;
+}
+
+/**
+ * Add all entries below the directory fd, which is path[0..len), to keys.
+ * Any error fails the scan, a filter missing paths would hide them.
+ */
+static int scan_dir(int fd, char *path, size_t len, struct bloom_keys *keys) {
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		int _errno = errno;
+		close(fd);
+		errno = _errno;
+		return -1;
+	}
+
+	int res = 0;
+	struct dirent *de;
+	while (1) {
+		errno = 0;
+		de = readdir(dp);
+		if (de == NULL) {
+			if (errno) res = -1;
+			break;
+		}
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		size_t name_len = strlen(de->d_name);
+		size_t sub_len = len ? len + 1 + name_len : name_len;
+		if (sub_len >= PATHLEN_MAX) continue; // too long to be looked up anyway
+
+		if (len) path[len] = '/';
+		memcpy(path + (len ? len + 1 : 0), de->d_name, name_len + 1);
+
+		bool is_dir, is_link;
+#ifdef DT_DIR
+		if (de->d_type != DT_UNKNOWN) {
+			is_dir = de->d_type == DT_DIR;
+			is_link = de->d_type == DT_LNK;
+		} else
+#endif
+		{
+			struct stat st;
+			if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+				res = -1;
+				break;
+			}
+			is_dir = S_ISDIR(st.st_mode);
+			is_link = S_ISLNK(st.st_mode);
+		}
+
+		if (add_key(keys, key_hash(path, sub_len))) {
+			res = -1;
+			break;
+		}
+		if (is_link && add_key(keys, symlink_hash(path, sub_len))) {
+			res = -1;
+			break;
+		}
+
+		if (is_dir) {
+			int sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (sub == -1 || scan_dir(sub, path, sub_len, keys)) {
+				res = -1;
+				break;
+			}
+		}
+	}
+
+	int _errno = errno;
+	closedir(dp);
+	errno = _errno;
+
+	path[len] = '\0';
+	return res;
+}
+
+/**
+ * Build the filter of the branch directory dirfd. Returns NULL and sets
+ * errno on failure.
+ */
+struct bloom *bloom_build(int dirfd) {
+	struct bloom_keys keys = { NULL, 0, 0 };
+	struct bloom *bloom = NULL;
+
+	int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1) return NULL;
+
+	char path[PATHLEN_MAX] = "";
+	if (scan_dir(fd, path, 0, &keys)) goto out;
+
+	// the prebuilt filter, which is written after the scan
+	if (add_key(&keys, key_hash(METANAME, strlen(METANAME)))) goto out;
+	if (add_key(&keys, key_hash(BLOOM_FILE, strlen(BLOOM_FILE)))) goto out;
+
+	bloom = calloc(1, sizeof(struct bloom));
+	if (!bloom) goto out;
+
+	bloom->hashes = BLOOM_HASHES;
+	bloom->keys = keys.count;
+	bloom->bits_log2 = BLOOM_MIN_BITS_LOG2;
+	while (((uint64_t)1 << bloom->bits_log2) < keys.count * BLOOM_BITS_PER_KEY)
+		bloom->bits_log2++;
+
+	bloom->bits = calloc(1, bits_bytes(bloom));
+	if (!bloom->bits) {
+		free(bloom);
+		bloom = NULL;
+		goto out;
+	}
+
+	size_t i;
+	for (i = 0; i < keys.count; i++) set(bloom, keys.hashes[i]);
+
+out:
+	free(keys.hashes);
+	if (!bloom && !errno) errno = ENOMEM;
+	return bloom;
+}
+
+/**
+ * Load the prebuilt filter of the branch directory dirfd. Returns NULL and
+ * sets errno if there is none or it is broken.
+ */
+struct bloom *bloom_load(int dirfd) {
+	int fd = openat(dirfd, BLOOM_FILE, O_RDONLY);
+	if (fd == -1) return NULL;
+
+	struct bloom *bloom = NULL;
+	struct bloom_header header;
+	struct stat st;
+
+	if (read(fd, &header, sizeof(header)) != sizeof(header) || fstat(fd, &st) == -1) goto invalid;
+	if (memcmp(header.magic, BLOOM_MAGIC, sizeof(header.magic)) != 0
+	|| header.hashes == 0 || header.hashes > 32
+	|| header.bits_log2 < BLOOM_MIN_BITS_LOG2 || header.bits_log2 > BLOOM_MAX_BITS_LOG2)
+		goto invalid;
+
+	bloom = calloc(1, sizeof(struct bloom));
+	if (!bloom) goto out;
+
+	bloom->hashes = header.hashes;
+	bloom->bits_log2 = header.bits_log2;
+	bloom->keys = header.keys;
+	if ((uint64_t)st.st_size != sizeof(header) + bits_bytes(bloom)) goto invalid;
+
+	bloom->bits = malloc(bits_bytes(bloom));
+	if (!bloom->bits) goto out;
+	if (read(fd, bloom->bits, bits_bytes(bloom)) != (ssize_t)bits_bytes(bloom)) goto invalid;
+
+	close(fd);
+	return bloom;
+
+invalid:
+	errno = EINVAL;
+out:
+	bloom_free(bloom);
+	int _errno = errno;
+	close(fd);
+	errno = _errno;
+	return NULL;
+}
+
+/**
+ * Write the filter as prebuilt filter of the branch directory dirfd.
+ * Returns 0 or -errno.
+ */
+int bloom_save(const struct bloom *bloom, int dirfd) {
+	if (mkdirat(dirfd, METANAME, 0755) == -1 && errno != EEXIST) return -errno;
+
+	const char *tmp = BLOOM_FILE ".tmp";
+	int fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) return -errno;
+
+	struct bloom_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BLOOM_MAGIC, sizeof(header.magic));
+	header.hashes = bloom->hashes;
+	header.bits_log2 = bloom->bits_log2;
+	header.keys = bloom->keys;
+
+	int res = 0;
+	if (write(fd, &header, sizeof(header)) != sizeof(header)
+	|| write(fd, bloom->bits, bits_bytes(bloom)) != (ssize_t)bits_bytes(bloom)
+	|| fsync(fd) == -1)
+		res = errno ? -errno : -EIO;
+	if (close(fd) == -1 && !res) res = -errno;
+
+	// replace the old filter only with a complete one
+	if (!res && renameat(dirfd, tmp, dirfd, BLOOM_FILE) == -1) res = -errno;
+	if (res) unlinkat(dirfd, tmp, 0);
+
+	return res;
+}
+
+uint64_t bloom_keys(const struct bloom *bloom) {
+	return bloom->keys;
+}
+
+void bloom_free(struct bloom *bloom) {
+	if (!bloom) return;
+	free(bloom->bits);
+	free(bloom);
+}
+
+// arg is a reference on the branch table of the mount
+static void *builder(void *arg) {
+	struct btable *table = arg;
+	btable_adopt(table);
+
+	while (1) {
+		int i = __atomic_fetch_add(&next_branch, 1, __ATOMIC_RELAXED);
+		if (i >= NBRANCHES) break;
+		if (BRANCH(i).rw) continue; // changes all the time
+		if (BRANCH(i).manifest) continue; // knows better already
+
+		const char *how = "loaded";
+		struct bloom *bloom = bloom_load(BRANCH(i).fd);
+		if (!bloom) {
+			how = "built";
+			bloom = bloom_build(BRANCH(i).fd);
+		}
+		if (!bloom) {
+			USYSLOG(LOG_WARNING, "No Bloom filter for branch %s: %s\n",
+				BRANCH(i).path, strerror(errno));
+			continue;
+		}
+
+		DBG("branch %d: %s filter of %llu paths\n", i, how, (unsigned long long)bloom->keys);
+
+		// the branches might have changed in the mean time
+		if (!btable_set_bloom(BRANCH(i).path, bloom)) bloom_free(bloom);
+	}
+
+	btable_adopt(NULL);
+	btable_unref(table);
+
+	return NULL;
+}
+
+/**
+ * Start building the filters, called once the file system is mounted (the
+ * threads would not survive daemonizing).
+ */
+void bloom_start(void) {
+	if (!uopt.bloom) return;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	int i;
+	for (i = 0; i < BLOOM_THREADS && i < NBRANCHES; i++) {
+		pthread_t thread;
+		struct btable *table = btable_ref();
+		int res = pthread_create(&thread, &attr, builder, table);
+		if (res) {
+			btable_unref(table);
+			USYSLOG(LOG_WARNING, "Failed to start a Bloom filter thread: %s\n", strerror(res));
+			break;
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Check if path, relative to branch, might exist. If false, it does not.
+ */
+bool bloom_may_exist(int branch, const char *path) {
+	const struct bloom *bloom = __atomic_load_n(&BRANCH(branch).bloom, __ATOMIC_ACQUIRE);
+	if (!bloom) return true;
+
+	// the key: no leading, trailing or duplicate slashes
+	char key[PATHLEN_MAX];
+	size_t len = 0;
+
+	while (*path) {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+
+		const char *name = path;
+		while (*path && *path != '/') path++;
+		size_t name_len = path - name;
+
+		if (name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.'))) return true;
+		if (len + 1 + name_len >= PATHLEN_MAX) return true;
+
+		if (len) {
+			// beyond a symlink the filter does not know anything
+			if (test(bloom, symlink_hash(key, len))) return true;
+			key[len++] = '/';
+		}
+		memcpy(key + len, name, name_len);
+		len += name_len;
+	}
+
+	if (len == 0) return true; // the branch itself
+
+	return test(bloom, key_hash(key, len));
+}
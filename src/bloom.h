@@ -0,0 +1,40 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "unionfs.h"
+
+#define BLOOM_MAGIC "UFSBLM01"
+#define BLOOM_FILE METANAME "/.bloom"	// prebuilt filter of a branch, written by unionfs-index
+#define BLOOM_HASHES 7			// bits per key, ~1% false positives
+#define BLOOM_BITS_PER_KEY 10		// at least, the size is rounded up to a power of two
+#define BLOOM_THREADS 4			// branches scanned at the same time on mount
+
+// the sidecar file is a struct bloom_header followed by the bit array
+struct bloom_header {
+	char magic[8];
+	uint32_t hashes;
+	uint32_t bits_log2;
+	uint64_t keys;
+};
+
+struct bloom;
+
+struct bloom *bloom_build(int dirfd);
+struct bloom *bloom_load(int dirfd);
+int bloom_save(const struct bloom *bloom, int dirfd);
+uint64_t bloom_keys(const struct bloom *bloom);
+void bloom_free(struct bloom *bloom);
+
+void bloom_start(void);
+bool bloom_may_exist(int branch, const char *path);
+
+#endif
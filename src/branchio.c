@@ -0,0 +1,700 @@
+/*
+* Description: file operations relative to a branch
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	We keep an open file descriptor of every branch anyway (to prevent
+*	accidental umounts), so with *at() support (see conf.h) we use it as
+*	starting point of the path lookup. That saves us from building the full
+*	path with BUILD_PATH() and the kernel from resolving the branch prefix
+*	again and again, which is especially expensive if branches are on
+*	network filesystems. Paths given to these functions are relative to the
+*	branch, just as libfuse gives them to us, e.g. "/dir/file".
+*	Without *at() support we fall back to BUILD_PATH() and the classical
+*	functions.
+*	Lookups and opendir() are skipped if the Bloom filter of a read-only
+*	branch (-o bloom) says path is not there. Lookups, readlink() and
+*	directory reads of a RO+IDX branch are answered from its manifest
+*	(see manifest.c), with b_dir_open() instead of b_opendir().
+*/
+
+#if defined __linux__
+	// For *at() functions
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "conf.h"
+#include "unionfs.h"
+#include "opts.h"
+#include "btable.h"
+#include "string.h"
+#include "branchio.h"
+#include "debug.h"
+#include "bloom.h"
+#include "manifest.h"
+#include "bexec.h"
+
+/**
+ * Return from the calling function with ENOENT if the Bloom filter of
+ * branch knows path does not exist, see bloom.c
+ */
+#define BLOOM_CHECK(branch, path, err) \
+	if (!bloom_may_exist(branch, path)) { \
+		errno = ENOENT; \
+		return err; \
+	}
+
+/**
+ * Look up path in the manifest of branch, entry is NULL if there is none
+ * or it does not know path. Return from the calling function with ENOENT
+ * if the manifest knows path does not exist.
+ */
+#define MANIFEST_LOOKUP(entry, branch, path, err) \
+	const struct manifest_entry *entry = NULL; \
+	if (BRANCH(branch).manifest) { \
+		bool unknown; \
+		entry = manifest_lookup(BRANCH(branch).manifest, path, &unknown); \
+		if (!entry && !unknown) { \
+			errno = ENOENT; \
+			return err; \
+		} \
+	}
+
+/**
+ * readlink() of the manifest entry, which must be a symlink
+ */
+static ssize_t manifest_readlink(int branch, const struct manifest_entry *e, char *buf, size_t size) {
+	if (!S_ISLNK(e->mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t len = e->target_len < size ? e->target_len : size;
+	memcpy(buf, manifest_string(BRANCH(branch).manifest, e->target), len);
+	return len;
+}
+
+#ifdef UNIONFS_HAVE_AT
+
+/**
+ * Convert path to a path relative to the branch directory
+ */
+static const char *rel(const char *path) {
+	while (*path == '/') path++;
+	if (*path == '\0') return ".";
+	return path;
+}
+
+#define BFD(branch) (BRANCH(branch).fd)
+
+static int raw_lstat(int branch, const char *path, struct stat *st) {
+	BLOOM_CHECK(branch, path, -1);
+	MANIFEST_LOOKUP(e, branch, path, -1);
+	if (e) {
+		manifest_stat(e, st);
+		return 0;
+	}
+	return fstatat(BFD(branch), rel(path), st, AT_SYMLINK_NOFOLLOW);
+}
+
+static int raw_stat(int branch, const char *path, struct stat *st) {
+	BLOOM_CHECK(branch, path, -1);
+	MANIFEST_LOOKUP(e, branch, path, -1);
+	if (e && !S_ISLNK(e->mode)) {
+		manifest_stat(e, st);
+		return 0;
+	}
+	return fstatat(BFD(branch), rel(path), st, 0);
+}
+
+static int raw_open(int branch, const char *path, int flags, mode_t mode) {
+	return openat(BFD(branch), rel(path), flags, mode);
+}
+
+static DIR *raw_opendir(int branch, const char *path) {
+	BLOOM_CHECK(branch, path, NULL);
+	MANIFEST_LOOKUP(e, branch, path, NULL);
+	if (e && !S_ISDIR(e->mode) && !S_ISLNK(e->mode)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+	int fd = openat(BFD(branch), rel(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) return NULL;
+
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		int _errno = errno;
+		close(fd);
+		errno = _errno;
+	}
+
+	return dp;
+}
+
+static int raw_mkdir(int branch, const char *path, mode_t mode) {
+	return mkdirat(BFD(branch), rel(path), mode);
+}
+
+static int raw_mknod(int branch, const char *path, mode_t mode, dev_t rdev) {
+	return mknodat(BFD(branch), rel(path), mode, rdev);
+}
+
+static int raw_unlink(int branch, const char *path) {
+	return unlinkat(BFD(branch), rel(path), 0);
+}
+
+static int raw_rmdir(int branch, const char *path) {
+	return unlinkat(BFD(branch), rel(path), AT_REMOVEDIR);
+}
+
+static int raw_rename(int branch, const char *from, const char *to) {
+	return renameat(BFD(branch), rel(from), BFD(branch), rel(to));
+}
+
+static int raw_link(int branch_from, const char *from, int branch_to, const char *to) {
+	return linkat(BFD(branch_from), rel(from), BFD(branch_to), rel(to), 0);
+}
+
+static int raw_symlink(const char *target, int branch, const char *path) {
+	return symlinkat(target, BFD(branch), rel(path));
+}
+
+static ssize_t raw_readlink(int branch, const char *path, char *buf, size_t size) {
+	MANIFEST_LOOKUP(e, branch, path, -1);
+	if (e) return manifest_readlink(branch, e, buf, size);
+	return readlinkat(BFD(branch), rel(path), buf, size);
+}
+
+static int raw_chmod(int branch, const char *path, mode_t mode) {
+	return fchmodat(BFD(branch), rel(path), mode, 0);
+}
+
+static int raw_lchown(int branch, const char *path, uid_t uid, gid_t gid) {
+	return fchownat(BFD(branch), rel(path), uid, gid, AT_SYMLINK_NOFOLLOW);
+}
+
+static int raw_utimens(int branch, const char *path, const struct timespec ts[2]) {
+	return utimensat(BFD(branch), rel(path), ts, AT_SYMLINK_NOFOLLOW);
+}
+
+#else // UNIONFS_HAVE_AT
+
+/**
+ * Build the full path of path on branch into p, which must have
+ * PATHLEN_MAX bytes. Return from the calling function on error.
+ */
+#define FULL_PATH(p, branch, path, err) \
+	char p[PATHLEN_MAX]; \
+	if (BUILD_PATH(p, BRANCH(branch).path, path)) { \
+		errno = ENAMETOOLONG; \
+		return err; \
+	}
+
+static int raw_lstat(int branch, const char *path, struct stat *st) {
+	BLOOM_CHECK(branch, path, -1);
+	MANIFEST_LOOKUP(e, branch, path, -1);
+	if (e) {
+		manifest_stat(e, st);
+		return 0;
+	}
+	FULL_PATH(p, branch, path, -1);
+	return lstat(p, st);
+}
+
+static int raw_stat(int branch, const char *path, struct stat *st) {
+	BLOOM_CHECK(branch, path, -1);
+	MANIFEST_LOOKUP(e, branch, path, -1);
+	if (e && !S_ISLNK(e->mode)) {
+		manifest_stat(e, st);
+		return 0;
+	}
+	FULL_PATH(p, branch, path, -1);
+	return stat(p, st);
+}
+
+static int raw_open(int branch, const char *path, int flags, mode_t mode) {
+	FULL_PATH(p, branch, path, -1);
+	return open(p, flags, mode);
+}
+
+static DIR *raw_opendir(int branch, const char *path) {
+	BLOOM_CHECK(branch, path, NULL);
+	MANIFEST_LOOKUP(e, branch, path, NULL);
+	if (e && !S_ISDIR(e->mode) && !S_ISLNK(e->mode)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+	FULL_PATH(p, branch, path, NULL);
+	return opendir(p);
+}
+
+static int raw_mkdir(int branch, const char *path, mode_t mode) {
+	FULL_PATH(p, branch, path, -1);
+	return mkdir(p, mode);
+}
+
+static int raw_mknod(int branch, const char *path, mode_t mode, dev_t rdev) {
+	FULL_PATH(p, branch, path, -1);
+	return mknod(p, mode, rdev);
+}
+
+static int raw_unlink(int branch, const char *path) {
+	FULL_PATH(p, branch, path, -1);
+	return unlink(p);
+}
+
+static int raw_rmdir(int branch, const char *path) {
+	FULL_PATH(p, branch, path, -1);
+	return rmdir(p);
+}
+
+static int raw_rename(int branch, const char *from, const char *to) {
+	FULL_PATH(f, branch, from, -1);
+	FULL_PATH(t, branch, to, -1);
+	return rename(f, t);
+}
+
+static int raw_link(int branch_from, const char *from, int branch_to, const char *to) {
+	FULL_PATH(f, branch_from, from, -1);
+	FULL_PATH(t, branch_to, to, -1);
+	return link(f, t);
+}
+
+static int raw_symlink(const char *target, int branch, const char *path) {
+	FULL_PATH(p, branch, path, -1);
+	return symlink(target, p);
+}
+
+static ssize_t raw_readlink(int branch, const char *path, char *buf, size_t size) {
+	MANIFEST_LOOKUP(e, branch, path, -1);
+	if (e) return manifest_readlink(branch, e, buf, size);
+	FULL_PATH(p, branch, path, -1);
+	return readlink(p, buf, size);
+}
+
+static int raw_chmod(int branch, const char *path, mode_t mode) {
+	FULL_PATH(p, branch, path, -1);
+	return chmod(p, mode);
+}
+
+static int raw_lchown(int branch, const char *path, uid_t uid, gid_t gid) {
+	FULL_PATH(p, branch, path, -1);
+	return lchown(p, uid, gid);
+}
+
+static int raw_utimens(int branch, const char *path, const struct timespec ts[2]) {
+	FULL_PATH(p, branch, path, -1);
+
+	struct timeval tv[2];
+	tv[0].tv_sec = ts[0].tv_sec;
+	tv[0].tv_usec = ts[0].tv_nsec / 1000;
+	tv[1].tv_sec = ts[1].tv_sec;
+	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+	return utimes(p, tv);
+}
+
+#endif // UNIONFS_HAVE_AT
+
+enum b_op {
+	B_LSTAT,
+	B_STAT,
+	B_OPEN,
+	B_OPENDIR,
+	B_MKDIR,
+	B_MKNOD,
+	B_UNLINK,
+	B_RMDIR,
+	B_RENAME,
+	B_LINK,
+	B_SYMLINK,
+	B_READLINK,
+	B_CHMOD,
+	B_LCHOWN,
+	B_UTIMENS,
+	B_PREAD,
+	B_PWRITE,
+};
+
+// a call run by the workers of a branch, see bexec.c
+struct b_job {
+	struct bexec_job job;
+	enum b_op op;
+	int branch;
+	int branch2;		// of b_link()
+	int flags;
+	mode_t mode;
+	dev_t rdev;
+	uid_t uid;
+	gid_t gid;
+	struct timespec ts[2];
+	int fd;			// dup()ed by the caller, for pread() and pwrite()
+	off_t off;
+	size_t size;
+	struct stat st;
+	char path[PATHLEN_MAX];
+	char path2[PATHLEN_MAX]; // rename() and link() target, symlink() contents
+	char data[];		// size bytes for readlink(), pread() and pwrite()
+};
+
+static long run_job(struct bexec_job *job) {
+	struct b_job *j = (struct b_job *)job;
+	long res;
+
+	switch (j->op) {
+	case B_LSTAT: return raw_lstat(j->branch, j->path, &j->st);
+	case B_STAT: return raw_stat(j->branch, j->path, &j->st);
+	case B_OPEN: return raw_open(j->branch, j->path, j->flags, j->mode);
+	case B_OPENDIR: return (long)raw_opendir(j->branch, j->path);
+	case B_MKDIR: return raw_mkdir(j->branch, j->path, j->mode);
+	case B_MKNOD: return raw_mknod(j->branch, j->path, j->mode, j->rdev);
+	case B_UNLINK: return raw_unlink(j->branch, j->path);
+	case B_RMDIR: return raw_rmdir(j->branch, j->path);
+	case B_RENAME: return raw_rename(j->branch, j->path, j->path2);
+	case B_LINK: return raw_link(j->branch, j->path, j->branch2, j->path2);
+	case B_SYMLINK: return raw_symlink(j->path2, j->branch, j->path);
+	case B_READLINK: return raw_readlink(j->branch, j->path, j->data, j->size);
+	case B_CHMOD: return raw_chmod(j->branch, j->path, j->mode);
+	case B_LCHOWN: return raw_lchown(j->branch, j->path, j->uid, j->gid);
+	case B_UTIMENS: return raw_utimens(j->branch, j->path, j->ts);
+	case B_PREAD:
+		res = pread(j->fd, j->data, j->size, j->off);
+		break;
+	case B_PWRITE:
+		res = pwrite(j->fd, j->data, j->size, j->off);
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	int _errno = errno;
+	close(j->fd);
+	j->fd = -1;
+	errno = _errno;
+	return res;
+}
+
+/**
+ * The caller timed out, the result of the job is not wanted anymore.
+ */
+static void abandon_job(struct bexec_job *job) {
+	struct b_job *j = (struct b_job *)job;
+
+	if (j->fd != -1) close(j->fd);
+	if (!j->job.ran) return;
+
+	if (j->op == B_OPEN && j->job.res != -1) close(j->job.res);
+	if (j->op == B_OPENDIR && j->job.res) closedir((DIR *)j->job.res);
+}
+
+static struct b_job *new_job(enum b_op op, int branch, const char *path, size_t data_size) {
+	struct b_job *j = malloc(sizeof(struct b_job) + data_size);
+	if (!j) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	j->job.fn = run_job;
+	j->job.abandon = abandon_job;
+	j->op = op;
+	j->branch = branch;
+	j->fd = -1;
+	j->size = data_size;
+	j->path2[0] = '\0';
+	if (snprintf(j->path, sizeof(j->path), "%s", path ? path : "") >= (int)sizeof(j->path)) {
+		free(j);
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return j;
+}
+
+static int set_path2(struct b_job *j, const char *path) {
+	if (snprintf(j->path2, sizeof(j->path2), "%s", path) < (int)sizeof(j->path2)) return 0;
+
+	free(j);
+	errno = ENAMETOOLONG;
+	return -1;
+}
+
+/**
+ * Run j on its branch, returns false with errno set if j did not finish and
+ * is gone. Otherwise errno is set to the one of the call.
+ */
+static bool run(struct b_job *j) {
+	if (!bexec_run(j->branch, &j->job, true)) return false;
+
+	errno = j->job.err;
+	return true;
+}
+
+/**
+ * Return the result of the finished job j and free it, keeping errno.
+ */
+static long finish(struct b_job *j) {
+	long res = j->job.res;
+	free(j);
+	return res;
+}
+
+#define NEW_JOB(j, op, branch, path, data_size, err) \
+	struct b_job *j = new_job(op, branch, path, data_size); \
+	if (!j) return err;
+
+// the manifest answers lookups from memory, no need for the workers
+#define DIRECT(branch) (!bexec_active(branch) || BRANCH(branch).manifest)
+
+int b_lstat(int branch, const char *path, struct stat *st) {
+	if (DIRECT(branch)) return raw_lstat(branch, path, st);
+
+	NEW_JOB(j, B_LSTAT, branch, path, 0, -1);
+	if (!run(j)) return -1;
+	*st = j->st;
+	return finish(j);
+}
+
+int b_stat(int branch, const char *path, struct stat *st) {
+	if (DIRECT(branch)) return raw_stat(branch, path, st);
+
+	NEW_JOB(j, B_STAT, branch, path, 0, -1);
+	if (!run(j)) return -1;
+	*st = j->st;
+	return finish(j);
+}
+
+int b_open(int branch, const char *path, int flags, mode_t mode) {
+	if (!bexec_active(branch)) return raw_open(branch, path, flags, mode);
+
+	NEW_JOB(j, B_OPEN, branch, path, 0, -1);
+	j->flags = flags;
+	j->mode = mode;
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+DIR *b_opendir(int branch, const char *path) {
+	if (DIRECT(branch)) return raw_opendir(branch, path);
+
+	NEW_JOB(j, B_OPENDIR, branch, path, 0, NULL);
+	if (!run(j)) return NULL;
+	return (DIR *)finish(j);
+}
+
+int b_mkdir(int branch, const char *path, mode_t mode) {
+	if (!bexec_active(branch)) return raw_mkdir(branch, path, mode);
+
+	NEW_JOB(j, B_MKDIR, branch, path, 0, -1);
+	j->mode = mode;
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+int b_mknod(int branch, const char *path, mode_t mode, dev_t rdev) {
+	if (!bexec_active(branch)) return raw_mknod(branch, path, mode, rdev);
+
+	NEW_JOB(j, B_MKNOD, branch, path, 0, -1);
+	j->mode = mode;
+	j->rdev = rdev;
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+int b_unlink(int branch, const char *path) {
+	if (!bexec_active(branch)) return raw_unlink(branch, path);
+
+	NEW_JOB(j, B_UNLINK, branch, path, 0, -1);
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+int b_rmdir(int branch, const char *path) {
+	if (!bexec_active(branch)) return raw_rmdir(branch, path);
+
+	NEW_JOB(j, B_RMDIR, branch, path, 0, -1);
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+int b_rename(int branch, const char *from, const char *to) {
+	if (!bexec_active(branch)) return raw_rename(branch, from, to);
+
+	NEW_JOB(j, B_RENAME, branch, from, 0, -1);
+	if (set_path2(j, to)) return -1;
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+int b_link(int branch_from, const char *from, int branch_to, const char *to) {
+	if (!bexec_active(branch_from)) return raw_link(branch_from, from, branch_to, to);
+
+	NEW_JOB(j, B_LINK, branch_from, from, 0, -1);
+	j->branch2 = branch_to;
+	if (set_path2(j, to)) return -1;
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+int b_symlink(const char *target, int branch, const char *path) {
+	if (!bexec_active(branch)) return raw_symlink(target, branch, path);
+
+	NEW_JOB(j, B_SYMLINK, branch, path, 0, -1);
+	if (set_path2(j, target)) return -1;
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+ssize_t b_readlink(int branch, const char *path, char *buf, size_t size) {
+	if (DIRECT(branch)) return raw_readlink(branch, path, buf, size);
+
+	NEW_JOB(j, B_READLINK, branch, path, size, -1);
+	if (!run(j)) return -1;
+	if (j->job.res > 0) memcpy(buf, j->data, j->job.res);
+	return finish(j);
+}
+
+int b_chmod(int branch, const char *path, mode_t mode) {
+	if (!bexec_active(branch)) return raw_chmod(branch, path, mode);
+
+	NEW_JOB(j, B_CHMOD, branch, path, 0, -1);
+	j->mode = mode;
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+int b_lchown(int branch, const char *path, uid_t uid, gid_t gid) {
+	if (!bexec_active(branch)) return raw_lchown(branch, path, uid, gid);
+
+	NEW_JOB(j, B_LCHOWN, branch, path, 0, -1);
+	j->uid = uid;
+	j->gid = gid;
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+int b_utimens(int branch, const char *path, const struct timespec ts[2]) {
+	if (!bexec_active(branch)) return raw_utimens(branch, path, ts);
+
+	NEW_JOB(j, B_UTIMENS, branch, path, 0, -1);
+	j->ts[0] = ts[0];
+	j->ts[1] = ts[1];
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+/**
+ * pread() of fd, a file opened on branch. The job reads through its own
+ * copy of fd, as the caller might close fd after a timeout.
+ */
+ssize_t b_pread(int branch, int fd, void *buf, size_t size, off_t off) {
+	if (!bexec_active(branch)) return pread(fd, buf, size, off);
+
+	NEW_JOB(j, B_PREAD, branch, NULL, size, -1);
+	j->off = off;
+	j->fd = dup(fd);
+	if (j->fd == -1) {
+		free(j);
+		return -1;
+	}
+
+	if (!run(j)) return -1;
+	if (j->job.res > 0) memcpy(buf, j->data, j->job.res);
+	return finish(j);
+}
+
+ssize_t b_pwrite(int branch, int fd, const void *buf, size_t size, off_t off) {
+	if (!bexec_active(branch)) return pwrite(fd, buf, size, off);
+
+	NEW_JOB(j, B_PWRITE, branch, NULL, size, -1);
+	j->off = off;
+	memcpy(j->data, buf, size);
+	j->fd = dup(fd);
+	if (j->fd == -1) {
+		free(j);
+		return -1;
+	}
+
+	if (!run(j)) return -1;
+	return finish(j);
+}
+
+/**
+ * Open directory path of branch for b_dir_read(), from the manifest if
+ * the branch has one. Returns 0 or -1 and sets errno.
+ */
+int b_dir_open(b_dir_t *dir, int branch, const char *path) {
+	memset(dir, 0, sizeof(*dir));
+
+	const struct manifest *m = BRANCH(branch).manifest;
+	if (m) {
+		bool unknown;
+		const struct manifest_entry *e = manifest_lookup(m, path, &unknown);
+		if (!e && !unknown) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		// a symlink is followed on the branch
+		if (e && !S_ISLNK(e->mode)) {
+			if (!manifest_children(m, e, &dir->next, &dir->end)) {
+				errno = ENOTDIR;
+				return -1;
+			}
+
+			dir->manifest = m;
+			return 0;
+		}
+	}
+
+	dir->dp = b_opendir(branch, path);
+	return dir->dp ? 0 : -1;
+}
+
+struct dirent *b_dir_read(b_dir_t *dir) {
+	if (dir->dp) return readdir(dir->dp);
+
+	struct dirent *de = &dir->de;
+
+	// like readdir() we start with . and ..
+	if (dir->dots < 2) {
+		de->d_ino = 0;
+		de->d_type = DT_DIR;
+		strcpy(de->d_name, dir->dots ? ".." : ".");
+		dir->dots++;
+		return de;
+	}
+
+	if (dir->next == dir->end) return NULL;
+
+	const struct manifest_entry *e = manifest_entry(dir->manifest, dir->next++);
+	const char *path = manifest_string(dir->manifest, e->path);
+	size_t name = e->dir_len ? e->dir_len + 1 : 0;
+	size_t len = e->path_len - name;
+	if (len >= sizeof(de->d_name)) len = sizeof(de->d_name) - 1;
+
+	de->d_ino = e->ino;
+	de->d_type = (e->mode & S_IFMT) >> 12;
+	memcpy(de->d_name, path + name, len);
+	de->d_name[len] = '\0';
+	return de;
+}
+
+void b_dir_close(b_dir_t *dir) {
+	if (dir->dp) closedir(dir->dp);
+	dir->dp = NULL;
+}
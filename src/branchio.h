@@ -0,0 +1,49 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef BRANCHIO_H
+#define BRANCHIO_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdbool.h>
+
+struct manifest;
+
+// a directory of a branch, see b_dir_open()
+typedef struct {
+	DIR *dp;				// NULL if read from the manifest
+	const struct manifest *manifest;
+	size_t next, end;			// the entries left in the manifest
+	int dots;				// . and .. returned
+	struct dirent de;
+} b_dir_t;
+
+int b_lstat(int branch, const char *path, struct stat *st);
+int b_stat(int branch, const char *path, struct stat *st);
+int b_open(int branch, const char *path, int flags, mode_t mode);
+DIR *b_opendir(int branch, const char *path);
+int b_mkdir(int branch, const char *path, mode_t mode);
+int b_mknod(int branch, const char *path, mode_t mode, dev_t rdev);
+int b_unlink(int branch, const char *path);
+int b_rmdir(int branch, const char *path);
+int b_rename(int branch, const char *from, const char *to);
+int b_link(int branch_from, const char *from, int branch_to, const char *to);
+int b_symlink(const char *target, int branch, const char *path);
+ssize_t b_readlink(int branch, const char *path, char *buf, size_t size);
+int b_chmod(int branch, const char *path, mode_t mode);
+int b_lchown(int branch, const char *path, uid_t uid, gid_t gid);
+int b_utimens(int branch, const char *path, const struct timespec ts[2]);
+ssize_t b_pread(int branch, int fd, void *buf, size_t size, off_t off);
+ssize_t b_pwrite(int branch, int fd, const void *buf, size_t size, off_t off);
+
+int b_dir_open(b_dir_t *dir, int branch, const char *path);
+struct dirent *b_dir_read(b_dir_t *dir);
+void b_dir_close(b_dir_t *dir);
+
+#endif
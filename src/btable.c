@@ -0,0 +1,532 @@
+/*
+* Description: the branch table, changeable while mounted
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	The branches are kept in a struct btable which is never changed once
+*	it was published. Adding, removing or moving a branch or changing its
+*	mode (unionfsctl, see uioctl.h) builds a new table and publishes it
+*	in place of the old one, operations running at that time simply
+*	finish on the old table. Every operation works on one table: the
+*	wrappers of fuse_ops.c and ll_ops.c call btable_enter(), which sets
+*	btable_cur of the thread, and btable_leave(). That costs two stores
+*	to a slot only written by the thread itself, no lock and no shared
+*	counter. Branch numbers, whatever caches keep them (lcache.c,
+*	inode.c), are only valid for the table they were found in.
+*	Reclamation is epoch based: the sequence number of a slot is odd
+*	while its thread is in an operation. After publishing a new table the
+*	writer waits until every slot found odd has moved on, then no thread
+*	can use the old table anymore, except for the jobs handed to other
+*	threads (pool.c, bexec.c, the Bloom filter builders), which hold a
+*	reference on their table. A table keeps its successor alive, the
+*	branches dropped from the successor (their fds, indexes and workers)
+*	are freed together with the last table knowing them.
+*	The branch numbers change with the table, so do the counters of
+*	unionfsctl -s, they belong to the position. Chunk maps of
+*	-o partial_cow find their ro-branch by its path, but open maps keep
+*	its number, so with that option the branches can not be changed.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "windex.h"
+#include "bloom.h"
+#include "imap.h"
+#include "manifest.h"
+#include "bexec.h"
+#include "lcache.h"
+#include "scache.h"
+#include "debug.h"
+#include "usyslog.h"
+
+struct btable_slot {
+	unsigned long seq;		// odd while in an operation
+	unsigned int depth;		// nested btable_enter()
+	bool used;			// owned by a thread
+	struct btable_slot *next;
+};
+
+__thread struct btable *btable_cur;
+struct btable *btable_live;
+
+static __thread struct btable_slot *self;
+static struct btable_slot *slots;	// never freed, only prepended
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER; // one writer at a time
+
+static void release_slot(void *arg) {
+	struct btable_slot *slot = arg;
+
+	pthread_mutex_lock(&slots_lock);
+	slot->used = false;
+	pthread_mutex_unlock(&slots_lock);
+}
+
+static struct btable_slot *get_slot(void) {
+	pthread_mutex_lock(&slots_lock);
+
+	struct btable_slot *slot;
+	for (slot = slots; slot; slot = slot->next) {
+		if (!slot->used) break;
+	}
+
+	if (!slot) {
+		slot = calloc(1, sizeof(struct btable_slot));
+		if (!slot) {
+			// without a slot the tables could be freed below us
+			USYSLOG(LOG_ERR, "Out of memory for the branch table slot, aborting!\n");
+			abort();
+		}
+		slot->next = slots;
+		__atomic_store_n(&slots, slot, __ATOMIC_RELEASE);
+	}
+	slot->used = true;
+
+	pthread_mutex_unlock(&slots_lock);
+
+	pthread_setspecific(slot_key, slot);
+	return slot;
+}
+
+/**
+ * Publish the branches parsed from the command line, from
+ * unionfs_post_opts(). uopt.branches is owned by the table afterwards.
+ */
+void btable_init(void) {
+	struct btable *t = calloc(1, sizeof(struct btable));
+	if (!t) {
+		fprintf(stderr, "%s: Out of memory\n", __func__);
+		exit(1);
+	}
+
+	t->nbranches = uopt.nbranches;
+	t->branches = uopt.branches;
+	t->gen = 1;
+	t->refs = 1; // the live table
+
+	uopt.branches = NULL;
+	uopt.nbranches = 0;
+
+	pthread_key_create(&slot_key, release_slot);
+
+	__atomic_store_n(&btable_live, t, __ATOMIC_RELEASE);
+}
+
+/**
+ * Start an operation, it works on the live table until btable_leave().
+ */
+void btable_enter(void) {
+	struct btable_slot *slot = self;
+	if (!slot) slot = self = get_slot();
+
+	if (slot->depth++) return;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	// the writer either sees us in the operation or we see its new table
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	btable_cur = __atomic_load_n(&btable_live, __ATOMIC_ACQUIRE);
+}
+
+void btable_leave(void) {
+	struct btable_slot *slot = self;
+
+	if (--slot->depth) return;
+
+	btable_cur = NULL;
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * A reference on the table of the current operation, for a job run by
+ * another thread.
+ */
+struct btable *btable_ref(void) {
+	struct btable *t = btable_get();
+	__atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+	return t;
+}
+
+static void free_branch(branch_entry_t *branch) {
+	if (branch->exec) bexec_branch_stop(branch->exec);
+	windex_free(branch->windex);
+	bloom_free(branch->bloom);
+	imap_free(branch->imap);
+	manifest_close(branch->manifest);
+	if (branch->fd != -1) close(branch->fd);
+	free(branch->path);
+}
+
+void btable_unref(struct btable *t) {
+	while (t && __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct btable *next = t->next;
+
+		int i;
+		for (i = 0; i < t->nretired; i++) free_branch(&t->retired[i]);
+		free(t->retired);
+		free(t->branches);
+		free(t);
+
+		t = next; // our reference on it
+	}
+}
+
+/**
+ * Run the calling thread on table t, a reference of a job. Returns the table
+ * to restore afterwards.
+ */
+struct btable *btable_adopt(struct btable *t) {
+	struct btable *prev = btable_cur;
+	btable_cur = t;
+	return prev;
+}
+
+/**
+ * A Bloom filter of branch path was built, store it into the live table.
+ * False if the branch is gone or has become writable, the caller frees the
+ * filter then.
+ */
+bool btable_set_bloom(const char *path, struct bloom *bloom) {
+	bool res = false;
+
+	pthread_mutex_lock(&swap_lock);
+
+	struct btable *t = btable_live;
+	int i;
+	for (i = 0; i < t->nbranches; i++) {
+		branch_entry_t *b = &t->branches[i];
+		if (b->path != path) continue;
+
+		if (!b->rw && !b->bloom) {
+			// lookups may use it right away
+			__atomic_store_n(&b->bloom, bloom, __ATOMIC_RELEASE);
+			res = true;
+		}
+		break;
+	}
+
+	pthread_mutex_unlock(&swap_lock);
+
+	return res;
+}
+
+/**
+ * Take swap_lock from an operation (the ioctl). The operation is left while
+ * waiting, another writer might be waiting for it to finish. The thread
+ * keeps the live table, nobody else can replace it while we have the lock.
+ */
+static void lock_writer(void) {
+	struct btable_slot *slot = self;
+	if (slot && slot->depth) __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&swap_lock);
+
+	if (slot && slot->depth) btable_cur = btable_live;
+}
+
+static void unlock_writer(void) {
+	pthread_mutex_unlock(&swap_lock);
+
+	struct btable_slot *slot = self;
+	if (slot && slot->depth) {
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		btable_cur = __atomic_load_n(&btable_live, __ATOMIC_ACQUIRE);
+	}
+}
+
+/**
+ * Wait until no operation can use another table than the live one anymore.
+ */
+static void wait_readers(void) {
+	struct btable_slot *slot;
+	for (slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+		unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1)) continue;
+
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == seq) usleep(100);
+	}
+}
+
+/**
+ * Replace the live table by t, with swap_lock held. retired are the branches
+ * not in t anymore. Returns once the old table is not used any longer.
+ */
+static void swap(struct btable *t, branch_entry_t *retired, int nretired) {
+	struct btable *old = btable_live;
+
+	t->gen = old->gen + 1;
+	t->refs = 2; // the live table and the reference of old
+	old->next = t;
+	old->retired = retired;
+	old->nretired = nretired;
+
+	__atomic_store_n(&btable_live, t, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (btable_cur) btable_cur = t;
+
+	// new operations count the devices of the new branches already
+	scache_init();
+
+	wait_readers();
+
+	// nothing can insert results of the old table anymore
+	lcache_invalidate_all();
+
+	btable_unref(old);
+}
+
+/**
+ * A copy of the live table with room for one more branch.
+ */
+static struct btable *copy_live(void) {
+	struct btable *old = btable_live;
+
+	struct btable *t = calloc(1, sizeof(struct btable));
+	if (!t) return NULL;
+
+	t->branches = malloc((old->nbranches + 1) * sizeof(branch_entry_t));
+	if (!t->branches) {
+		free(t);
+		return NULL;
+	}
+
+	memcpy(t->branches, old->branches, old->nbranches * sizeof(branch_entry_t));
+	t->nbranches = old->nbranches;
+
+	return t;
+}
+
+static void free_copy(struct btable *t) {
+	free(t->branches);
+	free(t);
+}
+
+/**
+ * Add the branch directory path at position pos (-1 for the last one).
+ * Returns 0 or -errno.
+ */
+int btable_add(const char *path, int pos, bool rw, bool idx) {
+	DBG("%s at %d\n", path, pos);
+
+	if (uopt.partial_cow_size) RETURN(-ENOTSUP);
+	if (path[0] != '/' || (rw && idx)) RETURN(-EINVAL);
+
+	size_t len = strlen(path);
+	if (len + 2 > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
+
+	branch_entry_t b;
+	memset(&b, 0, sizeof(b));
+	b.fd = -1;
+	b.rw = rw;
+	b.idx = idx;
+
+	int res = 0;
+	b.path = malloc(len + 2);
+	if (!b.path) RETURN(-ENOMEM);
+	strcpy(b.path, path);
+	if (b.path[len - 1] != '/') strcat(b.path, "/");
+	b.path_len = strlen(b.path);
+
+	b.fd = open(b.path, O_RDONLY | O_DIRECTORY);
+	if (b.fd == -1) {
+		res = -errno;
+		goto out_free;
+	}
+
+	if (idx) {
+		b.manifest = manifest_open(b.fd);
+		if (!b.manifest) {
+			res = -errno;
+			goto out_free;
+		}
+	}
+
+	res = windex_branch_load(&b);
+	if (res) goto out_free;
+
+	res = imap_branch_load(&b);
+	if (res) goto out_free;
+
+	res = bexec_branch_start(&b);
+	if (res) goto out_free;
+
+	lock_writer();
+
+	const struct btable *old = btable_live;
+	if (pos < 0) pos = old->nbranches;
+
+	int i;
+	for (i = 0; i < old->nbranches; i++) {
+		if (strcmp(old->branches[i].path, b.path) == 0) res = -EEXIST;
+	}
+	if (pos > old->nbranches) res = -EINVAL;
+
+	struct btable *t = res ? NULL : copy_live();
+	if (!t) {
+		unlock_writer();
+		if (!res) res = -ENOMEM;
+		goto out_free;
+	}
+
+	memmove(&t->branches[pos + 1], &t->branches[pos], (t->nbranches - pos) * sizeof(branch_entry_t));
+	t->branches[pos] = b;
+	t->nbranches++;
+
+	swap(t, NULL, 0);
+
+	unlock_writer();
+
+	USYSLOG(LOG_INFO, "Branch %s added as branch %d\n", b.path, pos);
+	RETURN(0);
+
+out_free:
+	free_branch(&b);
+	RETURN(res);
+}
+
+/**
+ * Remove branch from the union. Returns 0 or -errno.
+ */
+int btable_remove(int branch) {
+	DBG("%d\n", branch);
+
+	if (uopt.partial_cow_size) RETURN(-ENOTSUP);
+
+	lock_writer();
+
+	const struct btable *old = btable_live;
+	int res = 0;
+	struct btable *t = NULL;
+	branch_entry_t *retired = NULL;
+
+	// the union needs a branch, even if it is empty
+	if (branch < 0 || branch >= old->nbranches || old->nbranches == 1) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	t = copy_live();
+	retired = malloc(sizeof(branch_entry_t));
+	if (!t || !retired) {
+		if (t) free_copy(t);
+		free(retired);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	*retired = t->branches[branch];
+	memmove(&t->branches[branch], &t->branches[branch + 1], (t->nbranches - branch - 1) * sizeof(branch_entry_t));
+	t->nbranches--;
+
+	USYSLOG(LOG_INFO, "Branch %s (%d) removed\n", retired->path, branch);
+	swap(t, retired, 1);
+
+out:
+	unlock_writer();
+	RETURN(res);
+}
+
+/**
+ * Move branch to position pos, the branches in between move by one.
+ * Returns 0 or -errno.
+ */
+int btable_move(int branch, int pos) {
+	DBG("%d to %d\n", branch, pos);
+
+	if (uopt.partial_cow_size) RETURN(-ENOTSUP);
+
+	lock_writer();
+
+	const struct btable *old = btable_live;
+	int res = 0;
+
+	if (branch < 0 || branch >= old->nbranches || pos < 0 || pos >= old->nbranches) {
+		res = -EINVAL;
+		goto out;
+	}
+	if (branch == pos) goto out;
+
+	struct btable *t = copy_live();
+	if (!t) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	branch_entry_t b = t->branches[branch];
+	if (pos < branch)
+		memmove(&t->branches[pos + 1], &t->branches[pos], (branch - pos) * sizeof(branch_entry_t));
+	else
+		memmove(&t->branches[branch], &t->branches[branch + 1], (pos - branch) * sizeof(branch_entry_t));
+	t->branches[pos] = b;
+
+	USYSLOG(LOG_INFO, "Branch %s moved from %d to %d\n", b.path, branch, pos);
+	swap(t, NULL, 0);
+
+out:
+	unlock_writer();
+	RETURN(res);
+}
+
+/**
+ * Make branch writable or read-only. Returns 0 or -errno.
+ */
+int btable_set_mode(int branch, bool rw) {
+	DBG("%d %s\n", branch, rw ? "RW" : "RO");
+
+	if (uopt.partial_cow_size) RETURN(-ENOTSUP);
+
+	lock_writer();
+
+	const struct btable *old = btable_live;
+	int res = 0;
+	struct btable *t = NULL;
+	branch_entry_t *retired = NULL;
+
+	// a RO+IDX branch is sealed, its manifest would get outdated
+	if (branch < 0 || branch >= old->nbranches || (rw && old->branches[branch].idx)) {
+		res = -EINVAL;
+		goto out;
+	}
+	if (old->branches[branch].rw == rw) goto out;
+
+	t = copy_live();
+	if (!t) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	branch_entry_t *b = &t->branches[branch];
+	b->rw = rw;
+
+	// the filter does not know what gets written now
+	if (b->bloom) {
+		retired = calloc(1, sizeof(branch_entry_t));
+		if (!retired) {
+			free_copy(t);
+			res = -ENOMEM;
+			goto out;
+		}
+		retired->fd = -1;
+		retired->bloom = b->bloom;
+		b->bloom = NULL;
+	}
+
+	USYSLOG(LOG_INFO, "Branch %s (%d) is %s now\n", b->path, branch, rw ? "RW" : "RO");
+	swap(t, retired, retired ? 1 : 0);
+
+out:
+	unlock_writer();
+	RETURN(res);
+}
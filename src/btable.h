@@ -0,0 +1,54 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef BTABLE_H
+#define BTABLE_H
+
+#include <stdbool.h>
+
+#include "unionfs.h"
+
+struct bloom;
+
+// the branches of the union, never changed once published
+struct btable {
+	int nbranches;
+	branch_entry_t *branches;
+	unsigned long gen;		// incremented for every new table
+	int refs;
+	struct btable *next;		// the table that replaced this one
+	branch_entry_t *retired;	// not in next anymore, freed with this table
+	int nretired;
+};
+
+extern __thread struct btable *btable_cur;
+extern struct btable *btable_live;
+
+/**
+ * The table of the current operation. Outside of an operation (mount, init())
+ * the live table, which nobody can replace then.
+ */
+static inline struct btable *btable_get(void) {
+	struct btable *t = btable_cur;
+	return t ? t : __atomic_load_n(&btable_live, __ATOMIC_ACQUIRE);
+}
+
+#define NBRANCHES (btable_get()->nbranches)
+#define BRANCH(i) (btable_get()->branches[i])
+
+void btable_init(void);
+void btable_enter(void);
+void btable_leave(void);
+struct btable *btable_ref(void);
+void btable_unref(struct btable *t);
+struct btable *btable_adopt(struct btable *t);
+bool btable_set_bloom(const char *path, struct bloom *bloom);
+int btable_add(const char *path, int pos, bool rw, bool idx);
+int btable_remove(int branch);
+int btable_move(int branch, int pos);
+int btable_set_mode(int branch, bool rw);
+
+#endif
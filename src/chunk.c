@@ -0,0 +1,611 @@
+/*
+* Description: partial copy-up of large files
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	With -o partial_cow=megabytes the copy-up of a regular file of at
+*	least this size does not copy any data. The file on the rw-branch is
+*	created with the size of the ro-branch file, but it is entirely a
+*	hole. Which chunks (CHUNK_SIZE bytes each) were already copied is
+*	kept in a bitmap in METADIR/path_CHUNKS~ on the rw-branch, after a
+*	struct chunk_header which also names the ro-branch with the data, by
+*	the hash of its path, so a remount with reordered branches still
+*	finds it.
+*	Open files of such a partial copy get the map attached to their
+*	handle (see fhandle.c):
+*	 - read() takes copied chunks from the rw-branch file and all others
+*	   from the ro-branch file.
+*	 - write() first copies the chunks it touches, unless it overwrites
+*	   them entirely, and marks them in the bitmap.
+*	 - ftruncate() copies the chunk the file ends in, chunks behind the
+*	   end only have zeros now and are marked as copied.
+*	So changing a few bytes of a huge image only costs a few chunks.
+*	Once all chunks were copied the map file is removed and the file is
+*	an ordinary file. rename() and link() copy the missing chunks first,
+*	that way a map always belongs to the path of its file. The map is
+*	shared by all handles of a file, maps of currently open files are
+*	in a hash table.
+*	The rw-branch file must not be used directly while it still has a
+*	map, nor may the union be mounted without -o partial_cow then.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "btable.h"
+#include "hashtable.h"
+#include "string.h"
+#include "cow.h"
+#include "cow_utils.h"
+#include "branchio.h"
+#include "chunk.h"
+#include "debug.h"
+#include "usyslog.h"
+
+struct chunkmap {
+	char *key;		// "branch:path", the table has its own copy
+	bool hashed;		// in the table, protected by the table lock
+	int refs;		// protected by the table lock
+	int branch;		// the rw-branch
+	char *map_path;		// METADIR/path_CHUNKS~
+	bool removed;		// the file was unlinked, map_path is not ours anymore
+	pthread_mutex_t lock;	// protects the bitmap and the rw-branch file data
+	int map_fd;
+	int lower_fd;		// the file on the ro-branch
+	uint64_t lower_size;
+	uint32_t chunk_size;
+	uint64_t nchunks;	// chunks of the ro-branch file
+	uint64_t missing;	// chunks not copied yet
+	unsigned char *bits;	// set for copied chunks
+};
+
+static struct hashtable *maps;
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Initialize the table of open maps, must be called after option parsing.
+ */
+void chunk_init(void) {
+	if (!uopt.partial_cow_size) return;
+
+	maps = create_hashtable(64, string_hash, string_equal);
+	if (!maps) {
+		fprintf(stderr, "%s: Failed to create the chunk map table\n", __func__);
+		exit(1); // still early stage, we can abort
+	}
+}
+
+/**
+ * Should a file be copied up in chunks?
+ */
+bool chunk_wanted(const struct stat *st) {
+	return uopt.partial_cow_size && S_ISREG(st->st_mode)
+		&& (uint64_t)st->st_size >= uopt.partial_cow_size;
+}
+
+/**
+ * Get the path of the map of path, relative to the branch.
+ */
+static int build_map_path(char *p, const char *path) {
+	if (BUILD_PATH(p, METADIR, path)) return -1;
+	if (strlen(p) + strlen(CHUNKTAG) >= PATHLEN_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcat(p, CHUNKTAG);
+
+	return 0;
+}
+
+static size_t bitmap_size(uint64_t nchunks) {
+	return (nchunks + 7) / 8;
+}
+
+/**
+ * Identify a branch independent of its position, as rcache does.
+ */
+static uint64_t branch_id(int branch) {
+	const char *bpath = BRANCH(branch).path;
+	return string_hash64(bpath, strlen(bpath));
+}
+
+/**
+ * Write the map for a partial copy-up of path. Must be called before the
+ * rw-branch file is created, a copy-up without map would be empty.
+ */
+int chunk_copy_up(const char *path, int branch_ro, int branch_rw) {
+	DBG("%s\n", path);
+
+	char p[PATHLEN_MAX];
+	if (build_map_path(p, path)) RETURN(-1);
+
+	struct stat st;
+	if (b_lstat(branch_ro, path, &st) == -1) RETURN(-1);
+
+	// as for whiteouts, creates e.g. branch/.unionfs/some_directory
+	path_create_cutlast(p, branch_rw, branch_rw);
+
+	int fd = b_open(branch_rw, p, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) RETURN(-1);
+
+	struct chunk_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHUNK_MAGIC, sizeof(header.magic));
+	header.chunk_size = CHUNK_SIZE;
+	header.size = st.st_size;
+	header.branch_id = branch_id(branch_ro);
+
+	uint64_t nchunks = (header.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	// an all zero bitmap, nothing is copied yet
+	int res = 0;
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+	|| ftruncate(fd, sizeof(header) + bitmap_size(nchunks))) {
+		USYSLOG(LOG_WARNING, "%s: writing %s%s failed: %s\n", __func__,
+			BRANCH(branch_rw).path, p, strerror(errno));
+		res = -1;
+	}
+
+	close(fd);
+	if (res) b_unlink(branch_rw, p);
+
+	RETURN(res);
+}
+
+static void free_map(struct chunkmap *map) {
+	if (map->map_fd != -1) close(map->map_fd);
+	if (map->lower_fd != -1) close(map->lower_fd);
+	pthread_mutex_destroy(&map->lock);
+	free(map->bits);
+	free(map->map_path);
+	free(map->key);
+	free(map);
+}
+
+/**
+ * Read the map of path on branch. Returns NULL with errno = 0 if path is not
+ * a partial copy.
+ */
+static struct chunkmap *load_map(int branch, const char *path, const char *key) {
+	char p[PATHLEN_MAX];
+	if (build_map_path(p, path)) {
+		// such a map could not have been created
+		errno = 0;
+		return NULL;
+	}
+
+	int fd = b_open(branch, p, O_RDWR, 0);
+	if (fd == -1) {
+		if (errno == ENOENT || errno == ENOTDIR) errno = 0;
+		return NULL;
+	}
+
+	struct chunkmap *map = calloc(1, sizeof(struct chunkmap));
+	if (!map) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_init(&map->lock, NULL);
+	map->branch = branch;
+	map->map_fd = fd;
+	map->lower_fd = -1;
+	map->key = strdup(key);
+	map->map_path = strdup(p);
+	if (!map->key || !map->map_path) {
+		free_map(map);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct chunk_header header;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+	|| memcmp(header.magic, CHUNK_MAGIC, sizeof(header.magic))
+	|| header.chunk_size == 0)
+		goto invalid;
+
+	int branch_ro;
+	for (branch_ro = 0; branch_ro < NBRANCHES; branch_ro++) {
+		if (branch_ro != branch && branch_id(branch_ro) == header.branch_id) break;
+	}
+	if (branch_ro == NBRANCHES) goto invalid; // the ro-branch is not mounted
+
+	map->chunk_size = header.chunk_size;
+	map->lower_size = header.size;
+	map->nchunks = (header.size + header.chunk_size - 1) / header.chunk_size;
+
+	size_t len = bitmap_size(map->nchunks);
+	map->bits = malloc(len ? len : 1);
+	if (!map->bits) {
+		free_map(map);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (pread(fd, map->bits, len, sizeof(header)) != (ssize_t)len) goto invalid;
+
+	map->lower_fd = b_open(branch_ro, path, O_RDONLY, 0);
+	struct stat st;
+	if (map->lower_fd == -1 || fstat(map->lower_fd, &st) || (uint64_t)st.st_size != header.size)
+		goto invalid;
+
+	uint64_t i;
+	for (i = 0; i < map->nchunks; i++) {
+		if (!(map->bits[i / 8] & (1 << (i % 8)))) map->missing++;
+	}
+
+	return map;
+
+invalid:
+	USYSLOG(LOG_ERR, "%s: %s%s is invalid or its ro-branch is missing or changed\n",
+		__func__, BRANCH(branch).path, p);
+	free_map(map);
+	errno = EIO;
+	return NULL;
+}
+
+/**
+ * Get the map of path on branch, release it with chunk_close(). Returns NULL
+ * with errno = 0 if path is not a partial copy and with errno set on errors.
+ */
+struct chunkmap *chunk_open(int branch, const char *path) {
+	errno = 0;
+	if (!uopt.partial_cow_size) return NULL;
+
+	char key[PATHLEN_MAX + 16];
+	snprintf(key, sizeof(key), "%d:%s", branch, path);
+
+	pthread_mutex_lock(&maps_lock);
+
+	struct chunkmap *map = hashtable_search(maps, key);
+	if (!map) {
+		map = load_map(branch, path, key);
+
+		char *table_key = map ? strdup(key) : NULL;
+		if (table_key && hashtable_insert(maps, table_key, map)) {
+			map->hashed = true;
+		} else if (map) {
+			free(table_key);
+			free_map(map);
+			map = NULL;
+			errno = ENOMEM;
+		}
+	}
+	if (map) map->refs++;
+
+	pthread_mutex_unlock(&maps_lock);
+
+	return map;
+}
+
+void chunk_close(struct chunkmap *map) {
+	pthread_mutex_lock(&maps_lock);
+
+	if (--map->refs == 0) {
+		if (map->hashed) hashtable_remove(maps, map->key);
+		free_map(map);
+	}
+
+	pthread_mutex_unlock(&maps_lock);
+}
+
+/**
+ * Must be called with the map lock held.
+ */
+static bool is_copied(struct chunkmap *map, uint64_t i) {
+	if (i >= map->nchunks) return true; // behind the end of the ro-branch file
+	return map->bits[i / 8] & (1 << (i % 8));
+}
+
+/**
+ * Copy chunk i from the ro-branch to fd. Must be called with the map lock held.
+ */
+static int copy_chunk(struct chunkmap *map, int fd, uint64_t i) {
+	off_t off = i * map->chunk_size;
+	off_t len = map->chunk_size;
+	if ((uint64_t)(off + len) > map->lower_size) len = map->lower_size - off;
+
+	return copy_fd_range(map->lower_fd, fd, off, len);
+}
+
+/**
+ * Mark the chunks first to last as copied and store that. Must be called
+ * with the map lock held.
+ */
+static int mark_copied(struct chunkmap *map, uint64_t first, uint64_t last) {
+	if (map->nchunks == 0) return 0;
+	if (last >= map->nchunks) last = map->nchunks - 1;
+	if (first > last) return 0;
+
+	uint64_t i;
+	for (i = first; i <= last; i++) {
+		if (is_copied(map, i)) continue;
+
+		map->bits[i / 8] |= 1 << (i % 8);
+		map->missing--;
+	}
+
+	size_t len = last / 8 - first / 8 + 1;
+	off_t off = sizeof(struct chunk_header) + first / 8;
+	if (pwrite(map->map_fd, map->bits + first / 8, len, off) != (ssize_t)len) {
+		USYSLOG(LOG_ERR, "%s: updating %s%s failed: %s\n", __func__,
+			BRANCH(map->branch).path, map->map_path, strerror(errno));
+		return -1;
+	}
+
+	if (map->missing == 0 && !map->removed) {
+		// all data are on the rw-branch now, an ordinary file again
+		DBG("%s complete\n", map->map_path);
+		b_unlink(map->branch, map->map_path);
+		map->removed = true;
+	}
+
+	return 0;
+}
+
+ssize_t chunk_pread(struct chunkmap *map, int fd, char *buf, size_t size, off_t off) {
+	struct stat st;
+	if (fstat(fd, &st)) return -errno;
+
+	// the rw-branch file has the real size
+	if (off >= st.st_size) return 0;
+	if ((off_t)size > st.st_size - off) size = st.st_size - off;
+
+	off_t end = off + size;
+	size_t done = 0;
+	while (done < size) {
+		off_t pos = off + done;
+
+		// read all following chunks of the same kind at once
+		pthread_mutex_lock(&map->lock);
+		uint64_t i = pos / map->chunk_size;
+		bool copied = is_copied(map, i);
+		off_t run_end = (i + 1) * map->chunk_size;
+		while (run_end < end && is_copied(map, run_end / map->chunk_size) == copied)
+			run_end += map->chunk_size;
+		pthread_mutex_unlock(&map->lock);
+
+		if (run_end > end) run_end = end;
+		size_t len = run_end - pos;
+
+		ssize_t res = pread(copied ? fd : map->lower_fd, buf + done, len, pos);
+		if (res == -1) {
+			if (done) break;
+			return -errno;
+		}
+
+		if ((size_t)res < len) {
+			// truncated meanwhile
+			if (copied) return done + res;
+
+			// the ro-branch file ends here, the rw-branch file got extended
+			memset(buf + done + res, 0, len - res);
+		}
+
+		done += len;
+	}
+
+	return done;
+}
+
+ssize_t chunk_pwrite(struct chunkmap *map, int fd, const char *buf, size_t size, off_t off) {
+	if (size == 0) return 0;
+
+	uint64_t first = off / map->chunk_size;
+	uint64_t last = (off + size - 1) / map->chunk_size;
+	bool first_copied = false, last_copied = false; // by us, they have the old data
+	ssize_t written;
+
+	pthread_mutex_lock(&map->lock);
+
+	uint64_t i;
+	for (i = first; i <= last && i < map->nchunks; i++) {
+		if (is_copied(map, i)) continue;
+
+		// the old data of an entirely overwritten chunk are not needed
+		uint64_t start = i * map->chunk_size;
+		uint64_t stop = start + map->chunk_size;
+		if (stop > map->lower_size) stop = map->lower_size;
+		if ((uint64_t)off <= start && (uint64_t)off + size >= stop) continue;
+
+		if (copy_chunk(map, fd, i)) {
+			written = -errno;
+			goto out;
+		}
+		if (i == first) first_copied = true;
+		if (i == last) last_copied = true;
+	}
+
+	// the data first, the map must never claim chunks which are still holes
+	written = pwrite(fd, buf, size, off);
+	if (written <= 0) {
+		if (written == -1) written = -errno;
+		goto out; // chunks we copied are not marked, but equal the ro-branch
+	}
+
+	uint64_t end = off + written;
+	i = (end - 1) / map->chunk_size; // the chunk the write ended in
+	uint64_t start = i * map->chunk_size;
+	uint64_t stop = start + map->chunk_size;
+	if (stop > map->lower_size) stop = map->lower_size;
+
+	if (end < stop && !is_copied(map, i) && !(i == first && first_copied) && !(i == last && last_copied)) {
+		// a short write into a chunk meant to be overwritten entirely
+		if (copy_fd_range(map->lower_fd, fd, end, stop - end)) {
+			// its new part is lost, the chunk stays on the ro-branch
+			if (start <= (uint64_t)off) {
+				written = -errno;
+				goto out;
+			}
+			written = start - off;
+			i--;
+		}
+	}
+
+	if (mark_copied(map, first, i)) written = -EIO;
+
+out:
+	pthread_mutex_unlock(&map->lock);
+
+	return written;
+}
+
+int chunk_ftruncate(struct chunkmap *map, int fd, off_t size) {
+	int res = 0;
+
+	pthread_mutex_lock(&map->lock);
+
+	uint64_t i = size / map->chunk_size;
+	if ((uint64_t)size < map->lower_size && size % map->chunk_size && !is_copied(map, i)) {
+		// the chunk the file ends in keeps its first part
+		if (copy_chunk(map, fd, i)) res = -errno;
+	}
+
+	if (!res && ftruncate(fd, size)) res = -errno;
+
+	// everything behind the end reads as zeros now, even after an extension
+	if (!res && (uint64_t)size < map->lower_size && mark_copied(map, i, map->nchunks - 1))
+		res = -EIO;
+
+	pthread_mutex_unlock(&map->lock);
+
+	return res;
+}
+
+/**
+ * The bitmap needs to be as persistent as the data written to the file.
+ */
+int chunk_fsync(struct chunkmap *map) {
+	pthread_mutex_lock(&map->lock);
+	int res = fsync(map->map_fd);
+	pthread_mutex_unlock(&map->lock);
+
+	if (res == -1) return -errno;
+	return 0;
+}
+
+/**
+ * Copy all missing chunks of path on branch, so it becomes an ordinary file.
+ */
+int chunk_complete(int branch, const char *path) {
+	DBG("%s\n", path);
+
+	struct chunkmap *map = chunk_open(branch, path);
+	if (!map) RETURN(errno ? -1 : 0);
+
+	int fd = b_open(branch, path, O_WRONLY, 0);
+	if (fd == -1) {
+		int _errno = errno;
+		chunk_close(map);
+		errno = _errno;
+		RETURN(-1);
+	}
+
+	int res = 0;
+	pthread_mutex_lock(&map->lock);
+
+	uint64_t i;
+	for (i = 0; i < map->nchunks; i++) {
+		if (is_copied(map, i)) continue;
+		if (copy_chunk(map, fd, i)) {
+			res = -1;
+			break;
+		}
+	}
+	if (!res) res = mark_copied(map, 0, map->nchunks - 1);
+
+	pthread_mutex_unlock(&map->lock);
+
+	int _errno = errno;
+	close(fd);
+	chunk_close(map);
+	errno = _errno;
+
+	RETURN(res);
+}
+
+/**
+ * Copy all missing chunks of all files below the directory path on branch.
+ */
+int chunk_complete_tree(int branch, const char *path) {
+	DBG("%s\n", path);
+
+	if (!uopt.partial_cow_size) RETURN(0);
+
+	char p[PATHLEN_MAX];
+	if (BUILD_PATH(p, METADIR, path)) RETURN(-1);
+
+	DIR *dp = b_opendir(branch, p);
+	if (!dp) RETURN(0); // no meta data for this directory
+
+	int res = 0;
+	struct dirent *de;
+	while (res == 0 && (de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		char child[PATHLEN_MAX];
+		if (BUILD_PATH(child, path, "/", de->d_name)) {
+			res = -1;
+			break;
+		}
+
+		size_t len = strlen(child);
+		size_t tag_len = strlen(CHUNKTAG);
+		if (len > tag_len && strcmp(child + len - tag_len, CHUNKTAG) == 0) {
+			child[len - tag_len] = '\0';
+			res = chunk_complete(branch, child);
+		} else if (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN) {
+			// not a directory fails silently in b_opendir()
+			res = chunk_complete_tree(branch, child);
+		}
+	}
+
+	int _errno = errno;
+	closedir(dp);
+	errno = _errno;
+
+	RETURN(res);
+}
+
+/**
+ * path on branch was removed or replaced, so is its map.
+ */
+void chunk_remove(int branch, const char *path) {
+	if (!uopt.partial_cow_size) return;
+
+	DBG("%s\n", path);
+
+	char p[PATHLEN_MAX];
+	if (build_map_path(p, path)) return;
+
+	char key[PATHLEN_MAX + 16];
+	snprintf(key, sizeof(key), "%d:%s", branch, path);
+
+	pthread_mutex_lock(&maps_lock);
+
+	struct chunkmap *map = hashtable_search(maps, key);
+	if (map) {
+		// open handles keep using it, but it must not be found again
+		hashtable_remove(maps, key);
+		map->hashed = false;
+
+		pthread_mutex_lock(&map->lock);
+		map->removed = true;
+		pthread_mutex_unlock(&map->lock);
+	}
+
+	b_unlink(branch, p);
+
+	pthread_mutex_unlock(&maps_lock);
+}
@@ -0,0 +1,43 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define CHUNKTAG "_CHUNKS~"
+#define CHUNK_SIZE (1024 * 1024)	// granularity of the partial copy-up
+#define CHUNK_MAGIC "UFSCHNK2"
+
+// on-disk header of METADIR/path_CHUNKS~, followed by the bitmap
+struct chunk_header {
+	char magic[8];		// CHUNK_MAGIC
+	uint32_t chunk_size;
+	uint32_t reserved;
+	uint64_t size;		// size of the file on the ro-branch
+	uint64_t branch_id;	// hash of the path of the ro-branch with the data
+};
+
+struct chunkmap;
+
+void chunk_init(void);
+bool chunk_wanted(const struct stat *st);
+int chunk_copy_up(const char *path, int branch_ro, int branch_rw);
+struct chunkmap *chunk_open(int branch, const char *path);
+void chunk_close(struct chunkmap *map);
+ssize_t chunk_pread(struct chunkmap *map, int fd, char *buf, size_t size, off_t off);
+ssize_t chunk_pwrite(struct chunkmap *map, int fd, const char *buf, size_t size, off_t off);
+int chunk_ftruncate(struct chunkmap *map, int fd, off_t size);
+int chunk_fsync(struct chunkmap *map);
+int chunk_complete(int branch, const char *path);
+int chunk_complete_tree(int branch, const char *path);
+void chunk_remove(int branch, const char *path);
+
+#endif
@@ -19,6 +19,12 @@
 
 #endif // _XOPEN_SOURCE
 
+// splice() between /dev/fuse and the branch files, with libfuse >= 2.9
+// through read_buf() and write_buf(), see fhandle.c
+#if !defined (DISABLE_SPLICE) && defined (__linux__)
+	#define UNIONFS_HAVE_SPLICE
+#endif
+
 // xattr support
 #if !defined (DISABLE_XATTR)
 	#if defined (LIBC_XATTR)
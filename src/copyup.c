@@ -0,0 +1,214 @@
+/*
+* Description: single-flight copy-up
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	With the multithreaded FUSE loop several threads may want to write to
+*	the same file of a read-only branch at the same time, e.g. a build
+*	opening a file from many processes. Each of them used to find the file
+*	on the ro-branch and copy it, truncating the copy another thread had
+*	just made and maybe already written to.
+*	So every copy-up in progress is registered here. The first thread for
+*	a path does the copy, threads coming for the same path meanwhile wait
+*	for it and take its result. Each of the COPYUP_SHARDS lists has its
+*	own lock, so copy-ups of unrelated paths rarely contend.
+*	A thread may have looked up the branch just before the copy finished,
+*	so the first thread re-checks if the file is already on the rw-branch.
+*	That is not possible for directories (-o cow rename), their copy is
+*	always done.
+*	The copy is made in place, so a lookup may find the incomplete file on
+*	the rw-branch. find_rorw_branch() therefore calls copyup_wait() after
+*	each lookup, which only takes a lock if any copy-up is in progress.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "copyup.h"
+#include "cow.h"
+#include "general.h"
+#include "branchio.h"
+#include "string.h"
+#include "stats.h"
+#include "trace.h"
+#include "debug.h"
+
+struct copyup_entry {
+	struct copyup_entry *next;
+	unsigned int hash;
+	int branch_rw;
+	bool copy_dir;
+	pthread_t owner;	// thread doing the copy
+	bool done;
+	int res;		// result of cow_cp()
+	int err;		// and its errno
+	unsigned int waiters;	// threads waiting for done
+	char path[];
+};
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	struct copyup_entry *list; // copy-ups in progress
+} copyup_shard_t;
+
+static copyup_shard_t shards[COPYUP_SHARDS];
+static unsigned long inflight;	// number of copy-ups in progress
+
+void copyup_init(void) {
+	int i;
+	for (i = 0; i < COPYUP_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		pthread_cond_init(&shards[i].done, NULL);
+		shards[i].list = NULL;
+	}
+}
+
+static struct copyup_entry *find_entry(copyup_shard_t *shard, const char *path, unsigned int hash) {
+	struct copyup_entry *e;
+	for (e = shard->list; e; e = e->next) {
+		if (e->hash == hash && strcmp(e->path, path) == 0) return e;
+	}
+	return NULL;
+}
+
+static void unlink_entry(copyup_shard_t *shard, struct copyup_entry *entry) {
+	struct copyup_entry **p = &shard->list;
+	while (*p != entry) p = &(*p)->next;
+	*p = entry->next;
+}
+
+/**
+ * Wait until entry is done, with the shard locked.
+ * Frees entry if we were the last one waiting.
+ */
+static void wait_entry(copyup_shard_t *shard, struct copyup_entry *entry, int *res, int *err) {
+	entry->waiters++;
+	while (!entry->done) pthread_cond_wait(&shard->done, &shard->lock);
+
+	*res = entry->res;
+	*err = entry->err;
+
+	if (--entry->waiters == 0) free(entry);
+}
+
+/**
+ * Wait for a copy-up of path done by another thread. Returns true if we had to
+ * wait, then a branch looked up before might be outdated.
+ */
+bool copyup_wait(const char *path) {
+	// registered before the copy creates anything, see copyup()
+	if (__atomic_load_n(&inflight, __ATOMIC_SEQ_CST) == 0) return false;
+
+	unsigned int hash = string_hash((void *)path);
+	copyup_shard_t *shard = &shards[hash % COPYUP_SHARDS];
+	bool waited = false;
+
+	pthread_mutex_lock(&shard->lock);
+
+	struct copyup_entry *entry = find_entry(shard, path, hash);
+	if (entry && !pthread_equal(entry->owner, pthread_self())) {
+		int res, err;
+		wait_entry(shard, entry, &res, &err);
+		waited = true;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return waited;
+}
+
+/**
+ * Copy path from branch_ro to branch_rw and remove what might hide it, unless
+ * another thread is already doing that. Returns like cow_cp(), on failure
+ * errno is set.
+ */
+int copyup(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
+	DBG("%s\n", path);
+
+	unsigned int hash = string_hash((void *)path);
+	copyup_shard_t *shard = &shards[hash % COPYUP_SHARDS];
+	int res, err;
+
+	pthread_mutex_lock(&shard->lock);
+
+	struct copyup_entry *entry;
+	while ((entry = find_entry(shard, path, hash))) {
+		// a directory copy also covers the directory itself
+		if (entry->branch_rw == branch_rw && (entry->copy_dir || !copy_dir)) {
+			wait_entry(shard, entry, &res, &err);
+			pthread_mutex_unlock(&shard->lock);
+
+			errno = err;
+			RETURN(res);
+		}
+
+		// a different copy-up of the same path, do ours once it is done
+		wait_entry(shard, entry, &res, &err);
+	}
+
+	entry = malloc(sizeof(struct copyup_entry) + strlen(path) + 1);
+	if (!entry) {
+		pthread_mutex_unlock(&shard->lock);
+		errno = ENOMEM;
+		RETURN(-1);
+	}
+
+	entry->hash = hash;
+	entry->branch_rw = branch_rw;
+	entry->copy_dir = copy_dir;
+	entry->owner = pthread_self();
+	entry->done = false;
+	entry->waiters = 0;
+	strcpy(entry->path, path);
+
+	entry->next = shard->list;
+	shard->list = entry;
+	__atomic_add_fetch(&inflight, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	struct stat st;
+	if (!copy_dir && b_lstat(branch_rw, path, &st) == 0) {
+		// copied right before we registered
+		res = 0;
+		err = 0;
+	} else {
+		uint64_t start = stats_start();
+
+		res = cow_cp(path, branch_ro, branch_rw, copy_dir);
+		err = errno;
+
+		// remove a file that might hide the copied file
+		if (res == 0) remove_hidden(path, branch_rw);
+
+		stats_copyup_done(start);
+		TRACE(TRACE_EV_COPYUP, path, branch_rw, res ? -err : 0, start);
+	}
+
+	pthread_mutex_lock(&shard->lock);
+
+	unlink_entry(shard, entry);
+	__atomic_sub_fetch(&inflight, 1, __ATOMIC_SEQ_CST);
+	entry->res = res;
+	entry->err = err;
+	entry->done = true;
+
+	if (entry->waiters) {
+		pthread_cond_broadcast(&shard->done);
+	} else {
+		free(entry);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	errno = err;
+	RETURN(res);
+}
@@ -0,0 +1,18 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef COPYUP_H
+#define COPYUP_H
+
+#include <stdbool.h>
+
+#define COPYUP_SHARDS 16	// number of independently locked in-flight lists
+
+void copyup_init(void);
+bool copyup_wait(const char *path);
+int copyup(const char *path, int branch_ro, int branch_rw, bool copy_dir);
+
+#endif
@@ -16,8 +16,10 @@
 #include <errno.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <time.h>
 
 #include "opts.h"
+#include "btable.h"
 #include "findbranch.h"
 #include "general.h"
 #include "cow.h"
@@ -25,6 +27,13 @@
 #include "string.h"
 #include "debug.h"
 #include "usyslog.h"
+#include "lcache.h"
+#include "branchio.h"
+#include "chunk.h"
+#include "pool.h"
+#include "stats.h"
+#include "bexec.h"
+#include "imap.h"
 
 
 /**
@@ -34,10 +43,10 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 	DBG("%s\n", path);
 
 	char dirp[PATHLEN_MAX]; // dir path to create
-	sprintf(dirp, "%s%s", uopt.branches[nbranch_rw].path, path);
+	sprintf(dirp, "%s%s", BRANCH(nbranch_rw).path, path);
 
 	struct stat buf;
-	int res = stat(dirp, &buf);
+	int res = b_stat(nbranch_rw, path, &buf);
 	if (res != -1) RETURN(0); // already exists
 
 	if (nbranch_ro == nbranch_rw) {
@@ -46,22 +55,24 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 		buf.st_mode = S_IRWXU | S_IRWXG;
 	} else {
 		// data from the ro-branch
-		char o_dirp[PATHLEN_MAX]; // the pathname we want to copy
-		sprintf(o_dirp, "%s%s", uopt.branches[nbranch_ro].path, path);
-		res = stat(o_dirp, &buf);
+		res = b_stat(nbranch_ro, path, &buf);
 		if (res == -1) RETURN(1); // lower level branch removed in the mean time?
 	}
 
-	res = mkdir(dirp, buf.st_mode);
+	res = b_mkdir(nbranch_rw, path, buf.st_mode);
 	if (res == -1) {
 		USYSLOG(LOG_DAEMON, "Creating %s failed: \n", dirp);
 		RETURN(1);
 	}
 
+	lcache_invalidate(path);
+
 	if (nbranch_ro == nbranch_rw) RETURN(0); // the special case again
 
 	if (setfile(dirp, &buf)) RETURN(1); // directory already removed by another process?
 
+	imap_copied(nbranch_rw, path, &buf);
+
 	// TODO: time, but its values are modified by the next dir/file creation steps?
 
 	RETURN(0);
@@ -77,10 +88,10 @@ int path_create(const char *path, int nbranch_ro, int nbranch_rw) {
 	if (!uopt.cow_enabled) RETURN(0);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[nbranch_rw].path, path)) RETURN(-ENAMETOOLONG);
+	if (strlen(path) >= PATHLEN_MAX) RETURN(-ENAMETOOLONG);
 
 	struct stat st;
-	if (!stat(p, &st)) {
+	if (!b_stat(nbranch_rw, path, &st)) {
 		// path does already exists, no need to create it
 		RETURN(0);
 	}
@@ -122,42 +133,65 @@ int path_create_cutlast(const char *path, int nbranch_ro, int nbranch_rw) {
 	RETURN(ret);
 }
 
+// cow_cp() of a file, run by a worker of the ro-branch
+struct cow_cp_job {
+	struct bexec_job job;
+	int branch_ro;
+	int branch_rw;
+	char path[];
+};
+
+static long cow_cp_job_fn(struct bexec_job *job) {
+	struct cow_cp_job *j = (struct cow_cp_job *)job;
+	return cow_cp(j->path, j->branch_ro, j->branch_rw, false);
+}
+
 /**
- * initiate the cow-copy action
+ * Copy path by a worker of branch_ro (-o branch_threads), it shares the
+ * workers with the other calls on the branch, but is waited for without
+ * timeout.
  */
-int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
-	DBG("%s\n", path);
+static int cow_cp_worker(const char *path, int branch_ro, int branch_rw) {
+	struct cow_cp_job *j = malloc(sizeof(struct cow_cp_job) + strlen(path) + 1);
+	if (!j) RETURN(-ENOMEM);
 
-	// create the path to the file
-	path_create_cutlast(path, branch_ro, branch_rw);
+	j->job.fn = cow_cp_job_fn;
+	j->job.abandon = NULL;
+	j->branch_ro = branch_ro;
+	j->branch_rw = branch_rw;
+	strcpy(j->path, path);
+
+	// only fails if there are too many calls waiting for the branch
+	if (!bexec_run(branch_ro, &j->job, false)) RETURN(-errno);
 
+	int res = j->job.res;
+	free(j);
+	RETURN(res);
+}
+
+/**
+ * Copy path from branch_ro to branch_rw, its parent directory must exist on
+ * branch_rw already. uid and umask of cow are set by the caller.
+ */
+static int copy_entry(const char *path, int branch_ro, int branch_rw, struct cow *cow, bool copy_dir) {
 	char from[PATHLEN_MAX], to[PATHLEN_MAX];
-	if (BUILD_PATH(from, uopt.branches[branch_ro].path, path))
+	if (BUILD_PATH(from, BRANCH(branch_ro).path, path))
 		RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(to, uopt.branches[branch_rw].path, path))
+	if (BUILD_PATH(to, BRANCH(branch_rw).path, path))
 		RETURN(-ENAMETOOLONG);
 
-	setlocale(LC_ALL, "");
-
-	struct cow cow;
-
-	cow.uid = getuid();
-
-	// Copy the umask for explicit mode setting.
-	cow.umask = umask(0);
-	umask(cow.umask);
-
-	cow.from_path = from;
-	cow.to_path = to;
+	cow->from_path = from;
+	cow->to_path = to;
+	cow->sparse = false;
 
 	struct stat buf;
-	lstat(cow.from_path, &buf);
-	cow.stat = &buf;
+	lstat(cow->from_path, &buf);
+	cow->stat = &buf;
 
 	int res;
 	switch (buf.st_mode & S_IFMT) {
 		case S_IFLNK:
-			res = copy_link(&cow);
+			res = copy_link(cow);
 			break;
 		case S_IFDIR:
 			if (copy_dir) {
@@ -168,40 +202,143 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
 			break;
 		case S_IFBLK:
 		case S_IFCHR:
-			res = copy_special(&cow);
+			res = copy_special(cow);
 			break;
 		case S_IFIFO:
-			res = copy_fifo(&cow);
+			res = copy_fifo(cow);
 			break;
 		case S_IFSOCK:
-			USYSLOG(LOG_WARNING, "COW of sockets not supported: %s\n", cow.from_path);
+			USYSLOG(LOG_WARNING, "COW of sockets not supported: %s\n", cow->from_path);
 			RETURN(1);
 		default:
-			res = copy_file(&cow);
+			// large files only get their chunk map, see chunk.c
+			if (chunk_wanted(&buf) && chunk_copy_up(path, branch_ro, branch_rw) == 0)
+				cow->sparse = true;
+
+			res = copy_file(cow);
+			if (res && cow->sparse) chunk_remove(branch_rw, path);
+	}
+
+	// path is now (or maybe partly, if copying failed) on branch_rw
+	lcache_invalidate(path);
+	if (res == 0) {
+		// S_IFDIR is done by do_create() and create_dir()
+		if (!S_ISDIR(buf.st_mode)) imap_copied(branch_rw, path, &buf);
+		stats_copyup();
 	}
 
 	RETURN(res);
 }
 
 /**
- * copy a directory between branches (includes all contents of the directory)
+ * initiate the cow-copy action
  */
-int copy_directory(const char *path, int branch_ro, int branch_rw) {
+int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
 	DBG("%s\n", path);
 
-	/* create the directory on the destination branch */
-	int res = path_create(path, branch_ro, branch_rw);
-	if (res != 0) {
-		RETURN(res);
+	// a directory copy waits for the pool, which needs the workers itself
+	if (!copy_dir && bexec_active(branch_ro)) RETURN(cow_cp_worker(path, branch_ro, branch_rw));
+
+	// create the path to the file
+	path_create_cutlast(path, branch_ro, branch_rw);
+
+	setlocale(LC_ALL, "");
+
+	struct cow cow;
+
+	cow.uid = getuid();
+
+	// Copy the umask for explicit mode setting.
+	cow.umask = umask(0);
+	umask(cow.umask);
+
+	int res = copy_entry(path, branch_ro, branch_rw, &cow, copy_dir);
+	RETURN(res);
+}
+
+// a directory created by copy_directory(), its attributes are set at the end
+struct dir_copy_dir {
+	struct dir_copy_dir *next;
+	struct stat st;
+	char path[];
+};
+
+// a copy_directory() run
+struct dir_copy {
+	int branch_ro;
+	int branch_rw;
+	struct cow cow;			// uid and umask for all members
+	struct pool_group group;	// copies of the members
+	struct dir_copy_dir *dirs;	// created directories, the last one first
+	unsigned long entries;		// members handed to the pool
+};
+
+struct dir_copy_job {
+	struct dir_copy *copy;
+	char path[];
+};
+
+/**
+ * Copy a member which is not a directory, runs on a worker of the pool.
+ */
+static int copy_job(void *arg) {
+	struct dir_copy_job *job = arg;
+
+	struct cow cow = job->copy->cow; // copy_entry() fills in the paths
+	int res = copy_entry(job->path, job->copy->branch_ro, job->copy->branch_rw, &cow, false);
+
+	free(job);
+	return res;
+}
+
+/**
+ * Remember that we created the directory path, for the end of the copy.
+ */
+static int add_dir(struct dir_copy *copy, const char *path, const struct stat *st) {
+	struct dir_copy_dir *dir = malloc(sizeof(struct dir_copy_dir) + strlen(path) + 1);
+	if (!dir) RETURN(1);
+
+	dir->st = *st;
+	strcpy(dir->path, path);
+	dir->next = copy->dirs;
+	copy->dirs = dir;
+
+	RETURN(0);
+}
+
+/**
+ * Create the directory path on the rw-branch, its parent exists already.
+ * It is writable for us until the copy is finished.
+ */
+static int create_dir(struct dir_copy *copy, const char *path) {
+	struct stat st;
+	if (b_lstat(copy->branch_ro, path, &st) == -1) RETURN(1);
+
+	if (b_mkdir(copy->branch_rw, path, S_IRWXU) == -1) {
+		if (errno == EEXIST) RETURN(0); // keep it as it is
+
+		USYSLOG(LOG_WARNING, "Creating %s%s failed: %s\n",
+			BRANCH(copy->branch_rw).path, path, strerror(errno));
+		RETURN(1);
 	}
 
-	/* determine path to source directory on read-only branch */
-	char from[PATHLEN_MAX];
-	if (BUILD_PATH(from, uopt.branches[branch_ro].path, path)) RETURN(1);
+	lcache_invalidate(path);
+	imap_copied(copy->branch_rw, path, &st);
 
-	DIR *dp = opendir(from);
+	RETURN(add_dir(copy, path, &st));
+}
+
+/**
+ * Walk the directory path on the ro-branch, create its sub-directories right
+ * away and hand all other members to the pool.
+ */
+static int enumerate_dir(struct dir_copy *copy, const char *path) {
+	DBG("%s\n", path);
+
+	DIR *dp = b_opendir(copy->branch_ro, path);
 	if (dp == NULL) RETURN(1);
 
+	int res = 0;
 	struct dirent *de;
 	while ((de = readdir(dp)) != NULL) {
 		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
@@ -211,11 +348,96 @@ int copy_directory(const char *path, int branch_ro, int branch_rw) {
 			res = 1;
 			break;
 		}
-		res = cow_cp(member, branch_ro, branch_rw, true);
-		if (res != 0) break;
+
+		bool is_dir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+			if (b_lstat(copy->branch_ro, member, &st) == -1) {
+				res = 1;
+				break;
+			}
+			is_dir = S_ISDIR(st.st_mode);
+		}
+
+		if (is_dir) {
+			res = create_dir(copy, member);
+			if (!res) res = enumerate_dir(copy, member);
+			if (res) break;
+			continue;
+		}
+
+		struct dir_copy_job *job = malloc(sizeof(struct dir_copy_job) + strlen(member) + 1);
+		if (!job) {
+			res = 1;
+			break;
+		}
+		job->copy = copy;
+		strcpy(job->path, member);
+
+		// blocks while the queue is full
+		pool_submit(&copy->group, copy_job, job);
+
+		if (++copy->entries % COPY_PROGRESS_ENTRIES == 0)
+			USYSLOG(LOG_INFO, "copy-up: %lu of %lu files copied, now in %s\n",
+				pool_group_done(&copy->group), copy->entries, path);
 	}
 
 	closedir(dp);
 	RETURN(res);
 }
 
+/**
+ * copy a directory between branches (includes all contents of the directory)
+ *
+ * The tree is walked in this thread, while the worker pool copies the files
+ * in parallel. Directories are created as soon as they are found, their
+ * owner, mode and times are set once everything is copied, starting with the
+ * deepest ones, so that the copies do not modify the times again.
+ */
+int copy_directory(const char *path, int branch_ro, int branch_rw) {
+	DBG("%s\n", path);
+
+	struct dir_copy copy;
+	memset(&copy, 0, sizeof(copy));
+	copy.branch_ro = branch_ro;
+	copy.branch_rw = branch_rw;
+	copy.cow.uid = getuid();
+	copy.cow.umask = umask(0);
+	umask(copy.cow.umask);
+
+	struct stat st;
+	bool existed = b_lstat(branch_rw, path, &st) == 0;
+
+	/* create the directory on the destination branch */
+	int res = path_create(path, branch_ro, branch_rw);
+	if (res != 0) {
+		RETURN(res);
+	}
+
+	if (!existed && b_lstat(branch_ro, path, &st) == 0) add_dir(&copy, path, &st);
+
+	time_t start = time(NULL);
+	pool_group_init(&copy.group);
+
+	res = enumerate_dir(&copy, path);
+
+	int err = pool_group_wait(&copy.group);
+	if (!res) res = err;
+	pool_group_destroy(&copy.group);
+
+	while (copy.dirs) {
+		struct dir_copy_dir *dir = copy.dirs;
+		copy.dirs = dir->next;
+
+		char to[PATHLEN_MAX];
+		if (!BUILD_PATH(to, BRANCH(branch_rw).path, dir->path) && setfile(to, &dir->st))
+			res = 1;
+		free(dir);
+	}
+
+	if (copy.entries >= COPY_PROGRESS_ENTRIES)
+		USYSLOG(LOG_INFO, "copy-up of %s: %lu files copied in %lds\n",
+			path, copy.entries, (long)(time(NULL) - start));
+
+	RETURN(res);
+}
@@ -9,6 +9,8 @@
 
 #include <sys/stat.h>
 
+#define COPY_PROGRESS_ENTRIES 10000	// copy_directory() logs its progress
+
 int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir);
 int path_create(const char *path, int nbranch_ro, int nbranch_rw);
 int path_create_cutlast(const char *path, int nbranch_ro, int nbranch_rw);
@@ -30,6 +30,10 @@
  *	This file was taken from OpenBSD and modified to fit the unionfs requirements.
  */
 
+#if defined __linux__
+	// For copy_file_range(), SEEK_DATA and SEEK_HOLE
+	#define _GNU_SOURCE
+#endif
 
 #include <err.h>
 #include <errno.h>
@@ -39,14 +43,24 @@
 #include <string.h>
 #include <unistd.h>
 #include <utime.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 
+#if defined __linux__
+	#include <sys/ioctl.h>
+	#include <sys/sendfile.h>
+	#include <linux/fs.h> // FICLONE
+
+	#if defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+		#define HAVE_COPY_FILE_RANGE
+	#endif
+#endif
+
 #include "unionfs.h"
 #include "cow_utils.h"
 #include "debug.h"
 #include "general.h"
 #include "usyslog.h"
+#include "stats.h"
 
 // BSD seems to know S_ISTXT itself
 #ifndef S_ISTXT
@@ -127,6 +141,156 @@ static int setlink(const char *path, struct stat *fs)
 }
 
 
+// how copy_range() moves the data, in the order we try them
+enum copy_method {
+	COPY_FILE_RANGE,	// in kernel, might be a reflink on the server side
+	COPY_SENDFILE,		// in kernel, but through the page cache
+	COPY_READ_WRITE,	// always works
+};
+
+/**
+ * Copy-up runs in all fuse threads at the same time, so each thread needs
+ * its own buffer.
+ */
+static __thread char copy_buf[COPY_BUFSIZE];
+
+/**
+ * copy len bytes at off with pread() and pwrite()
+ **/
+static int copy_read_write(int from_fd, int to_fd, off_t off, off_t len)
+{
+	while (len > 0) {
+		size_t count = len < COPY_BUFSIZE ? (size_t)len : COPY_BUFSIZE;
+
+		ssize_t rcount = pread(from_fd, copy_buf, count, off);
+		if (rcount == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (rcount == 0) break; // the file got truncated meanwhile
+
+		ssize_t done = 0;
+		while (done < rcount) {
+			ssize_t wcount = pwrite(to_fd, copy_buf + done, rcount - done, off + done);
+			if (wcount == -1) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			done += wcount;
+		}
+
+		off += rcount;
+		len -= rcount;
+	}
+
+	return 0;
+}
+
+/**
+ * Copy len bytes at off, with the fastest method that works for these two
+ * files. If an in-kernel method fails, for example because the branches are
+ * on different file systems or the kernel is too old, it is not tried again
+ * for this file and we continue with the next one where it stopped. Real
+ * I/O errors then show up in the read/write loop.
+ **/
+static int copy_range(int from_fd, int to_fd, off_t off, off_t len, enum copy_method *method)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	while (*method == COPY_FILE_RANGE && len > 0) {
+		loff_t in_off = off, out_off = off;
+
+		ssize_t res = copy_file_range(from_fd, &in_off, to_fd, &out_off, len, 0);
+		if (res == -1 && errno == EINTR) continue;
+		if (res == 0) return 0; // the file got truncated meanwhile
+		if (res == -1) {
+			*method = COPY_SENDFILE;
+			break;
+		}
+
+		off += res;
+		len -= res;
+	}
+#endif
+
+#ifdef __linux__
+	// sendfile() writes at the file position of to_fd
+	if (*method <= COPY_SENDFILE && len > 0 && lseek(to_fd, off, SEEK_SET) == -1)
+		*method = COPY_READ_WRITE;
+
+	while (*method <= COPY_SENDFILE && len > 0) {
+		off_t in_off = off;
+
+		ssize_t res = sendfile(to_fd, from_fd, &in_off, len);
+		if (res == -1 && errno == EINTR) continue;
+		if (res == 0) return 0;
+		if (res == -1) {
+			*method = COPY_READ_WRITE;
+			break;
+		}
+
+		off += res;
+		len -= res;
+	}
+#endif
+
+	*method = COPY_READ_WRITE;
+	return copy_read_write(from_fd, to_fd, off, len);
+}
+
+/**
+ * Copy the data of from_fd to to_fd, which must be empty. If both are on a
+ * file system supporting reflinks (btrfs, xfs, ...) the data are shared,
+ * otherwise only the data segments are copied, so that holes stay holes.
+ **/
+static int copy_data(int from_fd, int to_fd)
+{
+	struct stat st;
+	if (fstat(from_fd, &st)) return -1;
+
+#ifdef FICLONE
+	if (ioctl(to_fd, FICLONE, from_fd) == 0) {
+		stats_copyup_bytes(st.st_size);
+		return 0;
+	}
+#endif
+
+	enum copy_method method = COPY_FILE_RANGE;
+	off_t pos = 0;
+	while (pos < st.st_size) {
+		off_t end = st.st_size;
+#ifdef SEEK_DATA
+		off_t data = lseek(from_fd, pos, SEEK_DATA);
+		if (data == -1 && errno == ENXIO) break; // only a hole is left
+		if (data != -1) {
+			// otherwise the file system can't tell us, copy it all
+			pos = data;
+			if (pos >= st.st_size) break;
+
+			end = lseek(from_fd, pos, SEEK_HOLE);
+			if (end == -1 || end > st.st_size) end = st.st_size;
+		}
+#endif
+		if (copy_range(from_fd, to_fd, pos, end - pos, &method)) return -1;
+		stats_copyup_bytes(end - pos);
+		pos = end;
+	}
+
+	// holes at the end of the file are not written at all
+	return ftruncate(to_fd, st.st_size);
+}
+
+/**
+ * copy len bytes at off of two open files, for the partial copy-up
+ **/
+int copy_fd_range(int from_fd, int to_fd, off_t off, off_t len)
+{
+	enum copy_method method = COPY_FILE_RANGE;
+	if (copy_range(from_fd, to_fd, off, len, &method)) return -1;
+
+	stats_copyup_bytes(len);
+	return 0;
+}
+
 /**
  * copy an ordinary file with all of its stat() data
  **/
@@ -134,13 +298,9 @@ int copy_file(struct cow *cow)
 {
 	DBG("from %s to %s\n", cow->from_path, cow->to_path);
 
-	static char buf[MAXBSIZE];
 	struct stat to_stat, *fs;
-	int from_fd, rcount, to_fd, wcount;
+	int from_fd, to_fd;
 	int rval = 0;
-#ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
-	char *p;
-#endif
 
 	if ((from_fd = open(cow->from_path, O_RDONLY, 0)) == -1) {
 		USYSLOG(LOG_WARNING, "%s", cow->from_path);
@@ -158,44 +318,15 @@ int copy_file(struct cow *cow)
 		RETURN(1);
 	}
 
-	/*
-	 * Mmap and write if less than 8M (the limit is so we don't totally
-	 * trash memory on big files.  This is really a minor hack, but it
-	 * wins some CPU back.
-	 */
-#ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
-	if (fs->st_size > 0 && fs->st_size <= 8 * 1048576) {
-		if ((p = mmap(NULL, (size_t)fs->st_size, PROT_READ,
-		    MAP_FILE|MAP_SHARED, from_fd, (off_t)0)) == MAP_FAILED) {
-			USYSLOG(LOG_WARNING, "mmap: %s", cow->from_path);
-			rval = 1;
-		} else {
-			madvise(p, fs->st_size, MADV_SEQUENTIAL);
-			if (write(to_fd, p, fs->st_size) != fs->st_size) {
-				USYSLOG(LOG_WARNING, "%s", cow->to_path);
-				rval = 1;
-			}
-			/* Some systems don't unmap on close(2). */
-			if (munmap(p, fs->st_size) < 0) {
-				USYSLOG(LOG_WARNING, "%s", cow->from_path);
-				rval = 1;
-			}
-		}
-	} else
-#endif
-	{
-		while ((rcount = read(from_fd, buf, MAXBSIZE)) > 0) {
-			wcount = write(to_fd, buf, rcount);
-			if (rcount != wcount || wcount == -1) {
-				USYSLOG(LOG_WARNING, "%s", cow->to_path);
-				rval = 1;
-				break;
-			}
-		}
-		if (rcount < 0) {
-			USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
+	if (cow->sparse) {
+		// the data are copied later, see chunk.c
+		if (ftruncate(to_fd, fs->st_size)) {
+			USYSLOG(LOG_WARNING, "%s", cow->to_path);
 			rval = 1;
 		}
+	} else if (copy_data(from_fd, to_fd)) {
+		USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
+		rval = 1;
 	}
 
 	if (rval == 1) {
@@ -7,8 +7,9 @@
 #ifndef COW_UTILS_H
 #define COW_UTILS_H
 
-#define VM_AND_BUFFER_CACHE_SYNCHRONIZED
-#define MAXBSIZE 4096
+#include <stdbool.h>
+
+#define COPY_BUFSIZE (128 * 1024)	// per thread, for the read/write fallback
 
 struct cow {
 	mode_t umask;
@@ -20,6 +21,7 @@ struct cow {
 
 	// destination file
 	char *to_path;
+	bool sparse;	// only create a file of the same size, no data
 };
 
 int setfile(const char *path, struct stat *fs);
@@ -27,5 +29,6 @@ int copy_special(struct cow *cow);
 int copy_fifo(struct cow *cow);
 int copy_link(struct cow *cow);
 int copy_file(struct cow *cow);
+int copy_fd_range(int from_fd, int to_fd, off_t off, off_t len);
 
 #endif
@@ -0,0 +1,553 @@
+/*
+* Description: cache of merged directories
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Merging a directory reads it on every branch and reads the whiteouts
+*	of every branch. rm -rf does so twice for each directory: on opendir()
+*	and in the dir_not_empty() check of rmdir(). With -o dir_cache=number
+*	the snapshots taken by opendir() (see readdir.c) are kept for up to
+*	number directories for -o lookup_cache_ttl seconds, on the branch table
+*	they were merged on.
+*	Every lcache_invalidate() of a path marks its name unsure in the cached
+*	parent directory, instead of dropping the parent. unlink() and rmdir()
+*	bracket themselves with dcache_remove_begin() and dcache_remove_end(),
+*	so the invalidations of their own path are known to be a removal and
+*	the name is removed from the snapshot once they succeeded (unless
+*	somebody else invalidated it meanwhile). So after the entries of a
+*	directory were removed, its cached snapshot says it is empty without
+*	reading any branch. dir_not_empty() stops at the first name known to be
+*	visible and only looks up the unsure ones. opendir() only uses
+*	snapshots without unsure names. A directory with more than
+*	DCACHE_UNSURE_MAX unsure names is dropped.
+*	Whiteout directories hide entire sub-trees, lcache_invalidate_tree()
+*	drops the cached directories below them. Like the lookup cache, a
+*	ticket keeps merges which raced with an invalidation out of the cache.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "string.h"
+#include "lcache.h"
+#include "dcache.h"
+#include "debug.h"
+
+// states of the names of a cached directory
+enum {
+	NAME_CLEAN,		// visible, as merged
+	NAME_UNSURE,		// invalidated, needs a lookup
+	NAME_PENDING,		// being removed by owner
+	NAME_REMOVED		// removed through unionfs
+};
+
+typedef struct {
+	unsigned long table;	// generation of the branch table
+	time_t expires;		// monotonic time in seconds
+	struct dir_snapshot dir;
+	uint32_t *sorted;	// indices of dir.entries, sorted by name
+	unsigned char *state;	// of each entry
+	const void **owner;	// remover of a NAME_PENDING entry
+	size_t clean;		// NAME_CLEAN entries, without "." and ".."
+	int nunsure;		// unsure entries and extra names
+	int nextra;
+	char *extra[DCACHE_UNSURE_MAX]; // unsure names not in dir
+} dcache_entry_t;
+
+typedef struct {
+	pthread_rwlock_t lock;
+	struct hashtable *table;
+	unsigned long seq;	// incremented on each invalidation
+} dcache_shard_t;
+
+static dcache_shard_t shards[LCACHE_SHARDS];
+static unsigned int max_per_shard;
+static bool enabled = false;
+
+// the path the calling thread is removing, see dcache_remove_begin()
+static __thread const char *removing;
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static dcache_shard_t *get_shard(const char *path) {
+	return &shards[string_hash((void *)path) % LCACHE_SHARDS];
+}
+
+static bool is_dot(const char *name) {
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+static void free_entry(dcache_entry_t *entry) {
+	if (!entry) return;
+
+	int i;
+	for (i = 0; i < entry->nextra; i++) free(entry->extra[i]);
+	free(entry->dir.names);
+	free(entry->dir.entries);
+	free(entry->sorted);
+	free(entry->state);
+	free(entry->owner);
+	free(entry);
+}
+
+/**
+ * Empty the hash table of a shard. The shard lock must be held.
+ */
+static void flush_shard(dcache_shard_t *shard) {
+	struct hashtable *table = create_hashtable(16, string_hash, string_equal);
+	if (!table) return; // keep the old entries, better than no table at all
+
+	if (hashtable_count(shard->table)) {
+		struct hashtable_itr *itr = hashtable_iterator(shard->table);
+		if (itr) {
+			do {
+				free_entry(hashtable_iterator_value(itr));
+			} while (hashtable_iterator_advance(itr));
+			free(itr);
+		}
+	}
+
+	hashtable_destroy(shard->table, 0);
+	shard->table = table;
+}
+
+/**
+ * Initialize the cache, must be called after option parsing.
+ */
+void dcache_init(void) {
+	if (uopt.dir_cache_size == 0) return;
+
+	max_per_shard = uopt.dir_cache_size / LCACHE_SHARDS;
+	if (max_per_shard == 0) max_per_shard = 1;
+
+	int i;
+	for (i = 0; i < LCACHE_SHARDS; i++) {
+		pthread_rwlock_init(&shards[i].lock, NULL);
+		shards[i].table = create_hashtable(16, string_hash, string_equal);
+		if (!shards[i].table) {
+			fprintf(stderr, "%s: Failed to create the directory cache\n", __func__);
+			exit(1); // still early stage, we can abort
+		}
+	}
+
+	enabled = true;
+}
+
+/**
+ * The entry of path if it is still valid. The shard lock must be held.
+ */
+static dcache_entry_t *find_entry(dcache_shard_t *shard, const char *path) {
+	dcache_entry_t *entry = hashtable_search(shard->table, (void *)path);
+	if (!entry || entry->table != btable_get()->gen || entry->expires <= now()) return NULL;
+	return entry;
+}
+
+/**
+ * Index of name in the snapshot of entry or -1.
+ */
+static long find_name(const dcache_entry_t *entry, const char *name) {
+	size_t lo = 0, hi = entry->dir.count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		uint32_t i = entry->sorted[mid];
+		int cmp = strcmp(entry->dir.names + entry->dir.entries[i].name, name);
+		if (cmp == 0) return i;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+struct sort_name {
+	const char *name;
+	uint32_t index;
+};
+
+static int cmp_name(const void *a, const void *b) {
+	return strcmp(((const struct sort_name *)a)->name, ((const struct sort_name *)b)->name);
+}
+
+/**
+ * Fill entry->sorted. Returns 0 or -1.
+ */
+static int sort_names(dcache_entry_t *entry) {
+	size_t count = entry->dir.count;
+	struct sort_name *names = malloc((count ? count : 1) * sizeof(struct sort_name));
+	if (!names) return -1;
+
+	size_t i;
+	for (i = 0; i < count; i++) {
+		names[i].name = entry->dir.names + entry->dir.entries[i].name;
+		names[i].index = i;
+	}
+	qsort(names, count, sizeof(struct sort_name), cmp_name);
+	for (i = 0; i < count; i++) entry->sorted[i] = names[i].index;
+
+	free(names);
+	return 0;
+}
+
+/**
+ * Get a ticket for dcache_insert(), before merging directory path.
+ */
+unsigned long dcache_ticket(const char *path) {
+	if (!enabled) return 0;
+
+	dcache_shard_t *shard = get_shard(path);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	unsigned long ticket = shard->seq;
+	pthread_rwlock_unlock(&shard->lock);
+
+	return ticket;
+}
+
+/**
+ * Remember a copy of the merged directory path.
+ */
+void dcache_insert(const char *path, const struct dir_snapshot *dir, unsigned long ticket) {
+	if (!enabled || dir->count > DCACHE_ENTRIES_MAX) return;
+
+	dcache_entry_t *entry = calloc(1, sizeof(dcache_entry_t));
+	if (!entry) return;
+
+	entry->dir.names = malloc(dir->names_len ? dir->names_len : 1);
+	entry->dir.entries = malloc((dir->count ? dir->count : 1) * sizeof(struct dir_entry));
+	entry->sorted = malloc((dir->count ? dir->count : 1) * sizeof(uint32_t));
+	entry->state = calloc(dir->count ? dir->count : 1, 1);
+	entry->owner = calloc(dir->count ? dir->count : 1, sizeof(void *));
+	if (!entry->dir.names || !entry->dir.entries || !entry->sorted || !entry->state || !entry->owner) {
+		free_entry(entry);
+		return;
+	}
+
+	memcpy(entry->dir.names, dir->names, dir->names_len);
+	entry->dir.names_len = entry->dir.names_size = dir->names_len;
+	memcpy(entry->dir.entries, dir->entries, dir->count * sizeof(struct dir_entry));
+	entry->dir.count = entry->dir.size = dir->count;
+
+	size_t i;
+	for (i = 0; i < dir->count; i++)
+		if (!is_dot(dir->names + dir->entries[i].name)) entry->clean++;
+
+	if (sort_names(entry)) {
+		free_entry(entry);
+		return;
+	}
+
+	dcache_shard_t *shard = get_shard(path);
+
+	pthread_rwlock_wrlock(&shard->lock);
+
+	// invalidated while we merged
+	if (shard->seq != ticket) goto err;
+
+	free_entry(hashtable_remove(shard->table, (void *)path));
+
+	// Simple size limit, a full shard is just emptied
+	if (hashtable_count(shard->table) >= max_per_shard) flush_shard(shard);
+
+	char *key = strdup(path);
+	if (!key || !hashtable_insert(shard->table, key, entry)) {
+		free(key);
+		goto err;
+	}
+
+	entry->table = btable_get()->gen;
+	entry->expires = now() + uopt.lookup_cache_ttl;
+
+	pthread_rwlock_unlock(&shard->lock);
+	return;
+
+err:
+	pthread_rwlock_unlock(&shard->lock);
+	free_entry(entry);
+}
+
+/**
+ * Return a new snapshot of directory path if it is cached and has no
+ * unsure names, NULL otherwise.
+ */
+struct dir_snapshot *dcache_snapshot(const char *path) {
+	if (!enabled) return NULL;
+
+	dcache_shard_t *shard = get_shard(path);
+	struct dir_snapshot *dir = NULL;
+
+	pthread_rwlock_rdlock(&shard->lock);
+
+	dcache_entry_t *entry = find_entry(shard, path);
+	if (entry && entry->nunsure == 0) {
+		dir = calloc(1, sizeof(struct dir_snapshot));
+
+		size_t i;
+		for (i = 0; dir && i < entry->dir.count; i++) {
+			if (entry->state[i] == NAME_REMOVED) continue;
+
+			struct dir_entry *e = &entry->dir.entries[i];
+			if (snapshot_add(dir, entry->dir.names + e->name, e->ino, e->mode)) {
+				free_snapshot(dir);
+				dir = NULL;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&shard->lock);
+
+	DBG("%s: %s\n", path, dir ? "hit" : "miss");
+	return dir;
+}
+
+/**
+ * Check the cached directory path for dir_not_empty(). Returns 1 if it has
+ * a visible entry, -1 if it is not cached. Otherwise 0 and the nunsure
+ * names in unsure need to be looked up.
+ */
+int dcache_not_empty(const char *path, char unsure[][DCACHE_NAME_MAX], int *nunsure) {
+	if (!enabled) return -1;
+
+	dcache_shard_t *shard = get_shard(path);
+	int res = -1;
+
+	pthread_rwlock_rdlock(&shard->lock);
+
+	dcache_entry_t *entry = find_entry(shard, path);
+	if (entry && entry->clean) {
+		res = 1;
+	} else if (entry) {
+		*nunsure = 0;
+
+		res = 0;
+
+		size_t i;
+		for (i = 0; i < entry->dir.count && res == 0; i++) {
+			if (entry->state[i] != NAME_UNSURE && entry->state[i] != NAME_PENDING) continue;
+			if (*nunsure == DCACHE_UNSURE_MAX) res = -1;
+			const char *name = entry->dir.names + entry->dir.entries[i].name;
+			if (res == 0) snprintf(unsure[(*nunsure)++], DCACHE_NAME_MAX, "%s", name);
+		}
+
+		int j;
+		for (j = 0; j < entry->nextra && res == 0; j++) {
+			if (*nunsure == DCACHE_UNSURE_MAX) res = -1;
+			if (res == 0) snprintf(unsure[(*nunsure)++], DCACHE_NAME_MAX, "%s", entry->extra[j]);
+		}
+	}
+
+	pthread_rwlock_unlock(&shard->lock);
+
+	DBG("%s: %d\n", path, res);
+	return res;
+}
+
+/**
+ * Mark name in entry as unsure, or as pending if the caller is removing it.
+ * The shard lock must be held. Returns false if entry must be dropped.
+ */
+static bool mark_name(dcache_entry_t *entry, const char *name, bool own) {
+	long i = find_name(entry, name);
+	if (i >= 0) {
+		unsigned char state = entry->state[i];
+
+		if (state == NAME_PENDING && entry->owner[i] == &removing) {
+			// invalidated again by the same removal
+		} else if (state == NAME_CLEAN && own) {
+			entry->state[i] = NAME_PENDING;
+			entry->owner[i] = &removing;
+			if (!is_dot(name)) entry->clean--;
+			entry->nunsure++;
+		} else if (state == NAME_CLEAN) {
+			entry->state[i] = NAME_UNSURE;
+			if (!is_dot(name)) entry->clean--;
+			entry->nunsure++;
+		} else if (state == NAME_PENDING) {
+			entry->state[i] = NAME_UNSURE; // somebody else changed it, too
+		} else if (state == NAME_REMOVED) {
+			entry->state[i] = NAME_UNSURE;
+			entry->nunsure++;
+		}
+	} else {
+		int j;
+		for (j = 0; j < entry->nextra; j++)
+			if (strcmp(entry->extra[j], name) == 0) return true;
+
+		if (entry->nextra == DCACHE_UNSURE_MAX || strlen(name) >= DCACHE_NAME_MAX) return false;
+
+		entry->extra[entry->nextra] = strdup(name);
+		if (!entry->extra[entry->nextra]) return false;
+		entry->nextra++;
+		entry->nunsure++;
+	}
+
+	return entry->nunsure <= DCACHE_UNSURE_MAX;
+}
+
+/**
+ * Split path into its parent directory and name. Returns false for "/".
+ */
+static bool split_path(const char *path, char *parent, const char **name) {
+	const char *slash = strrchr(path, '/');
+	if (!slash || slash[1] == '\0' || strlen(path) >= PATHLEN_MAX) return false;
+
+	size_t len = slash - path;
+	if (len == 0) len = 1; // the root directory
+	memcpy(parent, path, len);
+	parent[len] = '\0';
+
+	*name = slash + 1;
+	return true;
+}
+
+/**
+ * path changed, update the cached directory of its parent.
+ */
+static void mark_parent(const char *path) {
+	char parent[PATHLEN_MAX];
+	const char *name;
+	if (!split_path(path, parent, &name)) return;
+
+	bool own = removing && strcmp(removing, path) == 0;
+
+	dcache_shard_t *shard = get_shard(parent);
+
+	pthread_rwlock_wrlock(&shard->lock);
+
+	dcache_entry_t *entry = find_entry(shard, parent);
+	if (entry && !mark_name(entry, name, own)) free_entry(hashtable_remove(shard->table, parent));
+	shard->seq++;
+
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+/**
+ * The calling thread is going to remove path (unlink(), rmdir()), its
+ * invalidations of path are caused by that removal.
+ */
+void dcache_remove_begin(const char *path) {
+	removing = path;
+}
+
+/**
+ * The removal of path finished, removed if it succeeded.
+ */
+void dcache_remove_end(const char *path, bool removed) {
+	removing = NULL;
+
+	if (!enabled) return;
+
+	char parent[PATHLEN_MAX];
+	const char *name;
+	if (!split_path(path, parent, &name)) return;
+
+	dcache_shard_t *shard = get_shard(parent);
+
+	pthread_rwlock_wrlock(&shard->lock);
+
+	dcache_entry_t *entry = find_entry(shard, parent);
+	long i = entry ? find_name(entry, name) : -1;
+	if (i >= 0 && entry->state[i] == NAME_PENDING && entry->owner[i] == &removing) {
+		if (removed) {
+			entry->state[i] = NAME_REMOVED;
+			entry->nunsure--;
+		} else {
+			entry->state[i] = NAME_UNSURE;
+		}
+		entry->owner[i] = NULL;
+	}
+
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+/**
+ * path was modified (created, removed, copied up, hidden), called by
+ * lcache_invalidate().
+ */
+void dcache_invalidate(const char *path) {
+	if (!enabled) return;
+
+	DBG("%s\n", path);
+
+	// the directory itself, e.g. it was hidden or renamed
+	dcache_shard_t *shard = get_shard(path);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	free_entry(hashtable_remove(shard->table, (void *)path));
+	shard->seq++;
+	pthread_rwlock_unlock(&shard->lock);
+
+	mark_parent(path);
+}
+
+/**
+ * The sub-tree of path changed, e.g. a whiteout directory hides it now.
+ */
+void dcache_invalidate_tree(const char *path) {
+	if (!enabled) return;
+
+	DBG("%s\n", path);
+
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/') len--;
+	bool root = len == 1 && path[0] == '/';
+
+	int i;
+	for (i = 0; i < LCACHE_SHARDS; i++) {
+		pthread_rwlock_wrlock(&shards[i].lock);
+
+		if (root) {
+			flush_shard(&shards[i]);
+		} else if (hashtable_count(shards[i].table)) {
+			struct hashtable_itr *itr = hashtable_iterator(shards[i].table);
+			int more = itr != NULL;
+			while (more) {
+				const char *key = hashtable_iterator_key(itr);
+				if (strncmp(key, path, len) == 0 && (key[len] == '\0' || key[len] == '/')) {
+					free_entry(hashtable_iterator_value(itr));
+					more = hashtable_iterator_remove(itr);
+				} else {
+					more = hashtable_iterator_advance(itr);
+				}
+			}
+			free(itr);
+		}
+		shards[i].seq++;
+
+		pthread_rwlock_unlock(&shards[i].lock);
+	}
+
+	if (!root) mark_parent(path);
+}
+
+/**
+ * Anything might have changed, forget about everything.
+ */
+void dcache_invalidate_all(void) {
+	if (!enabled) return;
+
+	DBG_IN();
+
+	int i;
+	for (i = 0; i < LCACHE_SHARDS; i++) {
+		pthread_rwlock_wrlock(&shards[i].lock);
+		flush_shard(&shards[i]);
+		shards[i].seq++;
+		pthread_rwlock_unlock(&shards[i].lock);
+	}
+}
@@ -0,0 +1,29 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdbool.h>
+
+#include "readdir.h"
+
+#define DCACHE_ENTRIES_MAX 65536	// larger directories are not cached
+#define DCACHE_UNSURE_MAX 16		// changed names per directory, beyond it is dropped
+#define DCACHE_NAME_MAX 256		// NAME_MAX + 1
+
+void dcache_init(void);
+unsigned long dcache_ticket(const char *path);
+void dcache_insert(const char *path, const struct dir_snapshot *dir, unsigned long ticket);
+struct dir_snapshot *dcache_snapshot(const char *path);
+int dcache_not_empty(const char *path, char unsure[][DCACHE_NAME_MAX], int *nunsure);
+void dcache_remove_begin(const char *path);
+void dcache_remove_end(const char *path, bool removed);
+void dcache_invalidate(const char *path);
+void dcache_invalidate_tree(const char *path);
+void dcache_invalidate_all(void);
+
+#endif
@@ -27,10 +27,12 @@
 		errno = _errno; \
 	} while (0)
 
+// returncode is evaluated once, it might be a call like RETURN(fh_release(fi))
 #define RETURN(returncode) \
 	do { \
-		if (uopt.debug) DBG("return %d\n", returncode); \
-		return returncode; \
+		int _returncode = (returncode); \
+		if (uopt.debug) DBG("return %d\n", _returncode); \
+		return _returncode; \
 	} while (0)
 
 
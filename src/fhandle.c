@@ -0,0 +1,423 @@
+/*
+* Description: handles of open files
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	fi->fh of an open file points to a struct fhandle.
+*	Usually it only holds the file descriptor on the branch the file was
+*	opened on. With -o lazy_cow, open() for writing of a file that only
+*	exists on a ro-branch does not copy the file yet. The handle gets the
+*	ro-branch file opened read-only and is marked as pending, reads are
+*	served from there. Only the first write() or ftruncate() through the
+*	handle copies the file up, opens the copy and replaces fd under the
+*	lock of the handle. The ro-branch file stays open until release(),
+*	so a read() that got the old fd just before the swap still works.
+*	Tools which open files O_RDWR and never write do not cause a copy-up
+*	at all this way.
+*	Changes done through other handles or paths are not seen by a pending
+*	handle, it reads the ro-branch file until it writes itself.
+*	A handle of a partial copy (-o partial_cow) also has the chunk map of
+*	the file, fh_pread(), fh_pwrite() and fh_ftruncate() then go through
+*	chunk.c.
+*	fh_read_buf() and fh_write_buf() pass the file descriptor of a plain
+*	handle to libfuse, which can then splice() the data between /dev/fuse
+*	and the branch file. Lazy handles and partial copies are read and
+*	written through a buffer as with fh_pread() and fh_pwrite().
+*	With -o readahead every read of a plain handle is checked for a
+*	sequential stream. The kernel sends its own readahead requests in
+*	parallel, so reads a window before or after the end of the previous
+*	read still count as sequential. Once the stream is detected, the branch
+*	file is advised to be read sequentially and the next window is asked
+*	for with POSIX_FADV_WILLNEED while half of the current one is left.
+*	The stream state is updated without a lock, a race only costs a
+*	redundant or a missing hint.
+*	Plain handles know their branch, with -o branch_threads their reads
+*	and writes are done by the workers of the branch (see bexec.c) and
+*	not spliced.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "findbranch.h"
+#include "general.h"
+#include "branchio.h"
+#include "lcache.h"
+#include "fhandle.h"
+#include "stats.h"
+#include "bexec.h"
+#include "debug.h"
+
+static struct fhandle *get_fh(struct fuse_file_info *fi) {
+	return (struct fhandle *)(uintptr_t)fi->fh;
+}
+
+/**
+ * Hint the branch about the read of size at off through fh, see the
+ * details above.
+ */
+static void read_ahead(struct fhandle *fh, int fd, off_t off, size_t size) {
+	off_t window = uopt.readahead;
+	if (!window) return;
+
+	off_t end = off + size;
+	off_t next = __atomic_exchange_n(&fh->next_off, end, __ATOMIC_RELAXED);
+	unsigned int streak = __atomic_load_n(&fh->streak, __ATOMIC_RELAXED);
+
+	if (off < next - window || off > next + window) {
+		if (streak >= FH_SEQUENTIAL_READS) {
+			DBG("fd = %d random again at %lld\n", fd, (long long)off);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+			__atomic_store_n(&fh->ahead, 0, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&fh->streak, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (streak < FH_SEQUENTIAL_READS) {
+		__atomic_store_n(&fh->streak, ++streak, __ATOMIC_RELAXED);
+		if (streak < FH_SEQUENTIAL_READS) return;
+
+		DBG("fd = %d sequential at %lld\n", fd, (long long)off);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	off_t ahead = __atomic_load_n(&fh->ahead, __ATOMIC_RELAXED);
+	if (end + window / 2 <= ahead) return;
+
+	off_t start = ahead > end ? ahead : end;
+	__atomic_store_n(&fh->ahead, start + window, __ATOMIC_RELAXED);
+	posix_fadvise(fd, start, window, POSIX_FADV_WILLNEED);
+	stats_readahead();
+}
+
+/**
+ * Attach fd, opened on branch, to fi. fd is closed on failure.
+ */
+int fh_new(struct fuse_file_info *fi, int fd, int branch) {
+	struct fhandle *fh = calloc(1, sizeof(struct fhandle));
+	if (!fh) {
+		close(fd);
+		RETURN(-ENOMEM);
+	}
+
+	fh->fd = fd;
+	fh->branch = branch;
+	fi->fh = (uintptr_t)fh;
+
+	RETURN(0);
+}
+
+/**
+ * Attach the ro-branch file fd to fi, flags are the flags of the open()
+ * to do on the first write. fd is closed on failure.
+ */
+int fh_new_lazy(struct fuse_file_info *fi, int fd, int flags) {
+	// the file is replaced by the copy-up, so it has no branch
+	int res = fh_new(fi, fd, -1);
+	if (res) RETURN(res);
+
+	struct fhandle *fh = get_fh(fi);
+	fh->lazy = true;
+	fh->pending = true;
+	fh->lower_fd = -1;
+	fh->flags = flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+	pthread_mutex_init(&fh->lock, NULL);
+
+	RETURN(0);
+}
+
+/**
+ * Get the file descriptor and the chunk map of fh.
+ */
+static int get_file(struct fhandle *fh, struct chunkmap **chunks) {
+	if (!fh->lazy) {
+		*chunks = fh->chunks;
+		return fh->fd;
+	}
+
+	pthread_mutex_lock(&fh->lock);
+	int fd = fh->fd;
+	*chunks = fh->chunks;
+	pthread_mutex_unlock(&fh->lock);
+
+	return fd;
+}
+
+/**
+ * The file descriptor to read from. Do not read from it directly if the
+ * file might be a partial copy, use fh_pread() then.
+ */
+int fh_fd(struct fuse_file_info *fi) {
+	struct chunkmap *chunks;
+	return get_file(get_fh(fi), &chunks);
+}
+
+/**
+ * Attach the chunk map of path on branch, if it is a partial copy.
+ * Must be called before fi is used by other threads.
+ */
+int fh_chunks(struct fuse_file_info *fi, int branch, const char *path) {
+	struct fhandle *fh = get_fh(fi);
+
+	fh->chunks = chunk_open(branch, path);
+	if (!fh->chunks && errno) RETURN(-errno);
+
+	RETURN(0);
+}
+
+/**
+ * The file descriptor to write to, copies path up if the handle is still
+ * pending. Returns -errno on failure, also if path is NULL and a copy-up
+ * would be required.
+ */
+int fh_copyup(struct fuse_file_info *fi, const char *path) {
+	struct fhandle *fh = get_fh(fi);
+	if (!fh->lazy) return fh->fd;
+
+	pthread_mutex_lock(&fh->lock);
+
+	int res = fh->fd;
+	if (!fh->pending) goto out;
+
+	if (!path) {
+		// the path is required to find the rw-branch
+		res = -EIO;
+		goto out;
+	}
+
+	DBG("%s\n", path);
+
+	int i = find_rw_branch_cutlast(path);
+	if (i == -1) {
+		res = -errno;
+		goto out;
+	}
+
+	int fd = b_open(i, path, fh->flags, 0);
+	if (fd == -1) {
+		res = -errno;
+		goto out;
+	}
+
+	// a big file might have been copied up by chunks
+	struct chunkmap *chunks = chunk_open(i, path);
+	if (!chunks && errno) {
+		res = -errno;
+		close(fd);
+		goto out;
+	}
+
+	// as in unionfs_open()
+	remove_hidden(path, i);
+	lcache_drop_attr(path);
+
+	fh->chunks = chunks;
+	fh->lower_fd = fh->fd;
+	fh->fd = fd;
+	fh->pending = false;
+	res = fd;
+
+out:
+	pthread_mutex_unlock(&fh->lock);
+	return res;
+}
+
+/**
+ * pread() of the file behind fi, returns -errno on failure.
+ */
+ssize_t fh_pread(struct fuse_file_info *fi, char *buf, size_t size, off_t off) {
+	struct fhandle *fh = get_fh(fi);
+	struct chunkmap *chunks;
+	int fd = get_file(fh, &chunks);
+
+	if (chunks) return chunk_pread(chunks, fd, buf, size, off);
+
+	read_ahead(fh, fd, off, size);
+
+	ssize_t res = b_pread(fh->branch, fd, buf, size, off);
+	if (res == -1) return -errno;
+
+	return res;
+}
+
+/**
+ * pwrite() to the file behind fi, which might need a copy-up of path first.
+ * Returns -errno on failure.
+ */
+ssize_t fh_pwrite(struct fuse_file_info *fi, const char *path, const char *buf, size_t size, off_t off) {
+	int fd = fh_copyup(fi, path);
+	if (fd < 0) return fd;
+
+	struct chunkmap *chunks;
+	get_file(get_fh(fi), &chunks);
+
+	if (chunks) return chunk_pwrite(chunks, fd, buf, size, off);
+
+	ssize_t res = b_pwrite(get_fh(fi)->branch, fd, buf, size, off);
+	if (res == -1) return -errno;
+
+	return res;
+}
+
+/**
+ * ftruncate() the file behind fi, as fh_pwrite().
+ */
+int fh_ftruncate(struct fuse_file_info *fi, const char *path, off_t size) {
+	int fd = fh_copyup(fi, path);
+	if (fd < 0) RETURN(fd);
+
+	struct chunkmap *chunks;
+	get_file(get_fh(fi), &chunks);
+
+	if (chunks) RETURN(chunk_ftruncate(chunks, fd, size));
+
+	if (ftruncate(fd, size) == -1) RETURN(-errno);
+
+	RETURN(0);
+}
+
+/**
+ * A pending lazy_cow handle was not written to, nothing to copy up then.
+ */
+int fh_fsync(struct fuse_file_info *fi, int isdatasync) {
+	struct chunkmap *chunks;
+	int fd = get_file(get_fh(fi), &chunks);
+
+	int res;
+	if (isdatasync) {
+#if _POSIX_SYNCHRONIZED_IO + 0 > 0
+		res = fdatasync(fd);
+#else
+		res = fsync(fd);
+#endif
+	} else {
+		res = fsync(fd);
+	}
+
+	if (res == -1) RETURN(-errno);
+
+	// the data are only found with the chunk map
+	if (chunks) RETURN(chunk_fsync(chunks));
+
+	RETURN(0);
+}
+
+/**
+ * Close the files of fi and free the handle.
+ */
+int fh_release(struct fuse_file_info *fi) {
+	struct fhandle *fh = get_fh(fi);
+	fi->fh = 0;
+
+	int res = close(fh->fd);
+	int _errno = errno;
+
+	if (fh->chunks) chunk_close(fh->chunks);
+
+	if (fh->lazy) {
+		if (fh->lower_fd != -1) close(fh->lower_fd);
+		pthread_mutex_destroy(&fh->lock);
+	}
+	free(fh);
+
+	if (res == -1) RETURN(-_errno);
+	RETURN(0);
+}
+
+#ifdef FH_SPLICE
+/**
+ * The file libfuse may splice() from and to, -1 if fi must be accessed
+ * through fh_pread() and fh_pwrite().
+ */
+int fh_splice_fd(struct fuse_file_info *fi) {
+	struct fhandle *fh = get_fh(fi);
+	// the workers of -o branch_threads must do the reads and writes
+	if (fh->lazy || fh->chunks || bexec_active(fh->branch)) return -1;
+
+	return fh->fd;
+}
+
+/**
+ * Read size bytes at off into *bufp, which is malloc()ed as libfuse
+ * frees it. Returns the bytes read (for spliced reads the bytes left in the
+ * file up to size) or -errno.
+ */
+ssize_t fh_read_buf(struct fuse_file_info *fi, struct fuse_bufvec **bufp, size_t size, off_t off) {
+	struct fuse_bufvec *buf = malloc(sizeof(struct fuse_bufvec));
+	if (!buf) return -ENOMEM;
+	*buf = FUSE_BUFVEC_INIT(size);
+
+	int fd = fh_splice_fd(fi);
+	if (fd != -1) {
+		// libfuse stops at the end of the file, count only what it will send
+		struct stat st;
+		if (fstat(fd, &st) == 0) {
+			if (st.st_size <= off) buf->buf[0].size = 0;
+			else if ((uint64_t)(st.st_size - off) < size) buf->buf[0].size = st.st_size - off;
+		}
+
+		buf->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf->buf[0].fd = fd;
+		buf->buf[0].pos = off;
+		read_ahead(get_fh(fi), fd, off, buf->buf[0].size);
+		stats_splice(false);
+	} else {
+		// the data of a partial copy are spread over two files
+		buf->buf[0].mem = malloc(size);
+		if (!buf->buf[0].mem) {
+			free(buf);
+			return -ENOMEM;
+		}
+
+		ssize_t res = fh_pread(fi, buf->buf[0].mem, size, off);
+		if (res < 0) {
+			free(buf->buf[0].mem);
+			free(buf);
+			return res;
+		}
+		buf->buf[0].size = res;
+	}
+
+	*bufp = buf;
+	return buf->buf[0].size;
+}
+
+/**
+ * Write buf at off to the file behind fi, as fh_pwrite().
+ */
+ssize_t fh_write_buf(struct fuse_file_info *fi, const char *path, struct fuse_bufvec *buf, off_t off) {
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+
+	int fd = fh_splice_fd(fi);
+	if (fd != -1) {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fd;
+		dst.buf[0].pos = off;
+		stats_splice(true);
+		return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	}
+
+	// a copy-up or the chunks need the data in memory
+	char *mem = malloc(size);
+	if (!mem) return -ENOMEM;
+	dst.buf[0].mem = mem;
+
+	ssize_t res = fuse_buf_copy(&dst, buf, 0);
+	if (res >= 0) res = fh_pwrite(fi, path, mem, res, off);
+
+	free(mem);
+	return res;
+}
+#endif
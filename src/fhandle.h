@@ -0,0 +1,55 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef FHANDLE_H
+#define FHANDLE_H
+
+#include <fuse.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "conf.h"
+#include "chunk.h"
+
+// read_buf() and write_buf() hand the branch files to libfuse
+#if defined (UNIONFS_HAVE_SPLICE) && FUSE_VERSION >= 29
+	#define FH_SPLICE
+#endif
+
+#define FH_SEQUENTIAL_READS 2	// reads in a row make a sequential stream for -o readahead
+
+struct fhandle {
+	int fd;			// the file we read from and write to
+	int branch;		// fd is on this branch, -1 for lazy handles and cached copies
+	bool lazy;		// opened by -o lazy_cow, the fields below are used
+	pthread_mutex_t lock;	// protects fd and pending of a lazy handle
+	bool pending;		// fd is the ro-branch file, no copy-up yet
+	int lower_fd;		// ro-branch file after the copy-up, closed on release
+	int flags;		// open() flags for the copy-up
+	struct chunkmap *chunks; // fd is a partial copy, see chunk.c
+	off_t next_off;		// where the next sequential read starts, see -o readahead
+	unsigned int streak;	// sequential reads in a row
+	off_t ahead;		// the branch file is read ahead up to here
+};
+
+int fh_new(struct fuse_file_info *fi, int fd, int branch);
+int fh_new_lazy(struct fuse_file_info *fi, int fd, int flags);
+int fh_fd(struct fuse_file_info *fi);
+int fh_copyup(struct fuse_file_info *fi, const char *path);
+int fh_chunks(struct fuse_file_info *fi, int branch, const char *path);
+ssize_t fh_pread(struct fuse_file_info *fi, char *buf, size_t size, off_t off);
+ssize_t fh_pwrite(struct fuse_file_info *fi, const char *path, const char *buf, size_t size, off_t off);
+int fh_ftruncate(struct fuse_file_info *fi, const char *path, off_t size);
+int fh_fsync(struct fuse_file_info *fi, int isdatasync);
+int fh_release(struct fuse_file_info *fi);
+
+#ifdef FH_SPLICE
+int fh_splice_fd(struct fuse_file_info *fi);
+ssize_t fh_read_buf(struct fuse_file_info *fi, struct fuse_bufvec **bufp, size_t size, off_t off);
+ssize_t fh_write_buf(struct fuse_file_info *fi, const char *path, struct fuse_bufvec *buf, off_t off);
+#endif
+
+#endif
@@ -44,12 +44,18 @@
 
 #include "unionfs.h"
 #include "opts.h"
+#include "btable.h"
 #include "general.h"
 #include "cow.h"
 #include "findbranch.h"
 #include "string.h"
 #include "debug.h"
 #include "usyslog.h"
+#include "lcache.h"
+#include "branchio.h"
+#include "copyup.h"
+#include "stats.h"
+#include "trace.h"
 
 /**
  *  Find a branch that has "path". Return the branch number.
@@ -58,26 +64,30 @@ static int find_branch(const char *path, searchflag_t flag) {
 	DBG("%s\n", path);
 
 	int i = 0;
-	for (i = 0; i < uopt.nbranches; i++) {
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
-			errno = ENAMETOOLONG;
-			RETURN(-1);
-		}
+	for (i = 0; i < NBRANCHES; i++) {
+		uint64_t start = stats_start();
 
 		struct stat stbuf;
-		int res = lstat(p, &stbuf);
+		int res = b_lstat(i, path, &stbuf);
+		stats_branch_lookup(i, start);
 
-		DBG("%s: res = %d\n", p, res);
+		DBG("%s%s: res = %d\n", BRANCH(i).path, path, res);
+
+		// too long for this branch, then also for all other branches
+		if (res == -1 && errno == ENAMETOOLONG) RETURN(-1);
 
 		if (res == 0) { // path was found
 			switch (flag) {
 			case RWRO:
 				// any path we found is fine
+				stats_branch_hit(i);
 				RETURN(i);
 			case RWONLY:
 				// we need a rw-branch
-				if (uopt.branches[i].rw) RETURN(i);
+				if (BRANCH(i).rw) {
+					stats_branch_hit(i);
+					RETURN(i);
+				}
 				break;
 			default:
 				USYSLOG(LOG_ERR, "%s: Unknown flag %d\n", __func__, flag);
@@ -86,6 +96,7 @@ static int find_branch(const char *path, searchflag_t flag) {
 
 		// check check for a hide file, checking first here is the magic to hide files *below* this level
 		res = path_hidden(path, i);
+		if (uopt.cow_enabled) stats_whiteout_lookup(res > 0);
 		if (res > 0) {
 			// So no path, but whiteout found. No need to search in further branches
 			errno = ENOENT;
@@ -100,12 +111,43 @@ static int find_branch(const char *path, searchflag_t flag) {
 	RETURN(-1);
 }
 
+/**
+ * Find a ro or rw branch, possibly from the lookup cache.
+ */
+static int lookup_rorw_branch(const char *path) {
+	int res;
+	unsigned long ticket;
+	if (lcache_lookup(path, &res, &ticket)) {
+		stats_lookup_cache_hit();
+		if (res < 0) errno = ENOENT;
+		RETURN(res);
+	}
+
+	res = find_branch(path, RWRO);
+
+	// only cache real results, not errors such as ENAMETOOLONG
+	if (res >= 0 || errno == ENOENT) {
+		int _errno = errno;
+		lcache_insert(path, res, ticket);
+		errno = _errno;
+	}
+
+	return res;
+}
+
 /**
  * Find a ro or rw branch.
  */
 int find_rorw_branch(const char *path) {
 	DBG("%s\n", path);
-	int res = find_branch(path, RWRO);
+
+	uint64_t start = TRACE_START();
+	int res = lookup_rorw_branch(path);
+
+	// we might have found the incomplete copy of a running copy-up
+	while (copyup_wait(path)) res = lookup_rorw_branch(path);
+
+	TRACE(TRACE_EV_FIND_BRANCH, path, res, res < 0 ? -errno : 0, start);
 	RETURN(res);
 }
 
@@ -139,7 +181,7 @@ int __find_rw_branch_cutlast(const char *path, int rw_hint) {
 	if (branch < 0) goto out;
 
 	// Reminder rw_hint == -1 -> autodetect, we do not care which branch it is
-	if (uopt.branches[branch].rw
+	if (BRANCH(branch).rw
 	&& (rw_hint == -1 || branch == rw_hint)) goto out;
 
 	if (!uopt.cow_enabled) {
@@ -152,7 +194,7 @@ int __find_rw_branch_cutlast(const char *path, int rw_hint) {
 	int branch_rw;
 	// since it is a directory, any rw-branch is fine
 	if (rw_hint == -1)
-		branch_rw = find_lowest_rw_branch(uopt.nbranches);
+		branch_rw = find_lowest_rw_branch(NBRANCHES);
 	else
 		branch_rw = rw_hint;
 
@@ -203,7 +245,7 @@ int find_rw_branch_cow_common(const char *path, bool copy_dir) {
 	if (branch_rorw < 0) RETURN(-1);
 
 	// the found branch is writable, good!
-	if (uopt.branches[branch_rorw].rw) RETURN(branch_rorw);
+	if (BRANCH(branch_rorw).rw) RETURN(branch_rorw);
 
 	// cow is disabled and branch is not writable, so deny write permission
 	if (!uopt.cow_enabled) {
@@ -218,10 +260,8 @@ int find_rw_branch_cow_common(const char *path, bool copy_dir) {
 		RETURN(-1);
 	}
 
-	if (cow_cp(path, branch_rorw, branch_rw, copy_dir)) RETURN(-1);
-
-	// remove a file that might hide the copied file
-	remove_hidden(path, branch_rw);
+	// concurrent copy-ups of path are done only once
+	if (copyup(path, branch_rorw, branch_rw, copy_dir)) RETURN(-1);
 
 	RETURN(branch_rw);
 }
@@ -234,7 +274,7 @@ int find_lowest_rw_branch(int branch_ro) {
 
 	int i = 0;
 	for (i = 0; i < branch_ro; i++) {
-		if (uopt.branches[i].rw) RETURN(i); // found it it.
+		if (BRANCH(i).rw) RETURN(i); // found it it.
 	}
 
 	RETURN(-1);
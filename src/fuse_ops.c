@@ -45,6 +45,7 @@
 
 #include "unionfs.h"
 #include "opts.h"
+#include "btable.h"
 #include "debug.h"
 #include "findbranch.h"
 #include "general.h"
@@ -57,6 +58,20 @@
 #include "usyslog.h"
 #include "conf.h"
 #include "uioctl.h"
+#include "lcache.h"
+#include "xcache.h"
+#include "scache.h"
+#include "bloom.h"
+#include "imap.h"
+#include "warmup.h"
+#include "branchio.h"
+#include "fhandle.h"
+#include "chunk.h"
+#include "stats.h"
+#include "trace.h"
+#include "rcache.h"
+#include "bexec.h"
+#include "windex.h"
 
 static int unionfs_chmod(const char *path, mode_t mode) {
 	DBG("%s\n", path);
@@ -64,12 +79,10 @@ static int unionfs_chmod(const char *path, mode_t mode) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = chmod(p, mode);
+	int res = b_chmod(i, path, mode);
 	if (res == -1) RETURN(-errno);
 
+	lcache_drop_attr(path);
 	RETURN(0);
 }
 
@@ -79,12 +92,10 @@ static int unionfs_chown(const char *path, uid_t uid, gid_t gid) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = lchown(p, uid, gid);
+	int res = b_lchown(i, path, uid, gid);
 	if (res == -1) RETURN(-errno);
 
+	lcache_drop_attr(path);
 	RETURN(0);
 }
 
@@ -98,26 +109,24 @@ static int unionfs_create(const char *path, mode_t mode, struct fuse_file_info *
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
 	// NOTE: We should do:
 	//       Create the file with mode=0 first, otherwise we might create
 	//       a file as root + x-bit + suid bit set, which might be used for
 	//       security racing!
-	int res = open(p, fi->flags, 0);
+	int res = b_open(i, path, fi->flags, 0);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	lcache_invalidate(path);
+
+	set_owner(i, path); // no error check, since creating the file succeeded
 
 	// NOW, that the file has the proper owner we may set the requested mode
 	fchmod(res, mode);
 
-	fi->fh = res;
 	remove_hidden(path, i);
 
-	DBG("fd = %" PRIx64 "\n", fi->fh);
-	RETURN(0);
+	DBG("fd = %d\n", res);
+	RETURN(fh_new(fi, res, i));
 }
 
 
@@ -127,13 +136,14 @@ static int unionfs_create(const char *path, mode_t mode, struct fuse_file_info *
  * which flush the data/metadata on close()
  */
 static int unionfs_flush(const char *path, struct fuse_file_info *fi) {
-	DBG("fd = %"PRIx64"\n", fi->fh);
+	int fd = fh_fd(fi);
+	DBG("fd = %d\n", fd);
 
-	int fd = dup(fi->fh);
+	fd = dup(fd);
 
 	if (fd == -1) {
 		// What to do now?
-		if (fsync(fi->fh) == -1) RETURN(-EIO);
+		if (fsync(fh_fd(fi)) == -1) RETURN(-EIO);
 
 		RETURN(-errno);
 	}
@@ -148,35 +158,24 @@ static int unionfs_flush(const char *path, struct fuse_file_info *fi) {
  * Just a stub. This method is optional and can safely be left unimplemented
  */
 static int unionfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
-	DBG("fd = %"PRIx64"\n", fi->fh);
-
-	int res;
-	if (isdatasync) {
-#if _POSIX_SYNCHRONIZED_IO + 0 > 0
-		res = fdatasync(fi->fh);
-#else
-		res = fsync(fi->fh);
-#endif
-	} else {
-		res = fsync(fi->fh);
-	}
+	DBG("fd = %d\n", fh_fd(fi));
 
-	if (res == -1) RETURN(-errno);
-
-	RETURN(0);
+	RETURN(fh_fsync(fi, isdatasync));
 }
 
 static int unionfs_getattr(const char *path, struct stat *stbuf) {
 	DBG("%s\n", path);
 
-	int i = find_rorw_branch(path);
-	if (i == -1) RETURN(-errno);
+	// prefetched by readdir(), see -o readdirplus
+	if (!lcache_take_attr(path, stbuf)) {
+		int i = find_rorw_branch(path);
+		if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+		int res = b_lstat(i, path, stbuf);
+		if (res == -1) RETURN(-errno);
+	}
 
-	int res = lstat(p, stbuf);
-	if (res == -1) RETURN(-errno);
+	if (uopt.inode_map) stbuf->st_ino = imap_ino(stbuf->st_dev, stbuf->st_ino);
 
 	/* This is a workaround for broken gnu find implementations. Actually,
 	 * n_links is not defined at all for directories by posix. However, it
@@ -213,8 +212,21 @@ static int unionfs_access(const char *path, int mask) {
  * called before first access to the filesystem
  */
 static void * unionfs_init(struct fuse_conn_info *conn) {
-	// just to prevent the compiler complaining about unused variables
-	(void) conn->max_readahead;
+	// the kernel window is limited by the kernel and -o max_readahead of
+	// libfuse, the branches may be read further ahead
+	if (uopt.readahead)
+		USYSLOG(LOG_INFO, "Kernel reads ahead %u bytes, the branches %u bytes\n",
+			conn->max_readahead, uopt.readahead);
+
+	// the drainer thread would not survive daemonizing, so start it here,
+	// the path of the trace file is relative to the real root
+	if (uopt.trace_file) trace_start(uopt.trace_file);
+
+	// the same for the Bloom filter threads, they work on the branch fds
+	bloom_start();
+
+	// and the workers of -o branch_threads
+	bexec_start();
 
 	// we only now (from unionfs_init) may go into the chroot, since otherwise
 	// fuse_main() will fail to open /dev/fuse and to call mount
@@ -227,14 +239,40 @@ static void * unionfs_init(struct fuse_conn_info *conn) {
 		}
 	}
 
+	// the warm-up walks the union paths, so only in the chroot
+	warmup_start();
+
 #ifdef FUSE_CAP_IOCTL_DIR
 	if (conn->capable & FUSE_CAP_IOCTL_DIR)
 		conn->want |= FUSE_CAP_IOCTL_DIR;
 #endif
 
+#ifdef FH_SPLICE
+	// the data of read_buf() and write_buf() may go through pipes
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	USYSLOG(LOG_INFO, "Reads %s, writes %s\n",
+		(conn->want & FUSE_CAP_SPLICE_WRITE) ? "spliced" : "copied",
+		(conn->want & FUSE_CAP_SPLICE_READ) ? "spliced" : "copied");
+#else
+	USYSLOG(LOG_INFO, "Reads and writes copied, no splice support\n");
+#endif
+
 	return NULL;
 }
 
+static void unionfs_destroy(void *private_data) {
+	(void)private_data;
+
+	// the warm-up might still be walking
+	warmup_stop();
+
+	// write out the rest of the trace
+	trace_stop();
+
+	// the whiteouts of -o whiteout_journal into METADIR
+	windex_sync();
+}
+
 static int unionfs_link(const char *from, const char *to) {
 	DBG("from %s to %s\n", from, to);
 
@@ -242,18 +280,20 @@ static int unionfs_link(const char *from, const char *to) {
 	int i = find_rw_branch_cow(from);
 	if (i == -1) RETURN(-errno);
 
+	// a chunk map belongs to a single path
+	if (chunk_complete(i, from)) RETURN(-errno);
+
 	int j = __find_rw_branch_cutlast(to, i);
 	if (j == -1) RETURN(-errno);
 
 	DBG("from branch: %d to branch: %d\n", i, j);
 
-	char f[PATHLEN_MAX], t[PATHLEN_MAX];
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(t, uopt.branches[j].path, to)) RETURN(-ENAMETOOLONG);
-
-	int res = link(f, t);
+	int res = b_link(i, from, j, to);
 	if (res == -1) RETURN(-errno);
 
+	lcache_invalidate(to);
+	lcache_drop_attr(from); // st_nlink
+
 	// no need for set_owner(), since owner and permissions are copied over by link()
 
 	remove_hidden(to, i); // remove hide file (if any)
@@ -261,6 +301,41 @@ static int unionfs_link(const char *from, const char *to) {
 }
 
 #if FUSE_VERSION >= 28
+/**
+ * The branch commands of unionfsctl, only root and the user who mounted the
+ * union may change the branches.
+ */
+static int branch_ioctl(unsigned int cmd, struct unionfs_branch_ctl *ctl) {
+	if (cmd == UNIONFS_BRANCH_GET) {
+		struct btable *t = btable_get();
+		ctl->nbranches = t->nbranches;
+		if (ctl->branch < 0 || ctl->branch >= t->nbranches) return -ENOENT;
+
+		branch_entry_t *branch = &t->branches[ctl->branch];
+		ctl->flags = (branch->rw ? UNIONFS_BRANCH_RW : 0) | (branch->idx ? UNIONFS_BRANCH_IDX : 0);
+		strncpy(ctl->path, branch->path, PATHLEN_MAX - 1);
+		ctl->path[PATHLEN_MAX - 1] = '\0';
+		return 0;
+	}
+
+	uid_t uid;
+	gid_t gid;
+	request_owner(&uid, &gid);
+	if (uid != 0 && uid != getuid()) return -EPERM;
+
+	switch (cmd) {
+	case UNIONFS_BRANCH_ADD:
+		ctl->path[PATHLEN_MAX - 1] = '\0';
+		return btable_add(ctl->path, ctl->branch, ctl->flags & UNIONFS_BRANCH_RW, ctl->flags & UNIONFS_BRANCH_IDX);
+	case UNIONFS_BRANCH_REMOVE:
+		return btable_remove(ctl->branch);
+	case UNIONFS_BRANCH_MOVE:
+		return btable_move(ctl->branch, ctl->to);
+	default:
+		return btable_set_mode(ctl->branch, ctl->flags & UNIONFS_BRANCH_RW);
+	}
+}
+
 static int unionfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
 	(void) path;
 	(void) arg; // avoid compiler warning
@@ -273,7 +348,8 @@ static int unionfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_
 		return -ENOSYS;
 #endif
 
-	switch (cmd) {
+	// the _IOR() commands do not fit into a signed int
+	switch ((unsigned int)cmd) {
 	case UNIONFS_ONOFF_DEBUG: {
 		int on_off = *((int *) data);
 		// unionfs-ctl gives the opposite value, so !!
@@ -290,6 +366,38 @@ static int unionfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_
 		debug_init();
 		return 0;
 	}
+	case UNIONFS_STATS_BYTES_READ:
+	case UNIONFS_STATS_BYTES_WRITTEN: {
+		struct unionfs_stats stats;
+		stats_get(&stats);
+
+		uint64_t *bytes = (uint64_t *) data;
+		if ((unsigned int)cmd == UNIONFS_STATS_BYTES_READ)
+			*bytes = stats.bytes_read;
+		else
+			*bytes = stats.bytes_written;
+		return 0;
+	}
+	case UNIONFS_STATS_GET:
+		stats_get((struct unionfs_stats *) data);
+		return 0;
+	case UNIONFS_STATS_LATENCY:
+		stats_get_latency((struct unionfs_latency *) data);
+		return 0;
+	case UNIONFS_ONOFF_TRACE: {
+		int on_off = *((int *) data);
+		if (!on_off) {
+			trace_stop();
+			return 0;
+		}
+		return trace_start(uopt.trace_file ? uopt.trace_file : TRACE_DEFAULT_FILE);
+	}
+	case UNIONFS_BRANCH_ADD:
+	case UNIONFS_BRANCH_REMOVE:
+	case UNIONFS_BRANCH_MOVE:
+	case UNIONFS_BRANCH_MODE:
+	case UNIONFS_BRANCH_GET:
+		return branch_ioctl((unsigned int)cmd, (struct unionfs_branch_ctl *) data);
 	default:
 		USYSLOG(LOG_ERR, "Unknown ioctl: %d", cmd);
 		return -EINVAL;
@@ -312,15 +420,14 @@ static int unionfs_mkdir(const char *path, mode_t mode) {
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = mkdir(p, 0);
+	int res = b_mkdir(i, path, 0);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	lcache_invalidate(path);
+
+	set_owner(i, path); // no error check, since creating the file succeeded
 	// NOW, that the file has the proper owner we may set the requested mode
-	chmod(p, mode);
+	b_chmod(i, path, mode);
 
 	RETURN(0);
 }
@@ -331,9 +438,6 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
 	int file_type = mode & S_IFMT;
 	int file_perm = mode & (S_PROT_MASK);
 
@@ -346,17 +450,19 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 
 		USYSLOG (LOG_INFO, "deprecated mknod workaround, tell the unionfs-fuse authors if you see this!\n");
 
-		res = creat(p, 0);
+		res = b_open(i, path, O_CREAT | O_WRONLY | O_TRUNC, 0);
 		if (res > 0 && close(res) == -1) USYSLOG(LOG_WARNING, "Warning, cannot close file\n");
 	} else {
-		res = mknod(p, file_type, rdev);
+		res = b_mknod(i, path, file_type, rdev);
 	}
 
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	lcache_invalidate(path);
+
+	set_owner(i, path); // no error check, since creating the file succeeded
 	// NOW, that the file has the proper owner we may set the requested mode
-	chmod(p, file_perm);
+	b_chmod(i, path, file_perm);
 
 	remove_hidden(path, i);
 
@@ -368,6 +474,17 @@ static int unionfs_open(const char *path, struct fuse_file_info *fi) {
 
 	int i;
 	if (fi->flags & (O_WRONLY | O_RDWR)) {
+		if (uopt.lazy_cow && uopt.cow_enabled && !(fi->flags & O_TRUNC)) {
+			// keep reading from a ro-branch until the first write
+			i = find_rorw_branch(path);
+			if (i >= 0 && !BRANCH(i).rw && find_lowest_rw_branch(i) >= 0) {
+				int fd = b_open(i, path, (fi->flags & ~(O_ACCMODE | O_CREAT | O_EXCL)) | O_RDONLY, 0);
+				if (fd == -1) RETURN(-errno);
+
+				DBG("fd = %d, copy-up pending\n", fd);
+				RETURN(fh_new_lazy(fi, fd, fi->flags));
+			}
+		}
 		i = find_rw_branch_cutlast(path);
 	} else {
 		i = find_rorw_branch(path);
@@ -375,35 +492,58 @@ static int unionfs_open(const char *path, struct fuse_file_info *fi) {
 
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int fd = open(p, fi->flags);
+	int fd = rcache_open(i, path, fi->flags);
+	int fd_branch = -1;	// the cache branch has no workers
+	if (fd == -1) {
+		fd = b_open(i, path, fi->flags, 0);
+		fd_branch = i;
+	}
 	if (fd == -1) RETURN(-errno);
 
 	if (fi->flags & (O_WRONLY | O_RDWR)) {
 		// There might have been a hide file, but since we successfully
 		// wrote to the real file, a hide file must not exist anymore
 		remove_hidden(path, i);
+		lcache_drop_attr(path); // O_TRUNC
 	}
 
 	// This makes exec() fail
 	//fi->direct_io = 1;
-	fi->fh = (unsigned long)fd;
 
-	DBG("fd = %"PRIx64"\n", fi->fh);
-	RETURN(0);
+	// ro-branches do not change below us, keep the page cache over opens
+	if (uopt.cache_timeout && !BRANCH(i).rw) fi->keep_cache = 1;
+
+	DBG("fd = %d\n", fd);
+	int res = fh_new(fi, fd, fd_branch);
+	if (res) RETURN(res);
+
+	res = fh_chunks(fi, i, path);
+	if (!res && (fi->flags & O_TRUNC)) {
+		// nothing is left to be copied
+		res = fh_ftruncate(fi, path, 0);
+	}
+	if (res) fh_release(fi);
+
+	RETURN(res);
 }
 
 static int unionfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	DBG("fd = %"PRIx64"\n", fi->fh);
+	DBG("fd = %d\n", fh_fd(fi));
 
-	int res = pread(fi->fh, buf, size, offset);
+	int res = fh_pread(fi, buf, size, offset);
+	RETURN(res);
+}
 
-	if (res == -1) RETURN(-errno);
+#ifdef FH_SPLICE
+static int unionfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	DBG("fd = %d\n", fh_fd(fi));
 
-	RETURN(res);
+	int res = fh_read_buf(fi, bufp, size, offset);
+	if (res < 0) RETURN(res);
+
+	RETURN(0);
 }
+#endif
 
 static int unionfs_readlink(const char *path, char *buf, size_t size) {
 	DBG("%s\n", path);
@@ -411,10 +551,7 @@ static int unionfs_readlink(const char *path, char *buf, size_t size) {
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = readlink(p, buf, size - 1);
+	int res = b_readlink(i, path, buf, size - 1);
 
 	if (res == -1) RETURN(-errno);
 
@@ -424,12 +561,9 @@ static int unionfs_readlink(const char *path, char *buf, size_t size) {
 }
 
 static int unionfs_release(const char *path, struct fuse_file_info *fi) {
-	DBG("fd = %"PRIx64"\n", fi->fh);
-
-	int res = close(fi->fh);
-	if (res == -1) RETURN(-errno);
+	DBG("fd = %d\n", fh_fd(fi));
 
-	RETURN(0);
+	RETURN(fh_release(fi));
 }
 
 /**
@@ -448,7 +582,7 @@ static int unionfs_rename(const char *from, const char *to) {
 	int i = find_rorw_branch(from);
 	if (i == -1) RETURN(-errno);
 
-	if (!uopt.branches[i].rw) {
+	if (!BRANCH(i).rw) {
 		i = find_rw_branch_cow_common(from, true);
 		if (i == -1) RETURN(-errno);
 	}
@@ -459,18 +593,17 @@ static int unionfs_rename(const char *from, const char *to) {
 		RETURN(-EXDEV);
 	}
 
-	char f[PATHLEN_MAX], t[PATHLEN_MAX];
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
-
-	filetype_t ftype = path_is_dir(f);
-	if (ftype == NOT_EXISTING)
+	struct stat st;
+	if (b_lstat(i, from, &st) == -1)
 		RETURN(-ENOENT);
-	else if (ftype == IS_DIR)
+	else if (S_ISDIR(st.st_mode))
 		is_dir = true;
 
-	int res;
-	if (!uopt.branches[i].rw) {
+	// chunk maps do not move with their files, see chunk.c
+	int res = is_dir ? chunk_complete_tree(i, from) : chunk_complete(i, from);
+	if (res) RETURN(-errno);
+
+	if (!BRANCH(i).rw) {
 		// since original file is on a read-only branch, we copied the from file to a writable branch,
 		// but since we will rename from, we also need to hide the from file on the read-only branch
 		if (is_dir)
@@ -480,13 +613,23 @@ static int unionfs_rename(const char *from, const char *to) {
 		if (res) RETURN(-errno);
 	}
 
-	res = rename(f, t);
+	uint64_t replaced = imap_removing(i, to);
+
+	res = b_rename(i, from, to);
+
+	// a renamed directory moves an entire sub-tree
+	if (is_dir) {
+		lcache_invalidate_all();
+	} else {
+		lcache_invalidate(from);
+		lcache_invalidate(to);
+	}
 
 	if (res == -1) {
 		int err = errno; // unlink() might overwrite errno
 		// if from was on a read-only branch we copied it, but now rename failed so we need to delete it
-		if (!uopt.branches[i].rw) {
-			if (unlink(f))
+		if (!BRANCH(i).rw) {
+			if (b_unlink(i, from))
 				USYSLOG(LOG_ERR, "%s: cow of %s succeeded, but rename() failed and now "
 				       "also unlink()  failed\n", __func__, from);
 
@@ -497,7 +640,7 @@ static int unionfs_rename(const char *from, const char *to) {
 		RETURN(-err);
 	}
 
-	if (uopt.branches[i].rw) {
+	if (BRANCH(i).rw) {
 		// A lower branch still *might* have a file called 'from', we need to delete this.
 		// We only need to do this if we have been on a rw-branch, since we created
 		// a whiteout for read-only branches anyway.
@@ -507,54 +650,13 @@ static int unionfs_rename(const char *from, const char *to) {
 			maybe_whiteout(from, i, WHITEOUT_FILE);
 	}
 
-	remove_hidden(to, i); // remove hide file (if any)
-	RETURN(0);
-}
+	// a replaced partial copy
+	if (!is_dir) chunk_remove(i, to);
 
-/**
- * Wrapper function to convert the result of statfs() to statvfs()
- * libfuse uses statvfs, since it conforms to POSIX. Unfortunately,
- * glibc's statvfs parses /proc/mounts, which then results in reading
- * the filesystem itself again - which would result in a deadlock.
- * TODO: BSD/MacOSX
- */
-static int statvfs_local(const char *path, struct statvfs *stbuf) {
-#ifdef linux
-	/* glibc's statvfs walks /proc/mounts and stats entries found there
-	 * in order to extract their mount flags, which may deadlock if they
-	 * are mounted under the unionfs. As a result, we have to do this
-	 * ourselves.
-	 */
-	struct statfs stfs;
-	int res = statfs(path, &stfs);
-	if (res == -1) RETURN(res);
-
-	memset(stbuf, 0, sizeof(*stbuf));
-	stbuf->f_bsize = stfs.f_bsize;
-	if (stfs.f_frsize) {
-		stbuf->f_frsize = stfs.f_frsize;
-	} else {
-		stbuf->f_frsize = stfs.f_bsize;
-	}
-	stbuf->f_blocks = stfs.f_blocks;
-	stbuf->f_bfree = stfs.f_bfree;
-	stbuf->f_bavail = stfs.f_bavail;
-	stbuf->f_files = stfs.f_files;
-	stbuf->f_ffree = stfs.f_ffree;
-	stbuf->f_favail = stfs.f_ffree; /* nobody knows */
-
-	/* We don't worry about flags, exactly because this would
-	 * require reading /proc/mounts, and avoiding that and the
-	 * resulting deadlocks is exactly what we're trying to avoid
-	 * by doing this rather than using statvfs.
-	 */
-	stbuf->f_flag = 0;
-	stbuf->f_namemax = stfs.f_namelen;
+	imap_removed(i, replaced);
 
+	remove_hidden(to, i); // remove hide file (if any)
 	RETURN(0);
-#else
-	RETURN(statvfs(path, stbuf));
-#endif
 }
 
 /**
@@ -567,70 +669,7 @@ static int unionfs_statfs(const char *path, struct statvfs *stbuf) {
 
 	DBG("%s\n", path);
 
-	int first = 1;
-
-	dev_t devno[uopt.nbranches];
-
-	int retVal = 0;
-
-	int i = 0;
-	for (i = 0; i < uopt.nbranches; i++) {
-		struct statvfs stb;
-		int res = statvfs_local(uopt.branches[i].path, &stb);
-		if (res == -1) {
-			retVal = -errno;
-			break;
-		}
-
-		struct stat st;
-		res = stat(uopt.branches[i].path, &st);
-		if (res == -1) {
-			retVal = -errno;
-			break;
-		}
-		devno[i] = st.st_dev;
-
-		if (first) {
-			memcpy(stbuf, &stb, sizeof(*stbuf));
-			first = 0;
-			stbuf->f_fsid = stb.f_fsid << 8;
-			continue;
-		}
-
-		// Eliminate same devices
-		int j = 0;
-		for (j = 0; j < i; j ++) {
-			if (st.st_dev == devno[j]) break;
-		}
-
-		if (j == i) {
-			// Filesystem can have different block sizes -> normalize to first's block size
-			double ratio = (double)stb.f_bsize / (double)stbuf->f_bsize;
-
-			if (uopt.branches[i].rw) {
-				stbuf->f_blocks += stb.f_blocks * ratio;
-				stbuf->f_bfree += stb.f_bfree * ratio;
-				stbuf->f_bavail += stb.f_bavail * ratio;
-
-				stbuf->f_files += stb.f_files;
-				stbuf->f_ffree += stb.f_ffree;
-				stbuf->f_favail += stb.f_favail;
-			} else if (!uopt.statfs_omit_ro) {
-				// omitting the RO branches is not correct regarding
-				// the block counts but it actually fixes the
-				// percentage of free space. so, let the user decide.
-				stbuf->f_blocks += stb.f_blocks * ratio;
-				stbuf->f_files  += stb.f_files;
-			}
-
-			if (!(stb.f_flag & ST_RDONLY)) stbuf->f_flag &= ~ST_RDONLY;
-			if (!(stb.f_flag & ST_NOSUID)) stbuf->f_flag &= ~ST_NOSUID;
-
-			if (stb.f_namemax < stbuf->f_namemax) stbuf->f_namemax = stb.f_namemax;
-		}
-	}
-
-	RETURN(retVal);
+	RETURN(scache_statfs(stbuf));
 }
 
 static int unionfs_symlink(const char *from, const char *to) {
@@ -639,13 +678,12 @@ static int unionfs_symlink(const char *from, const char *to) {
 	int i = find_rw_branch_cutlast(to);
 	if (i == -1) RETURN(-errno);
 
-	char t[PATHLEN_MAX];
-	if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
-
-	int res = symlink(from, t);
+	int res = b_symlink(from, i, to);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(t); // no error check, since creating the file succeeded
+	lcache_invalidate(to);
+
+	set_owner(i, to); // no error check, since creating the file succeeded
 
 	remove_hidden(to, i); // remove hide file (if any)
 	RETURN(0);
@@ -657,13 +695,40 @@ static int unionfs_truncate(const char *path, off_t size) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	struct chunkmap *chunks = chunk_open(i, path);
+	if (!chunks && errno) RETURN(-errno);
+
+	int res;
+	if (chunks) {
+		// a partial copy, see chunk.c
+		int fd = b_open(i, path, O_WRONLY, 0);
+		if (fd == -1) {
+			res = -errno;
+		} else {
+			res = chunk_ftruncate(chunks, fd, size);
+			close(fd);
+		}
+		chunk_close(chunks);
+		if (res) RETURN(res);
+	} else {
+		char p[PATHLEN_MAX];
+		if (BUILD_PATH(p, BRANCH(i).path, path)) RETURN(-ENAMETOOLONG);
 
-	int res = truncate(p, size);
+		res = truncate(p, size);
+		if (res == -1) RETURN(-errno);
+	}
 
-	if (res == -1) RETURN(-errno);
+	lcache_drop_attr(path);
+	RETURN(0);
+}
+
+static int unionfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	DBG("fd = %d\n", fh_fd(fi));
+
+	int res = fh_ftruncate(fi, path, size);
+	if (res) RETURN(res);
 
+	if (path) lcache_drop_attr(path);
 	RETURN(0);
 }
 
@@ -673,35 +738,35 @@ static int unionfs_utimens(const char *path, const struct timespec ts[2]) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-#ifdef UNIONFS_HAVE_AT
-	int res = utimensat(0, p, ts, AT_SYMLINK_NOFOLLOW);
-#else
-	struct timeval tv[2];
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
-	int res = utimes(p, tv);
-#endif
+	int res = b_utimens(i, path, ts);
 
 	if (res == -1) RETURN(-errno);
 
+	lcache_drop_attr(path);
 	RETURN(0);
 }
 
 static int unionfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	(void)path;
+	DBG("fd = %d\n", fh_fd(fi));
 
-	DBG("fd = %"PRIx64"\n", fi->fh);
+	int res = fh_pwrite(fi, path, buf, size, offset);
+	if (res < 0) RETURN(res);
 
-	int res = pwrite(fi->fh, buf, size, offset);
-	if (res == -1) RETURN(-errno);
+	if (path) lcache_drop_attr(path);
+	RETURN(res);
+}
 
+#ifdef FH_SPLICE
+static int unionfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	DBG("fd = %d\n", fh_fd(fi));
+
+	int res = fh_write_buf(fi, path, buf, offset);
+	if (res < 0) RETURN(res);
+
+	if (path) lcache_drop_attr(path);
 	RETURN(res);
 }
+#endif
 
 #ifdef HAVE_XATTR
 
@@ -712,11 +777,15 @@ static int unionfs_getxattr(const char *path, const char *name, char *value, siz
 #endif
 	DBG("%s\n", path);
 
+	int err;
+	unsigned long ticket;
+	if (xcache_missing(path, name, &err, &ticket)) RETURN(-err);
+
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	if (BUILD_PATH(p, BRANCH(i).path, path)) RETURN(-ENAMETOOLONG);
 
 #if __APPLE__
 	int res = getxattr(p, name, value, size, position, XATTR_NOFOLLOW);
@@ -724,7 +793,10 @@ static int unionfs_getxattr(const char *path, const char *name, char *value, siz
 	int res = lgetxattr(p, name, value, size);
 #endif
 
-	if (res == -1) RETURN(-errno);
+	if (res == -1) {
+		if (errno == ENOATTR || errno == ENOTSUP) xcache_insert_missing(path, name, errno, ticket);
+		RETURN(-errno);
+	}
 
 	RETURN(res);
 }
@@ -732,11 +804,15 @@ static int unionfs_getxattr(const char *path, const char *name, char *value, siz
 static int unionfs_listxattr(const char *path, char *list, size_t size) {
 	DBG("%s\n", path);
 
+	ssize_t cached;
+	unsigned long ticket;
+	if (xcache_list(path, list, size, &cached, &ticket)) RETURN((int)cached);
+
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	if (BUILD_PATH(p, BRANCH(i).path, path)) RETURN(-ENAMETOOLONG);
 
 #if __APPLE__
 	int res = listxattr(p, list, size, XATTR_NOFOLLOW);
@@ -746,6 +822,8 @@ static int unionfs_listxattr(const char *path, char *list, size_t size) {
 
 	if (res == -1) RETURN(-errno);
 
+	// size 0 only asks for the size of the list
+	if (size) xcache_insert_list(path, list, res, ticket);
 	RETURN(res);
 }
 
@@ -756,7 +834,7 @@ static int unionfs_removexattr(const char *path, const char *name) {
 	if (i == -1) RETURN(-errno);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	if (BUILD_PATH(p, BRANCH(i).path, path)) RETURN(-ENAMETOOLONG);
 
 #if __APPLE__
 	int res = removexattr(p, name, XATTR_NOFOLLOW);
@@ -766,6 +844,8 @@ static int unionfs_removexattr(const char *path, const char *name) {
 
 	if (res == -1) RETURN(-errno);
 
+	xcache_invalidate(path);
+	lcache_drop_attr(path);
 	RETURN(res);
 }
 
@@ -780,7 +860,7 @@ static int unionfs_setxattr(const char *path, const char *name, const char *valu
 	if (i == -1) RETURN(-errno);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	if (BUILD_PATH(p, BRANCH(i).path, path)) RETURN(-ENAMETOOLONG);
 
 #if __APPLE__
 	int res = setxattr(p, name, value, size, position, flags | XATTR_NOFOLLOW);
@@ -790,42 +870,137 @@ static int unionfs_setxattr(const char *path, const char *name, const char *valu
 
 	if (res == -1) RETURN(-errno);
 
+	xcache_invalidate(path);
+	lcache_drop_attr(path);
 	RETURN(res);
 }
 #endif // HAVE_XATTR
 
+/*
+ * The operations as libfuse and ll_ops.c call them, counted and timed for
+ * unionfsctl -s and -l, and traced with the arguments for unionfs-replay.
+ * They run on one branch table, see btable.c.
+ */
+#define STATS_WRAPPER(op, name, path, proto, args, ...) \
+	static int stats_##name proto { \
+		uint64_t start = stats_start(); \
+		btable_enter(); \
+		int res = unionfs_##name args; \
+		btable_leave(); \
+		stats_op(op, res, start); \
+		TRACE_ARGS(op, path, res, start, __VA_ARGS__); \
+		return res; \
+	}
+
+// as STATS_WRAPPER(), but the file handle is cleared by the release
+#define STATS_WRAPPER_RELEASE(op, name) \
+	static int stats_##name(const char *path, struct fuse_file_info *fi) { \
+		uint64_t fh = fi->fh; \
+		uint64_t start = stats_start(); \
+		btable_enter(); \
+		int res = unionfs_##name(path, fi); \
+		btable_leave(); \
+		stats_op(op, res, start); \
+		TRACE_ARGS(op, path, res, start, { .fh = fh }); \
+		return res; \
+	}
+
+STATS_WRAPPER(STATS_OP_ACCESS, access, path, (const char *path, int mask), (path, mask), { .a = mask })
+STATS_WRAPPER(STATS_OP_CHMOD, chmod, path, (const char *path, mode_t mode), (path, mode), { .a = mode })
+STATS_WRAPPER(STATS_OP_CHOWN, chown, path, (const char *path, uid_t uid, gid_t gid), (path, uid, gid), { .a = uid, .b = gid })
+STATS_WRAPPER(STATS_OP_CREATE, create, path, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi), { .fh = fi->fh, .a = fi->flags, .b = mode })
+STATS_WRAPPER(STATS_OP_FLUSH, flush, path, (const char *path, struct fuse_file_info *fi), (path, fi), { .fh = fi->fh })
+STATS_WRAPPER(STATS_OP_FSYNC, fsync, path, (const char *path, int isdatasync, struct fuse_file_info *fi), (path, isdatasync, fi), { .fh = fi->fh, .a = isdatasync })
+STATS_WRAPPER(STATS_OP_FTRUNCATE, ftruncate, path, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi), { .fh = fi->fh, .a = size })
+STATS_WRAPPER(STATS_OP_GETATTR, getattr, path, (const char *path, struct stat *stbuf), (path, stbuf), { .path2 = NULL })
+#if FUSE_VERSION >= 28
+STATS_WRAPPER(STATS_OP_IOCTL, ioctl, path, (const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data), (path, cmd, arg, fi, flags, data), { .fh = fi->fh, .a = (unsigned int)cmd })
+#endif
+STATS_WRAPPER(STATS_OP_LINK, link, from, (const char *from, const char *to), (from, to), { .path2 = to })
+STATS_WRAPPER(STATS_OP_MKDIR, mkdir, path, (const char *path, mode_t mode), (path, mode), { .a = mode })
+STATS_WRAPPER(STATS_OP_MKNOD, mknod, path, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev), { .a = mode, .b = rdev })
+STATS_WRAPPER(STATS_OP_OPEN, open, path, (const char *path, struct fuse_file_info *fi), (path, fi), { .fh = fi->fh, .a = fi->flags })
+STATS_WRAPPER(STATS_OP_OPENDIR, opendir, path, (const char *path, struct fuse_file_info *fi), (path, fi), { .fh = fi->fh, .a = fi->flags })
+STATS_WRAPPER(STATS_OP_READ, read, path, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi), { .fh = fi->fh, .a = size, .b = offset })
+STATS_WRAPPER(STATS_OP_READDIR, readdir, path, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi), { .fh = fi->fh, .b = offset })
+STATS_WRAPPER(STATS_OP_READLINK, readlink, path, (const char *path, char *buf, size_t size), (path, buf, size), { .a = size })
+STATS_WRAPPER_RELEASE(STATS_OP_RELEASE, release)
+STATS_WRAPPER_RELEASE(STATS_OP_RELEASEDIR, releasedir)
+STATS_WRAPPER(STATS_OP_RENAME, rename, from, (const char *from, const char *to), (from, to), { .path2 = to })
+STATS_WRAPPER(STATS_OP_RMDIR, rmdir, path, (const char *path), (path), { .path2 = NULL })
+STATS_WRAPPER(STATS_OP_STATFS, statfs, path, (const char *path, struct statvfs *stbuf), (path, stbuf), { .path2 = NULL })
+STATS_WRAPPER(STATS_OP_SYMLINK, symlink, to, (const char *from, const char *to), (from, to), { .path2 = from })
+STATS_WRAPPER(STATS_OP_TRUNCATE, truncate, path, (const char *path, off_t size), (path, size), { .a = size })
+STATS_WRAPPER(STATS_OP_UNLINK, unlink, path, (const char *path), (path), { .path2 = NULL })
+STATS_WRAPPER(STATS_OP_UTIMENS, utimens, path, (const char *path, const struct timespec ts[2]), (path, ts), { .path2 = NULL })
+STATS_WRAPPER(STATS_OP_WRITE, write, path, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi), { .fh = fi->fh, .a = size, .b = offset })
+#ifdef FH_SPLICE
+STATS_WRAPPER(STATS_OP_WRITE, write_buf, path, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi), (path, buf, offset, fi), { .fh = fi->fh, .a = fuse_buf_size(buf), .b = offset })
+
+// as STATS_WRAPPER(), but the bytes read are in the buffer
+static int stats_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	uint64_t start = stats_start();
+	btable_enter();
+	int res = unionfs_read_buf(path, bufp, size, offset, fi);
+	btable_leave();
+	long bytes = res ? res : (long)fuse_buf_size(*bufp);
+	stats_op(STATS_OP_READ, bytes, start);
+	TRACE_ARGS(STATS_OP_READ, path, bytes, start, { .fh = fi->fh, .a = size, .b = offset });
+	return res;
+}
+#endif
+#ifdef HAVE_XATTR
+#if __APPLE__
+STATS_WRAPPER(STATS_OP_GETXATTR, getxattr, path, (const char *path, const char *name, char *value, size_t size, uint32_t position), (path, name, value, size, position), { .path2 = name, .a = size })
+STATS_WRAPPER(STATS_OP_SETXATTR, setxattr, path, (const char *path, const char *name, const char *value, size_t size, int flags, uint32_t position), (path, name, value, size, flags, position), { .path2 = name, .a = size, .b = flags })
+#else
+STATS_WRAPPER(STATS_OP_GETXATTR, getxattr, path, (const char *path, const char *name, char *value, size_t size), (path, name, value, size), { .path2 = name, .a = size })
+STATS_WRAPPER(STATS_OP_SETXATTR, setxattr, path, (const char *path, const char *name, const char *value, size_t size, int flags), (path, name, value, size, flags), { .path2 = name, .a = size, .b = flags })
+#endif
+STATS_WRAPPER(STATS_OP_LISTXATTR, listxattr, path, (const char *path, char *list, size_t size), (path, list, size), { .a = size })
+STATS_WRAPPER(STATS_OP_REMOVEXATTR, removexattr, path, (const char *path, const char *name), (path, name), { .path2 = name })
+#endif // HAVE_XATTR
+
 struct fuse_operations unionfs_oper = {
-	.chmod = unionfs_chmod,
-	.chown = unionfs_chown,
-	.create = unionfs_create,
-	.flush = unionfs_flush,
-	.fsync = unionfs_fsync,
-	.getattr = unionfs_getattr,
-	.access = unionfs_access,
+	.chmod = stats_chmod,
+	.chown = stats_chown,
+	.create = stats_create,
+	.flush = stats_flush,
+	.fsync = stats_fsync,
+	.ftruncate = stats_ftruncate,
+	.getattr = stats_getattr,
+	.access = stats_access,
 	.init = unionfs_init,
+	.destroy = unionfs_destroy,
 #if FUSE_VERSION >= 28
-	.ioctl = unionfs_ioctl,
+	.ioctl = stats_ioctl,
+#endif
+	.link = stats_link,
+	.mkdir = stats_mkdir,
+	.mknod = stats_mknod,
+	.open = stats_open,
+	.read = stats_read,
+#ifdef FH_SPLICE
+	.read_buf = stats_read_buf,
+	.write_buf = stats_write_buf,
 #endif
-	.link = unionfs_link,
-	.mkdir = unionfs_mkdir,
-	.mknod = unionfs_mknod,
-	.open = unionfs_open,
-	.read = unionfs_read,
-	.readlink = unionfs_readlink,
-	.readdir = unionfs_readdir,
-	.release = unionfs_release,
-	.rename = unionfs_rename,
-	.rmdir = unionfs_rmdir,
-	.statfs = unionfs_statfs,
-	.symlink = unionfs_symlink,
-	.truncate = unionfs_truncate,
-	.unlink = unionfs_unlink,
-	.utimens = unionfs_utimens,
-	.write = unionfs_write,
+	.readlink = stats_readlink,
+	.opendir = stats_opendir,
+	.readdir = stats_readdir,
+	.releasedir = stats_releasedir,
+	.release = stats_release,
+	.rename = stats_rename,
+	.rmdir = stats_rmdir,
+	.statfs = stats_statfs,
+	.symlink = stats_symlink,
+	.truncate = stats_truncate,
+	.unlink = stats_unlink,
+	.utimens = stats_utimens,
+	.write = stats_write,
 #ifdef HAVE_XATTR
-	.getxattr = unionfs_getxattr,
-	.listxattr = unionfs_listxattr,
-	.removexattr = unionfs_removexattr,
-	.setxattr = unionfs_setxattr,
+	.getxattr = stats_getxattr,
+	.listxattr = stats_listxattr,
+	.removexattr = stats_removexattr,
+	.setxattr = stats_setxattr,
 #endif
 };
@@ -25,27 +25,33 @@
 
 #include "unionfs.h"
 #include "opts.h"
+#include "btable.h"
 #include "string.h"
 #include "cow.h"
 #include "findbranch.h"
 #include "general.h"
 #include "debug.h"
 #include "usyslog.h"
+#include "lcache.h"
+#include "windex.h"
+#include "branchio.h"
+#include "ll_ops.h"
 
 /**
  * Check if a file or directory with the hidden flag exists.
+ * path is the path of the meta file relative to branch, without the tag
  */
-static int filedir_hidden(const char *path) {
+static int filedir_hidden(int branch, const char *path) {
 	// cow mode disabled, no need for hidden files
 	if (!uopt.cow_enabled) RETURN(false);
 
-	char p[PATHLEN_MAX];
+	char *p = scratch_path(SCRATCH_HIDDEN_TAG);
 	if (strlen(path) + strlen(HIDETAG) > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
 	snprintf(p, PATHLEN_MAX, "%s%s", path, HIDETAG);
 	DBG("%s\n", p);
 
 	struct stat stbuf;
-	int res = lstat(p, &stbuf);
+	int res = b_lstat(branch, p, &stbuf);
 	if (res == 0) RETURN(1);
 
 	RETURN(0);
@@ -59,11 +65,13 @@ int path_hidden(const char *path, int branch) {
 
 	if (!uopt.cow_enabled) RETURN(false);
 
-	char whiteoutpath[PATHLEN_MAX];
-	if (BUILD_PATH(whiteoutpath, uopt.branches[branch].path, METADIR, path)) RETURN(false);
+	if (uopt.whiteout_index && windex_ready(branch)) RETURN(windex_hidden(branch, path));
+
+	char *whiteoutpath = scratch_path(SCRATCH_HIDDEN);
+	if (BUILD_PATH(whiteoutpath, METADIR, path)) RETURN(false);
 
 	// -1 as we MUST not end on the next path element
-	char *walk = whiteoutpath + uopt.branches[branch].path_len + strlen(METADIR) - 1;
+	char *walk = whiteoutpath + strlen(METADIR) - 1;
 
 	// first slashes, e.g. we have path = /dir1/dir2/, will set walk = dir1/dir2/
 	while (*walk == '/') walk++;
@@ -73,10 +81,10 @@ int path_hidden(const char *path, int branch) {
 		while (*walk != '\0' && *walk != '/') walk++;
 
 		// +1 due to \0, which gets added automatically
-		char p[PATHLEN_MAX];
+		char *p = scratch_path(SCRATCH_HIDDEN_PART);
 		// walk - path = strlen(/dir1)
 		snprintf(p, (walk - whiteoutpath) + 1, "%s", whiteoutpath);
-		int res = filedir_hidden(p);
+		int res = filedir_hidden(branch, p);
 		if (res) RETURN(res); // path is hidden or error
 
 		// as above the do loop, walk over the next slashes, walk = dir2/
@@ -95,19 +103,36 @@ int remove_hidden(const char *path, int maxbranch) {
 
 	if (!uopt.cow_enabled) RETURN(0);
 
-	if (maxbranch == -1) maxbranch = uopt.nbranches;
+	if (maxbranch == -1) maxbranch = NBRANCHES;
+
+	char p[PATHLEN_MAX];
+	if (BUILD_PATH(p, METADIR, path)) RETURN(-ENAMETOOLONG);
+	if (strlen(p) + strlen(HIDETAG) >= PATHLEN_MAX) RETURN(-ENAMETOOLONG);
+	strcat(p, HIDETAG);
 
 	int i;
 	for (i = 0; i <= maxbranch; i++) {
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, METADIR, path)) RETURN(-ENAMETOOLONG);
-		if (strlen(p) + strlen(HIDETAG) > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
-		strcat(p, HIDETAG); // TODO check length
-
-		switch (path_is_dir(p)) {
-			case IS_FILE: unlink(p); break;
-			case IS_DIR: rmdir(p); break;
-			case NOT_EXISTING: continue;
+		if (uopt.whiteout_journal && BRANCH(i).rw && windex_ready(i)) {
+			int res = windex_log_remove(i, path);
+			if (res == WINDEX_DIR)
+				lcache_invalidate_tree(path);
+			else if (res == WINDEX_FILE)
+				lcache_invalidate(path);
+			continue;
+		}
+
+		struct stat st;
+		if (b_lstat(i, p, &st) == -1) continue; // no whiteout here
+
+		if (S_ISDIR(st.st_mode)) {
+			// the sub-tree of lower branches is visible again
+			b_rmdir(i, p);
+			windex_remove(i, path);
+			lcache_invalidate_tree(path);
+		} else {
+			b_unlink(i, p);
+			windex_remove(i, path);
+			lcache_invalidate(path);
 		}
 	}
 
@@ -137,6 +162,21 @@ filetype_t path_is_dir(const char *path) {
 static int do_create_whiteout(const char *path, int branch_rw, enum whiteout mode) {
 	DBG("%s\n", path);
 
+	if (uopt.whiteout_journal && windex_ready(branch_rw)) {
+		int res = windex_log_add(branch_rw, path, mode == WHITEOUT_DIR);
+
+		if (mode == WHITEOUT_FILE)
+			lcache_invalidate(path);
+		else
+			lcache_invalidate_tree(path);
+
+		if (res) {
+			errno = -res;
+			RETURN(-1);
+		}
+		RETURN(0);
+	}
+
 	char metapath[PATHLEN_MAX];
 
 	if (BUILD_PATH(metapath, METADIR, path)) RETURN(-1);
@@ -145,21 +185,32 @@ static int do_create_whiteout(const char *path, int branch_rw, enum whiteout mod
 	// this creates e.g. branch/.unionfs/some_directory
 	path_create_cutlast(metapath, branch_rw, branch_rw);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, metapath)) RETURN(-1);
-	strcat(p, HIDETAG); // TODO check length
+	if (strlen(metapath) + strlen(HIDETAG) >= PATHLEN_MAX) {
+		errno = ENAMETOOLONG;
+		RETURN(-1);
+	}
+	strcat(metapath, HIDETAG);
 
 	int res;
 	if (mode == WHITEOUT_FILE) {
-		res = open(p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+		res = b_open(branch_rw, metapath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
 		if (res == -1) RETURN(-1);
 		res = close(res);
 	} else {
-		res = mkdir(p, S_IRWXU);
+		res = b_mkdir(branch_rw, metapath, S_IRWXU);
 		if (res)
-			USYSLOG(LOG_ERR, "Creating %s failed: %s\n", p, strerror(errno));
+			USYSLOG(LOG_ERR, "Creating %s%s failed: %s\n",
+				BRANCH(branch_rw).path, metapath, strerror(errno));
 	}
 
+	if (res == 0) windex_add(branch_rw, path, mode == WHITEOUT_DIR);
+
+	// a whiteout directory hides the entire sub-tree of lower branches
+	if (mode == WHITEOUT_FILE)
+		lcache_invalidate(path);
+	else
+		lcache_invalidate_tree(path);
+
 	RETURN(res);
 }
 
@@ -198,12 +249,37 @@ int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode) {
 }
 
 /**
- * Set file owner of after an operation, which created a file.
+ * Get the user and group of the process doing the current request,
+ * for both, the high-level and the low-level engine, and unionfs-replay.
  */
-int set_owner(const char *path) {
+void request_owner(uid_t *uid, gid_t *gid) {
+	if (uopt.in_process) {
+		// there is no FUSE request, and no context for it
+		*uid = getuid();
+		*gid = getgid();
+		return;
+	}
+
+	if (uopt.lowlevel) {
+		ll_request_owner(uid, gid);
+		return;
+	}
+
 	struct fuse_context *ctx = fuse_get_context();
-	if (ctx->uid != 0 && ctx->gid != 0) {
-		int res = lchown(path, ctx->uid, ctx->gid);
+	*uid = ctx->uid;
+	*gid = ctx->gid;
+}
+
+/**
+ * Set file owner of after an operation, which created path on branch.
+ */
+int set_owner(int branch, const char *path) {
+	uid_t uid;
+	gid_t gid;
+	request_owner(&uid, &gid);
+
+	if (uid != 0 && gid != 0) {
+		int res = b_lchown(branch, path, uid, gid);
 		if (res) {
 			USYSLOG(LOG_WARNING,
 			       ":%s: Setting the correct file owner failed: %s !\n",
@@ -8,6 +8,7 @@
 #define GENERAL_H
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 enum  whiteout {
 	WHITEOUT_FILE,
@@ -26,7 +27,8 @@ int hide_file(const char *path, int branch_rw);
 int hide_dir(const char *path, int branch_rw);
 filetype_t path_is_dir (const char *path);
 int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode);
-int set_owner(const char *path);
+void request_owner(uid_t *uid, gid_t *gid);
+int set_owner(int branch, const char *path);
 
 
 #endif
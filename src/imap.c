@@ -0,0 +1,466 @@
+/*
+* Description: stable inode numbers of the union
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Usually getattr() and readdir() pass the inode numbers of the branches
+*	through, so files of different branches may share a number and a file
+*	gets a new one once it is copied up. With -o inode_map every device of
+*	the branches gets a slot, in the order of the branches on mount and
+*	devices seen later (mounts inside of the branches) after them, and the
+*	inode number of the union is the slot above the IMAP_INO_BITS of the
+*	inode number on the branch. Hard links keep sharing their number and
+*	no table is needed for it. Numbers of more than IMAP_INO_BITS and
+*	devices beyond IMAP_SLOTS get a number counted up from 1 instead, those
+*	are only stable while mounted.
+*	A copy-up keeps the number of the copied file: the new inode on the
+*	rw-branch gets an alias in the map of the branch and a record
+*	{inode number on the branch, number of the union} is appended to
+*	METADIR/.inodes, so that the alias survives remounts with the same
+*	branches. Removing the last link of an aliased inode appends a record
+*	with number 0, which drops it again; the map is read on mount and
+*	rewritten if most of its records are dropped ones. Looking up a
+*	number is a hash lookup, branches without aliases are skipped without
+*	taking their lock.
+*	unionfs.c mounts with use_ino then, so the kernel and tools like tar
+*	and rsync can rely on the numbers. An unchanged hard link on a
+*	ro-branch keeps the number of its sibling which was copied up.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "branchio.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "imap.h"
+#include "debug.h"
+#include "usyslog.h"
+
+struct imap {
+	pthread_rwlock_t lock;
+	struct hashtable *aliases;	// struct alias by the inode number on the branch
+	unsigned int count;		// of aliases, also read without the lock
+	dev_t dev;			// of the branch
+	int fd;				// of the branch, for the map
+	pthread_mutex_t map_lock;
+	int map_fd;			// METANAME/IMAP_FILE, -1 until the first record
+};
+
+// an alias, also the record of IMAP_FILE, a union number of 0 drops it
+struct alias {
+	uint64_t ino;			// on the branch
+	uint64_t union_ino;
+};
+
+// a number which does not fit into a slot
+struct spill {
+	dev_t dev;
+	uint64_t ino;
+	uint64_t union_ino;
+};
+
+static dev_t devs[IMAP_SLOTS];
+static int ndevs;			// only grows, read without the lock
+static pthread_mutex_t devs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct hashtable *spills;
+static uint64_t next_spill = 1;
+static pthread_mutex_t spills_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool enabled = false;
+
+static unsigned int alias_hash(void *k) {
+	uint64_t ino = ((struct alias *)k)->ino;
+	return (unsigned int)(ino ^ (ino >> 32));
+}
+
+static int alias_equal(void *a, void *b) {
+	return ((struct alias *)a)->ino == ((struct alias *)b)->ino;
+}
+
+static unsigned int spill_hash(void *k) {
+	struct spill *s = k;
+	return (unsigned int)(s->ino ^ (s->ino >> 32)) ^ (unsigned int)s->dev;
+}
+
+static int spill_equal(void *a, void *b) {
+	struct spill *s1 = a, *s2 = b;
+	return s1->dev == s2->dev && s1->ino == s2->ino;
+}
+
+/**
+ * The slot of dev, a new device gets the next one. Returns -1 once all
+ * slots are taken.
+ */
+static int get_slot(dev_t dev) {
+	int n = __atomic_load_n(&ndevs, __ATOMIC_ACQUIRE);
+	int i;
+	for (i = 0; i < n; i++) {
+		if (devs[i] == dev) return i;
+	}
+
+	pthread_mutex_lock(&devs_lock);
+
+	n = ndevs;
+	for (i = 0; i < n && devs[i] != dev; i++);
+	if (i == n) {
+		if (n < IMAP_SLOTS) {
+			devs[n] = dev;
+			__atomic_store_n(&ndevs, n + 1, __ATOMIC_RELEASE);
+			DBG("device %lu: slot %d\n", (unsigned long)dev, n);
+		} else {
+			i = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&devs_lock);
+
+	return i;
+}
+
+/**
+ * The counted number of ino on dev.
+ */
+static uint64_t spill(dev_t dev, uint64_t ino) {
+	struct spill key = { .dev = dev, .ino = ino };
+
+	pthread_mutex_lock(&spills_lock);
+
+	struct spill *s = hashtable_search(spills, &key);
+	if (!s && next_spill < (UINT64_C(1) << IMAP_INO_BITS)) {
+		s = malloc(sizeof(struct spill));
+		if (s) {
+			*s = key;
+			s->union_ino = next_spill;
+			if (hashtable_insert(spills, s, s)) {
+				next_spill++;
+			} else {
+				free(s);
+				s = NULL;
+			}
+		}
+	}
+
+	// out of memory, the number of the branch might collide
+	uint64_t res = s ? s->union_ino : ino;
+
+	pthread_mutex_unlock(&spills_lock);
+
+	return res;
+}
+
+/**
+ * The number of ino on dev, without looking at the aliases.
+ */
+static uint64_t plain(dev_t dev, uint64_t ino) {
+	int slot = ino < (UINT64_C(1) << IMAP_INO_BITS) ? get_slot(dev) : -1;
+	if (slot < 0) return spill(dev, ino);
+
+	return ((uint64_t)(slot + 1) << IMAP_INO_BITS) | ino;
+}
+
+/**
+ * Look up the alias of ino, returns true if there is one.
+ */
+static bool find_alias(struct imap *im, uint64_t ino, uint64_t *union_ino) {
+	if (!__atomic_load_n(&im->count, __ATOMIC_RELAXED)) return false;
+
+	struct alias key = { .ino = ino };
+
+	pthread_rwlock_rdlock(&im->lock);
+	struct alias *a = hashtable_search(im->aliases, &key);
+	if (a) *union_ino = a->union_ino;
+	pthread_rwlock_unlock(&im->lock);
+
+	return a != NULL;
+}
+
+/**
+ * Set the alias of ino to union_ino, 0 drops it. Returns 0 or -1 if out of
+ * memory.
+ */
+static int set_alias(struct imap *im, uint64_t ino, uint64_t union_ino) {
+	struct alias key = { .ino = ino };
+	int res = 0;
+
+	pthread_rwlock_wrlock(&im->lock);
+
+	struct alias *a = hashtable_search(im->aliases, &key);
+	if (a && union_ino) {
+		a->union_ino = union_ino;
+	} else if (a) {
+		hashtable_remove(im->aliases, &key); // frees a, the key
+		im->count--;
+	} else if (union_ino) {
+		a = malloc(sizeof(struct alias));
+		if (a) {
+			a->ino = ino;
+			a->union_ino = union_ino;
+		}
+		if (!a || !hashtable_insert(im->aliases, a, a)) {
+			free(a);
+			res = -1;
+		} else {
+			im->count++;
+		}
+	}
+
+	pthread_rwlock_unlock(&im->lock);
+
+	return res;
+}
+
+/**
+ * Append the record of an alias to the map of im.
+ */
+static void record(struct imap *im, uint64_t ino, uint64_t union_ino) {
+	struct alias rec = { .ino = ino, .union_ino = union_ino };
+
+	pthread_mutex_lock(&im->map_lock);
+
+	if (im->map_fd == -1) {
+		if (mkdirat(im->fd, METANAME, 0755) == 0 || errno == EEXIST)
+			im->map_fd = openat(im->fd, METANAME "/" IMAP_FILE, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+	}
+
+	// a single write, so that records do not interleave
+	if (im->map_fd == -1 || write(im->map_fd, &rec, sizeof(rec)) != sizeof(rec))
+		USYSLOG(LOG_WARNING, "Recording the inode number of %llu failed: %s\n",
+			(unsigned long long)ino, strerror(errno));
+
+	pthread_mutex_unlock(&im->map_lock);
+}
+
+/**
+ * Write the aliases of im into a new map, most records of the old one are
+ * dropped ones.
+ */
+static void compact(struct imap *im) {
+	int fd = openat(im->fd, METANAME "/" IMAP_FILE ".new", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) return;
+
+	bool failed = false;
+	struct hashtable_itr *itr = hashtable_count(im->aliases) ? hashtable_iterator(im->aliases) : NULL;
+	if (itr) {
+		do {
+			struct alias *a = hashtable_iterator_value(itr);
+			if (write(fd, a, sizeof(struct alias)) != sizeof(struct alias)) failed = true;
+		} while (!failed && hashtable_iterator_advance(itr));
+		free(itr);
+	}
+
+	if (fsync(fd) == -1) failed = true;
+	close(fd);
+
+	if (failed || renameat(im->fd, METANAME "/" IMAP_FILE ".new", im->fd, METANAME "/" IMAP_FILE) == -1) {
+		USYSLOG(LOG_WARNING, "Rewriting the inode map failed: %s\n", strerror(errno));
+		unlinkat(im->fd, METANAME "/" IMAP_FILE ".new", 0);
+	}
+}
+
+/**
+ * Read the map of IMAP_FILE into im, a record cut short ends it.
+ */
+static void load(struct imap *im, bool rw) {
+	int fd = openat(im->fd, METANAME "/" IMAP_FILE, O_RDONLY);
+	if (fd == -1) return;
+
+	struct alias recs[256];
+	unsigned long records = 0;
+	ssize_t n;
+	while ((n = read(fd, recs, sizeof(recs))) > 0) {
+		size_t i;
+		for (i = 0; i < n / sizeof(struct alias); i++) {
+			if (set_alias(im, recs[i].ino, recs[i].union_ino)) {
+				USYSLOG(LOG_ERR, "Out of memory for the inode map\n");
+				break;
+			}
+		}
+		records += n / sizeof(struct alias);
+
+		if (n % sizeof(struct alias)) break;
+	}
+	close(fd);
+
+	DBG("%lu records, %u aliases\n", records, im->count);
+
+	if (rw && records > IMAP_COMPACT_RECORDS && records > 2 * (unsigned long)im->count) compact(im);
+}
+
+static struct imap *imap_create(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) == -1) return NULL;
+
+	struct imap *im = calloc(1, sizeof(struct imap));
+	if (!im) return NULL;
+
+	im->aliases = create_hashtable(16, alias_hash, alias_equal);
+	if (!im->aliases) {
+		free(im);
+		return NULL;
+	}
+
+	pthread_rwlock_init(&im->lock, NULL);
+	pthread_mutex_init(&im->map_lock, NULL);
+	im->dev = st.st_dev;
+	im->fd = fd;
+	im->map_fd = -1;
+
+	// the devices of the branches get their slots first
+	get_slot(im->dev);
+
+	return im;
+}
+
+void imap_free(struct imap *im) {
+	if (!im) return;
+
+	if (im->map_fd != -1) close(im->map_fd);
+	hashtable_destroy(im->aliases, 0); // the values are the keys
+	pthread_mutex_destroy(&im->map_lock);
+	pthread_rwlock_destroy(&im->lock);
+	free(im);
+}
+
+/**
+ * Load the map of a branch added while mounted. Returns 0 or -errno.
+ */
+int imap_branch_load(branch_entry_t *branch) {
+	if (!enabled) return 0;
+
+	struct imap *im = imap_create(branch->fd);
+	if (!im) return -ENOMEM;
+
+	load(im, branch->rw);
+
+	branch->imap = im;
+	return 0;
+}
+
+/**
+ * Load the maps of all branches, must be called after btable_init().
+ */
+void imap_init(void) {
+	if (!uopt.inode_map) return;
+
+	spills = create_hashtable(16, spill_hash, spill_equal);
+	if (!spills) {
+		fprintf(stderr, "%s: Failed to create the inode map\n", __func__);
+		exit(1); // still early stage, we can abort
+	}
+
+	int i;
+	for (i = 0; i < NBRANCHES; i++) {
+		struct imap *im = imap_create(BRANCH(i).fd);
+		if (!im) {
+			fprintf(stderr, "%s: Failed to create the inode map\n", __func__);
+			exit(1);
+		}
+
+		// the fd of the branch also works in the chroot
+		load(im, BRANCH(i).rw);
+
+		BRANCH(i).imap = im;
+	}
+
+	enabled = true;
+}
+
+/**
+ * The number of the union for inode ino on device dev.
+ */
+uint64_t imap_ino(dev_t dev, uint64_t ino) {
+	if (!enabled) return ino;
+
+	// a copied up inode, several branches might share the device
+	int i;
+	for (i = 0; i < NBRANCHES; i++) {
+		struct imap *im = BRANCH(i).imap;
+		uint64_t union_ino;
+		if (im && im->dev == dev && find_alias(im, ino, &union_ino)) return union_ino;
+	}
+
+	return plain(dev, ino);
+}
+
+/**
+ * The number of the union for inode ino on the device of branch, for the
+ * dirents of readdir().
+ */
+uint64_t imap_branch_ino(int branch, uint64_t ino) {
+	if (!enabled) return ino;
+
+	return imap_ino(BRANCH(branch).imap->dev, ino);
+}
+
+/**
+ * path was copied up to branch_rw, src is the lstat() of the original.
+ * The copy keeps its number.
+ */
+void imap_copied(int branch_rw, const char *path, const struct stat *src) {
+	if (!enabled) return;
+
+	struct imap *im = BRANCH(branch_rw).imap;
+
+	struct stat st;
+	if (b_lstat(branch_rw, path, &st) == -1 || st.st_dev != im->dev) return;
+
+	uint64_t union_ino = imap_ino(src->st_dev, src->st_ino);
+	if (union_ino == plain(st.st_dev, st.st_ino)) return;
+
+	DBG("%s: %llu\n", path, (unsigned long long)union_ino);
+
+	if (set_alias(im, st.st_ino, union_ino)) {
+		USYSLOG(LOG_ERR, "Out of memory for the inode map\n");
+		return;
+	}
+	record(im, st.st_ino, union_ino);
+}
+
+/**
+ * path on branch is to be removed. Returns its inode number if this drops
+ * the last link of an alias, which is then to be passed to imap_removed().
+ * Otherwise 0.
+ */
+uint64_t imap_removing(int branch, const char *path) {
+	if (!enabled) return 0;
+
+	struct imap *im = BRANCH(branch).imap;
+	if (!__atomic_load_n(&im->count, __ATOMIC_RELAXED)) return 0;
+
+	struct stat st;
+	if (b_lstat(branch, path, &st) == -1 || st.st_dev != im->dev) return 0;
+
+	// the other hard links keep the alias
+	if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) return 0;
+
+	uint64_t union_ino;
+	if (!find_alias(im, st.st_ino, &union_ino)) return 0;
+
+	return st.st_ino;
+}
+
+/**
+ * The inode ino returned by imap_removing() is gone, drop its alias.
+ */
+void imap_removed(int branch, uint64_t ino) {
+	if (!ino) return;
+
+	struct imap *im = BRANCH(branch).imap;
+
+	DBG("%llu\n", (unsigned long long)ino);
+
+	set_alias(im, ino, 0);
+	record(im, ino, 0);
+}
@@ -0,0 +1,32 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef IMAP_H
+#define IMAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+
+#define IMAP_SLOTS 255		// devices with their own range of inode numbers
+#define IMAP_INO_BITS 56	// the bits of a branch inode number kept in the union
+#define IMAP_FILE ".inodes"	// in METANAME of a branch
+#define IMAP_COMPACT_RECORDS 4096 // a longer map of mostly dropped aliases is rewritten on mount
+
+struct imap;
+
+void imap_init(void);
+int imap_branch_load(branch_entry_t *branch);
+void imap_free(struct imap *im);
+uint64_t imap_ino(dev_t dev, uint64_t ino);
+uint64_t imap_branch_ino(int branch, uint64_t ino);
+void imap_copied(int branch_rw, const char *path, const struct stat *src);
+uint64_t imap_removing(int branch, const char *path);
+void imap_removed(int branch, uint64_t ino);
+
+#endif
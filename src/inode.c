@@ -0,0 +1,582 @@
+/*
+* Description: inode table of the low-level engine
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	The low-level FUSE API addresses files by inode numbers instead of
+*	paths. Each inode we hand out to the kernel is a struct inode, the
+*	inode number is simply its address (the root is INODE_ROOT_ID).
+*	An inode knows its parent and its name within the parent, so the union
+*	path can be rebuilt without asking libfuse, and it remembers on which
+*	branch the path was found. So the path is resolved across the branches
+*	once in lookup(), later requests go directly to the cached branch.
+*	All inodes known by (parent, name) are in a hash table, lookup() of an
+*	already known name returns the same inode again.
+*	Every request needs the path of its inode, so the table must not
+*	serialize them: it is split into INODE_SHARDS shards with their own
+*	mutex, and the parent and name chains are protected by a rwlock.
+*	Building paths, lookup() and unlink() only take it for reading, the
+*	reference counts are changed atomically then. Only rename() and
+*	freeing inodes take it for writing, a forget() only when it drops the
+*	last reference of the kernel.
+*	The cached branch follows the lcache rules: operations modifying the
+*	union call lcache_invalidate() or lcache_invalidate_all(), which also
+*	invalidate the affected inodes here. It is read without any lock: a
+*	sequence number per inode is odd while the branch is changed, readers
+*	retry the resolution if it changed under them. As for lcache.c, a
+*	resolution that raced with an invalidation is not stored. A cached
+*	branch is only used on the branch table it was found on (see
+*	btable.c).
+*	Inodes are freed once the kernel forgot them and they do not have
+*	children any more, children keep a reference on their parent.
+*	Invalidations are passed on to the kernel caches, see kcache.c. That
+*	includes names without an inode, the kernel might have a negative
+*	entry for them (see ll_lookup()).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "btable.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "string.h"
+#include "findbranch.h"
+#include "inode.h"
+#include "kcache.h"
+#include "debug.h"
+
+struct inode {
+	struct inode *parent;	// parent and name are protected by tree_lock
+	char *name;		// name within parent, NULL for the root
+	unsigned long nlookup;	// references of the kernel
+	unsigned long nchild;	// inodes with this inode as parent
+	bool hashed;		// in the (parent, name) table, protected by the shard lock
+	unsigned long seq;	// odd while the cached branch is changed
+	int branch;		// branch the path was found on
+	unsigned long gen;	// generation branch is valid for, 0 if invalid
+	unsigned long table;	// generation of the branch table of branch
+};
+
+// hash table key, name belongs to the inode
+struct inode_key {
+	struct inode *parent;
+	const char *name;
+};
+
+struct inode_shard {
+	pthread_mutex_t lock;
+	struct hashtable *table;
+};
+
+static struct inode root;
+static struct inode_shard shards[INODE_SHARDS];
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned long gen = 1; // incremented by inode_invalidate_all()
+static bool enabled = false;
+
+static unsigned int key_hash(void *k) {
+	struct inode_key *key = k;
+	uintptr_t p = (uintptr_t)key->parent / sizeof(struct inode);
+
+	return string_hash((void *)key->name) ^ (unsigned int)p;
+}
+
+static int key_equal(void *k1, void *k2) {
+	struct inode_key *key1 = k1;
+	struct inode_key *key2 = k2;
+
+	return key1->parent == key2->parent && strcmp(key1->name, key2->name) == 0;
+}
+
+static struct inode *get_inode(uint64_t ino) {
+	if (ino == INODE_ROOT_ID) return &root;
+	return (struct inode *)(uintptr_t)ino;
+}
+
+static uint64_t get_ino(struct inode *inode) {
+	if (inode == &root) return INODE_ROOT_ID;
+	return (uint64_t)(uintptr_t)inode;
+}
+
+static struct inode_shard *get_shard(struct inode_key *key) {
+	return &shards[key_hash(key) % INODE_SHARDS];
+}
+
+/**
+ * Find the child name of parent. Must be called with the shard lock held.
+ */
+static struct inode *search_child(struct inode_shard *shard, struct inode *parent, const char *name) {
+	struct inode_key key = { parent, name };
+	return hashtable_search(shard->table, &key);
+}
+
+/**
+ * Find the child name of parent, which stays valid as long as the tree lock
+ * is held.
+ */
+static struct inode *find_child(struct inode *parent, const char *name) {
+	struct inode_key key = { parent, name };
+	struct inode_shard *shard = get_shard(&key);
+
+	pthread_mutex_lock(&shard->lock);
+	struct inode *inode = hashtable_search(shard->table, &key);
+	pthread_mutex_unlock(&shard->lock);
+
+	return inode;
+}
+
+/**
+ * Must be called with the shard lock held.
+ */
+static void unhash_locked(struct inode_shard *shard, struct inode *inode) {
+	if (!inode->hashed) return;
+
+	struct inode_key key = { inode->parent, inode->name };
+	hashtable_remove(shard->table, &key); // frees the key, not the inode
+	inode->hashed = false;
+}
+
+/**
+ * Must be called with the tree lock held.
+ */
+static void unhash(struct inode *inode) {
+	struct inode_key key = { inode->parent, inode->name };
+	struct inode_shard *shard = get_shard(&key);
+
+	pthread_mutex_lock(&shard->lock);
+	unhash_locked(shard, inode);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Must be called with the shard lock held.
+ */
+static bool rehash_locked(struct inode_shard *shard, struct inode *inode) {
+	struct inode_key *key = malloc(sizeof(struct inode_key));
+	if (!key) return false;
+
+	key->parent = inode->parent;
+	key->name = inode->name;
+	if (!hashtable_insert(shard->table, key, inode)) {
+		free(key);
+		return false;
+	}
+
+	inode->hashed = true;
+	return true;
+}
+
+/**
+ * Must be called with the tree lock held for writing.
+ */
+static bool rehash(struct inode *inode) {
+	struct inode_key key = { inode->parent, inode->name };
+	struct inode_shard *shard = get_shard(&key);
+
+	pthread_mutex_lock(&shard->lock);
+	bool res = rehash_locked(shard, inode);
+	pthread_mutex_unlock(&shard->lock);
+
+	return res;
+}
+
+/**
+ * Free inode and all parents which are not used anymore.
+ * Must be called with the tree lock held for writing.
+ */
+static void put_inode(struct inode *inode) {
+	while (inode != &root && inode->nlookup == 0 && inode->nchild == 0) {
+		struct inode *parent = inode->parent;
+
+		unhash(inode);
+		free(inode->name);
+		free(inode);
+
+		parent->nchild--;
+		inode = parent;
+	}
+}
+
+/**
+ * Forget the cached branch of inode, also makes a running resolution drop
+ * its result.
+ */
+static void invalidate_branch(struct inode *inode) {
+	unsigned long seq = __atomic_load_n(&inode->seq, __ATOMIC_RELAXED);
+	do {
+		// another thread is storing its branch
+		while (seq & 1) seq = __atomic_load_n(&inode->seq, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&inode->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	__atomic_store_n(&inode->gen, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&inode->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Build the union path of inode. Must be called with the tree lock held.
+ */
+static int build_inode_path(struct inode *inode, char *path) {
+	if (inode == &root) {
+		strcpy(path, "/");
+		return 0;
+	}
+
+	size_t len = 0;
+	struct inode *walk;
+	for (walk = inode; walk != &root; walk = walk->parent)
+		len += strlen(walk->name) + 1;
+
+	if (len >= PATHLEN_MAX) return -ENAMETOOLONG;
+
+	// fill path from its end
+	path[len] = '\0';
+	for (walk = inode; walk != &root; walk = walk->parent) {
+		size_t name_len = strlen(walk->name);
+		len -= name_len;
+		memcpy(path + len, walk->name, name_len);
+		path[--len] = '/';
+	}
+
+	return 0;
+}
+
+/**
+ * Initialize the inode table, must be called after option parsing.
+ */
+void inode_init(void) {
+	if (!uopt.lowlevel) return;
+
+	int i;
+	for (i = 0; i < INODE_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].table = create_hashtable(1024 / INODE_SHARDS, key_hash, key_equal);
+		if (!shards[i].table) {
+			fprintf(stderr, "%s: Failed to create the inode table\n", __func__);
+			exit(1); // still early stage, we can abort
+		}
+	}
+
+	root.nlookup = 1; // never forgotten
+	enabled = true;
+}
+
+/**
+ * The kernel got a reference on name in parent, return its inode number.
+ * Returns 0 if we ran out of memory.
+ */
+uint64_t inode_lookup(uint64_t parent, const char *name) {
+	DBG("%s\n", name);
+
+	struct inode *dir = get_inode(parent);
+	struct inode_key key = { dir, name };
+	struct inode_shard *shard = get_shard(&key);
+
+	pthread_rwlock_rdlock(&tree_lock);
+	pthread_mutex_lock(&shard->lock);
+
+	struct inode *inode = search_child(shard, dir, name);
+	if (!inode) {
+		inode = calloc(1, sizeof(struct inode));
+		if (!inode) goto err;
+
+		inode->name = strdup(name);
+		if (!inode->name) {
+			free(inode);
+			goto err;
+		}
+
+		inode->parent = dir;
+		if (!rehash_locked(shard, inode)) {
+			free(inode->name);
+			free(inode);
+			goto err;
+		}
+		__atomic_add_fetch(&dir->nchild, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_add_fetch(&inode->nlookup, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&shard->lock);
+	pthread_rwlock_unlock(&tree_lock);
+	return get_ino(inode);
+
+err:
+	pthread_mutex_unlock(&shard->lock);
+	pthread_rwlock_unlock(&tree_lock);
+	return 0;
+}
+
+/**
+ * The kernel dropped nlookup references of ino.
+ */
+void inode_forget(uint64_t ino, unsigned long nlookup) {
+	struct inode *inode = get_inode(ino);
+	if (inode == &root) return;
+
+	// the kernel still has references, the inode can not go away
+	unsigned long old = __atomic_load_n(&inode->nlookup, __ATOMIC_RELAXED);
+	while (old > nlookup) {
+		if (__atomic_compare_exchange_n(&inode->nlookup, &old, old - nlookup, false,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return;
+	}
+
+	pthread_rwlock_wrlock(&tree_lock);
+
+	if (nlookup > inode->nlookup) nlookup = inode->nlookup;
+	inode->nlookup -= nlookup;
+	put_inode(inode);
+
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+/**
+ * Get the union path of ino, path needs to have a size of PATHLEN_MAX.
+ */
+int inode_path(uint64_t ino, char *path) {
+	pthread_rwlock_rdlock(&tree_lock);
+	int res = build_inode_path(get_inode(ino), path);
+	pthread_rwlock_unlock(&tree_lock);
+
+	RETURN(res);
+}
+
+/**
+ * Get the union path of name in the directory parent.
+ */
+int inode_child_path(uint64_t parent, const char *name, char *path) {
+	char dir[PATHLEN_MAX];
+	int res = inode_path(parent, dir);
+	if (res) RETURN(res);
+
+	// avoid a double slash for entries of the root directory
+	if (BUILD_PATH(path, dir[1] ? dir : "", "/", name)) RETURN(-ENAMETOOLONG);
+
+	RETURN(0);
+}
+
+/**
+ * Get the branch of ino, resolve its path only when the cached value is not
+ * valid anymore. Returns -1 and sets errno as find_rorw_branch().
+ * The kernel has a reference on ino, so no lock is needed.
+ */
+int inode_branch(uint64_t ino, const char *path) {
+	struct inode *inode = get_inode(ino);
+
+	unsigned long table = btable_get()->gen;
+	unsigned long cur_gen = __atomic_load_n(&gen, __ATOMIC_ACQUIRE);
+
+	unsigned long seq = __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
+	if (!(seq & 1)) {
+		int branch = __atomic_load_n(&inode->branch, __ATOMIC_RELAXED);
+		unsigned long branch_gen = __atomic_load_n(&inode->gen, __ATOMIC_RELAXED);
+		unsigned long branch_table = __atomic_load_n(&inode->table, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&inode->seq, __ATOMIC_RELAXED) == seq
+		&& branch_gen == cur_gen && branch_table == table)
+			RETURN(branch);
+	}
+
+	int branch = find_rorw_branch(path);
+	if (branch == -1) RETURN(-1);
+
+	// not stored if an invalidation or another resolution came in between
+	if (!(seq & 1) && __atomic_compare_exchange_n(&inode->seq, &seq, seq + 1, false,
+							__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&inode->branch, branch, __ATOMIC_RELAXED);
+		__atomic_store_n(&inode->gen, cur_gen, __ATOMIC_RELAXED);
+		__atomic_store_n(&inode->table, table, __ATOMIC_RELAXED);
+		__atomic_store_n(&inode->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+
+	RETURN(branch);
+}
+
+/**
+ * name in parent was removed, a new lookup() MUST give a new inode.
+ */
+void inode_unlink(uint64_t parent, const char *name) {
+	if (!enabled) return;
+
+	struct inode *dir = get_inode(parent);
+	struct inode_key key = { dir, name };
+	struct inode_shard *shard = get_shard(&key);
+
+	pthread_rwlock_rdlock(&tree_lock);
+	pthread_mutex_lock(&shard->lock);
+
+	struct inode *inode = search_child(shard, dir, name);
+	if (inode) {
+		unhash_locked(shard, inode);
+		invalidate_branch(inode);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+/**
+ * Move name in parent to newname in newparent, after a successful rename().
+ */
+void inode_rename(uint64_t parent, const char *name, uint64_t newparent, const char *newname) {
+	if (!enabled) return;
+
+	struct inode *dir = get_inode(parent);
+	struct inode *newdir = get_inode(newparent);
+
+	pthread_rwlock_wrlock(&tree_lock);
+
+	// the target got replaced
+	struct inode *target = find_child(newdir, newname);
+	if (target) unhash(target);
+
+	struct inode *inode = find_child(dir, name);
+	if (!inode) goto out;
+
+	char *new_name = strdup(newname);
+	if (!new_name) {
+		// we can't follow, the kernel will look it up again
+		unhash(inode);
+		goto out;
+	}
+
+	unhash(inode);
+	free(inode->name);
+	inode->name = new_name;
+	invalidate_branch(inode);
+
+	if (dir != newdir) {
+		inode->parent = newdir;
+		newdir->nchild++;
+		dir->nchild--;
+		put_inode(dir);
+	}
+
+	rehash(inode);
+
+out:
+	// the branches of all children might have changed
+	__atomic_add_fetch(&gen, 1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+/**
+ * path was modified, resolve its branch again on next access.
+ */
+void inode_invalidate(const char *path) {
+	if (!enabled) return;
+
+	DBG("%s\n", path);
+
+	pthread_rwlock_rdlock(&tree_lock);
+
+	struct inode *parent = NULL;
+	struct inode *inode = &root;
+	char name[PATHLEN_MAX];
+	const char *walk = path;
+	while (inode) {
+		while (*walk == '/') walk++;
+		if (*walk == '\0') break;
+
+		size_t len = strcspn(walk, "/");
+		memcpy(name, walk, len);
+		name[len] = '\0';
+		walk += len;
+
+		parent = inode;
+		inode = find_child(inode, name);
+	}
+
+	if (inode) {
+		invalidate_branch(inode);
+
+		if (inode != &root) kcache_inval(get_ino(inode->parent), inode->name, get_ino(inode));
+	} else if (*walk == '\0') {
+		// only the last component is unknown, it might be a negative entry
+		kcache_inval(get_ino(parent), name, 0);
+	}
+
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+/**
+ * An entire sub-tree was modified, resolve all inodes again.
+ */
+void inode_invalidate_all(void) {
+	if (!enabled) return;
+
+	DBG_IN();
+
+	__atomic_add_fetch(&gen, 1, __ATOMIC_RELEASE);
+
+	kcache_inval_all();
+}
+
+/**
+ * The names of all known entries of the root directory, for
+ * kcache_inval_all(). The array and the names are malloc'ed, NULL if out
+ * of memory.
+ */
+char **inode_root_names(size_t *count) {
+	pthread_rwlock_rdlock(&tree_lock);
+
+	*count = 0;
+	size_t max = __atomic_load_n(&root.nchild, __ATOMIC_RELAXED);
+	char **names = malloc((max + 1) * sizeof(char *));
+	if (!names) goto out;
+
+	int i;
+	for (i = 0; i < INODE_SHARDS; i++) {
+		struct inode_shard *shard = &shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		if (hashtable_count(shard->table) == 0) {
+			pthread_mutex_unlock(&shard->lock);
+			continue;
+		}
+
+		struct hashtable_itr *itr = hashtable_iterator(shard->table);
+		if (!itr) {
+			pthread_mutex_unlock(&shard->lock);
+			goto err;
+		}
+
+		do {
+			struct inode *inode = hashtable_iterator_value(itr);
+			// lookup() might add root entries, they are new in the kernel too
+			if (inode->parent != &root || *count == max) continue;
+
+			names[*count] = strdup(inode->name);
+			if (!names[*count]) {
+				free(itr);
+				pthread_mutex_unlock(&shard->lock);
+				goto err;
+			}
+			(*count)++;
+		} while (hashtable_iterator_advance(itr));
+
+		free(itr);
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	goto out;
+
+err:
+	while (*count) free(names[--(*count)]);
+	free(names);
+	names = NULL;
+out:
+	pthread_rwlock_unlock(&tree_lock);
+	return names;
+}
@@ -0,0 +1,28 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef INODE_H
+#define INODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define INODE_ROOT_ID 1	// the same as FUSE_ROOT_ID
+#define INODE_SHARDS 64	// independently locked parts of the (parent, name) table
+
+void inode_init(void);
+uint64_t inode_lookup(uint64_t parent, const char *name);
+void inode_forget(uint64_t ino, unsigned long nlookup);
+int inode_path(uint64_t ino, char *path);
+int inode_child_path(uint64_t parent, const char *name, char *path);
+int inode_branch(uint64_t ino, const char *path);
+void inode_unlink(uint64_t parent, const char *name);
+void inode_rename(uint64_t parent, const char *name, uint64_t newparent, const char *newname);
+void inode_invalidate(const char *path);
+void inode_invalidate_all(void);
+char **inode_root_names(size_t *count);
+
+#endif
@@ -0,0 +1,213 @@
+/*
+* Description: invalidation of the kernel caches of the low-level engine
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	With -o cache_timeout the low-level engine lets the kernel cache
+*	entries and attributes for longer than the usual second and keeps the
+*	page cache of files read from ro-branches. Only unionfs itself knows
+*	when the union changes below such a cached entry (copy-up, whiteouts,
+*	renamed directories), so every lcache_invalidate() also invalidates the
+*	kernel entry and attributes of the inode, see inode.c.
+*	The kernel takes directory locks for the notifications, which the
+*	request that caused the invalidation might still hold. So they must
+*	not be sent from the request: they are queued and sent by a thread
+*	after the reply. If the queue is full or an entire sub-tree changed
+*	(lcache_invalidate_all()), all entries of the root directory are
+*	invalidated instead, which drops the whole dentry tree below them.
+*	The negative entries lookup() hands out below the root directory are
+*	invalidated the same way, entries of the root directory itself would
+*	not be found by that, so they never get one.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "opts.h"
+#include "inode.h"
+#include "kcache.h"
+#include "debug.h"
+#include "usyslog.h"
+
+struct kcache_event {
+	uint64_t parent;
+	uint64_t ino;
+	char name[256];		// NAME_MAX of the kernel
+};
+
+static struct fuse_chan *chan;
+static bool enabled = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct kcache_event queue[KCACHE_QUEUE_SIZE];
+static unsigned int head, tail;	// events [tail, head) are queued
+static bool inval_all;		// invalidate everything
+static bool stop;
+static pthread_t notifier;
+
+#if FUSE_VERSION >= 28
+/**
+ * An error could only mean the kernel cannot be notified at all.
+ */
+static void check_notify(int res) {
+	// not cached, nothing to do
+	if (res == 0 || res == -ENOENT) return;
+
+	USYSLOG(LOG_WARNING, "Kernel cache invalidation failed: %s, disabled\n", strerror(-res));
+	__atomic_store_n(&enabled, false, __ATOMIC_RELAXED);
+}
+
+static void notify(const struct kcache_event *event) {
+	DBG("%s\n", event->name);
+
+	check_notify(fuse_lowlevel_notify_inval_entry(chan, event->parent, event->name, strlen(event->name)));
+
+	// open files keep the inode, their attributes might have changed too
+	if (event->ino) check_notify(fuse_lowlevel_notify_inval_inode(chan, event->ino, -1, 0));
+}
+
+static void notify_all(void) {
+	DBG_IN();
+
+	size_t count, i;
+	char **names = inode_root_names(&count);
+	if (!names) {
+		USYSLOG(LOG_WARNING, "Out of memory, kernel caches not invalidated\n");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		check_notify(fuse_lowlevel_notify_inval_entry(chan, INODE_ROOT_ID, names[i], strlen(names[i])));
+		free(names[i]);
+	}
+	free(names);
+
+	check_notify(fuse_lowlevel_notify_inval_inode(chan, INODE_ROOT_ID, -1, 0));
+}
+#endif
+
+static void *notifier_thread(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&lock);
+	while (!stop) {
+		if (!inval_all && head == tail) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+
+		bool all = inval_all;
+		struct kcache_event event;
+		if (all) {
+			// covers the queued events
+			inval_all = false;
+			tail = head;
+		} else {
+			event = queue[tail % KCACHE_QUEUE_SIZE];
+			tail++;
+		}
+		pthread_mutex_unlock(&lock);
+
+#if FUSE_VERSION >= 28
+		if (all)
+			notify_all();
+		else
+			notify(&event);
+#else
+		(void)event;
+#endif
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/**
+ * Start sending invalidations to channel ch, from the init() of the
+ * low-level engine (threads do not survive daemonizing).
+ */
+void kcache_start(struct fuse_chan *ch) {
+#if FUSE_VERSION >= 28
+	if (!uopt.cache_timeout) return;
+
+	chan = ch;
+	stop = false;
+	int res = pthread_create(&notifier, NULL, notifier_thread, NULL);
+	if (res) {
+		USYSLOG(LOG_ERR, "Failed to start the cache invalidation thread: %s\n", strerror(res));
+		return;
+	}
+
+	__atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+#else
+	(void)ch;
+	USYSLOG(LOG_WARNING, "libfuse can not invalidate the kernel caches, -o cache_timeout is ignored\n");
+#endif
+}
+
+void kcache_stop(void) {
+	if (!chan) return;
+
+	__atomic_store_n(&enabled, false, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&lock);
+	stop = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(notifier, NULL);
+	chan = NULL;
+}
+
+/**
+ * Whether invalidations reach the kernel, only then it may cache negative
+ * entries for longer.
+ */
+bool kcache_active(void) {
+	return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * The kernel entry name in parent, of inode ino (0 for a negative entry), is
+ * stale. Never blocks, may be called with the inode lock held.
+ */
+void kcache_inval(uint64_t parent, const char *name, uint64_t ino) {
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return;
+
+	pthread_mutex_lock(&lock);
+
+	if (head - tail == KCACHE_QUEUE_SIZE || strlen(name) >= sizeof(queue[0].name)) {
+		inval_all = true;
+	} else {
+		struct kcache_event *event = &queue[head % KCACHE_QUEUE_SIZE];
+		event->parent = parent;
+		event->ino = ino;
+		strcpy(event->name, name);
+		head++;
+	}
+
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * An entire sub-tree changed.
+ */
+void kcache_inval_all(void) {
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return;
+
+	pthread_mutex_lock(&lock);
+	inval_all = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
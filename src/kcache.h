@@ -0,0 +1,22 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef KCACHE_H
+#define KCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <fuse_lowlevel.h>
+
+#define KCACHE_QUEUE_SIZE 1024	// pending invalidations, beyond everything is invalidated
+
+void kcache_start(struct fuse_chan *ch);
+void kcache_stop(void);
+bool kcache_active(void);
+void kcache_inval(uint64_t parent, const char *name, uint64_t ino);
+void kcache_inval_all(void);
+
+#endif
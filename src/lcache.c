@@ -0,0 +1,240 @@
+/*
+* Description: cache of path -> branch lookups
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	find_branch() needs to lstat() the path on every branch until it finds
+*	it, with many branches this gets expensive. So we remember which branch
+*	had the path (positive entry) and also that no branch had it or a
+*	whiteout stopped the search (negative entry, branch = -1).
+*	The entries are kept in a sharded map (see smap.c), lookups from many
+*	threads do not write to shared memory and so do not contend.
+*	All operations modifying the union MUST call lcache_invalidate() or,
+*	if they change an entire sub-tree, lcache_invalidate_all(). Changes
+*	done directly on the branches (not through unionfs) are only noticed
+*	after the entries expired (-o lookup_cache_ttl).
+*	The invalidation is also passed to the inode table of the low-level
+*	engine (inode.c), which caches branches the same way, to the xattr
+*	cache (xcache.c) and to the directory cache (dcache.c). Whiteout
+*	directories call lcache_invalidate_tree(), which keeps the cached
+*	directories outside of the hidden sub-tree.
+*	In order not to re-insert a result that became stale while find_branch()
+*	was running, lcache_lookup() hands out a ticket (the invalidation
+*	counter of the map shard), lcache_insert() drops the result if the
+*	counter changed.
+*	With -o readdirplus readdir() also stores the attributes of each entry
+*	it read from the winning branch. FUSE 2 can not pass attributes with
+*	readdir() replies, so they are handed out once to the getattr() or
+*	lookup() following readdir() (ls -l, find). Operations only changing
+*	attributes MUST call lcache_drop_attr().
+*	Branch numbers are only valid for the branch table they were found on
+*	(see btable.c), so entries remember its generation and count as missing
+*	for the operations running on another table.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "smap.h"
+#include "lcache.h"
+#include "inode.h"
+#include "xcache.h"
+#include "dcache.h"
+#include "debug.h"
+
+typedef struct {
+	int branch;		// branch of the path, -1 if not found
+	unsigned long table;	// generation of the branch table of branch
+	time_t expires;		// monotonic time in seconds
+	bool has_attr;		// attr is valid, see lcache_insert_attr()
+	struct stat attr;
+} lcache_entry_t;
+
+static struct smap *map;
+static bool enabled = false;
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * Initialize the cache, must be called after option parsing.
+ */
+void lcache_init(void) {
+	// readdirplus passes its results through the cache
+	if (uopt.readdirplus && uopt.lookup_cache_size == 0)
+		uopt.lookup_cache_size = LCACHE_READDIRPLUS_SIZE;
+
+	if (uopt.lookup_cache_size == 0) return;
+
+	map = smap_create(sizeof(lcache_entry_t), uopt.lookup_cache_size);
+	if (!map) {
+		fprintf(stderr, "%s: Failed to create the lookup cache\n", __func__);
+		exit(1); // still early stage, we can abort
+	}
+
+	enabled = true;
+}
+
+/**
+ * Return true if path is cached and store the cached branch into *branch.
+ * On a cache miss *ticket needs to be passed to lcache_insert().
+ */
+bool lcache_lookup(const char *path, int *branch, unsigned long *ticket) {
+	if (!enabled) return false;
+
+	lcache_entry_t entry;
+	bool found = smap_get(map, path, &entry, ticket) &&
+		entry.table == btable_get()->gen && entry.expires > now();
+	if (found) *branch = entry.branch;
+
+	DBG("%s: %s\n", path, found ? "hit" : "miss");
+	return found;
+}
+
+/**
+ * Remember the result of a branch lookup. branch = -1 means path was not found.
+ */
+void lcache_insert(const char *path, int branch, unsigned long ticket) {
+	if (!enabled) return;
+
+	lcache_entry_t entry;
+	entry.branch = branch;
+	entry.table = btable_get()->gen;
+	entry.expires = now() + uopt.lookup_cache_ttl;
+	entry.has_attr = false;
+
+	smap_put(map, path, &entry, ticket); // dropped if invalidated in the mean time
+}
+
+/**
+ * Get a ticket for lcache_insert_attr(), before looking at path.
+ */
+unsigned long lcache_ticket(const char *path) {
+	if (!enabled) return 0;
+
+	return smap_ticket(map, path);
+}
+
+/**
+ * readdir() found path on branch and already got its attributes
+ * (-o readdirplus). The following getattr() can then be answered without
+ * searching and stat()ing path again.
+ */
+void lcache_insert_attr(const char *path, int branch, const struct stat *attr, unsigned long ticket) {
+	if (!enabled) return;
+
+	lcache_entry_t entry;
+	entry.branch = branch;
+	entry.table = btable_get()->gen;
+	entry.expires = now() + uopt.lookup_cache_ttl;
+	entry.attr = *attr;
+	entry.has_attr = true;
+
+	smap_put(map, path, &entry, ticket);
+}
+
+struct take_attr {
+	struct stat *attr;
+	bool found;
+};
+
+static void take_attr(void *value, bool created, void *arg) {
+	(void)created;
+	lcache_entry_t *entry = value;
+	struct take_attr *take = arg;
+
+	if (entry->has_attr && entry->table == btable_get()->gen && entry->expires > now()) {
+		*take->attr = entry->attr;
+		take->found = true;
+	}
+	entry->has_attr = false;
+}
+
+/**
+ * Get the attributes stored by lcache_insert_attr(). They are handed out only
+ * once, later requests stat() path again.
+ */
+bool lcache_take_attr(const char *path, struct stat *attr) {
+	if (!enabled || !uopt.readdirplus) return false;
+
+	// the common case, nothing to take and nothing to write
+	lcache_entry_t entry;
+	if (!smap_get(map, path, &entry, NULL) || !entry.has_attr) {
+		DBG("%s: miss\n", path);
+		return false;
+	}
+
+	struct take_attr take = { attr, false };
+	smap_update(map, path, SMAP_NO_TICKET, 0, take_attr, &take);
+
+	DBG("%s: %s\n", path, take.found ? "hit" : "miss");
+	return take.found;
+}
+
+static void drop_attr(void *value, bool created, void *arg) {
+	(void)created;
+	(void)arg;
+	((lcache_entry_t *)value)->has_attr = false;
+}
+
+/**
+ * The attributes of path changed, but not its branch.
+ */
+void lcache_drop_attr(const char *path) {
+	if (!enabled || !uopt.readdirplus) return;
+
+	// a running readdir() might have the old attributes
+	smap_update(map, path, SMAP_NO_TICKET, SMAP_INVALIDATE, drop_attr, NULL);
+}
+
+/**
+ * path was modified (created, removed, copied up, hidden), forget about it.
+ */
+void lcache_invalidate(const char *path) {
+	inode_invalidate(path);
+	xcache_invalidate(path);
+	dcache_invalidate(path);
+
+	if (!enabled) return;
+
+	DBG("%s\n", path);
+
+	smap_remove(map, path, NULL);
+}
+
+/**
+ * An entire sub-tree was modified (e.g. a directory was renamed), we do not
+ * know the affected entries, so forget about everything.
+ */
+void lcache_invalidate_all(void) {
+	dcache_invalidate_all();
+	lcache_invalidate_tree(NULL);
+}
+
+/**
+ * The sub-tree below path was modified (a whiteout directory was created or
+ * removed). Like lcache_invalidate_all(), but the directory cache only
+ * forgets about path and below (see dcache.c). NULL means everything.
+ */
+void lcache_invalidate_tree(const char *path) {
+	inode_invalidate_all();
+	xcache_invalidate_all();
+	if (path) dcache_invalidate_tree(path);
+
+	if (!enabled) return;
+
+	DBG("%s\n", path ? path : "(all)");
+
+	smap_clear(map);
+}
@@ -0,0 +1,28 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef LCACHE_H
+#define LCACHE_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#define LCACHE_SHARDS 16	// number of independently locked cache parts
+#define LCACHE_DEFAULT_TTL 1	// seconds a lookup result stays valid
+#define LCACHE_READDIRPLUS_SIZE 65536 // cache size if only enabled by readdirplus
+
+void lcache_init(void);
+bool lcache_lookup(const char *path, int *branch, unsigned long *ticket);
+void lcache_insert(const char *path, int branch, unsigned long ticket);
+unsigned long lcache_ticket(const char *path);
+void lcache_insert_attr(const char *path, int branch, const struct stat *attr, unsigned long ticket);
+bool lcache_take_attr(const char *path, struct stat *attr);
+void lcache_drop_attr(const char *path);
+void lcache_invalidate(const char *path);
+void lcache_invalidate_all(void);
+void lcache_invalidate_tree(const char *path);
+
+#endif
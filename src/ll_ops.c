@@ -0,0 +1,955 @@
+/*
+* Description: unionfs on the FUSE low-level API (-o lowlevel)
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	With the high-level API libfuse builds the full path of every request
+*	and we have to find it again on all branches. Here requests come with
+*	inode numbers, see inode.c, which remember the branch their path was
+*	found on. lookup() resolves one path component, read-only requests
+*	(getattr, readlink, read-only open) then go directly to that branch.
+*	Requests modifying the union (copy-up, whiteouts, ...) are handed over
+*	to the path based unionfs_oper functions, so both engines share the
+*	same semantics. Those functions invalidate the lcache entries they
+*	touch, which also invalidates the branch cached in the inode and, with
+*	-o cache_timeout, the kernel caches (see kcache.c). With that option
+*	lookup() of a missing name also gives the kernel a negative entry, so
+*	it does not ask again for every missing header of a build.
+*	Reads and writes of plain handles hand the branch file to libfuse,
+*	which can splice() the data (see fhandle.c).
+*/
+
+#if defined __linux__
+	// For pread()
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "btable.h"
+#include "debug.h"
+#include "inode.h"
+#include "findbranch.h"
+#include "lcache.h"
+#include "branchio.h"
+#include "fhandle.h"
+#include "stats.h"
+#include "trace.h"
+#include "kcache.h"
+#include "rcache.h"
+#include "imap.h"
+#include "ll_ops.h"
+
+#define LL_TIMEOUT 1.0 // attribute and entry timeout, as the high-level default
+
+// -o cache_timeout, the kernel is told about changes then
+#define TIMEOUT (uopt.cache_timeout ? (double)uopt.cache_timeout : LL_TIMEOUT)
+
+// the request the current thread is working on, see ll_request_owner()
+static __thread fuse_req_t cur_req;
+
+/**
+ * Owner of the request this thread is working on, for set_owner().
+ */
+void ll_request_owner(uid_t *uid, gid_t *gid) {
+	const struct fuse_ctx *ctx = fuse_req_ctx(cur_req);
+
+	*uid = ctx->uid;
+	*gid = ctx->gid;
+}
+
+/**
+ * lstat() ino on its cached branch. If the cached branch does not have it
+ * anymore (modified directly on the branches), resolve it once more.
+ */
+static int ino_stat(fuse_ino_t ino, const char *path, struct stat *stbuf) {
+	int i = inode_branch(ino, path);
+	if (i == -1) RETURN(-errno);
+
+	// prefetched by readdir(), see -o readdirplus
+	if (lcache_take_attr(path, stbuf)) goto out;
+
+	int res = b_lstat(i, path, stbuf);
+	if (res == -1 && errno == ENOENT) {
+		lcache_invalidate(path); // also invalidates ino
+		i = inode_branch(ino, path);
+		if (i == -1) RETURN(-errno);
+		res = b_lstat(i, path, stbuf);
+	}
+	if (res == -1) RETURN(-errno);
+
+out:
+	// -o inode_map: the numbers of the map, the kernel gets them with the attributes
+	if (uopt.inode_map)
+		stbuf->st_ino = imap_ino(stbuf->st_dev, stbuf->st_ino);
+	else
+		stbuf->st_ino = ino;
+
+	// the same workaround for broken find implementations as unionfs_getattr()
+	if (S_ISDIR(stbuf->st_mode)) stbuf->st_nlink = 1;
+
+	RETURN(0);
+}
+
+/**
+ * Look up name in parent and fill e, the kernel gets a reference on success.
+ */
+static int get_entry(fuse_ino_t parent, const char *name, const char *path, struct fuse_entry_param *e) {
+	memset(e, 0, sizeof(*e));
+
+	// no inode for missing names, forgetting it again would lock the table
+	if (find_rorw_branch(path) == -1) RETURN(-errno);
+
+	fuse_ino_t ino = inode_lookup(parent, name);
+	if (!ino) RETURN(-ENOMEM);
+
+	int res = ino_stat(ino, path, &e->attr);
+	if (res) {
+		inode_forget(ino, 1);
+		RETURN(res);
+	}
+
+	e->ino = ino;
+	e->attr_timeout = TIMEOUT;
+	e->entry_timeout = TIMEOUT;
+
+	RETURN(0);
+}
+
+/**
+ * Reply to a request which created name in parent.
+ */
+static int reply_new_entry(fuse_req_t req, fuse_ino_t parent, const char *name, const char *path) {
+	struct fuse_entry_param e;
+
+	int res = get_entry(parent, name, path, &e);
+	if (res) {
+		fuse_reply_err(req, -res);
+		return res;
+	}
+
+	fuse_reply_entry(req, &e);
+	return 0;
+}
+
+static void reply_res(fuse_req_t req, int res) {
+	fuse_reply_err(req, -res);
+}
+
+// userdata is the channel, for the notifications
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+	unionfs_oper.init(conn);
+	kcache_start(userdata);
+}
+
+static void ll_destroy(void *userdata) {
+	kcache_stop();
+	unionfs_oper.destroy(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	uint64_t start = stats_start();
+	cur_req = req;
+	DBG("%s\n", name);
+
+	char path[PATHLEN_MAX];
+	struct fuse_entry_param e;
+	int res = inode_child_path(parent, name, path);
+	if (!res) res = get_entry(parent, name, path, &e);
+
+	if (!res) {
+		fuse_reply_entry(req, &e);
+	} else if (res == -ENOENT && parent != FUSE_ROOT_ID && kcache_active()) {
+		// a negative entry, kcache.c drops it once name appears
+		e.ino = 0;
+		e.entry_timeout = TIMEOUT;
+		fuse_reply_entry(req, &e);
+	} else {
+		reply_res(req, res);
+	}
+
+	stats_op(STATS_OP_LOOKUP, res, start);
+	TRACE(STATS_OP_LOOKUP, res ? NULL : path, -1, res, start);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	inode_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= 29
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+	size_t i;
+	for (i = 0; i < count; i++) inode_forget(forgets[i].ino, forgets[i].nlookup);
+
+	fuse_reply_none(req);
+}
+#endif
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)fi;
+	uint64_t start = stats_start();
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	struct stat stbuf;
+
+	int res = inode_path(ino, path);
+	if (!res) res = ino_stat(ino, path, &stbuf);
+	stats_op(STATS_OP_GETATTR, res, start);
+	TRACE(STATS_OP_GETATTR, res ? NULL : path, -1, res, start);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	fuse_reply_attr(req, &stbuf, TIMEOUT);
+}
+
+#ifdef __APPLE__
+	#define ST_ATIM st_atimespec
+	#define ST_MTIM st_mtimespec
+#else
+	#define ST_ATIM st_atim
+	#define ST_MTIM st_mtim
+#endif
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+
+	if (!res && (to_set & FUSE_SET_ATTR_MODE))
+		res = unionfs_oper.chmod(path, attr->st_mode);
+
+	if (!res && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+		res = unionfs_oper.chown(path, uid, gid);
+	}
+
+	if (!res && (to_set & FUSE_SET_ATTR_SIZE)) {
+		if (fi)
+			res = unionfs_oper.ftruncate(path, attr->st_size, fi);
+		else
+			res = unionfs_oper.truncate(path, attr->st_size);
+	}
+
+	if (!res && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec ts[2];
+
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1].tv_nsec = UTIME_OMIT;
+		if (to_set & FUSE_SET_ATTR_ATIME) ts[0] = attr->ST_ATIM;
+		if (to_set & FUSE_SET_ATTR_MTIME) ts[1] = attr->ST_MTIM;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_nsec = UTIME_NOW;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_nsec = UTIME_NOW;
+#endif
+		res = unionfs_oper.utimens(path, ts);
+	}
+
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	ll_getattr(req, ino, NULL);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+	uint64_t start = stats_start();
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (res) {
+		stats_op(STATS_OP_READLINK, res, start);
+		TRACE(STATS_OP_READLINK, NULL, -1, res, start);
+		reply_res(req, res);
+		return;
+	}
+
+	int i = inode_branch(ino, path);
+	if (i == -1) {
+		res = -errno;
+		stats_op(STATS_OP_READLINK, res, start);
+		TRACE(STATS_OP_READLINK, path, i, res, start);
+		reply_res(req, res);
+		return;
+	}
+
+	char buf[PATHLEN_MAX];
+	res = b_readlink(i, path, buf, sizeof(buf) - 1);
+	if (res == -1) {
+		res = -errno;
+		stats_op(STATS_OP_READLINK, res, start);
+		TRACE(STATS_OP_READLINK, path, i, res, start);
+		reply_res(req, res);
+		return;
+	}
+	buf[res] = '\0';
+
+	stats_op(STATS_OP_READLINK, 0, start);
+	TRACE(STATS_OP_READLINK, path, i, 0, start);
+	fuse_reply_readlink(req, buf);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+	cur_req = req;
+	DBG("%s\n", name);
+
+	char path[PATHLEN_MAX];
+	int res = inode_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.mknod(path, mode, rdev);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	reply_new_entry(req, parent, name, path);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	cur_req = req;
+	DBG("%s\n", name);
+
+	char path[PATHLEN_MAX];
+	int res = inode_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.mkdir(path, mode);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	reply_new_entry(req, parent, name, path);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	cur_req = req;
+	DBG("%s\n", name);
+
+	char path[PATHLEN_MAX];
+	int res = inode_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.unlink(path);
+	if (!res) inode_unlink(parent, name);
+
+	reply_res(req, res);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	cur_req = req;
+	DBG("%s\n", name);
+
+	char path[PATHLEN_MAX];
+	int res = inode_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.rmdir(path);
+	if (!res) inode_unlink(parent, name);
+
+	reply_res(req, res);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+	cur_req = req;
+	DBG("%s\n", name);
+
+	char path[PATHLEN_MAX];
+	int res = inode_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.symlink(link, path);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	reply_new_entry(req, parent, name, path);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+	cur_req = req;
+	DBG("%s -> %s\n", name, newname);
+
+	char from[PATHLEN_MAX], to[PATHLEN_MAX];
+	int res = inode_child_path(parent, name, from);
+	if (!res) res = inode_child_path(newparent, newname, to);
+	if (!res) res = unionfs_oper.rename(from, to);
+	if (!res) inode_rename(parent, name, newparent, newname);
+
+	reply_res(req, res);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+	cur_req = req;
+	DBG("%s\n", newname);
+
+	char from[PATHLEN_MAX], to[PATHLEN_MAX];
+	int res = inode_path(ino, from);
+	if (!res) res = inode_child_path(newparent, newname, to);
+	if (!res) res = unionfs_oper.link(from, to);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	reply_new_entry(req, newparent, newname, to);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	DBG("%s\n", path);
+
+	if (fi->flags & (O_WRONLY | O_RDWR)) {
+		// might need a copy-up and removes whiteouts
+		res = unionfs_oper.open(path, fi);
+		if (res) {
+			reply_res(req, res);
+			return;
+		}
+	} else {
+		int i = inode_branch(ino, path);
+		if (i == -1) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+
+		int fd = rcache_open(i, path, fi->flags);
+		int fd_branch = -1;	// the cache branch has no workers
+		if (fd == -1) {
+			fd = b_open(i, path, fi->flags, 0);
+			fd_branch = i;
+		}
+		if (fd == -1) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+
+		// nothing can change the file below us, see kcache.c
+		if (uopt.cache_timeout && !BRANCH(i).rw) fi->keep_cache = 1;
+
+		res = fh_new(fi, fd, fd_branch);
+		if (!res) {
+			res = fh_chunks(fi, i, path);
+			if (res) fh_release(fi);
+		}
+		if (res) {
+			reply_res(req, res);
+			return;
+		}
+	}
+
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		// the open was interrupted
+		fh_release(fi);
+	}
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	cur_req = req;
+	DBG("%s\n", name);
+
+	char path[PATHLEN_MAX];
+	int res = inode_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.create(path, mode, fi);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	struct fuse_entry_param e;
+	res = get_entry(parent, name, path, &e);
+	if (res) {
+		fh_release(fi);
+		reply_res(req, res);
+		return;
+	}
+
+	if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+		// the create was interrupted
+		inode_forget(e.ino, 1);
+		fh_release(fi);
+	}
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	(void)ino;
+	uint64_t start = stats_start();
+	DBG("fd = %d\n", fh_fd(fi));
+
+	char *buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ssize_t res = fh_pread(fi, buf, size, off);
+	stats_op(STATS_OP_READ, res, start);
+	TRACE(STATS_OP_READ, NULL, -1, res, start);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, buf, res);
+
+	free(buf);
+}
+
+#ifdef FH_SPLICE
+/**
+ * read() passing the branch file to libfuse, which may splice() from it.
+ */
+static void ll_read_buf(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	if (fh_splice_fd(fi) == -1) {
+		ll_read(req, ino, size, off, fi);
+		return;
+	}
+
+	uint64_t start = stats_start();
+	DBG("fd = %d\n", fh_fd(fi));
+
+	struct fuse_bufvec *buf;
+	ssize_t res = fh_read_buf(fi, &buf, size, off);
+	stats_op(STATS_OP_READ, res, start);
+	TRACE(STATS_OP_READ, NULL, -1, res, start);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	fuse_reply_data(req, buf, FUSE_BUF_SPLICE_MOVE);
+	free(buf);
+}
+#endif
+
+/**
+ * Reply to a write of path (NULL if not needed) that returned res.
+ */
+static void reply_write(fuse_req_t req, const char *path, ssize_t res, uint64_t start) {
+	stats_op(STATS_OP_WRITE, res, start);
+	TRACE(STATS_OP_WRITE, path, -1, res, start);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	if (uopt.readdirplus && path) lcache_drop_attr(path);
+
+	fuse_reply_write(req, res);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	uint64_t start = stats_start();
+	char path[PATHLEN_MAX];
+	bool have_path = (uopt.lazy_cow || uopt.readdirplus) && !inode_path(ino, path);
+
+	DBG("fd = %d\n", fh_fd(fi));
+
+	ssize_t res = fh_pwrite(fi, have_path ? path : NULL, buf, size, off);
+	reply_write(req, have_path ? path : NULL, res, start);
+}
+
+#ifdef FH_SPLICE
+/**
+ * write() of data libfuse might have spliced from /dev/fuse.
+ */
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+	uint64_t start = stats_start();
+	char path[PATHLEN_MAX];
+	bool have_path = (uopt.lazy_cow || uopt.readdirplus) && !inode_path(ino, path);
+
+	DBG("fd = %d\n", fh_fd(fi));
+
+	ssize_t res = fh_write_buf(fi, have_path ? path : NULL, bufv, off);
+	reply_write(req, have_path ? path : NULL, res, start);
+}
+#endif
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)ino;
+	cur_req = req;
+
+	reply_res(req, unionfs_oper.flush(NULL, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)ino;
+	cur_req = req;
+
+	reply_res(req, unionfs_oper.release(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	(void)ino;
+	cur_req = req;
+
+	reply_res(req, unionfs_oper.fsync(NULL, datasync, fi));
+}
+
+// reply buffer of readdir()
+struct ll_dirbuf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+/**
+ * fuse_fill_dir_t for unionfs_readdir(), adds name to the reply buffer.
+ */
+static int ll_dir_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	struct ll_dirbuf *dirbuf = buf;
+
+	size_t left = dirbuf->size - dirbuf->len;
+	size_t len = fuse_add_direntry(dirbuf->req, dirbuf->buf + dirbuf->len, left, name, stbuf, off);
+	if (len > left) return 1; // full
+
+	dirbuf->len += len;
+	return 0;
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (!res) res = unionfs_oper.opendir(path, fi);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		// the opendir was interrupted
+		unionfs_oper.releasedir(path, fi);
+	}
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	struct ll_dirbuf dirbuf = { req, malloc(size), size, 0 };
+	if (!dirbuf.buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	res = unionfs_oper.readdir(path, &dirbuf, ll_dir_fill, off, fi);
+	if (res)
+		reply_res(req, res);
+	else
+		fuse_reply_buf(req, dirbuf.buf, dirbuf.len);
+
+	free(dirbuf.buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)ino;
+	cur_req = req;
+
+	reply_res(req, unionfs_oper.releasedir(NULL, fi));
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	(void)ino;
+	cur_req = req;
+
+	struct statvfs stbuf;
+	int res = unionfs_oper.statfs("/", &stbuf);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	fuse_reply_statfs(req, &stbuf);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (!res) res = unionfs_oper.access(path, mask);
+
+	reply_res(req, res);
+}
+
+#if FUSE_VERSION >= 28
+static void ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	// unionfs_ioctl() reads and writes the same buffer, as with libfuse
+	size_t size = in_bufsz > out_bufsz ? in_bufsz : out_bufsz;
+	char *data = NULL;
+	if (size) {
+		data = calloc(1, size);
+		if (!data) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		if (in_bufsz) memcpy(data, in_buf, in_bufsz);
+	}
+
+	res = unionfs_oper.ioctl(path, cmd, arg, fi, flags, data);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_ioctl(req, res, data, out_bufsz);
+
+	free(data);
+}
+#endif
+
+#if defined HAVE_XATTR && !defined __APPLE__
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	char *value = NULL;
+	if (size) {
+		value = malloc(size);
+		if (!value) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	res = unionfs_oper.getxattr(path, name, value, size);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else if (size)
+		fuse_reply_buf(req, value, res);
+	else
+		fuse_reply_xattr(req, res);
+
+	free(value);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (res) {
+		reply_res(req, res);
+		return;
+	}
+
+	char *list = NULL;
+	if (size) {
+		list = malloc(size);
+		if (!list) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	res = unionfs_oper.listxattr(path, list, size);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else if (size)
+		fuse_reply_buf(req, list, res);
+	else
+		fuse_reply_xattr(req, res);
+
+	free(list);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (!res) res = unionfs_oper.removexattr(path, name);
+
+	reply_res(req, res);
+}
+
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags) {
+	cur_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = inode_path(ino, path);
+	if (!res) res = unionfs_oper.setxattr(path, name, value, size, flags);
+
+	reply_res(req, res);
+}
+#endif
+
+/*
+ * The requests run on one branch table, see btable.c. forget() does not use
+ * the branches.
+ */
+#define BTABLE_WRAPPER(name, proto, args) \
+	static void bt_##name proto { \
+		btable_enter(); \
+		ll_##name args; \
+		btable_leave(); \
+	}
+
+BTABLE_WRAPPER(lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+BTABLE_WRAPPER(getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+BTABLE_WRAPPER(setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi), (req, ino, attr, to_set, fi))
+BTABLE_WRAPPER(readlink, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+BTABLE_WRAPPER(mknod, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev), (req, parent, name, mode, rdev))
+BTABLE_WRAPPER(mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode), (req, parent, name, mode))
+BTABLE_WRAPPER(unlink, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+BTABLE_WRAPPER(rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+BTABLE_WRAPPER(symlink, (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name), (req, link, parent, name))
+BTABLE_WRAPPER(rename, (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname), (req, parent, name, newparent, newname))
+BTABLE_WRAPPER(link, (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname), (req, ino, newparent, newname))
+BTABLE_WRAPPER(open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+BTABLE_WRAPPER(create, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi), (req, parent, name, mode, fi))
+#ifdef FH_SPLICE
+BTABLE_WRAPPER(read_buf, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi), (req, ino, size, off, fi))
+BTABLE_WRAPPER(write_buf, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi), (req, ino, bufv, off, fi))
+#else
+BTABLE_WRAPPER(read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi), (req, ino, size, off, fi))
+#endif
+BTABLE_WRAPPER(write, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi), (req, ino, buf, size, off, fi))
+BTABLE_WRAPPER(flush, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+BTABLE_WRAPPER(release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+BTABLE_WRAPPER(fsync, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi), (req, ino, datasync, fi))
+BTABLE_WRAPPER(opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+BTABLE_WRAPPER(readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi), (req, ino, size, off, fi))
+BTABLE_WRAPPER(releasedir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+BTABLE_WRAPPER(statfs, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+BTABLE_WRAPPER(access, (fuse_req_t req, fuse_ino_t ino, int mask), (req, ino, mask))
+#if FUSE_VERSION >= 28
+BTABLE_WRAPPER(ioctl, (fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz), (req, ino, cmd, arg, fi, flags, in_buf, in_bufsz, out_bufsz))
+#endif
+#if defined HAVE_XATTR && !defined __APPLE__
+BTABLE_WRAPPER(getxattr, (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size), (req, ino, name, size))
+BTABLE_WRAPPER(listxattr, (fuse_req_t req, fuse_ino_t ino, size_t size), (req, ino, size))
+BTABLE_WRAPPER(removexattr, (fuse_req_t req, fuse_ino_t ino, const char *name), (req, ino, name))
+BTABLE_WRAPPER(setxattr, (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags), (req, ino, name, value, size, flags))
+#endif
+
+struct fuse_lowlevel_ops unionfs_ll_oper = {
+	.init = ll_init,
+	.destroy = ll_destroy,
+	.lookup = bt_lookup,
+	.forget = ll_forget,
+#if FUSE_VERSION >= 29
+	.forget_multi = ll_forget_multi,
+#endif
+	.getattr = bt_getattr,
+	.setattr = bt_setattr,
+	.readlink = bt_readlink,
+	.mknod = bt_mknod,
+	.mkdir = bt_mkdir,
+	.unlink = bt_unlink,
+	.rmdir = bt_rmdir,
+	.symlink = bt_symlink,
+	.rename = bt_rename,
+	.link = bt_link,
+	.open = bt_open,
+#ifdef FH_SPLICE
+	.read = bt_read_buf,
+	.write_buf = bt_write_buf,
+#else
+	.read = bt_read,
+#endif
+	.write = bt_write,
+	.flush = bt_flush,
+	.release = bt_release,
+	.fsync = bt_fsync,
+	.opendir = bt_opendir,
+	.readdir = bt_readdir,
+	.releasedir = bt_releasedir,
+	.statfs = bt_statfs,
+	.access = bt_access,
+	.create = bt_create,
+#if FUSE_VERSION >= 28
+	.ioctl = bt_ioctl,
+#endif
+#if defined HAVE_XATTR && !defined __APPLE__
+	.getxattr = bt_getxattr,
+	.listxattr = bt_listxattr,
+	.removexattr = bt_removexattr,
+	.setxattr = bt_setxattr,
+#endif
+};
+
+/**
+ * fuse_main() for the low-level API
+ */
+int unionfs_ll_main(struct fuse_args *args) {
+	char *mountpoint = NULL;
+	int multithreaded, foreground;
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	int res = -1;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) RETURN(1);
+
+	ch = fuse_mount(mountpoint, args);
+	if (!ch) goto out_free;
+
+	se = fuse_lowlevel_new(args, &unionfs_ll_oper, sizeof(unionfs_ll_oper), ch);
+	if (!se) goto out_unmount;
+
+	if (fuse_set_signal_handlers(se) == -1) goto out_destroy;
+
+	fuse_session_add_chan(se, ch);
+
+	if (fuse_daemonize(foreground) == 0) {
+		if (multithreaded)
+			res = fuse_session_loop_mt(se);
+		else
+			res = fuse_session_loop(se);
+	}
+
+	fuse_remove_signal_handlers(se);
+	fuse_session_remove_chan(ch);
+
+out_destroy:
+	fuse_session_destroy(se);
+out_unmount:
+	fuse_unmount(mountpoint, ch);
+out_free:
+	free(mountpoint);
+
+	RETURN(res == -1 ? 1 : 0);
+}
@@ -0,0 +1,17 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef LL_OPS_H
+#define LL_OPS_H
+
+#include <fuse_lowlevel.h>
+
+extern struct fuse_lowlevel_ops unionfs_ll_oper;
+
+int unionfs_ll_main(struct fuse_args *args);
+void ll_request_owner(uid_t *uid, gid_t *gid);
+
+#endif
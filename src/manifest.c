@@ -0,0 +1,558 @@
+/*
+* Description: prebuilt manifest of a sealed read-only branch
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Read-only branches which never change (image layers, often on NFS)
+*	can be indexed once with unionfs-index, which writes all paths with
+*	their stat data and symlink targets into MANIFEST_FILE of the branch.
+*	A branch given as "path=RO+IDX" maps the manifest on mount and lstat(),
+*	readlink() and directory reads of that branch are answered from memory
+*	(see branchio.c), only file data is read from the branch itself.
+*	The entries are sorted by directory and then by name, a lookup is a
+*	binary search and the entries of a directory are consecutive.
+*	Paths below a symlink are not in the manifest, they are looked up on
+*	the branch as before. The manifest must be rebuilt whenever the branch
+*	changes, unionfs does not notice a stale one.
+*/
+
+#if defined __linux__
+	// For *at() functions
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+#include "bloom.h"
+#include "debug.h"
+
+struct manifest {
+	void *map;
+	size_t size;
+	const struct manifest_entry *entries;
+	uint64_t count;
+	const char *strings;
+};
+
+// an entry while scanning the branch
+struct build_entry {
+	char *path;
+	uint32_t dir_len;
+	struct stat st;
+	char *target;		// NULL if not a symlink
+};
+
+struct build {
+	struct build_entry *entries;
+	size_t count;
+	size_t size;
+	size_t strings_size;
+};
+
+/**
+ * Our own files are not part of the manifest, they are written after it.
+ */
+static bool is_index_file(const char *path, size_t len) {
+	return (len >= strlen(MANIFEST_FILE) && strncmp(path, MANIFEST_FILE, strlen(MANIFEST_FILE)) == 0)
+	    || (len >= strlen(BLOOM_FILE) && strncmp(path, BLOOM_FILE, strlen(BLOOM_FILE)) == 0);
+}
+
+static int cmp_part(const char *a, size_t a_len, const char *b, size_t b_len) {
+	int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+	if (res) return res;
+	return a_len < b_len ? -1 : a_len > b_len;
+}
+
+// the length of the directory part of path
+static size_t dir_length(const char *path, size_t len) {
+	while (len && path[len - 1] != '/') len--;
+	return len ? len - 1 : 0;
+}
+
+static size_t name_offset(size_t dir_len) {
+	return dir_len ? dir_len + 1 : 0;
+}
+
+/**
+ * The order of the manifest: directory first, then name.
+ */
+static int compare(const char *a, size_t a_len, size_t a_dir, const char *b, size_t b_len, size_t b_dir) {
+	int res = cmp_part(a, a_dir, b, b_dir);
+	if (res) return res;
+
+	// (dir, "") has no name at all
+	size_t a_name = name_offset(a_dir), b_name = name_offset(b_dir);
+	if (a_name > a_len) a_name = a_len;
+	if (b_name > b_len) b_name = b_len;
+	return cmp_part(a + a_name, a_len - a_name, b + b_name, b_len - b_name);
+}
+
+static int compare_build(const void *a, const void *b) {
+	const struct build_entry *x = a, *y = b;
+	return compare(x->path, strlen(x->path), x->dir_len, y->path, strlen(y->path), y->dir_len);
+}
+
+static int add_entry(struct build *build, const char *path, size_t len, const struct stat *st, char *target) {
+	if (build->count == build->size) {
+		size_t size = build->size ? build->size * 2 : 1024;
+		struct build_entry *entries = realloc(build->entries, size * sizeof(struct build_entry));
+		if (!entries) return -1;
+
+		build->entries = entries;
+		build->size = size;
+	}
+
+	struct build_entry *entry = &build->entries[build->count];
+	entry->path = strndup(path, len);
+	if (!entry->path) return -1;
+
+	entry->dir_len = dir_length(path, len);
+	entry->st = *st;
+	entry->target = target;
+
+	build->count++;
+	build->strings_size += len + 1 + (target ? strlen(target) + 1 : 0);
+	return 0;
+}
+
+/**
+ * Add all entries below the directory fd, which is path[0..len).
+ */
+static int scan_dir(int fd, char *path, size_t len, struct build *build) {
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		int _errno = errno;
+		close(fd);
+		errno = _errno;
+		return -1;
+	}
+
+	int res = 0;
+	struct dirent *de;
+	while (1) {
+		errno = 0;
+		de = readdir(dp);
+		if (de == NULL) {
+			if (errno) res = -1;
+			break;
+		}
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		size_t name_len = strlen(de->d_name);
+		size_t sub_len = len ? len + 1 + name_len : name_len;
+		if (sub_len >= PATHLEN_MAX) continue; // too long to be looked up anyway
+
+		if (len) path[len] = '/';
+		memcpy(path + name_offset(len), de->d_name, name_len + 1);
+
+		if (is_index_file(path, sub_len)) continue;
+
+		struct stat st;
+		if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			res = -1;
+			break;
+		}
+
+		char *target = NULL;
+		if (S_ISLNK(st.st_mode)) {
+			char buf[PATHLEN_MAX];
+			ssize_t n = readlinkat(dirfd(dp), de->d_name, buf, sizeof(buf) - 1);
+			if (n == -1 || !(target = strndup(buf, n))) {
+				res = -1;
+				break;
+			}
+		}
+
+		if (add_entry(build, path, sub_len, &st, target)) {
+			free(target);
+			res = -1;
+			break;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			int sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (sub == -1 || scan_dir(sub, path, sub_len, build)) {
+				res = -1;
+				break;
+			}
+		}
+	}
+
+	int _errno = errno;
+	closedir(dp);
+	errno = _errno;
+
+	path[len] = '\0';
+	return res;
+}
+
+static void fill_entry(struct manifest_entry *entry, const struct build_entry *b) {
+	memset(entry, 0, sizeof(*entry));
+	entry->path_len = strlen(b->path);
+	entry->dir_len = b->dir_len;
+	entry->mode = b->st.st_mode;
+	entry->uid = b->st.st_uid;
+	entry->gid = b->st.st_gid;
+	entry->nlink = b->st.st_nlink;
+	entry->blksize = b->st.st_blksize;
+	entry->ino = b->st.st_ino;
+	entry->dev = b->st.st_dev;
+	entry->rdev = b->st.st_rdev;
+	entry->size = b->st.st_size;
+	entry->blocks = b->st.st_blocks;
+#ifdef __APPLE__
+	entry->atime = b->st.st_atimespec.tv_sec;
+	entry->atime_nsec = b->st.st_atimespec.tv_nsec;
+	entry->mtime = b->st.st_mtimespec.tv_sec;
+	entry->mtime_nsec = b->st.st_mtimespec.tv_nsec;
+	entry->ctime = b->st.st_ctimespec.tv_sec;
+	entry->ctime_nsec = b->st.st_ctimespec.tv_nsec;
+#else
+	entry->atime = b->st.st_atim.tv_sec;
+	entry->atime_nsec = b->st.st_atim.tv_nsec;
+	entry->mtime = b->st.st_mtim.tv_sec;
+	entry->mtime_nsec = b->st.st_mtim.tv_nsec;
+	entry->ctime = b->st.st_ctim.tv_sec;
+	entry->ctime_nsec = b->st.st_ctim.tv_nsec;
+#endif
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_manifest(int fd, const struct build *build) {
+	struct manifest_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+	header.entry_size = sizeof(struct manifest_entry);
+	header.count = build->count;
+	header.strings_size = build->strings_size;
+	if (write_all(fd, &header, sizeof(header))) return -1;
+
+	uint64_t offset = 0;
+	size_t i;
+	for (i = 0; i < build->count; i++) {
+		const struct build_entry *b = &build->entries[i];
+		struct manifest_entry entry;
+		fill_entry(&entry, b);
+
+		entry.path = offset;
+		offset += entry.path_len + 1;
+		if (b->target) {
+			entry.target = offset;
+			entry.target_len = strlen(b->target);
+			offset += entry.target_len + 1;
+		}
+
+		if (write_all(fd, &entry, sizeof(entry))) return -1;
+	}
+
+	for (i = 0; i < build->count; i++) {
+		const struct build_entry *b = &build->entries[i];
+		if (write_all(fd, b->path, strlen(b->path) + 1)) return -1;
+		if (b->target && write_all(fd, b->target, strlen(b->target) + 1)) return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Scan the branch directory dirfd and write its manifest. Returns 0 or
+ * -errno, count is set to the number of entries.
+ */
+int manifest_write(int dirfd, uint64_t *count) {
+	struct build build;
+	memset(&build, 0, sizeof(build));
+
+	// the manifest shall know the directory it is in
+	if (mkdirat(dirfd, METANAME, 0755) == -1 && errno != EEXIST) return -errno;
+
+	int res = 0;
+	const char *tmp = MANIFEST_FILE ".tmp";
+	int fd = -1;
+
+	struct stat st;
+	if (fstat(dirfd, &st) == -1 || add_entry(&build, "", 0, &st, NULL)) goto err;
+
+	int root = openat(dirfd, ".", O_RDONLY | O_DIRECTORY);
+	char path[PATHLEN_MAX] = "";
+	if (root == -1 || scan_dir(root, path, 0, &build)) goto err;
+
+	qsort(build.entries, build.count, sizeof(struct build_entry), compare_build);
+
+	fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || write_manifest(fd, &build) || fsync(fd) == -1) goto err;
+	if (close(fd) == -1) {
+		fd = -1;
+		goto err;
+	}
+	fd = -1;
+
+	// replace the old manifest only with a complete one
+	if (renameat(dirfd, tmp, dirfd, MANIFEST_FILE) == -1) goto err;
+
+	*count = build.count;
+	goto out;
+
+err:
+	res = errno ? -errno : -EIO;
+	if (fd != -1) close(fd);
+	unlinkat(dirfd, tmp, 0);
+out:
+	{
+		size_t i;
+		for (i = 0; i < build.count; i++) {
+			free(build.entries[i].path);
+			free(build.entries[i].target);
+		}
+		free(build.entries);
+	}
+	return res;
+}
+
+/**
+ * Map the manifest of the branch directory dirfd. Returns NULL and sets
+ * errno if there is none or it is broken.
+ */
+struct manifest *manifest_open(int dirfd) {
+	int fd = openat(dirfd, MANIFEST_FILE, O_RDONLY);
+	if (fd == -1) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		int _errno = errno;
+		close(fd);
+		errno = _errno;
+		return NULL;
+	}
+
+	struct manifest *m = calloc(1, sizeof(struct manifest));
+	if (!m) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	m->size = st.st_size;
+	m->map = m->size ? mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd); // the mapping keeps the file
+	if (m->map == MAP_FAILED) {
+		if (!m->size) errno = EINVAL;
+		free(m);
+		return NULL;
+	}
+
+	const struct manifest_header *header = m->map;
+	if (m->size < sizeof(*header)
+	|| memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0
+	|| header->entry_size != sizeof(struct manifest_entry)
+	|| header->count == 0
+	|| header->count > (m->size - sizeof(*header)) / sizeof(struct manifest_entry)
+	|| header->strings_size != m->size - sizeof(*header) - header->count * sizeof(struct manifest_entry))
+		goto invalid;
+
+	m->count = header->count;
+	m->entries = (const struct manifest_entry *)(header + 1);
+	m->strings = (const char *)(m->entries + m->count);
+
+	// a broken file must not make us read beyond the mapping later
+	uint64_t i;
+	for (i = 0; i < m->count; i++) {
+		const struct manifest_entry *e = &m->entries[i];
+		if (e->path >= header->strings_size || e->path + e->path_len >= header->strings_size
+		|| e->dir_len > e->path_len
+		|| (S_ISLNK(e->mode) && (e->target >= header->strings_size
+		    || e->target + e->target_len >= header->strings_size)))
+			goto invalid;
+	}
+
+	return m;
+
+invalid:
+	munmap(m->map, m->size);
+	free(m);
+	errno = EINVAL;
+	return NULL;
+}
+
+void manifest_close(struct manifest *m) {
+	if (!m) return;
+	munmap(m->map, m->size);
+	free(m);
+}
+
+const char *manifest_string(const struct manifest *m, uint64_t offset) {
+	return m->strings + offset;
+}
+
+const struct manifest_entry *manifest_entry(const struct manifest *m, size_t i) {
+	return &m->entries[i];
+}
+
+/**
+ * The first entry not before (dir, name).
+ */
+static size_t lower_bound(const struct manifest *m, const char *path, size_t len, size_t dir_len) {
+	size_t low = 0, high = m->count;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		const struct manifest_entry *e = &m->entries[mid];
+
+		if (compare(m->strings + e->path, e->path_len, e->dir_len, path, len, dir_len) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static const struct manifest_entry *find(const struct manifest *m, const char *path, size_t len) {
+	size_t i = lower_bound(m, path, len, dir_length(path, len));
+	if (i == m->count) return NULL;
+
+	const struct manifest_entry *e = &m->entries[i];
+	if (e->path_len != len || memcmp(m->strings + e->path, path, len) != 0) return NULL;
+
+	return e;
+}
+
+/**
+ * Look up path, relative to the branch. Returns NULL if it does not exist.
+ * If the manifest can not tell, e.g. path is below a symlink, unknown is
+ * set.
+ */
+const struct manifest_entry *manifest_lookup(const struct manifest *m, const char *path, bool *unknown) {
+	*unknown = false;
+
+	// the key: no leading, trailing or duplicate slashes
+	char key[PATHLEN_MAX];
+	size_t len = 0;
+	key[0] = '\0';
+
+	while (*path) {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+
+		const char *name = path;
+		while (*path && *path != '/') path++;
+		size_t name_len = path - name;
+
+		if ((name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.')))
+		|| len + 1 + name_len >= PATHLEN_MAX) {
+			*unknown = true;
+			return NULL;
+		}
+
+		if (len) key[len++] = '/';
+		memcpy(key + len, name, name_len);
+		len += name_len;
+	}
+
+	if (is_index_file(key, len)) {
+		*unknown = true;
+		return NULL;
+	}
+
+	const struct manifest_entry *e = find(m, key, len);
+	if (e) return e;
+
+	// not there, unless the kernel would follow a symlink on the way
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (key[i] != '/') continue;
+
+		const struct manifest_entry *parent = find(m, key, i);
+		if (!parent || S_ISDIR(parent->mode)) {
+			if (!parent) break;
+			continue;
+		}
+
+		if (S_ISLNK(parent->mode)) *unknown = true;
+		break;
+	}
+
+	return NULL;
+}
+
+void manifest_stat(const struct manifest_entry *e, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_mode = e->mode;
+	st->st_uid = e->uid;
+	st->st_gid = e->gid;
+	st->st_nlink = e->nlink;
+	st->st_blksize = e->blksize;
+	st->st_ino = e->ino;
+	st->st_dev = e->dev;
+	st->st_rdev = e->rdev;
+	st->st_size = e->size;
+	st->st_blocks = e->blocks;
+#ifdef __APPLE__
+	st->st_atimespec.tv_sec = e->atime;
+	st->st_atimespec.tv_nsec = e->atime_nsec;
+	st->st_mtimespec.tv_sec = e->mtime;
+	st->st_mtimespec.tv_nsec = e->mtime_nsec;
+	st->st_ctimespec.tv_sec = e->ctime;
+	st->st_ctimespec.tv_nsec = e->ctime_nsec;
+#else
+	st->st_atim.tv_sec = e->atime;
+	st->st_atim.tv_nsec = e->atime_nsec;
+	st->st_mtim.tv_sec = e->mtime;
+	st->st_mtim.tv_nsec = e->mtime_nsec;
+	st->st_ctim.tv_sec = e->ctime;
+	st->st_ctim.tv_nsec = e->ctime_nsec;
+#endif
+}
+
+/**
+ * The entries [first, end) of the directory dir. Returns false if dir is
+ * not a directory.
+ */
+bool manifest_children(const struct manifest *m, const struct manifest_entry *dir, size_t *first, size_t *end) {
+	if (!S_ISDIR(dir->mode)) return false;
+
+	const char *path = m->strings + dir->path;
+
+	// (path, "") sorts before all entries of path
+	size_t i = lower_bound(m, path, dir->path_len, dir->path_len);
+
+	// the branch itself is in its own directory
+	if (dir->path_len == 0 && i < m->count && m->entries[i].path_len == 0) i++;
+	*first = i;
+
+	while (i < m->count) {
+		const struct manifest_entry *e = &m->entries[i];
+		if (e->dir_len != dir->path_len || memcmp(m->strings + e->path, path, e->dir_len) != 0) break;
+		if (dir->path_len == 0 && memchr(m->strings + e->path, '/', e->path_len)) break;
+		i++;
+	}
+	*end = i;
+
+	return true;
+}
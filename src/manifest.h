@@ -0,0 +1,67 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+
+#define MANIFEST_MAGIC "UFSIDX01"
+#define MANIFEST_FILE METANAME "/.index"	// written by unionfs-index
+
+// the manifest file is a struct manifest_header, the entries and the strings
+struct manifest_header {
+	char magic[8];
+	uint32_t entry_size;	// sizeof(struct manifest_entry)
+	uint32_t reserved;
+	uint64_t count;		// entries
+	uint64_t strings_size;
+};
+
+// sorted by directory, then name, so the entries of a directory are consecutive
+struct manifest_entry {
+	uint64_t path;		// offset in the strings, relative to the branch, "" is the branch
+	uint32_t path_len;
+	uint32_t dir_len;	// the directory part of path, without the slash
+	uint64_t target;	// offset of the symlink target
+	uint32_t target_len;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+	uint32_t blksize;
+	uint64_t ino;
+	uint64_t dev;
+	uint64_t rdev;
+	uint64_t size;
+	uint64_t blocks;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t atime_nsec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t padding;
+};
+
+struct manifest;
+
+int manifest_write(int dirfd, uint64_t *count);
+struct manifest *manifest_open(int dirfd);
+void manifest_close(struct manifest *m);
+
+const struct manifest_entry *manifest_lookup(const struct manifest *m, const char *path, bool *unknown);
+void manifest_stat(const struct manifest_entry *entry, struct stat *st);
+const char *manifest_string(const struct manifest *m, uint64_t offset);
+bool manifest_children(const struct manifest *m, const struct manifest_entry *dir, size_t *first, size_t *end);
+const struct manifest_entry *manifest_entry(const struct manifest *m, size_t i);
+
+#endif
@@ -13,6 +13,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <pthread.h>
@@ -21,6 +23,20 @@
 #include "opts.h"
 #include "version.h"
 #include "string.h"
+#include "lcache.h"
+#include "xcache.h"
+#include "windex.h"
+#include "dcache.h"
+#include "inode.h"
+#include "chunk.h"
+#include "pool.h"
+#include "copyup.h"
+#include "scache.h"
+#include "manifest.h"
+#include "rcache.h"
+#include "bexec.h"
+#include "btable.h"
+#include "imap.h"
 
 
 /**
@@ -104,6 +120,13 @@ void uopt_init() {
 	memset(&uopt, 0, sizeof(uopt_t)); // initialize options with zeros first
 
 	pthread_rwlock_init(&uopt.dbgpath_lock, NULL);
+
+	uopt.lookup_cache_ttl = LCACHE_DEFAULT_TTL;
+	uopt.cow_threads = POOL_DEFAULT_THREADS;
+	uopt.statfs_cache_ttl = SCACHE_DEFAULT_TTL;
+	uopt.cache_size = (uint64_t)RCACHE_DEFAULT_SIZE * 1024 * 1024;
+	uopt.cache_opens = RCACHE_DEFAULT_OPENS;
+	uopt.branch_timeout = BEXEC_DEFAULT_TIMEOUT;
 }
 
 /**
@@ -168,7 +191,7 @@ char *add_trailing_slash(char *path) {
 
 /**
  * Add a given branch and its options to the array of available branches.
- * example branch string "branch1=RO" or "/path/path2=RW"
+ * example branch string "branch1=RO", "/path/path2=RW", "layer=RO+IDX" or "/ssd=CACHE"
  */
 void add_branch(char *branch) {
 	uopt.branches = realloc(uopt.branches, (uopt.nbranches+1) * sizeof(branch_entry_t));
@@ -187,10 +210,27 @@ void add_branch(char *branch) {
 	// make_absolute() and add_trailing_slash() will corrupt our input (parse string)
 	uopt.branches[uopt.nbranches].path = strdup(res);
 	uopt.branches[uopt.nbranches].rw = 0;
+	uopt.branches[uopt.nbranches].windex = NULL;
+	uopt.branches[uopt.nbranches].bloom = NULL;
+	uopt.branches[uopt.nbranches].idx = 0;
+	uopt.branches[uopt.nbranches].manifest = NULL;
+	uopt.branches[uopt.nbranches].exec = NULL;
+	uopt.branches[uopt.nbranches].imap = NULL;
 
 	res = strsep(ptr, "=");
 	if (res) {
-		if (strcasecmp(res, "rw") == 0) {
+		if (strcasecmp(res, "cache") == 0) {
+			// not part of the union, see rcache.c
+			if (uopt.cache_branch) {
+				fprintf(stderr, "Only one CACHE branch is supported, aborting!\n");
+				exit(1);
+			}
+			uopt.cache_branch = uopt.branches[uopt.nbranches].path;
+			return;
+		} else if (strcasecmp(res, "ro+idx") == 0) {
+			// sealed branch with a manifest from unionfs-index
+			uopt.branches[uopt.nbranches].idx = 1;
+		} else if (strcasecmp(res, "rw") == 0) {
 			uopt.branches[uopt.nbranches].rw = 1;
 		} else if (strcasecmp(res, "ro") == 0) {
 			// no action needed here
@@ -266,6 +306,31 @@ static char * get_opt_str(const char *arg, char *opt_name)
 	return str;
 }
 
+/**
+  * get_opt_uint - get the parameter as unsigned number
+  * @arg	- option argument, e.g. "lookup_cache=1000"
+  * @opt_name	- option name, used for error messages
+  */
+static unsigned int get_opt_uint(const char *arg, char *opt_name)
+{
+	char *str = index(arg, '=');
+	if (!str || *(++str) == '\0') {
+		fprintf(stderr, "-o %s parameter not properly specified, aborting!\n",
+		        opt_name);
+		exit(1); // still early phase, we can abort
+	}
+
+	char *end;
+	unsigned long value = strtoul(str, &end, 10);
+	if (*end != '\0' || value > UINT_MAX) {
+		fprintf(stderr, "%s: Converting %s to number failed, aborting!\n",
+		        opt_name, str);
+		exit(1);
+	}
+
+	return value;
+}
+
 static void print_help(const char *progname) {
 	printf(
 	"unionfs-fuse version "VERSION"\n"
@@ -274,6 +339,8 @@ static void print_help(const char *progname) {
 	"Usage: %s [options] branch[=RO/RW][:branch...] mountpoint\n"
 	"The first argument is a colon separated list of directories to merge\n"
 	"When neither RO nor RW is specified, selection defaults to RO.\n"
+	"RO+IDX branches are served from their manifest, see unionfs-index.\n"
+	"A CACHE branch keeps copies of often read files of the RO branches.\n"
 	"\n"
 	"general options:\n"
 	"    -d                     Enable debug output\n"
@@ -282,20 +349,68 @@ static void print_help(const char *progname) {
 	"    -V   --version         print version\n"
 	"\n"
 	"UnionFS options:\n"
+	"    -o bloom               skip lookups on ro-branches without the\n"
+	"                           path, using Bloom filters built on mount\n"
+	"    -o branch_threads=number\n"
+	"                           threads per branch doing its syscalls, so\n"
+	"                           a hanging branch does not block the others\n"
+	"    -o branch_timeout=milliseconds\n"
+	"                           time a call waits for a branch with\n"
+	"                           branch_threads (default 10000)\n"
+	"    -o cache_opens=number  opens of a ro-branch file until it is copied\n"
+	"                           to the CACHE branch (default 2)\n"
+	"    -o cache_size=megabytes\n"
+	"                           space the CACHE branch may use (default 1024)\n"
+	"    -o cache_timeout=seconds\n"
+	"                           time the kernel may cache entries and\n"
+	"                           attributes (requires lowlevel)\n"
 	"    -o chroot=path         chroot into this path. Use this if you \n"
         "                           want to have a union of \"/\" \n"
 	"    -o cow                 enable copy-on-write\n"
 	"                           mountpoint\n"
+	"    -o cow_threads=number  threads copying directories (default 4)\n"
 	"    -o debug_file          file to write debug information into\n"
+	"    -o dir_cache=number    cache up to number merged directories\n"
 	"    -o dirs=branch[=RO/RW][:branch...]\n"
 	"                           alternate way to specify directories to merge\n"
 	"    -o hide_meta_files     \".unionfs\" is a secret directory not\n"
 	"                           visible by readdir(), and so are\n" 
         "                           .fuse_hidden* files\n"
+	"    -o inode_map           inode numbers unique in the union and kept\n"
+	"                           across copy-up\n"
+	"    -o lazy_cow            copy files up on the first write instead of\n"
+	"                           on open() for writing (requires cow)\n"
+	"    -o lookup_cache=number cache up to number branch lookups\n"
+	"    -o lookup_cache_ttl=seconds\n"
+	"                           time a cached lookup is valid (default 1)\n"
+	"    -o lowlevel            use the FUSE low-level API, paths are\n"
+	"                           resolved once per inode\n"
 	"    -o max_files=number    Increase the maximum number of open files\n"
+	"    -o partial_cow=megabytes\n"
+	"                           copy files of at least this size up chunk\n"
+	"                           by chunk, as they are written (requires cow)\n"
+	"    -o readahead=kbytes    read files ahead on the branches while they\n"
+	"                           are read sequentially\n"
+	"    -o readdirplus         readdir() gets the attributes of all entries\n"
+	"                           for the following getattr() calls\n"
 	"    -o relaxed_permissions Disable permissions checks, but only if\n"
 	"                           running neither as UID=0 or GID=0\n"
+	"    -o statfs_cache_ttl=seconds\n"
+	"                           time a statfs() result is valid (default 1)\n"
 	"    -o statfs_omit_ro      do not count blocks of ro-branches\n"
+	"    -o trace_capture       trace the arguments of the operations too,\n"
+	"                           for unionfs-replay\n"
+	"    -o trace_file=file     write a binary trace of all operations into\n"
+	"                           file, see unionfstrace\n"
+	"    -o warmup              load the whiteout index after mount, in the\n"
+	"                           background\n"
+	"    -o warmup_dirs=dir[:dir...]\n"
+	"                           walk these union directories after mount to\n"
+	"                           fill the caches, implies warmup\n"
+	"    -o whiteout_index      keep whiteouts in memory (requires cow)\n"
+	"    -o whiteout_journal    log whiteouts to a journal per rw-branch,\n"
+	"                           implies whiteout_index (requires cow)\n"
+	"    -o xattr_cache=number  cache missing xattrs of up to number paths\n"
 	"\n",
 	progname);
 }
@@ -344,9 +459,97 @@ void unionfs_post_opts(void) {
 		}
 		uopt.branches[i].fd = fd;
 		uopt.branches[i].path_len = strlen(path);
+
+		if (uopt.branches[i].idx) {
+			uopt.branches[i].manifest = manifest_open(fd);
+			if (!uopt.branches[i].manifest) {
+				fprintf(stderr, "\nFailed to load %s%s: %s. Run unionfs-index on the branch. Aborting!\n\n",
+					path, MANIFEST_FILE, strerror(errno));
+				exit(1);
+			}
+		}
+	}
+
+	if (uopt.cache_branch) {
+		if (!uopt.chroot)
+			uopt.cache_branch = make_absolute(uopt.cache_branch);
+		uopt.cache_branch = add_trailing_slash(uopt.cache_branch);
+
+		char path[PATHLEN_MAX];
+		if (!uopt.chroot) {
+			BUILD_PATH(path, uopt.cache_branch);
+		} else {
+			BUILD_PATH(path, uopt.chroot, uopt.cache_branch);
+		}
+
+		uopt.cache_fd = open(path, O_RDONLY | O_DIRECTORY);
+		if (uopt.cache_fd == -1) {
+			fprintf(stderr, "\nFailed to open the cache branch %s: %s. Aborting!\n\n",
+				path, strerror(errno));
+			exit(1);
+		}
 	}
+
+	btable_init();
+
+	lcache_init();
+	xcache_init();
+	dcache_init();
+	windex_init();
+	imap_init();
+	inode_init();
+	chunk_init();
+	copyup_init();
+	if (scache_init()) {
+		fprintf(stderr, "Failed to find the devices of the branches, aborting!\n");
+		exit(1);
+	}
+	rcache_init();
 }
 
+// shared by unionfs and unionfs-bench
+const struct fuse_opt unionfs_opts[] = {
+	FUSE_OPT_KEY("bloom", KEY_BLOOM),
+	FUSE_OPT_KEY("branch_threads=%s", KEY_BRANCH_THREADS),
+	FUSE_OPT_KEY("branch_timeout=%s", KEY_BRANCH_TIMEOUT),
+	FUSE_OPT_KEY("cache_opens=%s", KEY_CACHE_OPENS),
+	FUSE_OPT_KEY("cache_size=%s", KEY_CACHE_SIZE),
+	FUSE_OPT_KEY("cache_timeout=%s", KEY_CACHE_TIMEOUT),
+	FUSE_OPT_KEY("chroot=%s,", KEY_CHROOT),
+	FUSE_OPT_KEY("cow", KEY_COW),
+	FUSE_OPT_KEY("cow_threads=%s", KEY_COW_THREADS),
+	FUSE_OPT_KEY("debug_file=%s", KEY_DEBUG_FILE),
+	FUSE_OPT_KEY("dir_cache=%s", KEY_DIR_CACHE),
+	FUSE_OPT_KEY("dirs=%s", KEY_DIRS),
+	FUSE_OPT_KEY("--help", KEY_HELP),
+	FUSE_OPT_KEY("-h", KEY_HELP),
+	FUSE_OPT_KEY("hide_meta_dir", KEY_HIDE_METADIR),
+	FUSE_OPT_KEY("hide_meta_files", KEY_HIDE_META_FILES),
+	FUSE_OPT_KEY("inode_map", KEY_INODE_MAP),
+	FUSE_OPT_KEY("lazy_cow", KEY_LAZY_COW),
+	FUSE_OPT_KEY("lookup_cache=%s", KEY_LOOKUP_CACHE),
+	FUSE_OPT_KEY("lookup_cache_ttl=%s", KEY_LOOKUP_CACHE_TTL),
+	FUSE_OPT_KEY("lowlevel", KEY_LOWLEVEL),
+	FUSE_OPT_KEY("max_files=%s", KEY_MAX_FILES),
+	FUSE_OPT_KEY("noinitgroups", KEY_NOINITGROUPS),
+	FUSE_OPT_KEY("partial_cow=%s", KEY_PARTIAL_COW),
+	FUSE_OPT_KEY("readahead=%s", KEY_READAHEAD),
+	FUSE_OPT_KEY("readdirplus", KEY_READDIRPLUS),
+	FUSE_OPT_KEY("relaxed_permissions", KEY_RELAXED_PERMISSIONS),
+	FUSE_OPT_KEY("statfs_cache_ttl=%s", KEY_STATFS_CACHE_TTL),
+	FUSE_OPT_KEY("statfs_omit_ro", KEY_STATFS_OMIT_RO),
+	FUSE_OPT_KEY("trace_capture", KEY_TRACE_CAPTURE),
+	FUSE_OPT_KEY("trace_file=%s", KEY_TRACE_FILE),
+	FUSE_OPT_KEY("--version", KEY_VERSION),
+	FUSE_OPT_KEY("-V", KEY_VERSION),
+	FUSE_OPT_KEY("warmup", KEY_WARMUP),
+	FUSE_OPT_KEY("warmup_dirs=%s", KEY_WARMUP_DIRS),
+	FUSE_OPT_KEY("whiteout_index", KEY_WHITEOUT_INDEX),
+	FUSE_OPT_KEY("whiteout_journal", KEY_WHITEOUT_JOURNAL),
+	FUSE_OPT_KEY("xattr_cache=%s", KEY_XATTR_CACHE),
+	FUSE_OPT_END
+};
+
 int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
 	(void)data;
 
@@ -364,16 +567,44 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 			if (res > 0) return 0;
 			uopt.retval = 1;
 			return 1;
+		case KEY_BLOOM:
+			uopt.bloom = true;
+			return 0;
+		case KEY_BRANCH_THREADS:
+			uopt.branch_threads = get_opt_uint(arg, "branch_threads");
+			return 0;
+		case KEY_BRANCH_TIMEOUT:
+			uopt.branch_timeout = get_opt_uint(arg, "branch_timeout");
+			if (!uopt.branch_timeout) {
+				fprintf(stderr, "-o branch_timeout must not be 0, aborting!\n");
+				exit(1);
+			}
+			return 0;
+		case KEY_CACHE_OPENS:
+			uopt.cache_opens = get_opt_uint(arg, "cache_opens");
+			return 0;
+		case KEY_CACHE_SIZE:
+			uopt.cache_size = (uint64_t)get_opt_uint(arg, "cache_size") * 1024 * 1024;
+			return 0;
+		case KEY_CACHE_TIMEOUT:
+			uopt.cache_timeout = get_opt_uint(arg, "cache_timeout");
+			return 0;
 		case KEY_CHROOT:
 			uopt.chroot = get_opt_str(arg, "chroot");
 			return 0;
 		case KEY_COW:
 			uopt.cow_enabled = true;
 			return 0;
+		case KEY_COW_THREADS:
+			uopt.cow_threads = get_opt_uint(arg, "cow_threads");
+			return 0;
 		case KEY_DEBUG_FILE:
 			uopt.dbgpath = get_opt_str(arg, "debug_file");
 			uopt.debug = true;
 			return 0;
+		case KEY_DIR_CACHE:
+			uopt.dir_cache_size = get_opt_uint(arg, "dir_cache");
+			return 0;
 		case KEY_HELP:
 			print_help(outargs->argv[0]);
 			fuse_opt_add_arg(outargs, "-ho");
@@ -383,15 +614,53 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 		case KEY_HIDE_METADIR:
 			uopt.hide_meta_files = true;
 			return 0;
+		case KEY_INODE_MAP:
+			uopt.inode_map = true;
+			return 0;
+		case KEY_LAZY_COW:
+			uopt.lazy_cow = true;
+			return 0;
+		case KEY_LOOKUP_CACHE:
+			uopt.lookup_cache_size = get_opt_uint(arg, "lookup_cache");
+			return 0;
+		case KEY_LOOKUP_CACHE_TTL:
+			uopt.lookup_cache_ttl = get_opt_uint(arg, "lookup_cache_ttl");
+			return 0;
+		case KEY_LOWLEVEL:
+			uopt.lowlevel = true;
+			return 0;
 		case KEY_MAX_FILES:
 			set_max_open_files(arg);
 			return 0;
 		case KEY_NOINITGROUPS:
 			// option only for compatibility with older versions
 			return 0;
+		case KEY_PARTIAL_COW:
+			uopt.partial_cow_size = (uint64_t)get_opt_uint(arg, "partial_cow") * 1024 * 1024;
+			return 0;
+		case KEY_READAHEAD:
+			uopt.readahead = get_opt_uint(arg, "readahead");
+			if (uopt.readahead > UINT_MAX / 1024) {
+				fprintf(stderr, "-o readahead is out of range, aborting!\n");
+				exit(1);
+			}
+			uopt.readahead *= 1024;
+			return 0;
+		case KEY_READDIRPLUS:
+			uopt.readdirplus = true;
+			return 0;
+		case KEY_STATFS_CACHE_TTL:
+			uopt.statfs_cache_ttl = get_opt_uint(arg, "statfs_cache_ttl");
+			return 0;
 		case KEY_STATFS_OMIT_RO:
 			uopt.statfs_omit_ro = true;
 			return 0;
+		case KEY_TRACE_CAPTURE:
+			uopt.trace_capture = true;
+			return 0;
+		case KEY_TRACE_FILE:
+			uopt.trace_file = get_opt_str(arg, "trace_file");
+			return 0;
 		case KEY_RELAXED_PERMISSIONS:
 			uopt.relaxed_permissions = true;
 			return 0;
@@ -402,6 +671,23 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 #endif
 			uopt.doexit = 1;
 			return 1;
+		case KEY_WARMUP:
+			uopt.warmup = true;
+			return 0;
+		case KEY_WARMUP_DIRS:
+			uopt.warmup = true;
+			uopt.warmup_dirs = get_opt_str(arg, "warmup_dirs");
+			return 0;
+		case KEY_WHITEOUT_INDEX:
+			uopt.whiteout_index = true;
+			return 0;
+		case KEY_WHITEOUT_JOURNAL:
+			uopt.whiteout_index = true;
+			uopt.whiteout_journal = true;
+			return 0;
+		case KEY_XATTR_CACHE:
+			uopt.xattr_cache_size = get_opt_uint(arg, "xattr_cache");
+			return 0;
 		default:
  			uopt.retval = 1;
 			return 1;
@@ -10,6 +10,7 @@
 
 #include <fuse.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "unionfs.h"
 
@@ -17,9 +18,10 @@
 #define ROOT_SEP ":"
 
 typedef struct {
-	int nbranches;
+	int nbranches;		// as parsed, the union uses the table of btable.c
 	branch_entry_t *branches;
 
+	bool bloom;		// Bloom filters of the ro-branches, see bloom.c
 	bool cow_enabled;
 	bool statfs_omit_ro;
 	int doexit;
@@ -30,26 +32,77 @@ typedef struct {
 	pthread_rwlock_t dbgpath_lock; // locks dbgpath
 	bool hide_meta_files;
 	bool relaxed_permissions;
+	unsigned int lookup_cache_size;	// max. number of cached lookups, 0 disables the cache
+	unsigned int lookup_cache_ttl;	// seconds a cached lookup is valid
+	bool whiteout_index;	// keep whiteouts in memory, see windex.c
+	bool whiteout_journal;	// log whiteouts instead of creating them, see windex.c
+	bool warmup;		// fill the caches after mount, see warmup.c
+	char *warmup_dirs;	// directories walked by the warm-up
+	bool lowlevel;		// use the FUSE low-level API, see ll_ops.c
+	bool in_process;	// not an option, unionfs-replay calls the operations without libfuse
+	bool readdirplus;	// readdir() prefetches attributes, see lcache.c
+	bool inode_map;		// stable inode numbers, see imap.c
+	bool lazy_cow;		// copy-up on the first write, see fhandle.c
+	uint64_t partial_cow_size; // copy files of at least this size by chunks, see chunk.c
+	unsigned int cow_threads; // workers copying directories, see pool.c
+	char *trace_file;	// binary trace of the operations, see trace.c
+	bool trace_capture;	// the trace also has the arguments, for unionfs-replay
+	unsigned int statfs_cache_ttl; // seconds a statfs() result is valid, see scache.c
+	unsigned int cache_timeout; // seconds the kernel may cache entries, see kcache.c
+	unsigned int readahead;	// bytes to read ahead on the branches for sequential readers, see fhandle.c
+	char *cache_branch;	// path=CACHE, copies of often opened ro-branch files, see rcache.c
+	int cache_fd;
+	uint64_t cache_size;	// bytes the cache branch may use
+	unsigned int cache_opens; // opens until a file gets cached
+	unsigned int branch_threads; // workers per branch for its syscalls, see bexec.c
+	unsigned int branch_timeout; // milliseconds a call waits for the workers of a branch
+	unsigned int xattr_cache_size; // max. number of paths with cached xattrs, see xcache.c
+	unsigned int dir_cache_size; // max. number of cached merged directories, see dcache.c
 
 } uopt_t;
 
 enum {
+	KEY_BLOOM,
+	KEY_BRANCH_THREADS,
+	KEY_BRANCH_TIMEOUT,
+	KEY_CACHE_OPENS,
+	KEY_CACHE_SIZE,
+	KEY_CACHE_TIMEOUT,
 	KEY_CHROOT,
 	KEY_COW,
+	KEY_COW_THREADS,
 	KEY_DEBUG_FILE,
+	KEY_DIR_CACHE,
 	KEY_DIRS,
 	KEY_HELP,
 	KEY_HIDE_META_FILES,
 	KEY_HIDE_METADIR,
+	KEY_INODE_MAP,
+	KEY_LAZY_COW,
+	KEY_LOOKUP_CACHE,
+	KEY_LOOKUP_CACHE_TTL,
+	KEY_LOWLEVEL,
 	KEY_MAX_FILES,
 	KEY_NOINITGROUPS,
+	KEY_PARTIAL_COW,
+	KEY_READAHEAD,
+	KEY_READDIRPLUS,
 	KEY_RELAXED_PERMISSIONS,
+	KEY_STATFS_CACHE_TTL,
 	KEY_STATFS_OMIT_RO,
-	KEY_VERSION
+	KEY_TRACE_CAPTURE,
+	KEY_TRACE_FILE,
+	KEY_VERSION,
+	KEY_WARMUP,
+	KEY_WARMUP_DIRS,
+	KEY_WHITEOUT_INDEX,
+	KEY_WHITEOUT_JOURNAL,
+	KEY_XATTR_CACHE
 };
 
 
 extern uopt_t uopt;
+extern const struct fuse_opt unionfs_opts[];
 
 void set_debug_path(char *new_path, int len);
 bool set_debug_onoff(int value);
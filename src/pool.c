@@ -0,0 +1,161 @@
+/*
+* Description: pool of worker threads for copy-up
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	The copy-up of a directory copies all its files, which we want to do
+*	in parallel. There is a single pool of -o cow_threads workers for all
+*	operations, an operation submits its jobs with a struct pool_group
+*	and waits for the group to finish. The queue is bounded, so a thread
+*	submitting faster than the workers copy is slowed down and the jobs
+*	do not pile up in memory.
+*	The workers are started on the first pool_submit(), as libfuse forks
+*	into the background only after option parsing. Without workers, jobs
+*	are run in the calling thread. A job runs on the branch table of the
+*	thread that submitted it (see btable.c).
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "pool.h"
+#include "debug.h"
+#include "usyslog.h"
+
+struct pool_job {
+	struct pool_group *group;
+	pool_fn_t fn;
+	void *arg;
+	struct btable *table;	// a reference of the submitter
+};
+
+static struct pool_job queue[POOL_QUEUE_SIZE];
+static unsigned int queue_head;		// next job to run
+static unsigned int queue_len;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static unsigned int nworkers;		// threads actually running
+
+void pool_group_init(struct pool_group *group) {
+	memset(group, 0, sizeof(*group));
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->idle, NULL);
+}
+
+static void finish_job(struct pool_group *group, int res) {
+	pthread_mutex_lock(&group->lock);
+
+	if (res && !group->error) group->error = res;
+	group->done++;
+	if (--group->pending == 0) pthread_cond_broadcast(&group->idle);
+
+	pthread_mutex_unlock(&group->lock);
+}
+
+static void *worker(void *arg) {
+	(void)arg;
+
+	while (1) {
+		pthread_mutex_lock(&queue_lock);
+		while (queue_len == 0) pthread_cond_wait(&queue_not_empty, &queue_lock);
+
+		struct pool_job job = queue[queue_head];
+		queue_head = (queue_head + 1) % POOL_QUEUE_SIZE;
+		queue_len--;
+
+		pthread_cond_signal(&queue_not_full);
+		pthread_mutex_unlock(&queue_lock);
+
+		btable_adopt(job.table);
+		finish_job(job.group, job.fn(job.arg));
+		btable_adopt(NULL);
+		btable_unref(job.table);
+	}
+
+	return NULL;
+}
+
+static void start_workers(void) {
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	unsigned int i;
+	for (i = 0; i < uopt.cow_threads; i++) {
+		pthread_t thread;
+		int res = pthread_create(&thread, &attr, worker, NULL);
+		if (res) {
+			USYSLOG(LOG_WARNING, "%s: starting copy-up thread %u failed: %s\n",
+				__func__, i, strerror(res));
+			break;
+		}
+		nworkers++;
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Run fn(arg) as a job of group, on a worker if there is one.
+ */
+void pool_submit(struct pool_group *group, pool_fn_t fn, void *arg) {
+	pthread_once(&start_once, start_workers);
+
+	pthread_mutex_lock(&group->lock);
+	group->pending++;
+	pthread_mutex_unlock(&group->lock);
+
+	if (nworkers == 0) {
+		finish_job(group, fn(arg));
+		return;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	while (queue_len == POOL_QUEUE_SIZE) pthread_cond_wait(&queue_not_full, &queue_lock);
+
+	struct pool_job *job = &queue[(queue_head + queue_len) % POOL_QUEUE_SIZE];
+	job->group = group;
+	job->fn = fn;
+	job->arg = arg;
+	job->table = btable_ref();
+	queue_len++;
+
+	pthread_cond_signal(&queue_not_empty);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Wait until all jobs of group are finished, returns the result of the first
+ * failed job or 0. The group can be reused afterwards.
+ */
+int pool_group_wait(struct pool_group *group) {
+	pthread_mutex_lock(&group->lock);
+	while (group->pending) pthread_cond_wait(&group->idle, &group->lock);
+	int res = group->error;
+	pthread_mutex_unlock(&group->lock);
+
+	return res;
+}
+
+void pool_group_destroy(struct pool_group *group) {
+	pthread_cond_destroy(&group->idle);
+	pthread_mutex_destroy(&group->lock);
+}
+
+unsigned long pool_group_done(struct pool_group *group) {
+	pthread_mutex_lock(&group->lock);
+	unsigned long done = group->done;
+	pthread_mutex_unlock(&group->lock);
+
+	return done;
+}
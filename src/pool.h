@@ -0,0 +1,32 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+#define POOL_DEFAULT_THREADS 4	// -o cow_threads
+#define POOL_QUEUE_SIZE 256	// jobs waiting for a worker, pool_submit() blocks beyond
+
+typedef int (*pool_fn_t)(void *arg);
+
+// jobs of one operation, to wait for all of them
+struct pool_group {
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	unsigned long pending;	// submitted, but not finished
+	unsigned long done;	// finished jobs
+	int error;		// result of the first failed job
+};
+
+void pool_group_init(struct pool_group *group);
+void pool_submit(struct pool_group *group, pool_fn_t fn, void *arg);
+int pool_group_wait(struct pool_group *group);
+void pool_group_destroy(struct pool_group *group);
+unsigned long pool_group_done(struct pool_group *group);
+
+#endif
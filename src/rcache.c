@@ -0,0 +1,429 @@
+/*
+* Description: read-through cache of ro-branch files on a CACHE branch
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	A branch given as path=CACHE is not part of the union, nothing is ever
+*	looked up there. It keeps copies of ro-branch files which are opened
+*	often, typically on a local disk in front of ro-branches on NFS.
+*	The files of ro-branch b are kept below a directory named by the hash
+*	of the path of b, so the cache survives a remount even if the order
+*	of the branches changes.
+*	rcache_open() is called for every read-only open of a file on a
+*	ro-branch. It counts the opens of the file and once there were
+*	-o cache_opens of them, the file is copied to the cache branch by the
+*	copy-up workers (copy_file() of cow_utils.c, see pool.c). The copy is
+*	done to a temporary name and renamed when it is complete. Later opens
+*	get the cached copy, if its size and modification time (in seconds,
+*	which is what copy_file() sets) still match the ro-branch file.
+*	Otherwise the copy is stale and dropped.
+*	The cached files are kept in LRU order, the least recently opened ones
+*	are removed once more than -o cache_size megabytes are cached. Files
+*	larger than 1/RCACHE_FILE_SHARE of the budget are never cached. The
+*	files already in the cache are found on mount; the opens of at most
+*	RCACHE_MAX_COUNTED other files are counted at a time.
+*	Only the data are taken from the cache, the attributes still come from
+*	the ro-branch.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "btable.h"
+#include "hashtable.h"
+#include "string.h"
+#include "cow_utils.h"
+#include "branchio.h"
+#include "pool.h"
+#include "rcache.h"
+#include "stats.h"
+#include "debug.h"
+#include "usyslog.h"
+
+enum rcache_state {
+	RCACHE_COUNTING,	// opens are counted, in the counted list
+	RCACHE_COPYING,		// a copy is in flight, in no list
+	RCACHE_CACHED,		// in the LRU list
+};
+
+struct rcache_entry {
+	struct rcache_entry *prev, *next;
+	char *key;		// "hash/path" on the cache branch, owned by the table
+	enum rcache_state state;
+	unsigned int opens;
+	off_t size;		// of the ro-branch file when it was copied
+	time_t mtime;
+};
+
+struct rcache_list {
+	struct rcache_entry *first, *last;
+	unsigned long count;
+};
+
+struct rcache_copy {
+	struct rcache_entry *entry;
+	int branch;
+	char path[];
+};
+
+static struct hashtable *entries;
+static struct rcache_list lru;		// the most recently opened first
+static struct rcache_list counted;	// the most recently counted first
+static uint64_t used;			// bytes in the LRU list
+static uint64_t budget;
+static unsigned int copies;		// copies in flight
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_group copy_group;
+
+static void list_add(struct rcache_list *list, struct rcache_entry *entry) {
+	entry->prev = NULL;
+	entry->next = list->first;
+	if (list->first)
+		list->first->prev = entry;
+	else
+		list->last = entry;
+	list->first = entry;
+	list->count++;
+}
+
+static void list_del(struct rcache_list *list, struct rcache_entry *entry) {
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		list->first = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		list->last = entry->prev;
+	list->count--;
+}
+
+/**
+ * The cache key of path on ro-branch branch.
+ */
+static int make_key(char *key, size_t size, int branch, const char *path) {
+	const char *bpath = BRANCH(branch).path;
+	uint64_t hash = string_hash64(bpath, strlen(bpath));
+
+	int len = snprintf(key, size, "%016" PRIx64 "%s", hash, path);
+	if (len < 0 || (size_t)len >= size) return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static struct rcache_entry *new_entry(const char *key) {
+	struct rcache_entry *entry = calloc(1, sizeof(struct rcache_entry));
+	char *table_key = strdup(key);
+	if (!entry || !table_key || !hashtable_insert(entries, table_key, entry)) {
+		free(table_key);
+		free(entry);
+		return NULL;
+	}
+
+	entry->key = table_key;
+	return entry;
+}
+
+/**
+ * Forget entry, its file is removed if it was cached. Called with the lock.
+ */
+static void drop_entry(struct rcache_entry *entry) {
+	if (entry->state == RCACHE_CACHED) {
+		DBG("%s\n", entry->key);
+
+		list_del(&lru, entry);
+		used -= entry->size;
+		if (unlinkat(uopt.cache_fd, entry->key, 0) && errno != ENOENT) {
+			USYSLOG(LOG_WARNING, "Failed to remove %s%s from the cache: %s\n",
+				uopt.cache_branch, entry->key, strerror(errno));
+		}
+		stats_rcache_evict();
+	} else if (entry->state == RCACHE_COUNTING) {
+		list_del(&counted, entry);
+	}
+
+	hashtable_remove(entries, entry->key); // frees the key
+	free(entry);
+}
+
+/**
+ * Add entry to the cached files and keep within the budget. Called with
+ * the lock.
+ */
+static void add_cached(struct rcache_entry *entry) {
+	entry->state = RCACHE_CACHED;
+	list_add(&lru, entry);
+	used += entry->size;
+
+	while (used > budget && lru.last != entry) drop_entry(lru.last);
+}
+
+/**
+ * Create the parent directories of key on the cache branch.
+ */
+static int create_parents(const char *key) {
+	char dir[PATHLEN_MAX];
+	if (snprintf(dir, sizeof(dir), "%s", key) >= (int)sizeof(dir)) RETURN(-ENAMETOOLONG);
+
+	char *slash;
+	for (slash = strchr(dir, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdirat(uopt.cache_fd, dir, 0700) && errno != EEXIST) RETURN(-errno);
+		*slash = '/';
+	}
+
+	RETURN(0);
+}
+
+static int do_copy(struct rcache_copy *copy) {
+	struct rcache_entry *entry = copy->entry;
+
+	// the entry is not in a list while it is copied, so it stays
+	char from[PATHLEN_MAX], to[PATHLEN_MAX], tmp[PATHLEN_MAX];
+	if (BUILD_PATH(from, BRANCH(copy->branch).path, copy->path)) RETURN(-ENAMETOOLONG);
+	if (BUILD_PATH(to, uopt.cache_branch, entry->key)) RETURN(-ENAMETOOLONG);
+	if (snprintf(tmp, sizeof(tmp), "%s%s", to, RCACHE_TMP_SUFFIX) >= (int)sizeof(tmp)) RETURN(-ENAMETOOLONG);
+
+	int res = create_parents(entry->key);
+	if (res) RETURN(res);
+
+	struct stat st;
+	if (lstat(from, &st)) RETURN(-errno);
+	if (st.st_size != entry->size || st.st_mtime != entry->mtime) RETURN(-EAGAIN);
+
+	struct cow cow;
+	cow.umask = 0;
+	cow.uid = getuid();
+	cow.from_path = from;
+	cow.to_path = tmp;
+	cow.stat = &st;
+	cow.sparse = false;
+	if (copy_file(&cow)) {
+		unlink(tmp);
+		RETURN(-EIO);
+	}
+
+	// the file must not have changed while it was copied
+	if (lstat(from, &st) || st.st_size != entry->size || st.st_mtime != entry->mtime) {
+		unlink(tmp);
+		RETURN(-EAGAIN);
+	}
+
+	if (rename(tmp, to)) {
+		res = -errno;
+		unlink(tmp);
+		RETURN(res);
+	}
+
+	RETURN(0);
+}
+
+static int copy_job(void *arg) {
+	struct rcache_copy *copy = arg;
+	struct rcache_entry *entry = copy->entry;
+
+	int res = do_copy(copy);
+	if (res) {
+		USYSLOG(LOG_INFO, "Caching %s failed: %s\n", copy->path, strerror(-res));
+	} else {
+		stats_rcache_copy(entry->size);
+	}
+
+	pthread_mutex_lock(&lock);
+	copies--;
+	if (res) {
+		// count again
+		entry->state = RCACHE_COUNTING;
+		entry->opens = 0;
+		list_add(&counted, entry);
+	} else {
+		add_cached(entry);
+	}
+	pthread_mutex_unlock(&lock);
+
+	free(copy);
+	return 0;
+}
+
+/**
+ * Count an open of the file of entry, with the attributes st, and copy it
+ * once it was opened often enough. Called with the lock.
+ */
+static void count_open(struct rcache_entry *entry, int branch, const char *path, const struct stat *st) {
+	if (++entry->opens < uopt.cache_opens || copies >= RCACHE_MAX_COPIES) return;
+
+	struct rcache_copy *copy = malloc(sizeof(struct rcache_copy) + strlen(path) + 1);
+	if (!copy) return;
+
+	copy->entry = entry;
+	copy->branch = branch;
+	strcpy(copy->path, path);
+
+	list_del(&counted, entry);
+	entry->state = RCACHE_COPYING;
+	entry->size = st->st_size;
+	entry->mtime = st->st_mtime;
+	copies++;
+
+	// without workers the job runs right here and takes the lock
+	pthread_mutex_unlock(&lock);
+	pool_submit(&copy_group, copy_job, copy);
+	pthread_mutex_lock(&lock);
+}
+
+/**
+ * Return a file descriptor of the cached copy of path on ro-branch branch,
+ * opened with flags, or -1 if it should be opened from the branch. Counts
+ * the open for caching the file.
+ */
+int rcache_open(int branch, const char *path, int flags) {
+	if (!uopt.cache_branch || BRANCH(branch).rw) return -1;
+	if ((flags & O_ACCMODE) != O_RDONLY) return -1;
+
+	struct stat st;
+	if (b_stat(branch, path, &st) || !S_ISREG(st.st_mode)) return -1;
+
+	// the copy must be readable, too large files would flush the cache
+	if (!(st.st_mode & S_IRUSR) || (uint64_t)st.st_size > budget / RCACHE_FILE_SHARE) return -1;
+
+	char key[PATHLEN_MAX];
+	if (make_key(key, sizeof(key), branch, path)) return -1;
+
+	pthread_mutex_lock(&lock);
+
+	struct rcache_entry *entry = hashtable_search(entries, key);
+	if (entry && entry->state == RCACHE_CACHED) {
+		if (entry->size == st.st_size && entry->mtime == st.st_mtime) {
+			list_del(&lru, entry);
+			list_add(&lru, entry);
+			pthread_mutex_unlock(&lock);
+
+			int fd = openat(uopt.cache_fd, key, flags & ~(O_CREAT | O_EXCL | O_TRUNC));
+			if (fd != -1) {
+				DBG("%s from the cache, fd = %d\n", path, fd);
+				stats_rcache_hit();
+				return fd;
+			}
+
+			pthread_mutex_lock(&lock);
+			entry = hashtable_search(entries, key);
+			if (!entry || entry->state != RCACHE_CACHED) {
+				pthread_mutex_unlock(&lock);
+				return -1;
+			}
+		}
+
+		// stale, the ro-branch file changed
+		drop_entry(entry);
+		entry = NULL;
+	}
+
+	if (!entry) {
+		if (counted.count >= RCACHE_MAX_COUNTED) drop_entry(counted.last);
+
+		entry = new_entry(key);
+		if (entry) list_add(&counted, entry);
+	} else if (entry->state == RCACHE_COUNTING) {
+		list_del(&counted, entry);
+		list_add(&counted, entry);
+	}
+
+	if (entry && entry->state == RCACHE_COUNTING) count_open(entry, branch, path, &st);
+
+	pthread_mutex_unlock(&lock);
+
+	return -1;
+}
+
+static bool is_tmp(const char *name) {
+	size_t len = strlen(name);
+	size_t suffix_len = strlen(RCACHE_TMP_SUFFIX);
+
+	return len > suffix_len && !strcmp(name + len - suffix_len, RCACHE_TMP_SUFFIX);
+}
+
+/**
+ * Add the files of directory dir, key is its path on the cache branch.
+ */
+static void scan_dir(int dirfd, char *key) {
+	DIR *dp = fdopendir(dirfd);
+	if (!dp) {
+		close(dirfd);
+		return;
+	}
+
+	size_t len = strlen(key);
+	struct dirent *de;
+	while ((de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+		if (snprintf(key + len, PATHLEN_MAX - len, "%s%s", len ? "/" : "", de->d_name) >= (int)(PATHLEN_MAX - len))
+			continue;
+
+		struct stat st;
+		if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			int fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY);
+			if (fd != -1) scan_dir(fd, key);
+		} else if (is_tmp(de->d_name)) {
+			// left by a copy that was interrupted
+			unlinkat(dirfd, de->d_name, 0);
+		} else if (S_ISREG(st.st_mode) && (uint64_t)st.st_size <= budget / RCACHE_FILE_SHARE) {
+			struct rcache_entry *entry = new_entry(key);
+			if (entry) {
+				entry->size = st.st_size;
+				entry->mtime = st.st_mtime;
+				add_cached(entry);
+			}
+		}
+
+		key[len] = '\0';
+	}
+
+	closedir(dp);
+}
+
+/**
+ * Find the files cached by previous mounts, uopt.cache_fd must be open.
+ */
+void rcache_init(void) {
+	if (!uopt.cache_branch) return;
+
+	entries = create_hashtable(1024, string_hash, string_equal);
+	if (!entries) {
+		fprintf(stderr, "%s: Out of memory, aborting!\n", __func__);
+		exit(1);
+	}
+	pool_group_init(&copy_group);
+	budget = uopt.cache_size;
+
+	char key[PATHLEN_MAX] = "";
+	int fd = dup(uopt.cache_fd);
+	if (fd != -1) scan_dir(fd, key);
+}
+
+/**
+ * Bytes of the cached files.
+ */
+uint64_t rcache_used(void) {
+	pthread_mutex_lock(&lock);
+	uint64_t res = used;
+	pthread_mutex_unlock(&lock);
+
+	return res;
+}
@@ -0,0 +1,23 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef RCACHE_H
+#define RCACHE_H
+
+#include <stdint.h>
+
+#define RCACHE_DEFAULT_SIZE 1024	// -o cache_size, megabytes
+#define RCACHE_DEFAULT_OPENS 2		// -o cache_opens
+#define RCACHE_FILE_SHARE 8		// files larger than this part of the budget are not cached
+#define RCACHE_MAX_COUNTED 65536	// files whose opens are counted, the oldest are forgotten
+#define RCACHE_MAX_COPIES 16		// copies in flight, further files wait for later opens
+#define RCACHE_TMP_SUFFIX "_COPYING~"	// a copy that is not complete yet
+
+void rcache_init(void);
+int rcache_open(int branch, const char *path, int flags);
+uint64_t rcache_used(void);
+
+#endif
@@ -21,14 +21,26 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <stdbool.h>
 
+#include "conf.h"
 #include "unionfs.h"
 #include "opts.h"
+#include "btable.h"
 #include "debug.h"
-#include "hashtable.h"
+#include "strset.h"
 #include "general.h"
 #include "string.h"
+#include "windex.h"
+#include "branchio.h"
+#include "lcache.h"
+#include "dcache.h"
+#include "readdir.h"
+#include "findbranch.h"
+#include "imap.h"
 
 
 /**
@@ -40,13 +52,13 @@ static bool hide_meta_files(int branch, const char *path, struct dirent *de)
 
 	if (uopt.hide_meta_files == false) RETURN(false);
 
-	fprintf(stderr, "uopt.branches[branch].path = %s path = %s\n", uopt.branches[branch].path, path);
+	fprintf(stderr, "BRANCH(branch).path = %s path = %s\n", BRANCH(branch).path, path);
 	fprintf(stderr, "METANAME = %s, de->d_name = %s\n", METANAME, de->d_name);
 
 	// TODO Would it be faster to add hash comparison?
 
 	// HIDE out .unionfs directory
-	if (strcmp(uopt.branches[branch].path, path) == 0
+	if (strcmp(BRANCH(branch).path, path) == 0
 	&& strcmp(METANAME, de->d_name) == 0) {
 		RETURN(true);
 	}
@@ -64,7 +76,7 @@ static bool hide_meta_files(int branch, const char *path, struct dirent *de)
  * Also, add this file and to the hiding hash table.
  * Warning: If fname has the tag, fname gets modified.
  */
-static bool is_hiding(struct hashtable *hides, char *fname) {
+static bool is_hiding(strset_t *hides, char *fname) {
 	DBG("%s\n", fname);
 
 	char *tag;
@@ -76,10 +88,7 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 		*tag = '\0'; // this modifies fname!
 
 		// add to hides (only if not there already)
-		if (!hashtable_search(hides, fname)) {
-			char *key = strdup(fname);
-			hashtable_insert(hides, key, key);
-		}
+		strset_add(hides, fname);
 
 		RETURN(true);
 	}
@@ -90,48 +99,80 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 /**
  * Read whiteout files
  */
-static void read_whiteouts(const char *path, struct hashtable *whiteouts, int branch) {
+static void read_whiteouts(const char *path, strset_t *whiteouts, int branch) {
 	DBG("%s\n", path);
 
+	// nothing to read, if the index knows the whiteouts
+	if (windex_dir_whiteouts(branch, path, whiteouts)) return;
+
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch].path, METADIR, path)) return;
+	if (BUILD_PATH(p, METADIR, path)) return;
 
-	DIR *dp = opendir(p);
-	if (dp == NULL) return;
+	b_dir_t dir;
+	if (b_dir_open(&dir, branch, p)) return;
 
 	struct dirent *de;
-	while ((de = readdir(dp)) != NULL) {
+	while ((de = b_dir_read(&dir)) != NULL) {
 		is_hiding(whiteouts, de->d_name);
 	}
 
-	closedir(dp);
+	b_dir_close(&dir);
 }
 
 /**
- * unionfs-fuse readdir function
+ * -o readdirplus: get the attributes of name in directory path on branch,
+ * which is open as dir, and pass them to the following getattr(name)
  */
-int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+static void prefetch_attr(const char *path, int branch, b_dir_t *dir, const char *name, struct stat *stbuf) {
+	// . and .. are not looked up
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return;
+
+	char p[PATHLEN_MAX];
+	// avoid a double slash for entries of the root directory
+	if (BUILD_PATH(p, path[1] ? path : "", "/", name)) return;
+
+	unsigned long ticket = lcache_ticket(p);
+
+	struct stat st;
+#ifdef UNIONFS_HAVE_AT
+	int res = dir->dp ? fstatat(dirfd(dir->dp), name, &st, AT_SYMLINK_NOFOLLOW) : b_lstat(branch, p, &st);
+#else
+	(void)dir;
+	int res = b_lstat(branch, p, &st);
+#endif
+	if (res == -1) return;
+
+	lcache_insert_attr(p, branch, &st, ticket);
+	*stbuf = st;
+}
+
+/**
+ * Merge directory path of all branches, filler() is called for each entry
+ * visible in the union.
+ */
+static int merge_dir(const char *path, void *buf, fuse_fill_dir_t filler) {
 	DBG("%s\n", path);
 
-	(void)offset;
-	(void)fi;
 	int i = 0;
 	int rc = 0;
 
 	// we will store already added files here to handle same file names across different branches
-	struct hashtable *files = create_hashtable(16, string_hash, string_equal);
+	strset_t files;
+	if (strset_init(&files)) RETURN(-ENOMEM);
 
-	struct hashtable *whiteouts = NULL;
-
-	if (uopt.cow_enabled) whiteouts = create_hashtable(16, string_hash, string_equal);
+	strset_t whiteouts = { 0 };
+	if (uopt.cow_enabled && strset_init(&whiteouts)) {
+		strset_free(&files);
+		RETURN(-ENOMEM);
+	}
 
 	bool subdir_hidden = false;
 
-	for (i = 0; i < uopt.nbranches; i++) {
+	for (i = 0; i < NBRANCHES; i++) {
 		if (subdir_hidden) break;
 
 		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
+		if (BUILD_PATH(p, BRANCH(i).path, path)) {
 			rc = -ENAMETOOLONG;
 			goto out;
 		}
@@ -145,123 +186,229 @@ int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
 
 		if (res > 0) subdir_hidden = true;
 
-		DIR *dp = opendir(p);
-		if (dp == NULL) {
-			if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+		b_dir_t dir;
+		if (b_dir_open(&dir, i, path)) {
+			if (uopt.cow_enabled) read_whiteouts(path, &whiteouts, i);
 			continue;
 		}
 
 		struct dirent *de;
-		while ((de = readdir(dp)) != NULL) {
+		while ((de = b_dir_read(&dir)) != NULL) {
 			// already added in some other branch
-			if (hashtable_search(files, de->d_name) != NULL) continue;
+			if (strset_contains(&files, de->d_name)) continue;
 
 			// check if we need file hiding
 			if (uopt.cow_enabled) {
 				// file should be hidden from the user
-				if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
+				if (strset_contains(&whiteouts, de->d_name)) continue;
 			}
 
 			if (hide_meta_files(i, p, de) == true) continue;
 
-			// fill with something dummy, we're interested in key existence only
-			char *key = strdup(de->d_name);
-			hashtable_insert(files, key, key);
+			if (strset_add(&files, de->d_name) == -1) {
+				b_dir_close(&dir);
+				rc = -ENOMEM;
+				goto out;
+			}
 
 			struct stat st;
 			memset(&st, 0, sizeof(st));
 			st.st_ino = de->d_ino;
 			st.st_mode = de->d_type << 12;
 
-			if (filler(buf, de->d_name, &st, 0)) break;
+			if (uopt.readdirplus) prefetch_attr(path, i, &dir, de->d_name, &st);
+			if (uopt.inode_map) st.st_ino = imap_branch_ino(i, st.st_ino);
+
+			// the lower branches are not needed either
+			if (filler(buf, de->d_name, &st, 0)) {
+				b_dir_close(&dir);
+				goto out;
+			}
 		}
 
-		closedir(dp);
-		if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+		b_dir_close(&dir);
+		if (uopt.cow_enabled) read_whiteouts(path, &whiteouts, i);
 	}
 
 out:
-	hashtable_destroy(files, 0);
+	strset_free(&files);
 
-	if (uopt.cow_enabled) hashtable_destroy(whiteouts, 0);
+	if (uopt.cow_enabled) strset_free(&whiteouts);
 
 	RETURN(rc);
 }
 
 /**
- * check if a directory on all paths is empty
- * return 0 if empty, 1 if not and negative value on error
- *
- * TODO: This shares lots of code with unionfs_readdir(), can we merge
- *       both functions?
+ * Append name to the snapshot. Returns 0 or -1 if out of memory.
  */
-int dir_not_empty(const char *path) {
+int snapshot_add(struct dir_snapshot *dir, const char *name, ino_t ino, mode_t mode) {
+	size_t len = strlen(name) + 1;
+	if (dir->names_len + len > dir->names_size) {
+		size_t size = dir->names_size ? dir->names_size * 2 : 4096;
+		while (dir->names_len + len > size) size *= 2;
+
+		char *names = realloc(dir->names, size);
+		if (!names) return -1;
+		dir->names = names;
+		dir->names_size = size;
+	}
 
-	DBG("%s\n", path);
+	if (dir->count == dir->size) {
+		size_t size = dir->size ? dir->size * 2 : 128;
 
-	int i = 0;
-	int rc = 0;
-	int not_empty = 0;
+		struct dir_entry *entries = realloc(dir->entries, size * sizeof(struct dir_entry));
+		if (!entries) return -1;
+		dir->entries = entries;
+		dir->size = size;
+	}
 
-	struct hashtable *whiteouts = NULL;
+	struct dir_entry *entry = &dir->entries[dir->count++];
+	entry->name = dir->names_len;
+	entry->ino = ino;
+	entry->mode = mode & S_IFMT;
 
-	if (uopt.cow_enabled) whiteouts = create_hashtable(16, string_hash, string_equal);
+	memcpy(dir->names + dir->names_len, name, len);
+	dir->names_len += len;
 
-	bool subdir_hidden = false;
+	return 0;
+}
 
-	for (i = 0; i < uopt.nbranches; i++) {
-		if (subdir_hidden) break;
+/**
+ * fuse_fill_dir_t of merge_dir() to add name to the snapshot
+ */
+static int snapshot_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(void)off;
+	struct dir_snapshot *dir = buf;
 
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
-			rc = -ENAMETOOLONG;
-			goto out;
-		}
+	if (snapshot_add(dir, name, stbuf->st_ino, stbuf->st_mode)) {
+		dir->error = ENOMEM;
+		return 1; // stops merge_dir()
+	}
 
-		// check if branches below this branch are hidden
-		int res = path_hidden(path, i);
-		if (res < 0) {
-			rc = res; // error
-			goto out;
-		}
+	return 0;
+}
 
-		if (res > 0) subdir_hidden = true;
+void free_snapshot(struct dir_snapshot *dir) {
+	free(dir->names);
+	free(dir->entries);
+	free(dir);
+}
 
-		DIR *dp = opendir(p);
-		if (dp == NULL) {
-			if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
-			continue;
-		}
+/**
+ * unionfs-fuse opendir function
+ * The directory is merged only once here, readdir() then only returns the
+ * entries starting at the requested offset. So a directory read with many
+ * small buffers does not need to be merged again for each of them and
+ * offsets are stable also if the directory is modified meanwhile.
+ * With -o dir_cache the snapshot is also kept for dir_not_empty() and the
+ * next opendir(), see dcache.c.
+ */
+int unionfs_opendir(const char *path, struct fuse_file_info *fi) {
+	DBG("%s\n", path);
 
-		struct dirent *de;
-		while ((de = readdir(dp)) != NULL) {
-			// Ignore . and ..
-			if ((strcmp(de->d_name, ".") == 0) ||  (strcmp(de->d_name, "..") == 0)) {
-				continue;
-			}
+	struct dir_snapshot *dir = dcache_snapshot(path);
+	if (dir) {
+		fi->fh = (uintptr_t)dir;
+		RETURN(0);
+	}
 
-			// check if we need file hiding
-			if (uopt.cow_enabled) {
-				// file should be hidden from the user
-				if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
-			}
+	dir = calloc(1, sizeof(struct dir_snapshot));
+	if (!dir) RETURN(-ENOMEM);
 
-			if (hide_meta_files(i, p, de) == true) continue;
+	unsigned long ticket = dcache_ticket(path);
 
-			// When we arrive here, a valid entry was found
-			not_empty = 1;
-			closedir(dp);
-			goto out;
-		}
+	int res = merge_dir(path, dir, snapshot_fill);
+	if (!res && dir->error) res = -dir->error;
+	if (res) {
+		free_snapshot(dir);
+		RETURN(res);
+	}
+
+	dcache_insert(path, dir, ticket);
+
+	fi->fh = (uintptr_t)dir;
+	RETURN(0);
+}
+
+/**
+ * unionfs-fuse readdir function
+ */
+int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	DBG("%s\n", path);
+
+	// not opened by unionfs_opendir(), merge the directory now
+	if (!fi || !fi->fh) RETURN(merge_dir(path, buf, filler));
+
+	struct dir_snapshot *dir = (struct dir_snapshot *)(uintptr_t)fi->fh;
 
-		closedir(dp);
-		if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+	size_t i;
+	for (i = offset; i < dir->count; i++) {
+		struct dir_entry *entry = &dir->entries[i];
+
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = entry->ino;
+		st.st_mode = entry->mode;
+
+		// the offset of an entry is the offset of the next one
+		if (filler(buf, dir->names + entry->name, &st, i + 1)) break;
 	}
 
-out:
-	if (uopt.cow_enabled) hashtable_destroy(whiteouts, 0);
+	RETURN(0);
+}
+
+/**
+ * unionfs-fuse releasedir function
+ */
+int unionfs_releasedir(const char *path, struct fuse_file_info *fi) {
+	(void)path;
+
+	struct dir_snapshot *dir = (struct dir_snapshot *)(uintptr_t)fi->fh;
+	if (dir) free_snapshot(dir);
+	fi->fh = 0;
+
+	RETURN(0);
+}
+
+/**
+ * fuse_fill_dir_t of merge_dir() for dir_not_empty(), stops at the first
+ * entry besides . and ..
+ */
+static int not_empty_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(void)stbuf;
+	(void)off;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+
+	*(int *)buf = 1;
+	return 1;
+}
+
+/**
+ * check if a directory on all paths is empty
+ * return 0 if empty, 1 if not and negative value on error
+ */
+int dir_not_empty(const char *path) {
+	DBG("%s\n", path);
+
+	// the cached merge knows, up to the names changed since
+	char unsure[DCACHE_UNSURE_MAX][DCACHE_NAME_MAX];
+	int nunsure;
+	int res = dcache_not_empty(path, unsure, &nunsure);
+	if (res == 1) RETURN(1);
+	if (res == 0) {
+		int i;
+		for (i = 0; i < nunsure; i++) {
+			char p[PATHLEN_MAX];
+			if (BUILD_PATH(p, path[1] ? path : "", "/", unsure[i])) RETURN(-ENAMETOOLONG);
+			if (find_rorw_branch(p) >= 0) RETURN(1);
+		}
+		RETURN(0);
+	}
 
-	if (rc) RETURN(rc);
+	int not_empty = 0;
+	res = merge_dir(path, &not_empty, not_empty_fill);
+	if (res) RETURN(res);
 
 	RETURN(not_empty);
 }
@@ -2,8 +2,31 @@
 #define READDIR_H
 
 #include <fuse.h>
+#include <sys/types.h>
 
+// one entry of a directory snapshot
+struct dir_entry {
+	size_t name;		// offset of the name in dir_snapshot.names
+	ino_t ino;
+	mode_t mode;		// only the file type bits
+};
+
+// the merged directory, taken on opendir() or copied from the cache (dcache.c)
+struct dir_snapshot {
+	char *names;		// all names, each terminated by '\0'
+	size_t names_len;
+	size_t names_size;
+	struct dir_entry *entries;
+	size_t count;
+	size_t size;
+	int error;		// error while taking the snapshot
+};
+
+int unionfs_opendir(const char *path, struct fuse_file_info *fi);
+int unionfs_releasedir(const char *path, struct fuse_file_info *fi);
 int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
 int dir_not_empty(const char *path);
+int snapshot_add(struct dir_snapshot *dir, const char *name, ino_t ino, mode_t mode);
+void free_snapshot(struct dir_snapshot *dir);
 
 #endif
@@ -26,6 +26,7 @@
 
 #include "unionfs.h"
 #include "opts.h"
+#include "btable.h"
 #include "debug.h"
 #include "cow.h"
 #include "general.h"
@@ -33,6 +34,10 @@
 #include "string.h"
 #include "readdir.h"
 #include "usyslog.h"
+#include "lcache.h"
+#include "dcache.h"
+#include "branchio.h"
+#include "imap.h"
 
 /**
   * If the branch that has the directory to be removed is in read-write mode,
@@ -41,12 +46,13 @@
 static int rmdir_rw(const char *path, int branch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) return ENAMETOOLONG;
+	uint64_t ino = imap_removing(branch_rw, path);
 
-	int res = rmdir(p);
+	int res = b_rmdir(branch_rw, path);
 	if (res == -1) return errno;
 
+	imap_removed(branch_rw, ino);
+
 	return 0;
 }
 
@@ -81,19 +87,14 @@ static int rmdir_ro(const char *path, int branch_ro) {
 	return 0;
 }
 
-/**
-  * rmdir() call
-  */
-int unionfs_rmdir(const char *path) {
-	DBG("%s\n", path);
-
+static int do_rmdir(const char *path) {
 	if (dir_not_empty(path)) return -ENOTEMPTY;
 
 	int i = find_rorw_branch(path);
 	if (i == -1) return -errno;
 
 	int res;
-	if (!uopt.branches[i].rw) {
+	if (!BRANCH(i).rw) {
 		// read-only branch
 		if (!uopt.cow_enabled) {
 			res = EROFS;
@@ -109,5 +110,20 @@ int unionfs_rmdir(const char *path) {
 		}
 	}
 
+	if (res == 0) lcache_invalidate(path);
+
 	return -res;
 }
+
+/**
+  * rmdir() call
+  */
+int unionfs_rmdir(const char *path) {
+	DBG("%s\n", path);
+
+	dcache_remove_begin(path);
+	int res = do_rmdir(path);
+	dcache_remove_end(path, res == 0);
+
+	return res;
+}
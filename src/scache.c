@@ -0,0 +1,216 @@
+/*
+* Description: cache of the statfs() results of the branches
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	statfs() of the union sums up the file systems of all branches, each
+*	file system counted once even if several branches are on it. Monitoring
+*	and df loops call it all the time, so we do not look at the branches on
+*	every call: scache_init() finds out once which branches share a device
+*	(through the branch file descriptors, which also keeps working after
+*	the chroot). The statfs() results of the devices and their sum are
+*	then kept for -o statfs_cache_ttl seconds. Branches of other block
+*	sizes are converted to the block size of the first branch with integer
+*	arithmetic.
+*	scache_init() is called again whenever the branches change (see
+*	btable.c); the devices keep the fds, so operations still running on
+*	the old branch table get the statfs() of the new branches.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef linux
+	#include <sys/vfs.h>
+#endif
+
+#include "opts.h"
+#include "btable.h"
+#include "scache.h"
+#include "debug.h"
+#include "usyslog.h"
+
+typedef struct {
+	int fd;			// of the first branch on this device
+	bool rw;		// whether it is counted as rw, as the first branch
+	struct statvfs st;
+} scache_dev_t;
+
+static scache_dev_t *devs;
+static int ndevs;
+static struct statvfs sum;
+static time_t expires;		// sum and st of devs are valid until then
+static pthread_mutex_t scache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * Wrapper function to convert the result of statfs() to statvfs()
+ * libfuse uses statvfs, since it conforms to POSIX. Unfortunately,
+ * glibc's statvfs parses /proc/mounts, which then results in reading
+ * the filesystem itself again - which would result in a deadlock.
+ */
+static int statvfs_local(int fd, struct statvfs *stbuf) {
+#ifdef linux
+	/* glibc's statvfs walks /proc/mounts and stats entries found there
+	 * in order to extract their mount flags, which may deadlock if they
+	 * are mounted under the unionfs. As a result, we have to do this
+	 * ourselves.
+	 */
+	struct statfs stfs;
+	int res = fstatfs(fd, &stfs);
+	if (res == -1) RETURN(res);
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->f_bsize = stfs.f_bsize;
+	if (stfs.f_frsize) {
+		stbuf->f_frsize = stfs.f_frsize;
+	} else {
+		stbuf->f_frsize = stfs.f_bsize;
+	}
+	stbuf->f_blocks = stfs.f_blocks;
+	stbuf->f_bfree = stfs.f_bfree;
+	stbuf->f_bavail = stfs.f_bavail;
+	stbuf->f_files = stfs.f_files;
+	stbuf->f_ffree = stfs.f_ffree;
+	stbuf->f_favail = stfs.f_ffree; /* nobody knows */
+
+	/* We don't worry about flags, exactly because this would
+	 * require reading /proc/mounts, and avoiding that and the
+	 * resulting deadlocks is exactly what we're trying to avoid
+	 * by doing this rather than using statvfs.
+	 */
+	stbuf->f_flag = 0;
+	stbuf->f_namemax = stfs.f_namelen;
+
+	RETURN(0);
+#else
+	RETURN(fstatvfs(fd, stbuf));
+#endif
+}
+
+/**
+ * Find the distinct devices of the branches. Returns 0 or -errno, the old
+ * devices are kept on failure.
+ */
+int scache_init(void) {
+	int n = NBRANCHES;
+	scache_dev_t *new_devs = malloc(n * sizeof(scache_dev_t));
+	if (!new_devs) RETURN(-ENOMEM);
+
+	dev_t devno[n];
+	int nnew = 0;
+
+	int i;
+	for (i = 0; i < n; i++) {
+		struct stat st;
+		if (fstat(BRANCH(i).fd, &st) == -1) {
+			int res = -errno;
+			USYSLOG(LOG_ERR, "Failed to stat branch %s: %s\n",
+				BRANCH(i).path, strerror(errno));
+			free(new_devs);
+			RETURN(res);
+		}
+
+		int j;
+		for (j = 0; j < nnew; j++) {
+			if (devno[j] == st.st_dev) break;
+		}
+		if (j < nnew) continue;
+
+		devno[nnew] = st.st_dev;
+		new_devs[nnew].fd = BRANCH(i).fd;
+		new_devs[nnew].rw = BRANCH(i).rw;
+		nnew++;
+	}
+
+	pthread_mutex_lock(&scache_lock);
+
+	free(devs);
+	devs = new_devs;
+	ndevs = nnew;
+	expires = 0;
+
+	pthread_mutex_unlock(&scache_lock);
+
+	RETURN(0);
+}
+
+/**
+ * Sum up the statfs() results of the devices, with scache_lock held.
+ */
+static int refresh(void) {
+	int i;
+	for (i = 0; i < ndevs; i++) {
+		int res = statvfs_local(devs[i].fd, &devs[i].st);
+		if (res == -1) RETURN(-errno);
+	}
+
+	sum = devs[0].st;
+	sum.f_fsid = devs[0].st.f_fsid << 8;
+
+	for (i = 1; i < ndevs; i++) {
+		const struct statvfs *stb = &devs[i].st;
+
+		// Filesystem can have different block sizes -> normalize to first's block size
+		unsigned long bsize = stb->f_bsize, base = sum.f_bsize;
+#define NORMALIZE(blocks) (bsize == base ? (blocks) : (uint64_t)(blocks) * bsize / base)
+
+		if (devs[i].rw) {
+			sum.f_blocks += NORMALIZE(stb->f_blocks);
+			sum.f_bfree += NORMALIZE(stb->f_bfree);
+			sum.f_bavail += NORMALIZE(stb->f_bavail);
+
+			sum.f_files += stb->f_files;
+			sum.f_ffree += stb->f_ffree;
+			sum.f_favail += stb->f_favail;
+		} else if (!uopt.statfs_omit_ro) {
+			// omitting the RO branches is not correct regarding
+			// the block counts but it actually fixes the
+			// percentage of free space. so, let the user decide.
+			sum.f_blocks += NORMALIZE(stb->f_blocks);
+			sum.f_files  += stb->f_files;
+		}
+#undef NORMALIZE
+
+		if (!(stb->f_flag & ST_RDONLY)) sum.f_flag &= ~ST_RDONLY;
+		if (!(stb->f_flag & ST_NOSUID)) sum.f_flag &= ~ST_NOSUID;
+
+		if (stb->f_namemax < sum.f_namemax) sum.f_namemax = stb->f_namemax;
+	}
+
+	RETURN(0);
+}
+
+/**
+ * statfs() of the union, returns 0 or -errno.
+ */
+int scache_statfs(struct statvfs *stbuf) {
+	int res = 0;
+
+	pthread_mutex_lock(&scache_lock);
+
+	time_t t = now();
+	if (expires <= t) {
+		// errors are not cached, the next call tries again
+		res = refresh();
+		if (res == 0) expires = t + uopt.statfs_cache_ttl;
+	}
+	if (res == 0) memcpy(stbuf, &sum, sizeof(*stbuf));
+
+	pthread_mutex_unlock(&scache_lock);
+
+	RETURN(res);
+}
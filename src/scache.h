@@ -0,0 +1,17 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef SCACHE_H
+#define SCACHE_H
+
+#include <sys/statvfs.h>
+
+#define SCACHE_DEFAULT_TTL 1	// seconds a statfs() result stays valid
+
+int scache_init(void);
+int scache_statfs(struct statvfs *stbuf);
+
+#endif
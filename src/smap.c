@@ -0,0 +1,461 @@
+/*
+* Description: sharded string maps with lockless readers
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	The lookup cache, the xattr cache and the whiteout index are read on
+*	every request, from all libfuse threads at once, and only seldom
+*	written. With a rwlock per shard every read still writes the lock
+*	word, which bounces its cache line between the cores. So a map is
+*	split into SMAP_SHARDS shards, each with a sequence lock: writers take
+*	the mutex of the shard and make its sequence number odd while they
+*	change it, readers do not write anything. They search the shard and
+*	copy the value out, then check that the sequence number is still the
+*	even one they started with, otherwise they try again. After
+*	SMAP_READ_TRIES tries they take the mutex, so a stream of writers can
+*	not starve them.
+*	A reader may be on an entry while it is removed, so the memory of an
+*	entry is never given back while the map lives: removed entries go to
+*	a free list of their shard and are reused for keys of the same size
+*	class. A reader on a reused entry just reads the wrong key or value,
+*	and the changed sequence number makes it retry. In the same way
+*	the bucket arrays replaced when a shard grows are kept until
+*	smap_destroy(). The memory of a map is thus that of the most entries
+*	it ever had, which is bounded by max_entries for the caches.
+*	Tickets work as in the caches before (see lcache.c): a reader gets the
+*	invalidation counter of the shard together with the value, a writer
+*	passing it drops its result if the key was invalidated in the mean
+*	time.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "string.h"
+#include "smap.h"
+
+#define SMAP_MIN_BUCKETS 16		// of a shard, doubled as it grows
+#define SMAP_MIN_KEY 16			// bytes of the smallest size class
+#define SMAP_CLASSES 7			// SMAP_MIN_KEY << 6 == SMAP_KEY_MAX
+#define SMAP_CACHELINE 64
+
+struct smap_entry {
+	struct smap_entry *next;
+	uint64_t hash;
+	unsigned int key_size;		// room for the key, never changes
+	unsigned int class;
+	char data[];			// the value, then the key
+};
+
+struct smap_buckets {
+	struct smap_buckets *prev;	// replaced, kept for the readers
+	uint64_t mask;
+	struct smap_entry *heads[];
+};
+
+struct smap_shard {
+	unsigned int seq;		// odd while a writer changes the shard
+	unsigned int count;
+	unsigned long tickets;		// incremented on each invalidation
+	struct smap_buckets *buckets;
+	pthread_mutex_t lock;		// writers
+	struct smap_entry *free[SMAP_CLASSES]; // removed entries
+} __attribute__((aligned(SMAP_CACHELINE)));
+
+struct smap {
+	struct smap_shard shards[SMAP_SHARDS];
+	size_t value_size;
+	size_t value_room;		// value_size rounded up for the key
+	unsigned int max_per_shard;	// 0 for no limit
+	unsigned long count;		// all shards
+};
+
+static struct smap_shard *get_shard(struct smap *map, uint64_t hash) {
+	return &map->shards[hash >> 58]; // the top 6 bits, the low ones pick the bucket
+}
+
+static char *entry_key(struct smap *map, struct smap_entry *e) {
+	return e->data + map->value_room;
+}
+
+static struct smap_buckets *new_buckets(uint64_t n) {
+	struct smap_buckets *b = calloc(1, sizeof(struct smap_buckets) + n * sizeof(struct smap_entry *));
+	if (b) b->mask = n - 1;
+	return b;
+}
+
+/**
+ * Create a map of values of value_size bytes. With max_entries a shard
+ * holding its share of them is emptied before another key is added.
+ * Returns NULL if out of memory.
+ */
+struct smap *smap_create(size_t value_size, unsigned long max_entries) {
+	struct smap *map;
+	if (posix_memalign((void **)&map, SMAP_CACHELINE, sizeof(struct smap))) return NULL;
+	memset(map, 0, sizeof(struct smap));
+
+	map->value_size = value_size;
+	map->value_room = (value_size + 7) & ~(size_t)7;
+	if (max_entries) {
+		map->max_per_shard = max_entries / SMAP_SHARDS;
+		if (map->max_per_shard == 0) map->max_per_shard = 1;
+	}
+
+	int i;
+	for (i = 0; i < SMAP_SHARDS; i++) {
+		struct smap_shard *s = &map->shards[i];
+		pthread_mutex_init(&s->lock, NULL);
+		s->buckets = new_buckets(SMAP_MIN_BUCKETS);
+		if (!s->buckets) {
+			smap_destroy(map);
+			return NULL;
+		}
+	}
+
+	return map;
+}
+
+static void free_chain(struct smap_entry *e) {
+	while (e) {
+		struct smap_entry *next = e->next;
+		free(e);
+		e = next;
+	}
+}
+
+/**
+ * Free map, nobody may use it anymore.
+ */
+void smap_destroy(struct smap *map) {
+	if (!map) return;
+
+	int i, c;
+	for (i = 0; i < SMAP_SHARDS; i++) {
+		struct smap_shard *s = &map->shards[i];
+
+		struct smap_buckets *b = s->buckets;
+		if (b) {
+			uint64_t j;
+			for (j = 0; j <= b->mask; j++) free_chain(b->heads[j]);
+		}
+		while (b) {
+			struct smap_buckets *prev = b->prev;
+			free(b);
+			b = prev;
+		}
+
+		for (c = 0; c < SMAP_CLASSES; c++) free_chain(s->free[c]);
+		pthread_mutex_destroy(&s->lock);
+	}
+
+	free(map);
+}
+
+/**
+ * Start changing shard s, its lock must be held.
+ */
+static void write_begin(struct smap_shard *s) {
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	// readers seeing any of the following stores also see the odd number
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(struct smap_shard *s) {
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Find key in shard s and copy its value to value (if not NULL). Also
+ * called without the lock, everything read might be changed under us then
+ * and needs to be checked afterwards against the sequence number.
+ */
+static bool find(struct smap *map, struct smap_shard *s, const char *key, size_t len,
+		 uint64_t hash, void *value) {
+	struct smap_buckets *b = __atomic_load_n(&s->buckets, __ATOMIC_ACQUIRE);
+	// acquire, a new entry is complete before it is linked
+	struct smap_entry *e = __atomic_load_n(&b->heads[hash & b->mask], __ATOMIC_ACQUIRE);
+
+	// a chain changed under us might run in a circle
+	unsigned int steps = __atomic_load_n(&s->count, __ATOMIC_RELAXED) + 1;
+
+	for (; e && steps; e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE), steps--) {
+		if (__atomic_load_n(&e->hash, __ATOMIC_RELAXED) != hash) continue;
+
+		// key_size never changes, so we stay within the entry
+		if (len >= e->key_size || memcmp(entry_key(map, e), key, len + 1) != 0) continue;
+
+		if (value) memcpy(value, e->data, map->value_size);
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Look up key. If found its value is copied to value (if not NULL) and true
+ * is returned. *ticket (if not NULL) needs to be passed to smap_put() or
+ * smap_update() to store a result for key.
+ */
+bool smap_get(struct smap *map, const char *key, void *value, unsigned long *ticket) {
+	size_t len = strlen(key);
+	uint64_t hash = string_hash64(key, len);
+	struct smap_shard *s = get_shard(map, hash);
+	bool found;
+
+	int i;
+	for (i = 0; i < SMAP_READ_TRIES; i++) {
+		unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) continue; // a writer is busy
+
+		found = find(map, s, key, len, hash, value);
+		unsigned long t = __atomic_load_n(&s->tickets, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+			if (ticket) *ticket = t;
+			return found;
+		}
+	}
+
+	// the writers keep us busy, wait for them
+	pthread_mutex_lock(&s->lock);
+	found = find(map, s, key, len, hash, value);
+	if (ticket) *ticket = s->tickets;
+	pthread_mutex_unlock(&s->lock);
+
+	return found;
+}
+
+/**
+ * Get a ticket for smap_put() or smap_update() of key, before looking at
+ * what key stands for.
+ */
+unsigned long smap_ticket(struct smap *map, const char *key) {
+	uint64_t hash = string_hash64(key, strlen(key));
+	return __atomic_load_n(&get_shard(map, hash)->tickets, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Move the entries of shard s to its free lists. The lock must be held and
+ * the shard being written.
+ */
+static void empty_shard(struct smap *map, struct smap_shard *s) {
+	struct smap_buckets *b = s->buckets;
+
+	uint64_t i;
+	for (i = 0; i <= b->mask; i++) {
+		struct smap_entry *e = b->heads[i];
+		__atomic_store_n(&b->heads[i], NULL, __ATOMIC_RELAXED);
+
+		while (e) {
+			struct smap_entry *next = e->next;
+			__atomic_store_n(&e->next, s->free[e->class], __ATOMIC_RELAXED);
+			s->free[e->class] = e;
+			e = next;
+		}
+	}
+
+	__atomic_sub_fetch(&map->count, s->count, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->count, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Double the buckets of shard s, which is being written. The old array stays
+ * valid for readers still on it.
+ */
+static void grow(struct smap_shard *s) {
+	struct smap_buckets *old = s->buckets;
+	struct smap_buckets *b = new_buckets((old->mask + 1) * 2);
+	if (!b) return; // just longer chains
+
+	uint64_t i;
+	for (i = 0; i <= old->mask; i++) {
+		struct smap_entry *e = old->heads[i];
+		while (e) {
+			struct smap_entry *next = e->next;
+			struct smap_entry **head = &b->heads[e->hash & b->mask];
+			__atomic_store_n(&e->next, *head, __ATOMIC_RELAXED);
+			*head = e;
+			e = next;
+		}
+	}
+
+	b->prev = old;
+	__atomic_store_n(&s->buckets, b, __ATOMIC_RELEASE);
+}
+
+/**
+ * Add key to shard s, which is being written. Its value is all zero.
+ */
+static struct smap_entry *add(struct smap *map, struct smap_shard *s, const char *key, size_t len,
+			      uint64_t hash) {
+	// Simple size limit, a full shard is just emptied
+	if (map->max_per_shard && s->count >= map->max_per_shard) empty_shard(map, s);
+
+	unsigned int class = 0;
+	while ((size_t)(SMAP_MIN_KEY << class) < len + 1) class++;
+
+	struct smap_entry *e = s->free[class];
+	if (e) {
+		s->free[class] = e->next;
+	} else {
+		e = malloc(sizeof(struct smap_entry) + map->value_room + (SMAP_MIN_KEY << class));
+		if (!e) return NULL;
+		e->key_size = SMAP_MIN_KEY << class;
+		e->class = class;
+	}
+
+	__atomic_store_n(&e->hash, hash, __ATOMIC_RELAXED);
+	memset(e->data, 0, map->value_size);
+	memcpy(entry_key(map, e), key, len + 1);
+
+	if (s->count > s->buckets->mask) grow(s);
+
+	struct smap_entry **head = &s->buckets->heads[hash & s->buckets->mask];
+	__atomic_store_n(&e->next, *head, __ATOMIC_RELAXED);
+	__atomic_store_n(head, e, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&map->count, 1, __ATOMIC_RELAXED);
+
+	return e;
+}
+
+/**
+ * The entry of key in shard s, its lock must be held. prev is set to the
+ * pointer to it.
+ */
+static struct smap_entry *lookup_locked(struct smap *map, struct smap_shard *s, const char *key,
+					uint64_t hash, struct smap_entry ***prev) {
+	struct smap_entry **p = &s->buckets->heads[hash & s->buckets->mask];
+	struct smap_entry *e;
+
+	for (e = *p; e; p = &e->next, e = e->next) {
+		if (e->hash == hash && strcmp(entry_key(map, e), key) == 0) break;
+	}
+
+	if (prev) *prev = p;
+	return e;
+}
+
+/**
+ * Call fn with the value of key, which it may change. With SMAP_CREATE the
+ * key is added if it is missing, with SMAP_INVALIDATE the tickets of the
+ * shard become stale. Nothing is done if ticket is stale, unless it is
+ * SMAP_NO_TICKET. Returns true if fn was called.
+ */
+bool smap_update(struct smap *map, const char *key, unsigned long ticket, int flags,
+		 smap_update_fn fn, void *arg) {
+	size_t len = strlen(key);
+	if (len >= SMAP_KEY_MAX) return false;
+
+	uint64_t hash = string_hash64(key, len);
+	struct smap_shard *s = get_shard(map, hash);
+	bool done = false;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (ticket != SMAP_NO_TICKET && s->tickets != ticket) goto out; // invalidated in the mean time
+
+	struct smap_entry *e = lookup_locked(map, s, key, hash, NULL);
+	if (!e && !(flags & SMAP_CREATE) && !(flags & SMAP_INVALIDATE)) goto out;
+
+	write_begin(s);
+
+	bool created = false;
+	if (!e && (flags & SMAP_CREATE)) {
+		e = add(map, s, key, len, hash);
+		created = e != NULL;
+	}
+
+	if (e) {
+		fn(e->data, created, arg);
+		done = true;
+	}
+	if (flags & SMAP_INVALIDATE) __atomic_store_n(&s->tickets, s->tickets + 1, __ATOMIC_RELAXED);
+
+	write_end(s);
+
+out:
+	pthread_mutex_unlock(&s->lock);
+	return done;
+}
+
+struct put_arg {
+	const void *value;
+	size_t size;
+};
+
+static void put_value(void *value, bool created, void *arg) {
+	(void)created;
+	struct put_arg *put = arg;
+	memcpy(value, put->value, put->size);
+}
+
+/**
+ * Store value for key, unless ticket is stale. Returns true if stored.
+ */
+bool smap_put(struct smap *map, const char *key, const void *value, unsigned long ticket) {
+	struct put_arg put = { value, map->value_size };
+	return smap_update(map, key, ticket, SMAP_CREATE, put_value, &put);
+}
+
+/**
+ * Remove key, its value is copied to value (if not NULL). The tickets of its
+ * shard become stale in any case. Returns true if key was there.
+ */
+bool smap_remove(struct smap *map, const char *key, void *value) {
+	uint64_t hash = string_hash64(key, strlen(key));
+	struct smap_shard *s = get_shard(map, hash);
+
+	pthread_mutex_lock(&s->lock);
+	write_begin(s);
+
+	struct smap_entry **prev;
+	struct smap_entry *e = lookup_locked(map, s, key, hash, &prev);
+	if (e) {
+		if (value) memcpy(value, e->data, map->value_size);
+
+		__atomic_store_n(prev, e->next, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->next, s->free[e->class], __ATOMIC_RELAXED);
+		s->free[e->class] = e;
+
+		__atomic_store_n(&s->count, s->count - 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&map->count, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&s->tickets, s->tickets + 1, __ATOMIC_RELAXED);
+
+	write_end(s);
+	pthread_mutex_unlock(&s->lock);
+
+	return e != NULL;
+}
+
+/**
+ * Remove all keys, all tickets become stale.
+ */
+void smap_clear(struct smap *map) {
+	int i;
+	for (i = 0; i < SMAP_SHARDS; i++) {
+		struct smap_shard *s = &map->shards[i];
+
+		pthread_mutex_lock(&s->lock);
+		write_begin(s);
+		empty_shard(map, s);
+		__atomic_store_n(&s->tickets, s->tickets + 1, __ATOMIC_RELAXED);
+		write_end(s);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/**
+ * Number of keys, without any locking.
+ */
+unsigned long smap_count(struct smap *map) {
+	return __atomic_load_n(&map->count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,44 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef SMAP_H
+#define SMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "unionfs.h"
+
+#define SMAP_SHARDS 64			// independently written parts of a map
+#define SMAP_KEY_MAX PATHLEN_MAX	// longer keys are not stored
+#define SMAP_READ_TRIES 4		// lockless reads before taking the lock
+
+// flags of smap_update()
+#define SMAP_CREATE 1			// add the key if it is missing
+#define SMAP_INVALIDATE 2		// tickets handed out before become stale
+
+#define SMAP_NO_TICKET ((unsigned long)-1) // do not check the ticket
+
+struct smap;
+
+/**
+ * Called by smap_update() with the value of the key, which the callback may
+ * change. created is true for a key just added, its value is all zero.
+ */
+typedef void (*smap_update_fn)(void *value, bool created, void *arg);
+
+struct smap *smap_create(size_t value_size, unsigned long max_entries);
+void smap_destroy(struct smap *map);
+bool smap_get(struct smap *map, const char *key, void *value, unsigned long *ticket);
+unsigned long smap_ticket(struct smap *map, const char *key);
+bool smap_put(struct smap *map, const char *key, const void *value, unsigned long ticket);
+bool smap_update(struct smap *map, const char *key, unsigned long ticket, int flags,
+		 smap_update_fn fn, void *arg);
+bool smap_remove(struct smap *map, const char *key, void *value);
+void smap_clear(struct smap *map);
+unsigned long smap_count(struct smap *map);
+
+#endif
@@ -0,0 +1,418 @@
+/*
+* Description: operation counters, read with unionfsctl -s
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	The counters are always on, so they must be cheap on the hot path of
+*	every operation. Each thread counts into its own slot, which only this
+*	thread writes to, so a counter update is a plain (relaxed atomic) load
+*	and store of a cache line no other thread is writing, no lock and no
+*	locked instruction. stats_get() sums up all slots, the ioctl can be
+*	called any time without stopping the file system.
+*	libfuse starts and stops its worker threads as it likes. When a thread
+*	exits its slot is kept with all its counts and handed to the next new
+*	thread, so the sums never go backwards and the number of slots is
+*	bounded by the maximum number of threads at a time.
+*	Latencies go into log-linear (HDR style) histograms: each power of two
+*	nanoseconds is split into STATS_SUB_BUCKETS buckets, so a bucket is at
+*	most 1/STATS_SUB_BUCKETS wider than its lower bound, from nanoseconds to
+*	a minute in STATS_BUCKETS counters. Recording is a clz and an add, the
+*	percentiles are only computed when read. The histograms of the branches
+*	are allocated on their first use, most mounts have only a few branches.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "stats.h"
+#include "rcache.h"
+#include "bexec.h"
+#include "warmup.h"
+#include "debug.h"
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_slot {
+	struct unionfs_stats counters;	// nbranches and threads are unused
+	struct stats_hist hists[STATS_HISTS];
+	struct stats_hist *branch_hists[STATS_BRANCHES];
+	struct stats_slot *next;
+	bool in_use;			// owned by a running thread
+};
+
+static struct stats_slot *slots;	// never freed
+static unsigned int nslots;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct stats_slot *my_slot;
+
+/**
+ * Thread exit, the next new thread continues counting in the slot.
+ */
+static void release_slot(void *arg) {
+	struct stats_slot *slot = arg;
+
+	pthread_mutex_lock(&slots_lock);
+	slot->in_use = false;
+	pthread_mutex_unlock(&slots_lock);
+}
+
+static void create_slot_key(void) {
+	pthread_key_create(&slot_key, release_slot);
+}
+
+/**
+ * The slot of the calling thread, NULL if we ran out of memory.
+ */
+static struct stats_slot *get_slot(void) {
+	if (my_slot) return my_slot;
+
+	pthread_once(&slot_key_once, create_slot_key);
+
+	pthread_mutex_lock(&slots_lock);
+
+	struct stats_slot *slot;
+	for (slot = slots; slot; slot = slot->next) {
+		if (!slot->in_use) break;
+	}
+
+	if (!slot) {
+		slot = calloc(1, sizeof(struct stats_slot));
+		if (!slot) goto out;
+
+		slot->next = slots;
+		slots = slot;
+		nslots++;
+	}
+
+	slot->in_use = true;
+	pthread_setspecific(slot_key, slot);
+	my_slot = slot;
+
+out:
+	pthread_mutex_unlock(&slots_lock);
+	return slot;
+}
+
+// only the owner writes, stats_get() may read at the same time
+static inline void add(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * The bucket of a latency of ns nanoseconds.
+ */
+static unsigned int bucket(uint64_t ns) {
+	if (ns < STATS_SUB_BUCKETS) return ns; // exact
+
+	unsigned int exp = 63 - __builtin_clzll(ns);
+	if (exp > STATS_MAX_EXP) return STATS_BUCKETS - 1;
+
+	unsigned int sub = (ns >> (exp - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+	return (exp - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/**
+ * The highest latency counted in bucket b.
+ */
+static uint64_t bucket_limit(unsigned int b) {
+	if (b < STATS_SUB_BUCKETS) return b;
+
+	unsigned int shift = b / STATS_SUB_BUCKETS - 1;
+	uint64_t lower = (uint64_t)(STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS) << shift;
+	return lower + ((uint64_t)1 << shift) - 1;
+}
+
+static void record(struct stats_hist *hist, uint64_t ns) {
+	add(&hist->count, 1);
+	add(&hist->sum, ns);
+	add(&hist->buckets[bucket(ns)], 1);
+	if (ns > hist->max) __atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * Monotonic time in nanoseconds, where a measured operation starts.
+ */
+uint64_t stats_start(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t elapsed(uint64_t start) {
+	uint64_t now = stats_start();
+	return now > start ? now - start : 0;
+}
+
+/**
+ * Count an operation which began at start, res < 0 is an error, read and
+ * write count res bytes.
+ */
+void stats_op(enum stats_op op, long res, uint64_t start) {
+	struct stats_slot *slot = get_slot();
+	if (!slot) return;
+
+	record(&slot->hists[op], elapsed(start));
+
+	add(&slot->counters.calls[op], 1);
+
+	if (res < 0) {
+		add(&slot->counters.errors[op], 1);
+	} else if (op == STATS_OP_READ) {
+		add(&slot->counters.bytes_read, res);
+	} else if (op == STATS_OP_WRITE) {
+		add(&slot->counters.bytes_written, res);
+	}
+}
+
+/**
+ * find_branch() found a path on branch.
+ */
+void stats_branch_hit(int branch) {
+	struct stats_slot *slot = get_slot();
+	if (!slot) return;
+
+	if (branch >= STATS_BRANCHES) branch = STATS_BRANCHES - 1;
+	add(&slot->counters.branch_hits[branch], 1);
+}
+
+/**
+ * find_branch() looked for a path on branch, starting at start.
+ */
+void stats_branch_lookup(int branch, uint64_t start) {
+	struct stats_slot *slot = get_slot();
+	if (!slot) return;
+
+	if (branch >= STATS_BRANCHES) branch = STATS_BRANCHES - 1;
+
+	struct stats_hist *hist = slot->branch_hists[branch];
+	if (!hist) {
+		hist = calloc(1, sizeof(struct stats_hist));
+		if (!hist) return;
+
+		// stats_get_latency() may look at it right away
+		__atomic_store_n(&slot->branch_hists[branch], hist, __ATOMIC_RELEASE);
+	}
+
+	record(hist, elapsed(start));
+}
+
+void stats_lookup_cache_hit(void) {
+	struct stats_slot *slot = get_slot();
+	if (slot) add(&slot->counters.lookup_cache_hits, 1);
+}
+
+void stats_xattr_cache_hit(void) {
+	struct stats_slot *slot = get_slot();
+	if (slot) add(&slot->counters.xattr_cache_hits, 1);
+}
+
+void stats_whiteout_lookup(bool found) {
+	struct stats_slot *slot = get_slot();
+	if (!slot) return;
+
+	add(&slot->counters.whiteout_lookups, 1);
+	if (found) add(&slot->counters.whiteouts_found, 1);
+}
+
+void stats_copyup(void) {
+	struct stats_slot *slot = get_slot();
+	if (slot) add(&slot->counters.copyups, 1);
+}
+
+/**
+ * A copy-up, which began at start, is finished.
+ */
+void stats_copyup_done(uint64_t start) {
+	struct stats_slot *slot = get_slot();
+	if (slot) record(&slot->hists[STATS_HIST_COPYUP], elapsed(start));
+}
+
+void stats_copyup_bytes(uint64_t bytes) {
+	struct stats_slot *slot = get_slot();
+	if (slot) add(&slot->counters.copyup_bytes, bytes);
+}
+
+void stats_splice(bool write) {
+	struct stats_slot *slot = get_slot();
+	if (!slot) return;
+
+	if (write)
+		add(&slot->counters.spliced_writes, 1);
+	else
+		add(&slot->counters.spliced_reads, 1);
+}
+
+void stats_readahead(void) {
+	struct stats_slot *slot = get_slot();
+	if (slot) add(&slot->counters.readahead_windows, 1);
+}
+
+void stats_rcache_hit(void) {
+	struct stats_slot *slot = get_slot();
+	if (slot) add(&slot->counters.cache_hits, 1);
+}
+
+void stats_rcache_copy(uint64_t bytes) {
+	struct stats_slot *slot = get_slot();
+	if (!slot) return;
+
+	add(&slot->counters.cache_copies, 1);
+	add(&slot->counters.cache_copy_bytes, bytes);
+}
+
+void stats_rcache_evict(void) {
+	struct stats_slot *slot = get_slot();
+	if (slot) add(&slot->counters.cache_evictions, 1);
+}
+
+#define SUM(field) stats->field += __atomic_load_n(&c->field, __ATOMIC_RELAXED)
+
+/**
+ * Sum up the counters of all threads.
+ */
+void stats_get(struct unionfs_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+
+	stats->nbranches = NBRANCHES < STATS_BRANCHES ? NBRANCHES : STATS_BRANCHES;
+
+	pthread_mutex_lock(&slots_lock);
+
+	stats->threads = nslots;
+
+	struct stats_slot *slot;
+	for (slot = slots; slot; slot = slot->next) {
+		const struct unionfs_stats *c = &slot->counters;
+		int i;
+
+		for (i = 0; i < STATS_OPS; i++) {
+			SUM(calls[i]);
+			SUM(errors[i]);
+		}
+		for (i = 0; i < STATS_BRANCHES; i++) SUM(branch_hits[i]);
+
+		SUM(bytes_read);
+		SUM(bytes_written);
+		SUM(lookup_cache_hits);
+		SUM(whiteout_lookups);
+		SUM(whiteouts_found);
+		SUM(copyups);
+		SUM(copyup_bytes);
+		SUM(spliced_reads);
+		SUM(spliced_writes);
+		SUM(readahead_windows);
+		SUM(cache_hits);
+		SUM(cache_copies);
+		SUM(cache_copy_bytes);
+		SUM(cache_evictions);
+		SUM(xattr_cache_hits);
+	}
+
+	pthread_mutex_unlock(&slots_lock);
+
+	if (uopt.cache_branch) stats->cache_bytes = rcache_used();
+	bexec_get(stats);
+	warmup_get(stats);
+}
+
+static void merge(struct stats_hist *to, const struct stats_hist *from) {
+	to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	if (max > to->max) to->max = max;
+
+	int i;
+	for (i = 0; i < STATS_BUCKETS; i++)
+		to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+}
+
+/**
+ * The latency below which a fraction q of the counted ones are.
+ */
+static uint64_t percentile(const struct stats_hist *hist, uint64_t total, double q) {
+	uint64_t rank = (uint64_t)(q * total + 0.5);
+	if (rank == 0) rank = 1;
+
+	uint64_t seen = 0;
+	int i;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) break;
+	}
+	if (i == STATS_BUCKETS) i--;
+
+	uint64_t limit = bucket_limit(i);
+	return limit < hist->max ? limit : hist->max;
+}
+
+static void summarize(const struct stats_hist *hist, struct unionfs_latency_summary *sum) {
+	// the buckets may have been updated after count was read
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < STATS_BUCKETS; i++) total += hist->buckets[i];
+
+	memset(sum, 0, sizeof(*sum));
+	if (total == 0) return;
+
+	sum->count = total;
+	sum->mean = hist->sum / (hist->count ? hist->count : 1);
+	sum->p50 = percentile(hist, total, 0.5);
+	sum->p99 = percentile(hist, total, 0.99);
+	sum->p999 = percentile(hist, total, 0.999);
+	sum->max = hist->max;
+}
+
+/**
+ * Merge the latency histograms of all threads and compute the percentiles.
+ */
+void stats_get_latency(struct unionfs_latency *latency) {
+	memset(latency, 0, sizeof(*latency));
+
+	latency->nbranches = NBRANCHES < STATS_BRANCHES ? NBRANCHES : STATS_BRANCHES;
+
+	struct stats_hist *hist = malloc(sizeof(struct stats_hist));
+	if (!hist) return;
+
+	pthread_mutex_lock(&slots_lock);
+
+	int i;
+	for (i = 0; i < STATS_HISTS + (int)latency->nbranches; i++) {
+		memset(hist, 0, sizeof(*hist));
+
+		struct stats_slot *slot;
+		for (slot = slots; slot; slot = slot->next) {
+			if (i < STATS_HISTS) {
+				merge(hist, &slot->hists[i]);
+				continue;
+			}
+
+			struct stats_hist *bhist = __atomic_load_n(&slot->branch_hists[i - STATS_HISTS], __ATOMIC_ACQUIRE);
+			if (bhist) merge(hist, bhist);
+		}
+
+		if (i < STATS_HISTS)
+			summarize(hist, &latency->ops[i]);
+		else
+			summarize(hist, &latency->branches[i - STATS_HISTS]);
+	}
+
+	pthread_mutex_unlock(&slots_lock);
+
+	free(hist);
+}
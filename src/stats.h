@@ -0,0 +1,186 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STATS_BRANCHES 64	// branches with their own hit counter, the last one counts the rest
+
+// latency histograms: 2^STATS_SUB_BITS buckets per power of two nanoseconds
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP 35	// ~69s, longer is counted in the last bucket
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+
+// operations of both engines, counted by stats_op()
+enum stats_op {
+	STATS_OP_ACCESS,
+	STATS_OP_CHMOD,
+	STATS_OP_CHOWN,
+	STATS_OP_CREATE,
+	STATS_OP_FLUSH,
+	STATS_OP_FSYNC,
+	STATS_OP_FTRUNCATE,
+	STATS_OP_GETATTR,
+	STATS_OP_GETXATTR,
+	STATS_OP_IOCTL,
+	STATS_OP_LINK,
+	STATS_OP_LISTXATTR,
+	STATS_OP_LOOKUP,
+	STATS_OP_MKDIR,
+	STATS_OP_MKNOD,
+	STATS_OP_OPEN,
+	STATS_OP_OPENDIR,
+	STATS_OP_READ,
+	STATS_OP_READDIR,
+	STATS_OP_READLINK,
+	STATS_OP_RELEASE,
+	STATS_OP_RELEASEDIR,
+	STATS_OP_REMOVEXATTR,
+	STATS_OP_RENAME,
+	STATS_OP_RMDIR,
+	STATS_OP_SETXATTR,
+	STATS_OP_STATFS,
+	STATS_OP_SYMLINK,
+	STATS_OP_TRUNCATE,
+	STATS_OP_UNLINK,
+	STATS_OP_UTIMENS,
+	STATS_OP_WRITE,
+	STATS_OPS
+};
+
+#define STATS_HIST_COPYUP STATS_OPS	// latency of a whole copy-up
+#define STATS_HISTS (STATS_OPS + 1)
+
+static const char *const stats_op_names[STATS_OPS] = {
+	[STATS_OP_ACCESS] = "access",
+	[STATS_OP_CHMOD] = "chmod",
+	[STATS_OP_CHOWN] = "chown",
+	[STATS_OP_CREATE] = "create",
+	[STATS_OP_FLUSH] = "flush",
+	[STATS_OP_FSYNC] = "fsync",
+	[STATS_OP_FTRUNCATE] = "ftruncate",
+	[STATS_OP_GETATTR] = "getattr",
+	[STATS_OP_GETXATTR] = "getxattr",
+	[STATS_OP_IOCTL] = "ioctl",
+	[STATS_OP_LINK] = "link",
+	[STATS_OP_LISTXATTR] = "listxattr",
+	[STATS_OP_LOOKUP] = "lookup",
+	[STATS_OP_MKDIR] = "mkdir",
+	[STATS_OP_MKNOD] = "mknod",
+	[STATS_OP_OPEN] = "open",
+	[STATS_OP_OPENDIR] = "opendir",
+	[STATS_OP_READ] = "read",
+	[STATS_OP_READDIR] = "readdir",
+	[STATS_OP_READLINK] = "readlink",
+	[STATS_OP_RELEASE] = "release",
+	[STATS_OP_RELEASEDIR] = "releasedir",
+	[STATS_OP_REMOVEXATTR] = "removexattr",
+	[STATS_OP_RENAME] = "rename",
+	[STATS_OP_RMDIR] = "rmdir",
+	[STATS_OP_SETXATTR] = "setxattr",
+	[STATS_OP_STATFS] = "statfs",
+	[STATS_OP_SYMLINK] = "symlink",
+	[STATS_OP_TRUNCATE] = "truncate",
+	[STATS_OP_UNLINK] = "unlink",
+	[STATS_OP_UTIMENS] = "utimens",
+	[STATS_OP_WRITE] = "write",
+};
+
+// the workers of a branch with -o branch_threads
+struct unionfs_branch_exec {
+	uint32_t queued;		// calls waiting for a worker
+	uint32_t busy;			// workers running a call
+	uint64_t calls;
+	uint64_t timeouts;		// calls given up after -o branch_timeout
+	uint64_t rejected;		// calls failed at once, queue full or branch degraded
+	uint32_t degraded;
+	uint32_t padding;
+};
+
+// states of the warm-up
+#define STATS_WARMUP_OFF 0
+#define STATS_WARMUP_RUNNING 1
+#define STATS_WARMUP_DONE 2
+
+// the warm-up of -o warmup
+struct unionfs_warmup {
+	uint32_t state;			// STATS_WARMUP_*
+	uint32_t branches_left;		// whiteout indexes not loaded yet
+	uint64_t whiteouts;		// loaded into the indexes
+	uint64_t dirs;			// of -o warmup_dirs walked
+	uint64_t entries;		// looked up in them
+	uint64_t msecs;			// since the start, until done
+};
+
+// what UNIONFS_STATS_GET hands out, counted since the mount
+struct unionfs_stats {
+	uint32_t nbranches;		// valid entries of branch_hits
+	uint32_t threads;		// threads that ever counted something
+	uint64_t calls[STATS_OPS];
+	uint64_t errors[STATS_OPS];
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t branch_hits[STATS_BRANCHES];	// find_branch() results
+	uint64_t lookup_cache_hits;
+	uint64_t whiteout_lookups;
+	uint64_t whiteouts_found;
+	uint64_t copyups;		// entries copied to a rw-branch
+	uint64_t copyup_bytes;
+	uint64_t spliced_reads;		// reads libfuse could splice() from the branch
+	uint64_t spliced_writes;
+	uint64_t readahead_windows;	// POSIX_FADV_WILLNEED hints of -o readahead
+	uint64_t cache_hits;		// opens served from the CACHE branch
+	uint64_t cache_copies;		// files copied to the CACHE branch
+	uint64_t cache_copy_bytes;
+	uint64_t cache_evictions;
+	uint64_t cache_bytes;		// currently on the CACHE branch
+	uint64_t xattr_cache_hits;	// xattr calls answered by -o xattr_cache
+	uint32_t branch_threads;	// workers per branch, 0 without -o branch_threads
+	uint32_t padding;
+	struct unionfs_branch_exec branch_exec[STATS_BRANCHES];
+	struct unionfs_warmup warmup;
+};
+
+// a latency histogram boiled down, all times in nanoseconds
+struct unionfs_latency_summary {
+	uint64_t count;
+	uint64_t mean;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+// what UNIONFS_STATS_LATENCY hands out
+struct unionfs_latency {
+	uint32_t nbranches;		// valid entries of branches
+	struct unionfs_latency_summary ops[STATS_HISTS];
+	struct unionfs_latency_summary branches[STATS_BRANCHES]; // lookups in find_branch()
+};
+
+uint64_t stats_start(void);
+void stats_op(enum stats_op op, long res, uint64_t start);
+void stats_branch_hit(int branch);
+void stats_branch_lookup(int branch, uint64_t start);
+void stats_lookup_cache_hit(void);
+void stats_xattr_cache_hit(void);
+void stats_whiteout_lookup(bool found);
+void stats_copyup(void);
+void stats_copyup_done(uint64_t start);
+void stats_copyup_bytes(uint64_t bytes);
+void stats_splice(bool write);
+void stats_readahead(void);
+void stats_rcache_hit(void);
+void stats_rcache_copy(uint64_t bytes);
+void stats_rcache_evict(void);
+void stats_get(struct unionfs_stats *stats);
+void stats_get_latency(struct unionfs_latency *latency);
+
+#endif
@@ -18,11 +18,13 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "unionfs.h"
 #include "opts.h"
 #include "debug.h"
 #include "general.h"
+#include "string.h"
 #include "usyslog.h"
 
 /**
@@ -157,38 +159,40 @@ char *u_dirname(const char *path) {
 }
 
 /**
- * general elf hash (32-bit) function
- *
- * Algorithm taken from URL: http://www.partow.net/programming/hashfunctions/index.html,
- * but rewritten from scratch due to incompatible license.
- *
- * str needs to NULL terminated
+ * 64-bit string hash, it processes 8 bytes per step and uses the
+ * multiply-xorshift mixing of MurmurHash64A.
  */
-static unsigned int elfhash(const char *str) {
-	DBG("%s\n", str);
+uint64_t string_hash64(const char *str, size_t len) {
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	uint64_t hash = 0x8445d61a4e774912ULL ^ (len * m);
 
-	unsigned int hash = 0;
+	while (len >= 8) {
+		uint64_t k;
+		memcpy(&k, str, 8); // might be unaligned
 
-	while (*str) {
-		hash = (hash << 4) + (*str); // hash * 16 + c
+		k *= m;
+		k ^= k >> 47;
+		k *= m;
 
-		// 0xF is 1111 in dual system, so highbyte is the highest byte of hash (which is 32bit == 4 Byte)
-		unsigned int highbyte = hash & 0xF0000000UL;
+		hash ^= k;
+		hash *= m;
 
-		if (highbyte != 0) hash ^= (highbyte >> 24);
-		// example (if the condition is met):
-		//               hash = 10110000000000000000000010100000
-		//           highbyte = 10110000000000000000000000000000
-		//   (highbyte >> 24) = 00000000000000000000000010110000
-		// after XOR:    hash = 10110000000000000000000000010000
+		str += 8;
+		len -= 8;
+	}
 
-		hash &= ~highbyte;
-		//          ~highbyte = 01001111111111111111111111111111
-		// after AND:    hash = 00000000000000000000000000010000
+	if (len) {
+		uint64_t k = 0;
+		memcpy(&k, str, len);
 
-		str++;
+		hash ^= k;
+		hash *= m;
 	}
 
+	hash ^= hash >> 47;
+	hash *= m;
+	hash ^= hash >> 47;
+
 	return hash;
 }
 
@@ -197,5 +201,19 @@ static unsigned int elfhash(const char *str) {
  * hash algorith.
  */
 unsigned int string_hash(void *s) {
-	return elfhash(s);
+	uint64_t hash = string_hash64(s, strlen(s));
+
+	return (unsigned int)(hash ^ (hash >> 32));
+}
+
+static __thread char scratch_paths[SCRATCH_SLOTS][PATHLEN_MAX];
+
+/**
+ * A PATHLEN_MAX buffer of the calling thread, for the functions on the
+ * path of every lookup instead of buffers on their stack. Only the user
+ * of slot may use it, so it must not be used by anything the user calls
+ * while it needs the contents.
+ */
+char *scratch_path(enum scratch_slot slot) {
+	return scratch_paths[slot];
 }
@@ -8,12 +8,25 @@
 #define UNIONFS_STRING_H
 
 #include <string.h>
+#include <stdint.h>
 
 char *whiteout_tag(const char *fname);
 int build_path(char *dest, int max_len, const char *callfunc, int line, ...);
 char *u_dirname(const char *path);
+uint64_t string_hash64(const char *str, size_t len);
 unsigned int string_hash(void *s);
 
+// the users of the per-thread path buffers, each has its own
+enum scratch_slot {
+	SCRATCH_HIDDEN,		// path_hidden()
+	SCRATCH_HIDDEN_PART,	// path_hidden()
+	SCRATCH_HIDDEN_TAG,	// filedir_hidden()
+	SCRATCH_WINDEX,		// windex_hidden()
+	SCRATCH_SLOTS
+};
+
+char *scratch_path(enum scratch_slot slot);
+
 /**
  * A wrapper for build_path(). In build_path() we test if the given number of strings does exceed
  * a maximum string length. Since there is no way in C to determine the given number of arguments, we
@@ -0,0 +1,152 @@
+/*
+* Description: set of strings, used to merge directories
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	readdir() needs to remember all names it already returned and all
+*	whiteouts it found, for directories with many entries that used to
+*	be one strdup() and one chain node per name in the generic hashtable.
+*	Here the strings are copied into a bump-pointer arena of large chunks
+*	and the set itself is an open-addressing table with linear probing,
+*	which stores the full hash next to the string pointer. So an insert
+*	usually needs no malloc() at all and freeing the set is freeing a few
+*	chunks. Strings can not be removed.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "string.h"
+#include "strset.h"
+
+struct strset_chunk {
+	struct strset_chunk *next;
+	char data[];
+};
+
+/**
+ * Get an empty set, returns -1 if we ran out of memory.
+ */
+int strset_init(strset_t *set) {
+	memset(set, 0, sizeof(*set));
+
+	set->slots = calloc(STRSET_MIN_SLOTS, sizeof(struct strset_slot));
+	if (!set->slots) return -1;
+
+	set->mask = STRSET_MIN_SLOTS - 1;
+	return 0;
+}
+
+/**
+ * Copy str of len bytes (including the '\0') into the arena.
+ */
+static const char *arena_copy(strset_t *set, const char *str, size_t len) {
+	if (len > set->arena_left) {
+		size_t size = len > STRSET_CHUNK_SIZE ? len : STRSET_CHUNK_SIZE;
+
+		struct strset_chunk *chunk = malloc(sizeof(struct strset_chunk) + size);
+		if (!chunk) return NULL;
+
+		chunk->next = set->chunks;
+		set->chunks = chunk;
+		set->arena_ptr = chunk->data;
+		set->arena_left = size;
+	}
+
+	char *copy = set->arena_ptr;
+	memcpy(copy, str, len);
+	set->arena_ptr += len;
+	set->arena_left -= len;
+
+	return copy;
+}
+
+/**
+ * Find the slot of str, or the empty slot where it belongs to.
+ */
+static struct strset_slot *find_slot(const strset_t *set, const char *str, uint64_t hash) {
+	size_t i = hash & set->mask;
+
+	while (set->slots[i].str) {
+		if (set->slots[i].hash == hash && strcmp(set->slots[i].str, str) == 0) break;
+		i = (i + 1) & set->mask;
+	}
+
+	return &set->slots[i];
+}
+
+/**
+ * Double the number of slots.
+ */
+static int grow(strset_t *set) {
+	size_t nslots = (set->mask + 1) * 2;
+
+	struct strset_slot *slots = calloc(nslots, sizeof(struct strset_slot));
+	if (!slots) return -1;
+
+	size_t i;
+	for (i = 0; i <= set->mask; i++) {
+		if (!set->slots[i].str) continue;
+
+		size_t j = set->slots[i].hash & (nslots - 1);
+		while (slots[j].str) j = (j + 1) & (nslots - 1);
+		slots[j] = set->slots[i];
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->mask = nslots - 1;
+
+	return 0;
+}
+
+/**
+ * Add a copy of str. Returns 1 if it was added, 0 if it was already in the
+ * set and -1 if we ran out of memory.
+ */
+int strset_add(strset_t *set, const char *str) {
+	size_t len = strlen(str);
+	uint64_t hash = string_hash64(str, len);
+
+	struct strset_slot *slot = find_slot(set, str, hash);
+	if (slot->str) return 0;
+
+	// keep the load factor below 3/4, probe sequences stay short
+	if ((set->count + 1) * 4 > (set->mask + 1) * 3) {
+		if (grow(set)) return -1;
+		slot = find_slot(set, str, hash);
+	}
+
+	const char *copy = arena_copy(set, str, len + 1);
+	if (!copy) return -1;
+
+	slot->hash = hash;
+	slot->str = copy;
+	set->count++;
+
+	return 1;
+}
+
+bool strset_contains(const strset_t *set, const char *str) {
+	uint64_t hash = string_hash64(str, strlen(str));
+
+	return find_slot(set, str, hash)->str != NULL;
+}
+
+/**
+ * Release the set including all strings.
+ */
+void strset_free(strset_t *set) {
+	struct strset_chunk *chunk = set->chunks;
+	while (chunk) {
+		struct strset_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
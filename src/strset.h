@@ -0,0 +1,38 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef STRSET_H
+#define STRSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STRSET_MIN_SLOTS 256		// initial size of the slot table
+#define STRSET_CHUNK_SIZE (64 * 1024)	// arena chunk for the strings
+
+struct strset_chunk;
+
+struct strset_slot {
+	uint64_t hash;
+	const char *str;	// NULL for an empty slot
+};
+
+typedef struct {
+	struct strset_slot *slots;
+	size_t mask;			// number of slots - 1
+	size_t count;
+	struct strset_chunk *chunks;	// string arena
+	char *arena_ptr;		// free space in the current chunk
+	size_t arena_left;
+} strset_t;
+
+int strset_init(strset_t *set);
+int strset_add(strset_t *set, const char *str);
+bool strset_contains(const strset_t *set, const char *str);
+void strset_free(strset_t *set);
+
+#endif
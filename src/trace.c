@@ -0,0 +1,391 @@
+/*
+* Description: binary tracing of operations, decoded by unionfstrace
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	DBG() formats text and writes it twice under a lock, with debugging
+*	enabled all threads are serialized on it. Tracing (-o trace_file or
+*	unionfsctl -t on) instead stores a fixed size struct trace_record per
+*	operation, lookup and copy-up into a ring of the calling thread. Each
+*	ring has a single producer (its thread) and a single consumer (the
+*	drainer thread), so head and tail are plain atomic loads and stores.
+*	If a ring is full the record is dropped and counted, a thread never
+*	waits for the drainer. The drainer writes the rings to the trace file
+*	every TRACE_DRAIN_MS and notes dropped records in the file.
+*	The records only contain the hash of the path. The first time a thread
+*	sees a path (as far as its small TRACE_SEEN_SLOTS cache knows) it also
+*	writes the path itself as TRACE_EV_PATH records, so that the decoder
+*	can print names.
+*	With -o trace_capture each operation is preceded by a TRACE_EV_ARGS
+*	record of its arguments (flags, sizes, offsets, file handle, the second
+*	path), which is enough for unionfs-replay to run the operations again.
+*	As the rings of the stats, rings of exited threads are reused.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "opts.h"
+#include "trace.h"
+#include "string.h"
+#include "debug.h"
+#include "usyslog.h"
+
+struct trace_ring {
+	struct trace_record records[TRACE_RING_SIZE];
+	uint64_t head;			// next record to write, by the owner
+	uint64_t tail;			// next record to drain, by the drainer
+	uint64_t dropped;		// by the owner
+	uint64_t dropped_reported;	// by the drainer
+	uint64_t seen[TRACE_SEEN_SLOTS];// path hashes already named
+	unsigned int generation;	// seen is valid for this trace file
+	uint32_t tid;
+	bool in_use;
+	struct trace_ring *next;
+};
+
+bool trace_enabled = false;
+
+static struct trace_ring *rings;	// never freed
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_ring *my_ring;
+
+// protected by control_lock: trace_start(), trace_stop() and the drainer
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static FILE *trace_file;
+static pthread_t drainer;
+static bool drainer_running;
+static bool drainer_stop;
+static unsigned int generation;		// incremented by trace_start()
+
+static void release_ring(void *arg) {
+	struct trace_ring *ring = arg;
+
+	pthread_mutex_lock(&rings_lock);
+	ring->in_use = false;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void create_ring_key(void) {
+	pthread_key_create(&ring_key, release_ring);
+}
+
+static uint32_t get_tid(void) {
+#ifdef SYS_gettid
+	return syscall(SYS_gettid);
+#else
+	return (uint32_t)(uintptr_t)pthread_self();
+#endif
+}
+
+/**
+ * The ring of the calling thread, NULL if we ran out of memory.
+ */
+static struct trace_ring *get_ring(void) {
+	if (my_ring) return my_ring;
+
+	pthread_once(&ring_key_once, create_ring_key);
+
+	pthread_mutex_lock(&rings_lock);
+
+	struct trace_ring *ring;
+	for (ring = rings; ring; ring = ring->next) {
+		if (!ring->in_use) break;
+	}
+
+	if (!ring) {
+		ring = calloc(1, sizeof(struct trace_ring));
+		if (!ring) goto out;
+
+		ring->next = rings;
+		rings = ring;
+	}
+
+	// the records of the old owner keep its tid
+	ring->tid = get_tid();
+	ring->generation = 0;
+	ring->in_use = true;
+	pthread_setspecific(ring_key, ring);
+	my_ring = ring;
+
+out:
+	pthread_mutex_unlock(&rings_lock);
+	return ring;
+}
+
+/**
+ * Check for n consecutive free records, count them as dropped if the ring is
+ * too full.
+ */
+static bool reserve(struct trace_ring *ring, uint64_t n) {
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (ring->head - tail + n > TRACE_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + n, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	return true;
+}
+
+static struct trace_record *slot(struct trace_ring *ring, uint64_t i) {
+	return &ring->records[(ring->head + i) & (TRACE_RING_SIZE - 1)];
+}
+
+/**
+ * The TRACE_EV_PATH records needed to name path, 0 if the ring named it
+ * already.
+ */
+static uint64_t names_needed(struct trace_ring *ring, const char *path, size_t *len, uint64_t *hash) {
+	*len = 0;
+	*hash = 0;
+	if (!path) return 0;
+
+	*len = strlen(path);
+	*hash = string_hash64(path, *len);
+	if (ring->seen[*hash % TRACE_SEEN_SLOTS] == *hash) return 0;
+
+	return *len / TRACE_NAME_LEN + 1; // including the '\0'
+}
+
+/**
+ * Fill the n TRACE_EV_PATH records of path from slot first on.
+ */
+static void put_names(struct trace_ring *ring, uint64_t first, uint64_t n, const char *path, size_t len, uint64_t hash) {
+	uint64_t i;
+	for (i = 0; i < n; i++) {
+		struct trace_record *rec = slot(ring, first + i);
+		size_t off = i * TRACE_NAME_LEN;
+		size_t bytes = len + 1 - off < TRACE_NAME_LEN ? len + 1 - off : TRACE_NAME_LEN;
+
+		rec->event = TRACE_EV_PATH;
+		rec->branch = i;
+		rec->tid = ring->tid;
+		rec->path_hash = hash;
+		memset(rec->u.name, 0, TRACE_NAME_LEN);
+		memcpy(rec->u.name, path + off, bytes);
+	}
+	if (n) ring->seen[hash % TRACE_SEEN_SLOTS] = hash;
+}
+
+/**
+ * Record an event on path (may be NULL), which began at start, preceded by
+ * the arguments if not NULL. All records of an event are consecutive in
+ * the ring and so in the trace file.
+ */
+static void record(int event, const char *path, int branch, int res, uint64_t start,
+		   const struct trace_args *args) {
+	struct trace_ring *ring = get_ring();
+	if (!ring) return;
+
+	unsigned int gen = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+	if (ring->generation != gen) {
+		// a new trace file, which does not know any names yet
+		memset(ring->seen, 0, sizeof(ring->seen));
+		ring->generation = gen;
+	}
+
+	size_t len, len2;
+	uint64_t hash, hash2;
+	uint64_t names = names_needed(ring, path, &len, &hash);
+	uint64_t names2 = args ? names_needed(ring, args->path2, &len2, &hash2) : 0;
+	if (names2 && hash2 == hash) names2 = 0; // rename to itself
+	uint64_t n = names + names2 + (args ? 1 : 0);
+
+	if (!reserve(ring, n + 1)) return;
+
+	put_names(ring, 0, names, path, len, hash);
+	if (args) {
+		put_names(ring, names, names2, args->path2, len2, hash2);
+
+		struct trace_record *rec = slot(ring, n - 1);
+		rec->event = TRACE_EV_ARGS;
+		rec->branch = -1;
+		rec->tid = ring->tid;
+		rec->path_hash = args->path2 ? hash2 : args->fh;
+		rec->u.args.a = args->a;
+		rec->u.args.b = args->b;
+	}
+
+	uint64_t now = stats_start();
+	struct trace_record *rec = slot(ring, n);
+	rec->event = event;
+	rec->branch = branch;
+	rec->tid = ring->tid;
+	rec->path_hash = hash;
+	rec->u.op.time = start;
+	rec->u.op.res = res;
+	rec->u.op.duration = now - start > UINT32_MAX ? UINT32_MAX : now - start;
+
+	// publish the records to the drainer
+	__atomic_store_n(&ring->head, ring->head + n + 1, __ATOMIC_RELEASE);
+}
+
+void trace_event(int event, const char *path, int branch, int res, uint64_t start) {
+	record(event, path, branch, res, start, NULL);
+}
+
+/**
+ * Record an operation, with -o trace_capture also its arguments.
+ */
+void trace_event_args(int event, const char *path, int res, uint64_t start, const struct trace_args *args) {
+	record(event, path, -1, res, start, uopt.trace_capture ? args : NULL);
+}
+
+/**
+ * Write out what the threads recorded, with control_lock held.
+ */
+static void drain(void) {
+	pthread_mutex_lock(&rings_lock);
+	struct trace_ring *list = rings;
+	pthread_mutex_unlock(&rings_lock);
+
+	// rings are only added at the front, we see all rings up to list
+	struct trace_ring *ring;
+	for (ring = list; ring; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+
+		while (tail != head) {
+			uint64_t start = tail & (TRACE_RING_SIZE - 1);
+			uint64_t n = head - tail;
+			if (n > TRACE_RING_SIZE - start) n = TRACE_RING_SIZE - start;
+
+			fwrite(&ring->records[start], sizeof(struct trace_record), n, trace_file);
+			tail += n;
+		}
+
+		// the owner may now reuse the records
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_reported) {
+			struct trace_record rec;
+			memset(&rec, 0, sizeof(rec));
+			rec.event = TRACE_EV_DROPPED;
+			rec.branch = -1;
+			rec.tid = ring->tid;
+			rec.u.op.time = stats_start();
+			rec.u.op.res = dropped - ring->dropped_reported;
+			fwrite(&rec, sizeof(rec), 1, trace_file);
+
+			ring->dropped_reported = dropped;
+		}
+	}
+
+	fflush(trace_file);
+}
+
+static void *drainer_main(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&control_lock);
+
+	while (!drainer_stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TRACE_DRAIN_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+
+		pthread_cond_timedwait(&drain_cond, &control_lock, &ts);
+		drain();
+	}
+
+	pthread_mutex_unlock(&control_lock);
+	return NULL;
+}
+
+/**
+ * Start tracing into path, which is truncated. Returns 0 or -errno.
+ */
+int trace_start(const char *path) {
+	pthread_mutex_lock(&control_lock);
+
+	int res = 0;
+	if (trace_file) goto out; // already running
+
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		res = -errno;
+		USYSLOG(LOG_ERR, "Failed to open trace file %s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	struct trace_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.record_size = sizeof(struct trace_record);
+	header.events = TRACE_EVENTS;
+	fwrite(&header, sizeof(header), 1, trace_file);
+
+	// records of a previous trace file which the drainer did not write
+	// out anymore are lost, just as the names this file does not know yet
+	struct trace_ring *ring;
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = ring->next) {
+		__atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+		ring->dropped_reported = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&rings_lock);
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+
+	drainer_stop = false;
+	res = -pthread_create(&drainer, NULL, drainer_main, NULL);
+	if (res) {
+		fclose(trace_file);
+		trace_file = NULL;
+		goto out;
+	}
+	drainer_running = true;
+
+	__atomic_store_n(&trace_enabled, true, __ATOMIC_RELAXED);
+
+out:
+	pthread_mutex_unlock(&control_lock);
+	return res;
+}
+
+/**
+ * Stop tracing and write out all records.
+ */
+void trace_stop(void) {
+	__atomic_store_n(&trace_enabled, false, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&control_lock);
+
+	if (drainer_running) {
+		drainer_stop = true;
+		pthread_cond_signal(&drain_cond);
+		pthread_mutex_unlock(&control_lock);
+
+		pthread_join(drainer, NULL);
+
+		pthread_mutex_lock(&control_lock);
+		drainer_running = false;
+	}
+
+	if (trace_file) {
+		// what was recorded until the threads noticed trace_enabled
+		drain();
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+
+	pthread_mutex_unlock(&control_lock);
+}
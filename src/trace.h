@@ -0,0 +1,95 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+#define TRACE_MAGIC "UFSTRC01"
+#define TRACE_RING_SIZE 4096	// records per thread, must be a power of two
+#define TRACE_SEEN_SLOTS 256	// paths per thread we know we already named
+#define TRACE_DRAIN_MS 100	// the drainer writes out the rings this often
+#define TRACE_NAME_LEN 16	// path bytes per TRACE_EV_PATH record
+#define TRACE_DEFAULT_FILE "./unionfs_trace.bin" // unionfsctl -t on without -o trace_file
+
+// record types besides the operations of enum stats_op
+enum trace_event {
+	TRACE_EV_FIND_BRANCH = STATS_OPS,	// branch = find_rorw_branch() result
+	TRACE_EV_COPYUP,			// branch = the rw-branch
+	TRACE_EV_PATH,				// a piece of the path with path_hash
+	TRACE_EV_DROPPED,			// res = records lost as a ring was full
+	TRACE_EV_ARGS,				// of the next record, see struct trace_args
+	TRACE_EVENTS
+};
+
+// the trace file is a struct trace_header followed by records
+struct trace_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t events;	// TRACE_EVENTS
+};
+
+struct trace_record {
+	uint16_t event;
+	int16_t branch;		// -1 if none, the piece number for TRACE_EV_PATH
+	uint32_t tid;
+	uint64_t path_hash;	// string_hash64() of the path, 0 if none
+	union {
+		struct {
+			uint64_t time;		// CLOCK_MONOTONIC, ns
+			int32_t res;		// -errno on failure
+			uint32_t duration;	// ns, saturated
+		} op;
+		struct {
+			uint64_t a;
+			uint64_t b;
+		} args;
+		char name[TRACE_NAME_LEN];	// not '\0' terminated if full
+	} u;
+};
+
+/*
+ * The arguments of an operation, which -o trace_capture records for
+ * unionfs-replay. A TRACE_EV_ARGS record has the path_hash of path2, or fh
+ * if there is no path2, and a and b.
+ */
+struct trace_args {
+	const char *path2;	// rename and link target, symlink contents, xattr name
+	uint64_t fh;		// fi->fh
+	uint64_t a;		// flags, mode, size, mask or uid
+	uint64_t b;		// offset, mode of create, rdev, gid or xattr flags
+};
+
+extern bool trace_enabled;
+
+// the start time for TRACE(), without tracing we do not need it
+#define TRACE_START() (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED) ? stats_start() : 0)
+
+#define TRACE(event, path, branch, res, start) \
+	do { \
+		if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) \
+			trace_event(event, path, branch, res, start); \
+	} while (0)
+
+// as TRACE() for an operation, args is an initializer of struct trace_args
+#define TRACE_ARGS(event, path, res, start, ...) \
+	do { \
+		if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) { \
+			struct trace_args targs = __VA_ARGS__; \
+			trace_event_args(event, path, res, start, &targs); \
+		} \
+	} while (0)
+
+void trace_event(int event, const char *path, int branch, int res, uint64_t start);
+void trace_event_args(int event, const char *path, int res, uint64_t start, const struct trace_args *args);
+int trace_start(const char *path);
+void trace_stop(void);
+
+#endif
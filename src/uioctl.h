@@ -8,15 +8,37 @@
 #define UIOCTL_H_
 
 #include <sys/ioctl.h>
+#include <stdint.h>
 
 #include "unionfs.h"
+#include "stats.h"
 
 
-enum unionfs_ioctls {
+#define UNIONFS_BRANCH_RW	1	// struct unionfs_branch_ctl flags
+#define UNIONFS_BRANCH_IDX	2
+
+// the branch commands of unionfsctl
+struct unionfs_branch_ctl {
+	int32_t branch;		// -1 adds the branch as last one
+	int32_t to;		// new position of UNIONFS_BRANCH_MOVE
+	uint32_t flags;		// UNIONFS_BRANCH_*
+	uint32_t nbranches;	// set by UNIONFS_BRANCH_GET
+	char path[PATHLEN_MAX];
+};
+
+typedef enum unionfs_ioctls {
 	UNIONFS_ONOFF_DEBUG         = _IOW('E', 0, int),
 	UNIONFS_SET_DEBUG_FILE      = _IOW('E', 1, char[PATHLEN_MAX]),
-	UNIONFS_STATS_BYTES_READ    = _IOW('E', 2, void),
-	UNIONFS_STATS_BYTES_WRITTEN = _IOW('E', 3, void),
+	UNIONFS_STATS_BYTES_READ    = _IOR('E', 2, uint64_t),
+	UNIONFS_STATS_BYTES_WRITTEN = _IOR('E', 3, uint64_t),
+	UNIONFS_STATS_GET           = _IOR('E', 4, struct unionfs_stats),
+	UNIONFS_STATS_LATENCY       = _IOR('E', 5, struct unionfs_latency),
+	UNIONFS_ONOFF_TRACE         = _IOW('E', 6, int),
+	UNIONFS_BRANCH_ADD          = _IOW('E', 7, struct unionfs_branch_ctl),
+	UNIONFS_BRANCH_REMOVE       = _IOW('E', 8, struct unionfs_branch_ctl),
+	UNIONFS_BRANCH_MOVE         = _IOW('E', 9, struct unionfs_branch_ctl),
+	UNIONFS_BRANCH_MODE         = _IOW('E', 10, struct unionfs_branch_ctl),
+	UNIONFS_BRANCH_GET          = _IOWR('E', 11, struct unionfs_branch_ctl),
 } unionfs_ioctls_t;
 
 #endif // UIOCTL_H_
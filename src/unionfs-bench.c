@@ -0,0 +1,621 @@
+/*
+* Description: microbenchmarks of the union operations
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Builds a stack of branches in a scratch directory, the first branch
+*	rw and all others ro, and runs the operations of unionfs_oper on it
+*	in-process, just like the kernel would call them through libfuse, but
+*	without the kernel and libfuse in the way. So the numbers are those of
+*	find_branch(), unionfs_readdir(), copy_file() and friends only, they
+*	do not depend on the FUSE setup of the machine and no /dev/fuse is
+*	needed. The -o options are those of unionfs.
+*
+*	Every benchmark is run -r times, the minimum, median and maximum time
+*	per operation over the runs are written to stdout as JSON, see bench.py
+*	for a driver running a matrix of stacks.
+*	getattr_threads runs getattr() of the entries of /dir from 1, 2, 4 up
+*	to -j threads at once, each doing -n calls, for the scaling of the
+*	caches and indexes shared by the libfuse threads. Its times are those
+*	of all calls divided by their number, so they sink with the threads as
+*	long as they scale.
+*/
+
+#if defined __linux__
+	// For nftw() and mkdtemp()
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <ftw.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "version.h"
+#include "usyslog.h"
+
+#define BENCH_BRANCHES_MAX 64
+#define BENCH_RUNS_MAX 100
+#define BENCH_SMALL_SIZE 4096		// copyup_small
+#define BENCH_CHUNK (128 * 1024)	// read and write size of seq_read/seq_write
+#define BENCH_THREADS_MAX 256		// getattr_threads
+#define BENCH_THREAD_PATHS 1024		// entries of /dir looked up by getattr_threads
+
+static int nbranches = 4;
+static long entries = 1000;		// in /dir, spread over the branches
+static long whiteouts = 0;		// in /dir and /depth
+static long ops = 10000;		// getattr and statfs calls per run
+static long files = 100;		// copy-ups and unlinks per run
+static long long size = 16 << 20;	// copyup_large, seq_read and seq_write
+static int runs = 5;
+static int threads = 64;		// getattr_threads
+static char *tests = "getattr,readdir,copyup,unlink,statfs,seq";
+static char options[4096];		// -o, for the JSON
+static char root[PATHLEN_MAX];		// the branches are root/b<i>
+
+static bool first_result = true;
+static char *data;			// BENCH_CHUNK bytes to write
+
+static void usage(const char *progname) {
+	fprintf(stderr,
+"Usage: %s [options]\n"
+"\n"
+"    -b branches            number of branches, 1 to %d (default %d)\n"
+"    -e entries             entries of the readdir directory (default %ld)\n"
+"    -w whiteouts           whiteouts hiding ro entries (default %ld)\n"
+"    -n ops                 getattr and statfs calls per run (default %ld)\n"
+"    -f files               copy-ups and unlinks per run (default %ld)\n"
+"    -s MiB                 size of the large files (default %lld)\n"
+"    -r runs                runs of every benchmark (default %d)\n"
+"    -j threads             most threads of getattr_threads (default %d)\n"
+"    -t test[,test...]      of %s,getattr_threads\n"
+"    -o opt[,opt...]        unionfs options, e.g. -o cow\n"
+"    -d dir                 scratch directory, kept afterwards\n"
+"\n"
+"The branch b0 is rw, all others are ro. Results go to stdout as JSON.\n",
+		progname, BENCH_BRANCHES_MAX, nbranches, entries, whiteouts, ops,
+		files, size >> 20, runs, threads, tests);
+	exit(1);
+}
+
+static void die(const char *what, const char *path, int err) {
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(err));
+	exit(1);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool selected(const char *test) {
+	size_t len = strlen(test);
+	const char *s = tests;
+	while ((s = strstr(s, test)) != NULL) {
+		if ((s == tests || s[-1] == ',') && (s[len] == ',' || s[len] == '\0')) return true;
+		s += len;
+	}
+	return false;
+}
+
+/**
+ * Create path in branch with size bytes, directly and not through unionfs.
+ */
+static void branch_file(int branch, const char *path, long long bytes) {
+	char p[PATHLEN_MAX];
+	if (snprintf(p, sizeof(p), "%s/b%d%s", root, branch, path) >= (int)sizeof(p))
+		die("Path too long", path, ENAMETOOLONG);
+
+	int fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) die("Failed to create", p, errno);
+
+	while (bytes > 0) {
+		ssize_t n = write(fd, data, bytes < BENCH_CHUNK ? bytes : BENCH_CHUNK);
+		if (n == -1) die("Failed to write", p, errno);
+		bytes -= n;
+	}
+	close(fd);
+}
+
+static void branch_dir(int branch, const char *path) {
+	char p[PATHLEN_MAX];
+	if (snprintf(p, sizeof(p), "%s/b%d%s", root, branch, path) >= (int)sizeof(p))
+		die("Path too long", path, ENAMETOOLONG);
+	if (mkdir(p, 0755) && errno != EEXIST) die("Failed to create", p, errno);
+}
+
+/**
+ * Hide path of the lowest branch with a whiteout in the rw branch.
+ */
+static void branch_whiteout(const char *path) {
+	char p[PATHLEN_MAX];
+	branch_file(nbranches - 1, path, 0);
+	if (snprintf(p, sizeof(p), "/" METANAME "%s" HIDETAG, path) >= (int)sizeof(p))
+		die("Path too long", path, ENAMETOOLONG);
+	branch_file(0, p, 0);
+}
+
+static void build_layout(void) {
+	static const char *dirs[] = { "", "/dir", "/depth", "/copy", "/unlink", "/seq", NULL };
+	char p[PATHLEN_MAX];
+	int i, j;
+	long k;
+
+	// directories exist in every layer, as in images
+	for (i = 0; i < nbranches; i++) {
+		for (j = 0; dirs[j]; j++) branch_dir(i, dirs[j]);
+	}
+	branch_dir(0, "/" METANAME);
+	branch_dir(0, "/" METANAME "/dir");
+	branch_dir(0, "/" METANAME "/depth");
+
+	for (k = 0; k < entries; k++) {
+		snprintf(p, sizeof(p), "/dir/e%ld", k);
+		branch_file(k % nbranches, p, 0);
+	}
+
+	for (k = 0; k < whiteouts; k++) {
+		snprintf(p, sizeof(p), "/dir/w%ld", k);
+		branch_whiteout(p);
+		snprintf(p, sizeof(p), "/depth/w%ld", k);
+		branch_whiteout(p);
+	}
+
+	// /depth/f<i> only exists in branch i
+	for (i = 0; i < nbranches; i++) {
+		snprintf(p, sizeof(p), "/depth/f%d", i);
+		branch_file(i, p, 0);
+	}
+
+	// copied up and removed from the lowest branch, one set per run
+	int low = nbranches - 1;
+	for (k = 0; k < files * runs; k++) {
+		snprintf(p, sizeof(p), "/copy/s%ld", k);
+		branch_file(low, p, BENCH_SMALL_SIZE);
+		snprintf(p, sizeof(p), "/unlink/u%ld", k);
+		branch_file(low, p, 0);
+	}
+	for (i = 0; i < runs; i++) {
+		snprintf(p, sizeof(p), "/copy/l%d", i);
+		branch_file(low, p, size);
+	}
+
+	// not through unionfs_create(), which needs a FUSE request for the owner
+	branch_file(0, "/seq/file", 0);
+}
+
+static void json_string(const char *s) {
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') putchar('\\');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Print the result of a benchmark, ns[] are the times of the runs with n
+ * operations each, which moved bytes per operation.
+ */
+static void report(const char *name, const char *extra, long n, uint64_t *ns, long long bytes) {
+	qsort(ns, runs, sizeof(uint64_t), cmp_u64);
+	uint64_t median = ns[runs / 2];
+
+	printf("%s\n    {\"name\": \"%s\"", first_result ? "" : ",", name);
+	if (extra) printf(", %s", extra);
+	printf(", \"ops\": %ld, \"ns_min\": %llu, \"ns_median\": %llu, \"ns_max\": %llu",
+		n, (unsigned long long)(ns[0] / n), (unsigned long long)(median / n),
+		(unsigned long long)(ns[runs - 1] / n));
+	if (bytes)
+		printf(", \"bytes\": %lld, \"mb_per_s\": %.1f", bytes,
+			median ? (double)bytes * n / (1 << 20) / (median / 1e9) : 0.0);
+	printf("}");
+	fflush(stdout);
+
+	first_result = false;
+}
+
+static void bench_getattr(void) {
+	uint64_t ns[BENCH_RUNS_MAX];
+	char path[PATHLEN_MAX], extra[64];
+	struct stat st;
+	int depth, r;
+	long i;
+
+	// the branch depth in steps of powers of two, and the lowest branch
+	for (depth = 0; ; depth = depth ? depth * 2 : 1) {
+		if (depth > nbranches - 1) depth = nbranches - 1;
+
+		snprintf(path, sizeof(path), "/depth/f%d", depth);
+		int res = unionfs_oper.getattr(path, &st);
+		if (res) die("getattr", path, -res);
+
+		for (r = 0; r < runs; r++) {
+			uint64_t start = now_ns();
+			for (i = 0; i < ops; i++) unionfs_oper.getattr(path, &st);
+			ns[r] = now_ns() - start;
+		}
+
+		snprintf(extra, sizeof(extra), "\"depth\": %d", depth);
+		report("getattr_hit", extra, ops, ns, 0);
+		if (depth == nbranches - 1) break;
+	}
+
+	// misses search all branches
+	const char *missing = "/depth/missing";
+	unionfs_oper.getattr(missing, &st);
+	for (r = 0; r < runs; r++) {
+		uint64_t start = now_ns();
+		for (i = 0; i < ops; i++) {
+			int res = unionfs_oper.getattr(missing, &st);
+			if (res != -ENOENT) die("getattr", missing, res ? -res : EEXIST);
+		}
+		ns[r] = now_ns() - start;
+	}
+	snprintf(extra, sizeof(extra), "\"depth\": %d", nbranches);
+	report("getattr_miss", extra, ops, ns, 0);
+}
+
+static char thread_paths[BENCH_THREAD_PATHS][32];
+static long nthread_paths;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static bool started;			// all threads of a run were created
+
+static void *getattr_worker(void *arg) {
+	long t = (long)arg, i;
+	struct stat st;
+
+	pthread_mutex_lock(&start_lock);
+	while (!started) pthread_cond_wait(&start_cond, &start_lock);
+	pthread_mutex_unlock(&start_lock);
+
+	// every thread starts at another path, but they all share the paths
+	for (i = 0; i < ops; i++)
+		unionfs_oper.getattr(thread_paths[(t * 7 + i) % nthread_paths], &st);
+
+	return NULL;
+}
+
+static void bench_getattr_threads(void) {
+	uint64_t ns[BENCH_RUNS_MAX];
+	pthread_t tids[BENCH_THREADS_MAX];
+	char extra[64];
+	struct stat st;
+	long i, n;
+	int r;
+
+	nthread_paths = entries < BENCH_THREAD_PATHS ? entries : BENCH_THREAD_PATHS;
+	for (i = 0; i < nthread_paths; i++) snprintf(thread_paths[i], sizeof(thread_paths[i]), "/dir/e%ld", i);
+	if (nthread_paths == 0) {
+		strcpy(thread_paths[0], "/depth/f0");
+		nthread_paths = 1;
+	}
+
+	for (i = 0; i < nthread_paths; i++) {
+		int res = unionfs_oper.getattr(thread_paths[i], &st);
+		if (res) die("getattr", thread_paths[i], -res);
+	}
+
+	for (n = 1; ; n = n * 2 < threads ? n * 2 : threads) {
+		for (r = 0; r < runs; r++) {
+			started = false;
+			for (i = 0; i < n; i++) {
+				int res = pthread_create(&tids[i], NULL, getattr_worker, (void *)i);
+				if (res) die("pthread_create", "", res);
+			}
+
+			pthread_mutex_lock(&start_lock);
+			started = true;
+			pthread_cond_broadcast(&start_cond);
+			pthread_mutex_unlock(&start_lock);
+
+			uint64_t start = now_ns();
+			for (i = 0; i < n; i++) pthread_join(tids[i], NULL);
+			ns[r] = now_ns() - start;
+		}
+
+		snprintf(extra, sizeof(extra), "\"threads\": %ld", n);
+		report("getattr_threads", extra, ops * n, ns, 0);
+		if (n == threads) break;
+	}
+}
+
+static int count_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(void)name;
+	(void)stbuf;
+	(void)off;
+	(*(long *)buf)++;
+	return 0;
+}
+
+static long list_dir(const char *path) {
+	struct fuse_file_info fi;
+	long count = 0;
+
+	memset(&fi, 0, sizeof(fi));
+	int res = unionfs_oper.opendir(path, &fi);
+	if (res) die("opendir", path, -res);
+
+	res = unionfs_oper.readdir(path, &count, count_fill, 0, &fi);
+	if (res) die("readdir", path, -res);
+
+	unionfs_oper.releasedir(path, &fi);
+	return count;
+}
+
+static void bench_readdir(void) {
+	uint64_t ns[BENCH_RUNS_MAX];
+	char extra[64];
+	int r;
+
+	long listed = list_dir("/dir");
+	for (r = 0; r < runs; r++) {
+		uint64_t start = now_ns();
+		list_dir("/dir");
+		ns[r] = now_ns() - start;
+	}
+
+	snprintf(extra, sizeof(extra), "\"entries\": %ld, \"listed\": %ld", entries, listed);
+	report("readdir", extra, 1, ns, 0);
+}
+
+/**
+ * Open path for writing and write a byte, the copy-up of -o lazy_cow only
+ * happens on the first write.
+ */
+static void copy_up(const char *path) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY;
+
+	int res = unionfs_oper.open(path, &fi);
+	if (res) die("open", path, -res);
+
+	res = unionfs_oper.write(path, "x", 1, 0, &fi);
+	if (res != 1) die("write", path, res < 0 ? -res : EIO);
+
+	unionfs_oper.release(path, &fi);
+}
+
+static void bench_copyup(void) {
+	uint64_t ns[BENCH_RUNS_MAX];
+	char path[PATHLEN_MAX];
+	int r;
+	long i;
+
+	for (r = 0; r < runs; r++) {
+		uint64_t start = now_ns();
+		for (i = 0; i < files; i++) {
+			snprintf(path, sizeof(path), "/copy/s%ld", r * files + i);
+			copy_up(path);
+		}
+		ns[r] = now_ns() - start;
+	}
+	report("copyup_small", NULL, files, ns, BENCH_SMALL_SIZE);
+
+	for (r = 0; r < runs; r++) {
+		snprintf(path, sizeof(path), "/copy/l%d", r);
+		uint64_t start = now_ns();
+		copy_up(path);
+		ns[r] = now_ns() - start;
+	}
+	report("copyup_large", NULL, 1, ns, size);
+}
+
+static void bench_unlink(void) {
+	uint64_t ns[BENCH_RUNS_MAX];
+	char path[PATHLEN_MAX];
+	int r;
+	long i;
+
+	for (r = 0; r < runs; r++) {
+		uint64_t start = now_ns();
+		for (i = 0; i < files; i++) {
+			snprintf(path, sizeof(path), "/unlink/u%ld", r * files + i);
+			int res = unionfs_oper.unlink(path);
+			if (res) die("unlink", path, -res);
+		}
+		ns[r] = now_ns() - start;
+	}
+	report("unlink_whiteout", NULL, files, ns, 0);
+}
+
+static void bench_statfs(void) {
+	uint64_t ns[BENCH_RUNS_MAX];
+	struct statvfs st;
+	int r;
+	long i;
+
+	int res = unionfs_oper.statfs("/", &st);
+	if (res) die("statfs", "/", -res);
+
+	for (r = 0; r < runs; r++) {
+		uint64_t start = now_ns();
+		for (i = 0; i < ops; i++) unionfs_oper.statfs("/", &st);
+		ns[r] = now_ns() - start;
+	}
+	report("statfs", NULL, ops, ns, 0);
+}
+
+static void bench_seq(void) {
+	uint64_t ns[BENCH_RUNS_MAX];
+	const char *path = "/seq/file";
+	struct fuse_file_info fi;
+	char *buf = malloc(BENCH_CHUNK);
+	long long off;
+	int r, res;
+
+	if (!buf) die("malloc", "", ENOMEM);
+
+	for (r = 0; r < runs; r++) {
+		uint64_t start = now_ns();
+
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY | O_TRUNC;
+		res = unionfs_oper.open(path, &fi);
+		if (res) die("open", path, -res);
+
+		for (off = 0; off < size; off += res) {
+			size_t n = size - off < BENCH_CHUNK ? size - off : BENCH_CHUNK;
+			res = unionfs_oper.write(path, data, n, off, &fi);
+			if (res <= 0) die("write", path, res < 0 ? -res : EIO);
+		}
+
+		unionfs_oper.release(path, &fi);
+		ns[r] = now_ns() - start;
+	}
+	report("seq_write", NULL, 1, ns, size);
+
+	// the file was just written, so this is read from the page cache
+	for (r = 0; r < runs; r++) {
+		uint64_t start = now_ns();
+
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_RDONLY;
+		res = unionfs_oper.open(path, &fi);
+		if (res) die("open", path, -res);
+
+		for (off = 0; off < size; off += res) {
+			res = unionfs_oper.read(path, buf, BENCH_CHUNK, off, &fi);
+			if (res <= 0) die("read", path, res < 0 ? -res : EIO);
+		}
+
+		unionfs_oper.release(path, &fi);
+		ns[r] = now_ns() - start;
+	}
+	report("seq_read", NULL, 1, ns, size);
+
+	free(buf);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove(path);
+}
+
+int main(int argc, char **argv) {
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	char *dir = NULL;
+	int c;
+
+	fuse_opt_add_arg(&args, argv[0]);
+
+	while ((c = getopt(argc, argv, "b:e:w:n:f:s:r:j:t:o:d:h")) != -1) {
+		switch (c) {
+		case 'b': nbranches = atoi(optarg); break;
+		case 'e': entries = atol(optarg); break;
+		case 'w': whiteouts = atol(optarg); break;
+		case 'n': ops = atol(optarg); break;
+		case 'f': files = atol(optarg); break;
+		case 's': size = atoll(optarg) << 20; break;
+		case 'r': runs = atoi(optarg); break;
+		case 'j': threads = atoi(optarg); break;
+		case 't': tests = optarg; break;
+		case 'o':
+			fuse_opt_add_arg(&args, "-o");
+			fuse_opt_add_arg(&args, optarg);
+			if (options[0]) strncat(options, ",", sizeof(options) - strlen(options) - 1);
+			strncat(options, optarg, sizeof(options) - strlen(options) - 1);
+			break;
+		case 'd': dir = optarg; break;
+		default: usage(basename(argv[0]));
+		}
+	}
+	if (optind != argc || nbranches < 1 || nbranches > BENCH_BRANCHES_MAX
+	    || entries < 0 || whiteouts < 0 || ops < 1 || files < 1 || size < 1
+	    || runs < 1 || runs > BENCH_RUNS_MAX || threads < 1 || threads > BENCH_THREADS_MAX)
+		usage(basename(argv[0]));
+
+	data = malloc(BENCH_CHUNK);
+	if (!data) die("malloc", "", ENOMEM);
+	memset(data, 'x', BENCH_CHUNK);
+
+	if (dir) {
+		if (mkdir(dir, 0755) && errno != EEXIST) die("Failed to create", dir, errno);
+		if (!realpath(dir, root)) die("Failed to resolve", dir, errno);
+	} else {
+		const char *tmp = getenv("TMPDIR");
+		snprintf(root, sizeof(root), "%s/unionfs-bench.XXXXXX", tmp ? tmp : "/tmp");
+		if (!mkdtemp(root)) die("Failed to create", root, errno);
+	}
+
+	init_syslog();
+	uopt_init();
+
+	if (fuse_opt_parse(&args, NULL, unionfs_opts, unionfs_opt_proc) == -1) exit(1);
+	if (uopt.doexit) exit(uopt.retval);
+	if (uopt.nbranches) {
+		fprintf(stderr, "The branches are built by %s, not given with -o dirs\n", argv[0]);
+		exit(1);
+	}
+
+	fprintf(stderr, "Building %d branches in %s\n", nbranches, root);
+	build_layout();
+
+	char branches[BENCH_BRANCHES_MAX * (PATHLEN_MAX + 8)] = "";
+	int i;
+	for (i = 0; i < nbranches; i++) {
+		size_t len = strlen(branches);
+		snprintf(branches + len, sizeof(branches) - len, "%s%s/b%d=%s",
+			i ? ROOT_SEP : "", root, i, i ? "RO" : "RW");
+	}
+	parse_branches(branches);
+	unionfs_post_opts();
+
+	struct fuse_conn_info conn;
+	memset(&conn, 0, sizeof(conn));
+	unionfs_oper.init(&conn);
+
+	printf("{\n  \"version\": \"%s\",\n  \"branches\": %d,\n  \"cow\": %s,\n  \"options\": ",
+		VERSION, nbranches, uopt.cow_enabled ? "true" : "false");
+	json_string(options);
+	printf(",\n  \"entries\": %ld,\n  \"whiteouts\": %ld,\n  \"runs\": %d,\n  \"results\": [",
+		entries, whiteouts, runs);
+
+	if (selected("getattr")) bench_getattr();
+	if (selected("getattr_threads")) bench_getattr_threads();
+	if (selected("readdir")) bench_readdir();
+
+	// ro files are only copied up or hidden with -o cow
+	bool cow = uopt.cow_enabled && nbranches > 1;
+	if (selected("copyup") && cow) bench_copyup();
+	if (selected("unlink") && cow) bench_unlink();
+	if ((selected("copyup") || selected("unlink")) && !cow)
+		fprintf(stderr, "copyup and unlink skipped, they need -o cow and at least 2 branches\n");
+
+	if (selected("statfs")) bench_statfs();
+	if (selected("seq")) bench_seq();
+
+	printf("\n  ]\n}\n");
+
+	unionfs_oper.destroy(NULL);
+
+	if (!dir) nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+
+	fuse_opt_free_args(&args);
+	free(data);
+	return 0;
+}
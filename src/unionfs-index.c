@@ -0,0 +1,69 @@
+/*
+* Description: prebuild the index files of a read-only branch
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Scanning a large branch on every mount, possibly over NFS, takes time.
+*	Branches which do not change any more (image layers) can be indexed
+*	once, unionfs then loads the index files from the branch on mount:
+*	the Bloom filter for -o bloom and the manifest for RO+IDX branches.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include "bloom.h"
+#include "manifest.h"
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <branch>\n", basename(argv[0]));
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Writes the Bloom filter of the branch (-o bloom) to %s\n", BLOOM_FILE);
+		fprintf(stderr, "and its manifest (branch=RO+IDX) to %s in the branch.\n", MANIFEST_FILE);
+		fprintf(stderr, "Run it again whenever the branch changed.\n");
+		exit(1);
+	}
+
+	const char *branch = argv[1];
+	int fd = open(branch, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", branch, strerror(errno));
+		exit(1);
+	}
+
+	struct bloom *bloom = bloom_build(fd);
+	if (!bloom) {
+		fprintf(stderr, "Failed to scan %s: %s\n", branch, strerror(errno));
+		exit(1);
+	}
+
+	int res = bloom_save(bloom, fd);
+	if (res) {
+		fprintf(stderr, "Failed to write %s/%s: %s\n", branch, BLOOM_FILE, strerror(-res));
+		exit(1);
+	}
+
+	printf("%s: Bloom filter of %llu paths\n", branch, (unsigned long long)bloom_keys(bloom));
+
+	uint64_t count;
+	res = manifest_write(fd, &count);
+	if (res) {
+		fprintf(stderr, "Failed to write %s/%s: %s\n", branch, MANIFEST_FILE, strerror(-res));
+		exit(1);
+	}
+
+	printf("%s: manifest of %llu entries\n", branch, (unsigned long long)count);
+
+	bloom_free(bloom);
+	close(fd);
+	return 0;
+}
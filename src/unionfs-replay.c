@@ -0,0 +1,736 @@
+/*
+* Description: replay a trace written with -o trace_capture
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Reads all operations of the trace, which has their arguments with -o
+*	trace_capture, and sorts them by their start time. Then -j threads run
+*	them again in that order, each takes the next operation as soon as it
+*	is done with its last one, so up to -j operations run concurrently.
+*	With -s the operations are started at the pace of the trace instead
+*	of as fast as possible.
+*	Against a mountpoint the operations become the system calls which lead
+*	to them (getattr a lstat(), readdir a full readdir() and so on). With
+*	-b the branches are stacked in-process with the -o options of unionfs
+*	and the operations are called directly like libfuse would, without the
+*	kernel, its caches and permission checks in between.
+*	File handles of the trace are mapped to our own. An operation on a file
+*	handle waits until its open() is done, a release() waits for the other
+*	operations on the file handle. Those without arguments (not captured)
+*	or with an unknown file handle (opened before the trace started) are
+*	skipped. If the release of a file handle was dropped from the trace,
+*	it is closed when the number is opened again.
+*	The latencies are printed as "unionfsctl -l" does, in microseconds.
+*/
+
+#if defined __linux__
+	// For pread()/pwrite()/utimensat()
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "conf.h"
+#include "unionfs.h"
+#include "opts.h"
+#include "trace.h"
+#include "usyslog.h"
+#include "hashtable.h"
+
+#define REPLAY_THREADS_MAX 256
+#define REPLAY_IO_MAX (1 << 20)	// larger reads and writes are cut
+
+// the operations of the trace, sorted by time
+struct replay_op {
+	uint64_t time;		// start in the trace
+	uint64_t path_hash;
+	uint64_t path2_hash;	// or the file handle, see struct trace_args
+	uint64_t a, b;
+	const char *path;	// resolved once the whole trace is read
+	const char *path2;
+	uint64_t latency;	// ns, of the replay
+	int32_t res;		// in the trace
+	int32_t replay_res;
+	uint16_t event;
+	bool has_args;
+	bool done;		// not skipped
+};
+
+// a file handle of the trace
+struct handle {
+	uint64_t fh;		// the key
+	int state;
+	unsigned int users;	// operations running on it
+	int fd;			// against a mountpoint
+	DIR *dir;
+	struct fuse_file_info fi; // directly
+	struct replay_op *opened; // the open, to close it without a release
+};
+
+#define HANDLE_OPENING 0
+#define HANDLE_OPEN 1
+#define HANDLE_FAILED 2
+#define HANDLE_CLOSING 3
+
+struct name {
+	uint64_t hash;		// the key
+	char path[];
+};
+
+static struct replay_op *ops;
+static size_t nops;
+static uint64_t dropped;	// records lost while tracing
+
+static const char *mountpoint;	// NULL if directly
+static int nthreads = 1;
+static double speed = 0;	// 0 as fast as possible, 1 the pace of the trace
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER; // of a handle
+static size_t next_op;
+static struct hashtable *handles;
+static uint64_t replay_start;
+static size_t lost_releases;	// of dropped records, closed on the next open
+
+static void usage(const char *progname) {
+	fprintf(stderr,
+"Usage: %s [options] <trace-file> <mountpoint>\n"
+"       %s [options] -b <branches> <trace-file>\n"
+"\n"
+"Replays a trace of -o trace_file,trace_capture against a mounted union,\n"
+"or with -b directly against the branches, without FUSE in between.\n"
+"\n"
+"    -b branches            stack these branches in-process (as unionfs)\n"
+"    -o opt[,opt...]        unionfs options with -b, e.g. -o cow\n"
+"    -j threads             operations running at the same time (default 1)\n"
+"    -s speed               keep the pace of the trace, 2 twice as fast\n"
+"                           (default 0, as fast as possible)\n",
+		progname, progname);
+	exit(1);
+}
+
+static void die(const char *what, const char *arg, int err) {
+	fprintf(stderr, "%s %s: %s\n", what, arg, strerror(err));
+	exit(1);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int u64_hash(void *k) {
+	uint64_t v = *(uint64_t *)k; // the first member of the key
+	return (unsigned int)(v ^ (v >> 32));
+}
+
+static int u64_equal(void *a, void *b) {
+	return *(uint64_t *)a == *(uint64_t *)b;
+}
+
+/**
+ * The second path of an operation, the others have a file handle.
+ */
+static bool has_path2(int event) {
+	switch (event) {
+	case STATS_OP_LINK:
+	case STATS_OP_RENAME:
+	case STATS_OP_SYMLINK:
+	case STATS_OP_GETXATTR:
+	case STATS_OP_SETXATTR:
+	case STATS_OP_REMOVEXATTR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static const char *find_name(struct hashtable *names, uint64_t hash) {
+	struct name *name = hashtable_search(names, &hash);
+	return name ? name->path : NULL;
+}
+
+static void load(const char *fn) {
+	FILE *file = fopen(fn, "r");
+	if (!file) die("Failed to open", fn, errno);
+
+	struct trace_header header;
+	if (fread(&header, sizeof(header), 1, file) != 1
+	|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+	|| header.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s is not a trace file of this unionfs version\n", fn);
+		exit(1);
+	}
+
+	struct hashtable *names = create_hashtable(4096, u64_hash, u64_equal);
+	if (!names) die("Failed to read", fn, ENOMEM);
+
+	size_t size = 0;
+	char path[PATHLEN_MAX + TRACE_NAME_LEN];
+	size_t path_len = 0;
+	struct trace_record args;	// TRACE_EV_ARGS of the next record
+	bool have_args = false;
+	memset(&args, 0, sizeof(args));
+
+	struct trace_record rec;
+	while (fread(&rec, sizeof(rec), 1, file) == 1) {
+		switch (rec.event) {
+		case TRACE_EV_PATH:
+			// the pieces of a path are consecutive records
+			if (rec.branch == 0) path_len = 0;
+			if (path_len + TRACE_NAME_LEN > PATHLEN_MAX) continue; // broken
+
+			memcpy(path + path_len, rec.u.name, TRACE_NAME_LEN);
+			path_len += TRACE_NAME_LEN;
+
+			if (memchr(rec.u.name, '\0', TRACE_NAME_LEN) && !find_name(names, rec.path_hash)) {
+				struct name *name = malloc(sizeof(struct name) + strlen(path) + 1);
+				if (!name) die("Failed to read", fn, ENOMEM);
+				name->hash = rec.path_hash;
+				strcpy(name->path, path);
+				if (!hashtable_insert(names, name, name)) die("Failed to read", fn, ENOMEM);
+			}
+			continue;
+		case TRACE_EV_ARGS:
+			args = rec;
+			have_args = true;
+			continue;
+		case TRACE_EV_DROPPED:
+			dropped += rec.u.op.res;
+			continue;
+		}
+
+		if (rec.event >= STATS_OPS) continue; // lookups and copy-ups
+		if (rec.event == STATS_OP_IOCTL) continue; // unionfsctl
+
+		if (nops == size) {
+			size = size ? size * 2 : 4096;
+			ops = realloc(ops, size * sizeof(struct replay_op));
+			if (!ops) die("Failed to read", fn, ENOMEM);
+		}
+
+		struct replay_op *op = &ops[nops++];
+		memset(op, 0, sizeof(*op));
+		op->event = rec.event;
+		op->time = rec.u.op.time;
+		op->res = rec.u.op.res;
+		op->path_hash = rec.path_hash;
+
+		// the arguments directly precede the operation of the thread
+		if (have_args && args.tid == rec.tid) {
+			op->has_args = true;
+			op->path2_hash = args.path_hash;
+			op->a = args.u.args.a;
+			op->b = args.u.args.b;
+		}
+		have_args = false;
+	}
+	fclose(file);
+
+	size_t i;
+	for (i = 0; i < nops; i++) {
+		struct replay_op *op = &ops[i];
+		if (op->path_hash) op->path = find_name(names, op->path_hash);
+		if (op->has_args && has_path2(op->event)) op->path2 = find_name(names, op->path2_hash);
+	}
+	// the names stay, ops point to them
+}
+
+static int cmp_time(const void *a, const void *b) {
+	const struct replay_op *x = a, *y = b;
+	return x->time < y->time ? -1 : x->time > y->time;
+}
+
+/**
+ * Whether the operation is on a file handle, which is in path2_hash.
+ */
+static bool has_handle(int event) {
+	switch (event) {
+	case STATS_OP_CREATE:
+	case STATS_OP_OPEN:
+	case STATS_OP_OPENDIR:
+	case STATS_OP_READ:
+	case STATS_OP_WRITE:
+	case STATS_OP_READDIR:
+	case STATS_OP_FLUSH:
+	case STATS_OP_FSYNC:
+	case STATS_OP_FTRUNCATE:
+	case STATS_OP_RELEASE:
+	case STATS_OP_RELEASEDIR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_open(int event) {
+	return event == STATS_OP_CREATE || event == STATS_OP_OPEN || event == STATS_OP_OPENDIR;
+}
+
+static bool is_release(int event) {
+	return event == STATS_OP_RELEASE || event == STATS_OP_RELEASEDIR;
+}
+
+static int count_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(void)name;
+	(void)stbuf;
+	(void)off;
+	(*(long *)buf)++;
+	return 0;
+}
+
+/**
+ * Run op directly, h is its handle if it has a file handle.
+ */
+static int run_direct(struct replay_op *op, struct handle *h, char *buf) {
+	const char *path = op->path ? op->path : "";
+	size_t size = op->a < REPLAY_IO_MAX ? op->a : REPLAY_IO_MAX;
+	struct timespec ts[2] = { { 0, UTIME_NOW }, { 0, UTIME_NOW } };
+	struct statvfs stv;
+	struct stat st;
+	long count = 0;
+
+	switch (op->event) {
+	case STATS_OP_ACCESS: return unionfs_oper.access(path, op->a);
+	case STATS_OP_CHMOD: return unionfs_oper.chmod(path, op->a);
+	case STATS_OP_CHOWN: return unionfs_oper.chown(path, op->a, op->b);
+	case STATS_OP_CREATE:
+		h->fi.flags = op->a;
+		return unionfs_oper.create(path, op->b, &h->fi);
+	case STATS_OP_FLUSH: return unionfs_oper.flush(path, &h->fi);
+	case STATS_OP_FSYNC: return unionfs_oper.fsync(path, op->a, &h->fi);
+	case STATS_OP_FTRUNCATE: return unionfs_oper.ftruncate(path, op->a, &h->fi);
+	case STATS_OP_GETATTR:
+	case STATS_OP_LOOKUP:
+		return unionfs_oper.getattr(path, &st);
+	case STATS_OP_LINK: return unionfs_oper.link(path, op->path2);
+	case STATS_OP_MKDIR: return unionfs_oper.mkdir(path, op->a);
+	case STATS_OP_MKNOD: return unionfs_oper.mknod(path, op->a, op->b);
+	case STATS_OP_OPEN:
+		h->fi.flags = op->a;
+		return unionfs_oper.open(path, &h->fi);
+	case STATS_OP_OPENDIR:
+		h->fi.flags = op->a;
+		return unionfs_oper.opendir(path, &h->fi);
+	case STATS_OP_READ: return unionfs_oper.read(path, buf, size, op->b, &h->fi);
+	case STATS_OP_READDIR: return unionfs_oper.readdir(path, &count, count_fill, op->b, &h->fi);
+	case STATS_OP_READLINK: return unionfs_oper.readlink(path, buf, size ? size : PATHLEN_MAX);
+	case STATS_OP_RELEASE: return unionfs_oper.release(path, &h->fi);
+	case STATS_OP_RELEASEDIR: return unionfs_oper.releasedir(path, &h->fi);
+	case STATS_OP_RENAME: return unionfs_oper.rename(path, op->path2);
+	case STATS_OP_RMDIR: return unionfs_oper.rmdir(path);
+	case STATS_OP_STATFS: return unionfs_oper.statfs(path, &stv);
+	case STATS_OP_SYMLINK: return unionfs_oper.symlink(op->path2, path);
+	case STATS_OP_TRUNCATE: return unionfs_oper.truncate(path, op->a);
+	case STATS_OP_UNLINK: return unionfs_oper.unlink(path);
+	case STATS_OP_UTIMENS: return unionfs_oper.utimens(path, ts);
+	case STATS_OP_WRITE: return unionfs_oper.write(path, buf, size, op->b, &h->fi);
+#ifdef HAVE_XATTR
+#if __APPLE__
+	case STATS_OP_GETXATTR: return unionfs_oper.getxattr(path, op->path2, buf, size, 0);
+	case STATS_OP_SETXATTR: return unionfs_oper.setxattr(path, op->path2, buf, size, op->b, 0);
+#else
+	case STATS_OP_GETXATTR: return unionfs_oper.getxattr(path, op->path2, buf, size);
+	case STATS_OP_SETXATTR: return unionfs_oper.setxattr(path, op->path2, buf, size, op->b);
+#endif
+	case STATS_OP_LISTXATTR: return unionfs_oper.listxattr(path, buf, size);
+	case STATS_OP_REMOVEXATTR: return unionfs_oper.removexattr(path, op->path2);
+#endif
+	default: return -ENOSYS;
+	}
+}
+
+#define SYSCALL(call) ((call) == -1 ? -errno : 0)
+
+/**
+ * Run op as system calls on the mountpoint, h is its handle if it has a
+ * file handle.
+ */
+static int run_mounted(struct replay_op *op, struct handle *h, char *buf) {
+	char p[PATHLEN_MAX], p2[PATHLEN_MAX];
+	size_t size = op->a < REPLAY_IO_MAX ? op->a : REPLAY_IO_MAX;
+	struct statvfs stv;
+	struct stat st;
+	ssize_t res;
+
+	snprintf(p, sizeof(p), "%s%s", mountpoint, op->path ? op->path : "");
+	if (op->path2) snprintf(p2, sizeof(p2), "%s%s", mountpoint, op->path2);
+
+	switch (op->event) {
+	case STATS_OP_ACCESS: return SYSCALL(access(p, op->a));
+	case STATS_OP_CHMOD: return SYSCALL(chmod(p, op->a));
+	case STATS_OP_CHOWN: return SYSCALL(lchown(p, op->a, op->b));
+	case STATS_OP_CREATE:
+		h->fd = open(p, op->a | O_CREAT, op->b);
+		return SYSCALL(h->fd);
+	case STATS_OP_FLUSH: {
+		// the kernel flushes on every close of a file descriptor
+		int fd = dup(h->fd);
+		return SYSCALL(fd == -1 ? -1 : close(fd));
+	}
+	case STATS_OP_FSYNC: return SYSCALL(op->a ? fdatasync(h->fd) : fsync(h->fd));
+	case STATS_OP_FTRUNCATE: return SYSCALL(ftruncate(h->fd, op->a));
+	case STATS_OP_GETATTR:
+	case STATS_OP_LOOKUP:
+		return SYSCALL(lstat(p, &st));
+	case STATS_OP_LINK: return SYSCALL(link(p, p2));
+	case STATS_OP_MKDIR: return SYSCALL(mkdir(p, op->a));
+	case STATS_OP_MKNOD: return SYSCALL(mknod(p, op->a, op->b));
+	case STATS_OP_OPEN:
+		// as the kernel passed them, O_CREAT came as create()
+		h->fd = open(p, op->a & ~(O_CREAT | O_EXCL));
+		return SYSCALL(h->fd);
+	case STATS_OP_OPENDIR:
+		h->dir = opendir(p);
+		return h->dir ? 0 : -errno;
+	case STATS_OP_READ:
+		res = pread(h->fd, buf, size, op->b);
+		return res == -1 ? -errno : res;
+	case STATS_OP_READDIR:
+		// unionfs lists the whole directory in one call
+		rewinddir(h->dir);
+		errno = 0;
+		while (readdir(h->dir));
+		return -errno;
+	case STATS_OP_READLINK:
+		res = readlink(p, buf, size ? size : PATHLEN_MAX);
+		return res == -1 ? -errno : 0;
+	case STATS_OP_RELEASE: return SYSCALL(close(h->fd));
+	case STATS_OP_RELEASEDIR: return SYSCALL(closedir(h->dir));
+	case STATS_OP_RENAME: return SYSCALL(rename(p, p2));
+	case STATS_OP_RMDIR: return SYSCALL(rmdir(p));
+	case STATS_OP_STATFS: return SYSCALL(statvfs(p, &stv));
+	case STATS_OP_SYMLINK: return SYSCALL(symlink(op->path2, p));
+	case STATS_OP_TRUNCATE: return SYSCALL(truncate(p, op->a));
+	case STATS_OP_UNLINK: return SYSCALL(unlink(p));
+	case STATS_OP_UTIMENS: return SYSCALL(utimensat(AT_FDCWD, p, NULL, AT_SYMLINK_NOFOLLOW));
+	case STATS_OP_WRITE:
+		res = pwrite(h->fd, buf, size, op->b);
+		return res == -1 ? -errno : res;
+#ifdef HAVE_XATTR
+#if __APPLE__
+	case STATS_OP_GETXATTR:
+		res = getxattr(p, op->path2, buf, size, 0, XATTR_NOFOLLOW);
+		return res == -1 ? -errno : res;
+	case STATS_OP_SETXATTR: return SYSCALL(setxattr(p, op->path2, buf, size, 0, op->b | XATTR_NOFOLLOW));
+	case STATS_OP_LISTXATTR:
+		res = listxattr(p, buf, size, XATTR_NOFOLLOW);
+		return res == -1 ? -errno : res;
+	case STATS_OP_REMOVEXATTR: return SYSCALL(removexattr(p, op->path2, XATTR_NOFOLLOW));
+#else
+	case STATS_OP_GETXATTR:
+		res = lgetxattr(p, op->path2, buf, size);
+		return res == -1 ? -errno : res;
+	case STATS_OP_SETXATTR: return SYSCALL(lsetxattr(p, op->path2, buf, size, op->b));
+	case STATS_OP_LISTXATTR:
+		res = llistxattr(p, buf, size);
+		return res == -1 ? -errno : res;
+	case STATS_OP_REMOVEXATTR: return SYSCALL(lremovexattr(p, op->path2));
+#endif
+#endif
+	default: return -ENOSYS;
+	}
+}
+
+/**
+ * Whether op can be run at all, with lock held.
+ */
+static bool runnable(const struct replay_op *op) {
+	switch (op->event) {
+	case STATS_OP_GETATTR:
+	case STATS_OP_LOOKUP:
+	case STATS_OP_RMDIR:
+	case STATS_OP_STATFS:
+	case STATS_OP_UNLINK:
+	case STATS_OP_UTIMENS:
+		return op->path != NULL; // nothing else is needed
+	case STATS_OP_READLINK:
+	case STATS_OP_LISTXATTR:
+		return op->path != NULL; // a size of 0 is fine
+	default:
+		if (!op->has_args) return false;
+		if (has_path2(op->event) && !op->path2) return false;
+		// reads and writes of the low-level engine have no path
+		return op->path != NULL || (has_handle(op->event) && !is_open(op->event));
+	}
+}
+
+/**
+ * Wait for the file handle of op to be usable, NULL if op must be skipped.
+ * With lock held.
+ */
+/**
+ * Close h without a release from the trace.
+ */
+static void close_handle(struct handle *h) {
+	struct replay_op release = *h->opened;
+	release.event = release.event == STATS_OP_OPENDIR ? STATS_OP_RELEASEDIR : STATS_OP_RELEASE;
+	if (mountpoint) run_mounted(&release, h, NULL);
+	else run_direct(&release, h, NULL);
+}
+
+static struct handle *take_handle(struct replay_op *op) {
+	uint64_t fh = op->path2_hash;
+	struct handle *h = hashtable_search(handles, &fh);
+
+	if (is_open(op->event)) {
+		// failed in the trace, the file handle means nothing
+		if (op->res < 0) {
+			h = calloc(1, sizeof(struct handle));
+			if (h) h->opened = op;
+			return h;
+		}
+
+		while (h) {
+			if (h->state == HANDLE_OPENING || h->state == HANDLE_CLOSING || h->users) {
+				// a release of the same number is still running
+				pthread_cond_wait(&changed, &lock);
+			} else {
+				// the number is only reused after a release, which was dropped
+				if (h->state == HANDLE_OPEN) close_handle(h);
+				hashtable_remove(handles, &fh); // frees h
+				lost_releases++;
+			}
+			h = hashtable_search(handles, &fh);
+		}
+
+		h = calloc(1, sizeof(struct handle));
+		if (!h) return NULL;
+		h->fh = fh;
+		h->opened = op;
+		h->state = HANDLE_OPENING;
+		if (!hashtable_insert(handles, h, h)) {
+			free(h);
+			return NULL;
+		}
+		return h;
+	}
+
+	if (!h) return NULL; // opened before the trace started
+	while (h->state == HANDLE_OPENING) pthread_cond_wait(&changed, &lock);
+
+	if (h->state == HANDLE_FAILED && is_release(op->event)) {
+		// nothing to close, but the number may be opened again
+		hashtable_remove(handles, &fh); // frees h
+		pthread_cond_broadcast(&changed);
+		return NULL;
+	}
+	if (h->state != HANDLE_OPEN) return NULL;
+
+	if (is_release(op->event)) {
+		h->state = HANDLE_CLOSING;
+		while (h->users) pthread_cond_wait(&changed, &lock);
+	} else {
+		h->users++;
+	}
+
+	return h;
+}
+
+/**
+ * op is done with h, with lock held.
+ */
+static void put_handle(struct replay_op *op, struct handle *h) {
+	if (is_open(op->event)) {
+		if (!h->fh) {
+			// close what we opened for an open that failed in the trace
+			if (op->replay_res >= 0) close_handle(h);
+			free(h);
+			return;
+		}
+		h->state = op->replay_res < 0 ? HANDLE_FAILED : HANDLE_OPEN;
+	} else if (is_release(op->event)) {
+		hashtable_remove(handles, &h->fh); // frees h
+	} else {
+		h->users--;
+	}
+
+	pthread_cond_broadcast(&changed);
+}
+
+static void *worker(void *arg) {
+	(void)arg;
+
+	char *buf = malloc(REPLAY_IO_MAX);
+	if (!buf) die("malloc", "", ENOMEM);
+	memset(buf, 'x', REPLAY_IO_MAX);
+
+	pthread_mutex_lock(&lock);
+	while (next_op < nops) {
+		struct replay_op *op = &ops[next_op++];
+		if (!runnable(op)) continue;
+
+		struct handle *h = NULL;
+		if (has_handle(op->event) && !(h = take_handle(op))) continue;
+
+		pthread_mutex_unlock(&lock);
+
+		if (speed > 0) {
+			// the same distance to the first operation as in the trace
+			uint64_t due = replay_start + (op->time - ops[0].time) / speed;
+			uint64_t now = now_ns();
+			if (due > now) {
+				struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		uint64_t start = now_ns();
+		op->replay_res = mountpoint ? run_mounted(op, h, buf) : run_direct(op, h, buf);
+		op->latency = now_ns() - start;
+		op->done = true;
+
+		pthread_mutex_lock(&lock);
+		if (h) put_handle(op, h);
+	}
+	pthread_mutex_unlock(&lock);
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_latency(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_results(uint64_t nsecs) {
+	uint64_t *latencies = malloc(nops * sizeof(uint64_t) + 1);
+	if (!latencies) die("malloc", "", ENOMEM);
+
+	size_t done = 0, differ = 0, i;
+	for (i = 0; i < nops; i++) {
+		if (!ops[i].done) continue;
+		done++;
+		if ((ops[i].res < 0) != (ops[i].replay_res < 0)) differ++;
+	}
+
+	printf("%-24s %14zu\n", "operations", nops);
+	printf("%-24s %14zu\n", "replayed", done);
+	printf("%-24s %14zu\n", "skipped", nops - done);
+	printf("%-24s %14zu\n", "results_differ", differ);
+	printf("%-24s %14" PRIu64 "\n", "trace_records_dropped", dropped);
+	printf("%-24s %14zu\n", "lost_releases", lost_releases);
+	printf("%-24s %14d\n", "threads", nthreads);
+	printf("%-24s %14.3f\n", "seconds", nsecs / 1e9);
+	printf("%-24s %14.0f\n", "ops_per_second", nsecs ? done / (nsecs / 1e9) : 0.0);
+	printf("\n");
+
+	printf("%-16s %12s %10s %10s %10s %10s %10s %10s\n",
+		"operation", "count", "errors", "mean", "p50", "p99", "p99.9", "max");
+
+	int event;
+	for (event = 0; event < STATS_OPS; event++) {
+		size_t n = 0, errors = 0;
+		uint64_t sum = 0;
+		for (i = 0; i < nops; i++) {
+			if (!ops[i].done || ops[i].event != event) continue;
+			latencies[n++] = ops[i].latency;
+			sum += ops[i].latency;
+			if (ops[i].replay_res < 0) errors++;
+		}
+		if (n == 0) continue;
+
+		qsort(latencies, n, sizeof(uint64_t), cmp_latency);
+		printf("%-16s %12zu %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			stats_op_names[event], n, errors, sum / n / 1000.0,
+			latencies[n / 2] / 1000.0, latencies[n * 99 / 100] / 1000.0,
+			latencies[n * 999 / 1000] / 1000.0, latencies[n - 1] / 1000.0);
+	}
+
+	free(latencies);
+}
+
+int main(int argc, char **argv) {
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	const char *branches = NULL;
+	int c;
+
+	fuse_opt_add_arg(&args, argv[0]);
+
+	while ((c = getopt(argc, argv, "b:o:j:s:h")) != -1) {
+		switch (c) {
+		case 'b': branches = optarg; break;
+		case 'o':
+			fuse_opt_add_arg(&args, "-o");
+			fuse_opt_add_arg(&args, optarg);
+			break;
+		case 'j': nthreads = atoi(optarg); break;
+		case 's': speed = atof(optarg); break;
+		default: usage(basename(argv[0]));
+		}
+	}
+	if (argc - optind != (branches ? 1 : 2) || nthreads < 1 || nthreads > REPLAY_THREADS_MAX || speed < 0)
+		usage(basename(argv[0]));
+	if (!branches) mountpoint = argv[optind + 1];
+	if (!branches && args.argc > 1) {
+		fprintf(stderr, "-o only applies to -b, a mounted union has its options\n");
+		exit(1);
+	}
+
+	load(argv[optind]);
+	qsort(ops, nops, sizeof(struct replay_op), cmp_time);
+	if (dropped)
+		fprintf(stderr, "%" PRIu64 " records were lost while tracing, the replay misses them\n", dropped);
+
+	handles = create_hashtable(256, u64_hash, u64_equal);
+	if (!handles) die("malloc", "", ENOMEM);
+
+	if (branches) {
+		init_syslog();
+		uopt_init();
+
+		if (fuse_opt_parse(&args, NULL, unionfs_opts, unionfs_opt_proc) == -1) exit(1);
+		if (uopt.doexit) exit(uopt.retval);
+		if (uopt.lowlevel) {
+			fprintf(stderr, "-o lowlevel can not be replayed directly\n");
+			exit(1);
+		}
+		uopt.in_process = true;
+
+		if (parse_branches(branches) <= 0) {
+			fprintf(stderr, "You need to specify at least one branch!\n");
+			exit(1);
+		}
+		unionfs_post_opts();
+
+		struct fuse_conn_info conn;
+		memset(&conn, 0, sizeof(conn));
+		unionfs_oper.init(&conn);
+	}
+
+	pthread_t threads[REPLAY_THREADS_MAX];
+	int i;
+
+	replay_start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		int res = pthread_create(&threads[i], NULL, worker, NULL);
+		if (res) die("Failed to start", "a thread", res);
+	}
+	for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+	uint64_t nsecs = now_ns() - replay_start;
+
+	if (branches) unionfs_oper.destroy(NULL);
+
+	print_results(nsecs);
+
+	fuse_opt_free_args(&args);
+	return 0;
+}
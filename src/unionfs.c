@@ -20,6 +20,7 @@
 #include "debug.h"
 #include "opts.h"
 #include "usyslog.h"
+#include "ll_ops.h"
 
 #ifndef _IOC_SIZE
 #ifdef IOCPARM_LEN
@@ -29,24 +30,6 @@
 #endif
 #endif
 
-static struct fuse_opt unionfs_opts[] = {
-	FUSE_OPT_KEY("chroot=%s,", KEY_CHROOT),
-	FUSE_OPT_KEY("cow", KEY_COW),
-	FUSE_OPT_KEY("debug_file=%s", KEY_DEBUG_FILE),
-	FUSE_OPT_KEY("dirs=%s", KEY_DIRS),
-	FUSE_OPT_KEY("--help", KEY_HELP),
-	FUSE_OPT_KEY("-h", KEY_HELP),
-	FUSE_OPT_KEY("hide_meta_dir", KEY_HIDE_METADIR),
-	FUSE_OPT_KEY("hide_meta_files", KEY_HIDE_META_FILES),
-	FUSE_OPT_KEY("max_files=%s", KEY_MAX_FILES),
-	FUSE_OPT_KEY("noinitgroups", KEY_NOINITGROUPS),
-	FUSE_OPT_KEY("relaxed_permissions", KEY_RELAXED_PERMISSIONS),
-	FUSE_OPT_KEY("statfs_omit_ro", KEY_STATFS_OMIT_RO),
-	FUSE_OPT_KEY("--version", KEY_VERSION),
-	FUSE_OPT_KEY("-V", KEY_VERSION),
-	FUSE_OPT_END
-};
-
 int main(int argc, char *argv[]) {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
@@ -86,6 +69,14 @@ int main(int argc, char *argv[]) {
 	}
 	unionfs_post_opts();
 
+	// the numbers of imap.c, the low-level API always passes them
+	if (uopt.inode_map && !uopt.lowlevel) {
+		if (fuse_opt_add_arg(&args, "-ouse_ino,readdir_ino")) {
+			fprintf(stderr, "Failed to enable the inode map!\n");
+			exit(1);
+		}
+	}
+
 #ifdef FUSE_CAP_BIG_WRITES
 	/* libfuse > 0.8 supports large IO, also for reads, to increase performance
 	 * We support any IO sizes, so lets enable that option */
@@ -96,6 +87,10 @@ int main(int argc, char *argv[]) {
 #endif
 
 	umask(0);
-	int res = fuse_main(args.argc, args.argv, &unionfs_oper, NULL);
+	int res;
+	if (uopt.lowlevel && !uopt.doexit)
+		res = unionfs_ll_main(&args);
+	else
+		res = fuse_main(args.argc, args.argv, &unionfs_oper, NULL);
 	RETURN(uopt.doexit ? uopt.retval : res);
 }
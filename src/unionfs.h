@@ -20,11 +20,23 @@
 // file access protection mask
 #define S_PROT_MASK (S_ISUID| S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO)
 
+struct windex;
+struct bloom;
+struct manifest;
+struct bexec_branch;
+struct imap;
+
 typedef struct {
 	char *path;
 	int path_len;		// strlen(path)
 	int fd;			 // used to prevent accidental umounts of path
 	unsigned char rw;	 // the writable flag
+	struct windex *windex;	 // whiteout index, see windex.c
+	struct bloom *bloom;	 // paths of a ro-branch, see bloom.c
+	unsigned char idx;	 // RO+IDX, served from the manifest
+	struct manifest *manifest; // see manifest.c
+	struct bexec_branch *exec; // workers of -o branch_threads, see bexec.c
+	struct imap *imap;	 // inode numbers of -o inode_map, see imap.c
 } branch_entry_t;
 
 extern struct fuse_operations unionfs_oper;
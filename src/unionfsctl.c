@@ -5,6 +5,9 @@
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <strings.h>
 
 #include "uioctl.h"
 
@@ -17,6 +20,22 @@ static void print_help(char* progname) {
 	fprintf(stderr, "       -p </path/to/debug/file>\n");
 	fprintf(stderr, "       -d <on/off>\n");
 	fprintf(stderr, "          Enable or disable debugging.\n");
+	fprintf(stderr, "       -s\n");
+	fprintf(stderr, "          Print the operation counters.\n");
+	fprintf(stderr, "       -t <on/off>\n");
+	fprintf(stderr, "          Enable or disable tracing into the trace file.\n");
+	fprintf(stderr, "       -l\n");
+	fprintf(stderr, "          Print the operation latencies in microseconds.\n");
+	fprintf(stderr, "       -b\n");
+	fprintf(stderr, "          Print the branches.\n");
+	fprintf(stderr, "       -a [<position>:]<branch>[=RO/RW/RO+IDX]\n");
+	fprintf(stderr, "          Add a branch, by default as last RO branch.\n");
+	fprintf(stderr, "       -r <n>\n");
+	fprintf(stderr, "          Remove branch n.\n");
+	fprintf(stderr, "       -m <n>:<position>\n");
+	fprintf(stderr, "          Move branch n to position.\n");
+	fprintf(stderr, "       -f <n>=RO/RW\n");
+	fprintf(stderr, "          Make branch n read-only or writable.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Example: ");
 	fprintf(stderr, " %s -p /tmp/unionfs-fuse.log -d on /mnt/unionfs/union\n", progname);
@@ -24,6 +43,170 @@ static void print_help(char* progname) {
 	fprintf(stderr, "\n");
 }
 
+static void print_stats(const struct unionfs_stats *stats) {
+	printf("%-16s %14s %14s\n", "operation", "calls", "errors");
+
+	int i;
+	for (i = 0; i < STATS_OPS; i++) {
+		if (stats->calls[i] == 0) continue;
+		printf("%-16s %14" PRIu64 " %14" PRIu64 "\n",
+			stats_op_names[i], stats->calls[i], stats->errors[i]);
+	}
+
+	printf("\n");
+	printf("%-24s %14" PRIu64 "\n", "bytes_read", stats->bytes_read);
+	printf("%-24s %14" PRIu64 "\n", "bytes_written", stats->bytes_written);
+	printf("%-24s %14" PRIu64 "\n", "lookup_cache_hits", stats->lookup_cache_hits);
+	printf("%-24s %14" PRIu64 "\n", "whiteout_lookups", stats->whiteout_lookups);
+	printf("%-24s %14" PRIu64 "\n", "whiteouts_found", stats->whiteouts_found);
+	printf("%-24s %14" PRIu64 "\n", "copyups", stats->copyups);
+	printf("%-24s %14" PRIu64 "\n", "copyup_bytes", stats->copyup_bytes);
+	printf("%-24s %14" PRIu64 "\n", "spliced_reads", stats->spliced_reads);
+	printf("%-24s %14" PRIu64 "\n", "spliced_writes", stats->spliced_writes);
+	printf("%-24s %14" PRIu64 "\n", "readahead_windows", stats->readahead_windows);
+	printf("%-24s %14" PRIu64 "\n", "cache_hits", stats->cache_hits);
+	printf("%-24s %14" PRIu64 "\n", "cache_copies", stats->cache_copies);
+	printf("%-24s %14" PRIu64 "\n", "cache_copy_bytes", stats->cache_copy_bytes);
+	printf("%-24s %14" PRIu64 "\n", "cache_evictions", stats->cache_evictions);
+	printf("%-24s %14" PRIu64 "\n", "cache_bytes", stats->cache_bytes);
+	printf("%-24s %14" PRIu64 "\n", "xattr_cache_hits", stats->xattr_cache_hits);
+	printf("%-24s %14" PRIu32 "\n", "threads", stats->threads);
+
+	printf("\n");
+	for (i = 0; i < (int)stats->nbranches; i++) {
+		printf("branch %-17d %14" PRIu64 "\n", i, stats->branch_hits[i]);
+	}
+
+	if (stats->warmup.state != STATS_WARMUP_OFF) {
+		const struct unionfs_warmup *w = &stats->warmup;
+		printf("\n%-24s %14s\n", "warmup", w->state == STATS_WARMUP_DONE ? "done" : "running");
+		printf("%-24s %14" PRIu32 "\n", "warmup_branches_left", w->branches_left);
+		printf("%-24s %14" PRIu64 "\n", "warmup_whiteouts", w->whiteouts);
+		printf("%-24s %14" PRIu64 "\n", "warmup_dirs", w->dirs);
+		printf("%-24s %14" PRIu64 "\n", "warmup_entries", w->entries);
+		printf("%-24s %14" PRIu64 "\n", "warmup_msecs", w->msecs);
+	}
+
+	if (!stats->branch_threads) return;
+
+	printf("\n%-8s %8s %8s %8s %14s %10s %10s  (%" PRIu32 " workers each)\n", "workers",
+		"queued", "busy", "degraded", "calls", "timeouts", "rejected", stats->branch_threads);
+	for (i = 0; i < (int)stats->nbranches; i++) {
+		const struct unionfs_branch_exec *e = &stats->branch_exec[i];
+		printf("%-8d %8" PRIu32 " %8" PRIu32 " %8s %14" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+			i, e->queued, e->busy, e->degraded ? "yes" : "no", e->calls, e->timeouts, e->rejected);
+	}
+}
+
+static void print_latency_line(const char *name, const struct unionfs_latency_summary *sum) {
+	printf("%-16s %12" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, sum->count,
+		sum->mean / 1000.0, sum->p50 / 1000.0, sum->p99 / 1000.0,
+		sum->p999 / 1000.0, sum->max / 1000.0);
+}
+
+static void print_latency(const struct unionfs_latency *latency) {
+	printf("%-16s %12s %10s %10s %10s %10s %10s\n",
+		"operation", "count", "mean", "p50", "p99", "p99.9", "max");
+
+	int i;
+	for (i = 0; i < STATS_OPS; i++) {
+		if (latency->ops[i].count == 0) continue;
+		print_latency_line(stats_op_names[i], &latency->ops[i]);
+	}
+	if (latency->ops[STATS_HIST_COPYUP].count)
+		print_latency_line("copy-up", &latency->ops[STATS_HIST_COPYUP]);
+
+	printf("\n");
+	for (i = 0; i < (int)latency->nbranches; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "branch %d", i);
+		print_latency_line(name, &latency->branches[i]);
+	}
+}
+
+static void print_branches(int fd) {
+	struct unionfs_branch_ctl ctl;
+	memset(&ctl, 0, sizeof(ctl));
+
+	do {
+		if (ioctl(fd, UNIONFS_BRANCH_GET, &ctl) == -1) {
+			fprintf(stderr, "branch ioctl failed: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		const char *mode = ctl.flags & UNIONFS_BRANCH_RW ? "RW" :
+			ctl.flags & UNIONFS_BRANCH_IDX ? "RO+IDX" : "RO";
+		printf("%-6d %-6s %s\n", ctl.branch, mode, ctl.path);
+	} while (++ctl.branch < (int32_t)ctl.nbranches);
+}
+
+/**
+ * Parse a "<n>" prefix of arg ending with sep, returns the rest or NULL.
+ */
+static const char *parse_branch_number(const char *arg, char sep, int32_t *n) {
+	char *end;
+
+	if (!isdigit((unsigned char)arg[0])) return NULL;
+	long val = strtol(arg, &end, 10);
+	if (*end != sep || val > INT32_MAX) return NULL;
+
+	*n = (int32_t)val;
+	return sep ? end + 1 : end;
+}
+
+/**
+ * Parse "RO", "RW" or "RO+IDX" into ctl->flags.
+ */
+static int parse_branch_mode(const char *mode, struct unionfs_branch_ctl *ctl) {
+	if (strcasecmp(mode, "rw") == 0)
+		ctl->flags = UNIONFS_BRANCH_RW;
+	else if (strcasecmp(mode, "ro+idx") == 0)
+		ctl->flags = UNIONFS_BRANCH_IDX;
+	else if (strcasecmp(mode, "ro") == 0)
+		ctl->flags = 0;
+	else
+		return -1;
+	return 0;
+}
+
+/**
+ * -a [<position>:]<branch>[=RO/RW/RO+IDX], the branch path is relative to
+ * the current directory of unionfsctl.
+ */
+static int parse_add(const char *arg, struct unionfs_branch_ctl *ctl) {
+	ctl->branch = -1;
+	const char *rest = parse_branch_number(arg, ':', &ctl->branch);
+	if (rest) arg = rest;
+
+	char path[PATHLEN_MAX];
+	if (arg[0] == '/') {
+		path[0] = '\0';
+	} else if (!getcwd(path, sizeof(path))) {
+		return -1;
+	} else {
+		strcat(path, "/");
+	}
+	if (strlen(path) + strlen(arg) >= sizeof(path)) return -1;
+	strcat(path, arg);
+
+	char *mode = strrchr(path, '=');
+	ctl->flags = 0;
+	if (mode) {
+		if (parse_branch_mode(mode + 1, ctl)) return -1;
+		*mode = '\0';
+	}
+
+	strcpy(ctl->path, path);
+	return 0;
+}
+
+static void branch_cmd(int fd, unsigned long cmd, struct unionfs_branch_ctl *ctl) {
+	if (ioctl(fd, cmd, ctl) == -1) {
+		fprintf(stderr, "branch ioctl failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
 int main(int argc, char **argv) {
 	char *progname = basename(argv[0]);
 
@@ -46,7 +229,13 @@ int main(int argc, char **argv) {
 	const char* argument_param;
 	int debug_on_off;
 	int ioctl_res;
-	while ((opt = getopt(argc, argv, "d:p:")) != -1) {
+	struct unionfs_stats stats;
+	struct unionfs_latency latency;
+	int trace_on_off;
+	struct unionfs_branch_ctl branch_ctl;
+	const char *rest;
+	while ((opt = getopt(argc, argv, "a:bd:f:lm:p:r:st:")) != -1) {
+		memset(&branch_ctl, 0, sizeof(branch_ctl));
 		switch (opt) {
 		case 'p':
 			argument_param = optarg;
@@ -96,6 +285,83 @@ int main(int argc, char **argv) {
 				exit(1);
 			}
 			break;
+		case 't':
+			argument_param = optarg;
+			if (strcmp(argument_param, "on") == 0)
+				trace_on_off = 1;
+			else if (strcmp(argument_param, "off") == 0)
+				trace_on_off = 0;
+			else {
+				fprintf(stderr,
+					"invalid \"-t %s\" option given, valid is "
+					"\"-t on/off\"!\n", argument_param);
+				exit(1);
+			}
+
+			ioctl_res = ioctl(fd, UNIONFS_ONOFF_TRACE, &trace_on_off);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "trace-on/off ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
+		case 's':
+			ioctl_res = ioctl(fd, UNIONFS_STATS_GET, &stats);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "stats ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+
+			print_stats(&stats);
+			break;
+		case 'l':
+			ioctl_res = ioctl(fd, UNIONFS_STATS_LATENCY, &latency);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "latency ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+
+			print_latency(&latency);
+			break;
+		case 'b':
+			print_branches(fd);
+			break;
+		case 'a':
+			if (parse_add(optarg, &branch_ctl)) {
+				fprintf(stderr, "invalid \"-a %s\" option given, valid is "
+					"\"-a [<position>:]<branch>[=RO/RW/RO+IDX]\"!\n", optarg);
+				exit(1);
+			}
+			branch_cmd(fd, UNIONFS_BRANCH_ADD, &branch_ctl);
+			break;
+		case 'r':
+			if (!parse_branch_number(optarg, '\0', &branch_ctl.branch)) {
+				fprintf(stderr, "invalid \"-r %s\" option given, valid is "
+					"\"-r <n>\"!\n", optarg);
+				exit(1);
+			}
+			branch_cmd(fd, UNIONFS_BRANCH_REMOVE, &branch_ctl);
+			break;
+		case 'm':
+			rest = parse_branch_number(optarg, ':', &branch_ctl.branch);
+			if (!rest || !parse_branch_number(rest, '\0', &branch_ctl.to)) {
+				fprintf(stderr, "invalid \"-m %s\" option given, valid is "
+					"\"-m <n>:<position>\"!\n", optarg);
+				exit(1);
+			}
+			branch_cmd(fd, UNIONFS_BRANCH_MOVE, &branch_ctl);
+			break;
+		case 'f':
+			rest = parse_branch_number(optarg, '=', &branch_ctl.branch);
+			if (!rest || parse_branch_mode(rest, &branch_ctl) || (branch_ctl.flags & UNIONFS_BRANCH_IDX)) {
+				fprintf(stderr, "invalid \"-f %s\" option given, valid is "
+					"\"-f <n>=RO/RW\"!\n", optarg);
+				exit(1);
+			}
+			branch_cmd(fd, UNIONFS_BRANCH_MODE, &branch_ctl);
+			break;
 		default:
 			fprintf(stderr, "Unhandled option %c given.\n", opt);
 			break;
@@ -0,0 +1,163 @@
+/*
+* Description: decode a trace file written with -o trace_file, see trace.c
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libgen.h>
+
+#include "unionfs.h"
+#include "trace.h"
+
+#define NAME_SLOTS 4096		// initial size of the path name table
+
+struct name {
+	uint64_t hash;
+	char *path;		// NULL for an empty slot
+};
+
+static struct name *names;
+static size_t names_mask = NAME_SLOTS - 1;
+static size_t names_count;
+
+static struct name *find_name(uint64_t hash) {
+	size_t i = hash & names_mask;
+	while (names[i].path && names[i].hash != hash) i = (i + 1) & names_mask;
+	return &names[i];
+}
+
+static void add_name(uint64_t hash, const char *path) {
+	struct name *name = find_name(hash);
+	if (name->path) return;
+
+	if ((names_count + 1) * 2 > names_mask + 1) {
+		struct name *old = names;
+		size_t old_slots = names_mask + 1;
+
+		names_mask = old_slots * 2 - 1;
+		names = calloc(names_mask + 1, sizeof(struct name));
+		if (!names) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		size_t i;
+		for (i = 0; i < old_slots; i++) {
+			if (old[i].path) *find_name(old[i].hash) = old[i];
+		}
+		free(old);
+
+		name = find_name(hash);
+	}
+
+	name->hash = hash;
+	name->path = strdup(path);
+	names_count++;
+}
+
+static const char *event_name(unsigned int event) {
+	if (event < STATS_OPS) return stats_op_names[event];
+
+	switch (event) {
+	case TRACE_EV_FIND_BRANCH: return "find_branch";
+	case TRACE_EV_COPYUP: return "copy-up";
+	case TRACE_EV_DROPPED: return "dropped";
+	case TRACE_EV_ARGS: return "args";
+	default: return "unknown";
+	}
+}
+
+static void print_record(const struct trace_record *rec) {
+	if (rec->event == TRACE_EV_DROPPED) {
+		printf("%" PRIu64 ".%09" PRIu64 " %7" PRIu32 " %-12s %" PRId32 " records lost\n",
+			rec->u.op.time / 1000000000, rec->u.op.time % 1000000000,
+			rec->tid, event_name(rec->event), rec->u.op.res);
+		return;
+	}
+
+	char hash[24];
+	const char *path = "-";
+	if (rec->path_hash) {
+		struct name *name = find_name(rec->path_hash);
+		if (name->path) {
+			path = name->path;
+		} else {
+			snprintf(hash, sizeof(hash), "#%016" PRIx64, rec->path_hash);
+			path = hash;
+		}
+	}
+
+	// of the next record, path is the second path or the file handle
+	if (rec->event == TRACE_EV_ARGS) {
+		printf("- %7" PRIu32 " %-12s %" PRIu64 " %" PRIu64 " %s\n",
+			rec->tid, event_name(rec->event), rec->u.args.a, rec->u.args.b, path);
+		return;
+	}
+
+	printf("%" PRIu64 ".%09" PRIu64 " %7" PRIu32 " %-12s %3d %6" PRId32 " %10" PRIu32 " %s\n",
+		rec->u.op.time / 1000000000, rec->u.op.time % 1000000000,
+		rec->tid, event_name(rec->event), rec->branch, rec->u.op.res,
+		rec->u.op.duration, path);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace-file>\n", basename(argv[0]));
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Prints one line per record: time, thread, event, branch,\n");
+		fprintf(stderr, "result, duration in ns and path. With -o trace_capture an\n");
+		fprintf(stderr, "operation is preceded by its arguments: thread, \"args\", two\n");
+		fprintf(stderr, "numbers and the second path or the file handle.\n");
+		exit(1);
+	}
+
+	FILE *file = fopen(argv[1], "r");
+	if (!file) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+		exit(1);
+	}
+
+	struct trace_header header;
+	if (fread(&header, sizeof(header), 1, file) != 1
+	|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+	|| header.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s is not a trace file of this unionfs version\n", argv[1]);
+		exit(1);
+	}
+
+	names = calloc(NAME_SLOTS, sizeof(struct name));
+	if (!names) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	// the pieces of a path are consecutive records
+	char path[PATHLEN_MAX + TRACE_NAME_LEN];
+	size_t path_len = 0;
+
+	struct trace_record rec;
+	while (fread(&rec, sizeof(rec), 1, file) == 1) {
+		if (rec.event != TRACE_EV_PATH) {
+			print_record(&rec);
+			continue;
+		}
+
+		if (rec.branch == 0) path_len = 0;
+		if (path_len + TRACE_NAME_LEN > PATHLEN_MAX) continue; // broken
+
+		memcpy(path + path_len, rec.u.name, TRACE_NAME_LEN);
+		path_len += TRACE_NAME_LEN;
+
+		if (memchr(rec.u.name, '\0', TRACE_NAME_LEN)) add_name(rec.path_hash, path);
+	}
+
+	fclose(file);
+	return 0;
+}
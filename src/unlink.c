@@ -24,11 +24,17 @@
 
 #include "unionfs.h"
 #include "opts.h"
+#include "btable.h"
 #include "debug.h"
 #include "cow.h"
 #include "general.h"
 #include "findbranch.h"
 #include "string.h"
+#include "lcache.h"
+#include "dcache.h"
+#include "branchio.h"
+#include "chunk.h"
+#include "imap.h"
 
 /**
   * If the branch that has the file to be unlinked is in read-only mode,
@@ -60,26 +66,24 @@ static int unlink_ro(const char *path, int branch_ro) {
 static int unlink_rw(const char *path, int branch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) RETURN(ENAMETOOLONG);
+	uint64_t ino = imap_removing(branch_rw, path);
 
-	int res = unlink(p);
+	int res = b_unlink(branch_rw, path);
 	if (res == -1) RETURN(errno);
 
+	imap_removed(branch_rw, ino);
+
+	chunk_remove(branch_rw, path);
+
 	RETURN(0);
 }
 
-/**
-  * unlink() call
-  */
-int unionfs_unlink(const char *path) {
-	DBG("%s\n", path);
-
+static int do_unlink(const char *path) {
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(errno);
 
 	int res;
-	if (!uopt.branches[i].rw) {
+	if (!BRANCH(i).rw) {
 		// read-only branch
 		if (!uopt.cow_enabled) {
 			res = EROFS;
@@ -95,5 +99,20 @@ int unionfs_unlink(const char *path) {
 		}
 	}
 
+	if (res == 0) lcache_invalidate(path);
+
 	RETURN(-res);
 }
+
+/**
+  * unlink() call
+  */
+int unionfs_unlink(const char *path) {
+	DBG("%s\n", path);
+
+	dcache_remove_begin(path);
+	int res = do_unlink(path);
+	dcache_remove_end(path, res == 0);
+
+	RETURN(res);
+}
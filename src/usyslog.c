@@ -2,17 +2,30 @@
  * License: BSD-style license
  * Copyright: Bernd Schubert <bernd.schubert@fastmail.fm>
  *
- * Details: 
+ * Details:
  *   Log files might be located on our own filesystem. If we then want to log
  *   a message to syslog, we would need to log to ourself, which easily ends up
- *   in a deadlock. Initializing openlog() using the flags 
+ *   in a deadlock. Initializing openlog() using the flags
  *   LOG_NDELAY | LOG_NOWAIT should prevent that, but real live has shown that
- *   this does not work reliable and systems 'crashed' just because we 
- *   tried to log a harmless message. 
- *   So this file introduces a syslog thread and a syslog buffer. usyslog() 
- *   calls write without a risk to deadlock into the syslog buffer (chained 
- *   list) and then the seperate syslog_thread call syslog(). That way our
+ *   this does not work reliable and systems 'crashed' just because we
+ *   tried to log a harmless message.
+ *   So this file introduces a syslog thread and a syslog buffer. usyslog()
+ *   calls write without a risk to deadlock into the syslog buffer and then
+ *   the seperate syslog_thread call syslog(). That way our
  *   our filesystem thread(s) cannot stall from syslog() calls.
+ *
+ *   The buffer is a bounded ring of preallocated slots with many producers
+ *   (the filesystem threads) and a single consumer (the syslog thread).
+ *   Every slot carries a sequence number, which says whether it is free for
+ *   or filled at a ring position. A producer claims a position with one
+ *   compare-and-swap, formats its message into the slot and publishes it by
+ *   advancing the sequence number. So an error burst from all threads, e.g.
+ *   when a branch goes away, never serializes them on a lock. If the ring is
+ *   full the message is dropped and counted, the syslog thread then logs how
+ *   many messages got lost.
+ *   The syslog thread sleeps on an eventfd (a pipe on other systems). To
+ *   batch wakeups, producers only write to it when the thread announced
+ *   that it is going to sleep, it then logs everything there is.
  */
 
 #include <stdio.h>
@@ -20,11 +33,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 
-#if __APPLE__
-#include <malloc/malloc.h>
-#else
-#include <malloc.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
 #endif
 
 #include <pthread.h>
@@ -33,120 +45,67 @@
 #include "usyslog.h"
 #include "debug.h"
 
-static ulogs_t *free_head, *free_bottom; // free chained list log entries
-static ulogs_t *used_head = NULL, *used_bottom = NULL; //used chained list pointers
-
-static pthread_mutex_t list_lock; 	// locks the entire chained list
-static pthread_cond_t cond_message;		// used to wake up the syslog thread
+static ulogs_t ring[MAX_SYSLOG_MESSAGES];
+static uint64_t enqueue_pos;	// next position a producer claims
+static uint64_t dequeue_pos;	// next position the syslog thread logs, only used by it
+static uint64_t dropped;	// messages lost as the ring was full
 
-// Only used for debugging, protected by list_lock
-static int free_entries;  
-static int used_entries = 0;
+static int sleeping;		// the syslog thread waits for a wakeup
+static int wake_fd[2] = { -1, -1 }; // read and write end, the same eventfd on linux
 
-//#define USYSLOG_DEBUG
-
-#ifdef USYSLOG_DEBUG
-static void verify_lists()
+/**
+ * Wake up the syslog thread.
+ */
+static void wake_syslog(void)
 {
-	pthread_mutex_lock(&list_lock);
-	
-	ulogs_t *entry = free_head;
-	int free_count = -1;
-	bool first_free = true;
-	while (entry) {
-		if (first_free) {
-			first_free = false;
-			free_count = 1;
-		} else
-			free_count++;
-		entry = entry->next;
-	}
-	if (free_count != free_entries && free_entries != 0) 
-		DBG("usyslog list error detected: number of free entries inconsistent!"
-		     " %d vs. %d", free_count, free_entries);
-		     
-	entry = used_head;
-	int used_count = -1;
-	bool first_used = true;
-	while (entry) {
-		if (first_used) {
-			first_used = false;
-			used_count = 1;
-		} else
-			used_count++;
-		entry = entry->next;
-	}
-	if (used_count != used_entries && used_entries != 0) 
-		DBG("usyslog list error detected: number of used entries inconsistent!"
-		     " (used: %d vs. %d) (free: %d vs. %d) \n", 
-		     used_count, used_entries, free_count, free_entries);
-		     
-	pthread_mutex_unlock(&list_lock);
+	uint64_t one = 1;
+	ssize_t res = write(wake_fd[1], &one, sizeof(one));
+	(void)res; // the counter or pipe is full, so there is a wakeup pending
 }
-#else
-#define verify_lists()
-#endif
 
+/**
+ * Wait until wake_syslog() was called.
+ */
+static void wait_syslog(void)
+{
+	uint64_t count;
+	ssize_t res = read(wake_fd[0], &count, sizeof(count));
+	if (res < 0 && errno != EINTR)
+		DBG("Reading the syslog wakeup failed: %s\n", strerror(errno));
+}
 
 /**
- * Walks the chained used-list and calls syslog()
+ * Logs all filled slots in ring order, returns false if there was none
  */
-static void do_syslog(void)
+static bool do_syslog(void)
 {
-	pthread_mutex_lock(&list_lock); // we MUST ensure not to keep that forever
-
-	ulogs_t *log_entry = used_head;
-
-	while (log_entry) {
-		pthread_mutex_t *entry_lock = &log_entry->lock;
-		int res = pthread_mutex_trylock(entry_lock);
-		if (res) {
-			if (res != EBUSY) 
-				DBG("Entirely unexpected locking error %s\n", 
-				    strerror(res));
-			// If something goes wrong with the log_entry we do not
-			// block the critical list_lock forever!
-			// EBUSY might come up rarely, if we race with usyslog()
-			pthread_mutex_unlock(&list_lock);
-			sleep(1);
-			pthread_mutex_lock(&list_lock);
-			log_entry = used_head;
-			continue;
-		}
-		pthread_mutex_unlock(&list_lock);
-		
-		// This syslog call and so this lock might block, so be
-		// carefull on using locks! The filesystem IO thread
-		// *MUST* only try to lock it using pthread_mutex_trylock()
+	bool logged = false;
+
+	while (1) {
+		ulogs_t *log_entry = &ring[dequeue_pos & (MAX_SYSLOG_MESSAGES - 1)];
+
+		// a producer may still be writing its message
+		uint64_t seq = __atomic_load_n(&log_entry->seq, __ATOMIC_ACQUIRE);
+		if (seq != dequeue_pos + 1) break;
+
+		// This syslog call might block, but the filesystem threads
+		// do not wait for us
 		syslog(log_entry->priority, "%s", log_entry->message);
-		log_entry->used = false;
-
-		// NOTE: The list is only locked now, after syslog() succeeded!
-		pthread_mutex_lock(&list_lock);
-		ulogs_t *next_entry = log_entry->next; // just to save the pointer
-		
-		used_head = log_entry->next;
-		if (!used_head)
-			used_bottom = NULL; // no used entries left
-		
-		if (free_bottom)
-			free_bottom->next = log_entry;
-		free_bottom = log_entry;
-		free_bottom->next = NULL; 
-		
-		if (!free_head)
-			free_head = log_entry;
-			
-		free_entries++;
-		used_entries--;
-			
-		pthread_mutex_unlock(&list_lock); // unlock ist ASAP
-		
-		log_entry = next_entry;
-		pthread_mutex_unlock(entry_lock);
+
+		// hand out the slot for the next round of the ring
+		__atomic_store_n(&log_entry->seq, dequeue_pos + MAX_SYSLOG_MESSAGES, __ATOMIC_RELEASE);
+		dequeue_pos++;
+		logged = true;
+	}
+
+	uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if (lost) {
+		syslog(LOG_WARNING, "%llu messages lost, the syslog buffer was full",
+		       (unsigned long long)lost);
+		logged = true;
 	}
-	
-	verify_lists();
+
+	return logged;
 }
 
 /**
@@ -154,19 +113,22 @@ static void do_syslog(void)
  */
 static void * syslog_thread(void *arg)
 {
-	// FIXME: What is a better way to prevent a compiler warning about
-	//        unused variable 'arg'
-	int tinfo = *((int *) arg);
-	if (tinfo == 0 && tinfo == 1)
-		printf("Starting thread %d", tinfo);
-
-	pthread_mutex_t sleep_mutex; 
+	(void)arg;
 
-	pthread_mutex_init(&sleep_mutex, NULL);
-	pthread_mutex_lock(&sleep_mutex);
 	while (1) {
-		pthread_cond_wait(&cond_message, &sleep_mutex);
-		do_syslog();
+		if (do_syslog()) continue;
+
+		// Announce we are going to sleep, then look again. A producer
+		// either published before and we see its message, or it sees
+		// us sleeping and wakes us up.
+		__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+		if (do_syslog()) {
+			__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		wait_syslog();
+		__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
 	}
 
 	return NULL;
@@ -177,77 +139,45 @@ static void * syslog_thread(void *arg)
  */
 void usyslog(int priority, const char *format, ...)
 {
-	int res;
+	if (wake_fd[1] < 0) return; // init_syslog() was not called yet
+
 	ulogs_t *log;
+	uint64_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
 
-	// Lock the entire list first, which means the syslog thread MUST NOT
-	// lock it if there is any chance it might be locked forever.
-	pthread_mutex_lock(&list_lock);
-	
-	// Some sanity checks. If we fail here, we will leak a log entry,
-	// but will not lock up.
-
-	if (free_head == NULL) {
-		DBG("All syslog entries already busy\n");
-		pthread_mutex_unlock(&list_lock);
-		return;
-	}
-	
-	log = free_head;
-	free_head = log->next;
-
-	res = pthread_mutex_trylock(&log->lock);
-	if (res == EBUSY) {
-			// huh, that never should happen!
-			DBG("Critical log error, log entry is BUSY, but should not\n");
-			pthread_mutex_unlock(&list_lock);
+	while (1) {
+		log = &ring[pos & (MAX_SYSLOG_MESSAGES - 1)];
+		uint64_t seq = __atomic_load_n(&log->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - pos);
+
+		if (diff == 0) {
+			// the slot is free for pos, try to claim it, on failure
+			// pos is updated
+			if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			// the syslog thread did not log this slot yet
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			DBG("All syslog entries already busy\n");
 			return;
-	} else if (res) {
-		// huh, that never should happen either!
-		DBG("Never should happen, can get lock: %s\n", strerror(res));
-		pthread_mutex_unlock(&list_lock);
-		return;
-	}
-
-	if (log->used) {
-		// huh, that never should happen either!
-		DBG("Never should happen, entry is busy, but should not!\n");
-		pthread_mutex_unlock(&log->lock);
-		pthread_mutex_unlock(&list_lock);
-		return;
+		} else {
+			// another producer claimed pos
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		}
 	}
 
-	if (!used_head)
-		used_head = used_bottom = log;
-	else {
-		used_bottom->next = log;
-		used_bottom = log;
-	}
-	
-	if (log->next) {
-		// from free_list to end of used_list, so next is NULL now
-		log->next = NULL; 
-	} else {
-		// so the last entry in free_list
-		free_bottom = NULL;
-	}
-	
-	
-	free_entries--;
-	used_entries++;
-		
-	// Everything below is log entry related, so we can free the list_lock
-	pthread_mutex_unlock(&list_lock);
-	
 	va_list ap;
 	va_start(ap, format);
 	vsnprintf(log->message, MAX_MSG_SIZE, format, ap);
+	va_end(ap);
 	log->priority = priority;
-	log->used = 1;
 
-	pthread_mutex_unlock(&log->lock);
+	// publish the message, this pairs with the store of sleeping
+	__atomic_store_n(&log->seq, pos + 1, __ATOMIC_SEQ_CST);
 
-	pthread_cond_signal(&cond_message); // wake up the syslog thread
+	if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST))
+		wake_syslog(); // wake up the syslog thread
 }
 
 /**
@@ -257,46 +187,39 @@ void init_syslog(void)
 {
 	openlog("unionfs-fuse: ", LOG_CONS | LOG_NDELAY | LOG_NOWAIT | LOG_PID, LOG_DAEMON);
 
-	pthread_mutex_init(&list_lock, NULL);
-	pthread_cond_init(&cond_message, NULL);
 	pthread_t thread;
 	pthread_attr_t attr;
-	int t_arg = 0; // thread argument, not required for us
 
 	int i;
-	ulogs_t *log, *last = NULL;
-	for (i = 0; i < MAX_SYSLOG_MESSAGES; i++) {
-		log = malloc(sizeof(ulogs_t));
-		if (log == NULL) {
-			fprintf(stderr, "\nLog initialization failed: %s\n", strerror(errno));
-			fprintf(stderr, "Aborting!\n");
-			// Still initialazation phase, we can abort.
-			exit (1);	
-		}
+	for (i = 0; i < MAX_SYSLOG_MESSAGES; i++)
+		ring[i].seq = i;
 
-		log->used = false;
-		pthread_mutex_init(&log->lock, NULL);
-		
-		if (last) {
-			last->next = log;
-		} else {
-			// so the very first entry
-			free_head = log;
-		}
-		last = log;
+	int res;
+#ifdef __linux__
+	res = eventfd(0, EFD_CLOEXEC);
+	wake_fd[0] = wake_fd[1] = res;
+#else
+	res = pipe(wake_fd);
+	if (res == 0) {
+		fcntl(wake_fd[0], F_SETFD, FD_CLOEXEC);
+		fcntl(wake_fd[1], F_SETFD, FD_CLOEXEC);
+		// a full pipe already means a wakeup is pending
+		res = fcntl(wake_fd[1], F_SETFL, O_NONBLOCK);
+	}
+#endif
+	if (res < 0) {
+		fprintf(stderr, "\nLog initialization failed: %s\n", strerror(errno));
+		fprintf(stderr, "Aborting!\n");
+		// Still initialazation phase, we can abort.
+		exit (1);
 	}
-	last->next = NULL;
-	free_bottom = last;
-	
-	free_entries = MAX_SYSLOG_MESSAGES;
 
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	int res = pthread_create(&thread, &attr, syslog_thread, (void *) &t_arg);
+	res = pthread_create(&thread, &attr, syslog_thread, NULL);
 	if (res != 0) {
 		fprintf(stderr, "Failed to initialize the syslog threads: %s\n",
 			strerror(res));
 		exit(1);
 	}
 }
-
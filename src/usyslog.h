@@ -5,17 +5,16 @@
 
 #include <syslog.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-#define MAX_SYSLOG_MESSAGES 32	// max number of buffered syslog messages
+#define MAX_SYSLOG_MESSAGES 32	// max number of buffered syslog messages, a power of two
 #define MAX_MSG_SIZE 256	// max string length for syslog messages
 
-/* chained buffer list of syslog entries  */
+/* slot of the syslog ring buffer */
 typedef struct ulogs {
+	uint64_t seq;		// ring position this slot is free or filled for
 	int priority; // first argument for syslog()
 	char message[MAX_MSG_SIZE]; // 2nd argument for syslog() 
-	bool used;		// is this entry used?
-	pthread_mutex_t lock;	// lock a single entry
-	struct ulogs *next;	// pointer to the next entry
 } ulogs_t;
 
 
@@ -28,4 +27,3 @@ void usyslog(int priority, const char *format, ...);
 		DBG(format, ##__VA_ARGS__);			\
 		usyslog(priority, format, ##__VA_ARGS__);	\
 	} while (0);
-
@@ -0,0 +1,263 @@
+/*
+* Description: warm-up of the caches after mount
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Right after mount the whiteout index is read before the first request,
+*	and all caches are empty, so e.g. the boot of an NFS root is slow
+*	until the caches have filled. With -o warmup WARMUP_THREADS threads
+*	are started from unionfs_init() while requests are served already.
+*	They first load the whiteout indexes of the branches (see
+*	windex_warmup()), one branch per thread at a time, until then the
+*	whiteouts of a branch are looked up in METADIR. Then they walk the
+*	directories of -o warmup_dirs recursively and look up every entry,
+*	which fills the lookup, directory and attribute caches of unionfs if
+*	enabled and the kernel caches of the branches anyway. The directories
+*	are shared through a queue, each thread lists one directory at a time
+*	and queues the sub-directories it finds. "unionfsctl -s" shows the
+*	progress, unmounting stops the walk.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "branchio.h"
+#include "findbranch.h"
+#include "readdir.h"
+#include "string.h"
+#include "windex.h"
+#include "warmup.h"
+#include "debug.h"
+#include "usyslog.h"
+
+// a directory to walk
+struct warmup_dir {
+	struct warmup_dir *next;
+	char path[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER; // queue, walking or threads
+static struct warmup_dir *queue;	// the last queued first
+static unsigned int walking;		// threads listing a directory
+static unsigned int threads;		// running
+static bool stop;			// unmounting
+static int next_branch;			// whiteout index to load next
+static struct timespec started;
+static struct unionfs_warmup progress;	// counters updated without the lock
+
+static uint64_t msecs_since(const struct timespec *ts) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+static void queue_dir(const char *path) {
+	struct warmup_dir *dir = malloc(sizeof(struct warmup_dir) + strlen(path) + 1);
+	if (!dir) return; // just not warmed up
+
+	strcpy(dir->path, path);
+
+	pthread_mutex_lock(&lock);
+	dir->next = queue;
+	queue = dir;
+	pthread_cond_signal(&changed);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Look up an entry of directory buf, its sub-directories are queued.
+ */
+static int walk_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(void)off;
+	const char *path = buf;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+	if (path[1] == '\0' && strcmp(name, METANAME) == 0) return 0;
+
+	char p[PATHLEN_MAX];
+	// avoid a double slash for entries of the root directory
+	if (BUILD_PATH(p, path[1] ? path : "", "/", name)) return 0;
+
+	__atomic_add_fetch(&progress.entries, 1, __ATOMIC_RELAXED);
+
+	int branch = find_rorw_branch(p);
+	if (branch != -1) {
+		// readdir() only knows the type if the branch tells it
+		mode_t mode = stbuf->st_mode;
+		struct stat st;
+		if (!(mode & S_IFMT) && b_lstat(branch, p, &st) == 0) mode = st.st_mode;
+
+		if (S_ISDIR(mode)) queue_dir(p);
+	}
+
+	return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+static void walk(const char *path) {
+	DBG("%s\n", path);
+
+	// a directory of -o warmup_dirs might not exist, the others are cached
+	if (find_rorw_branch(path) == -1) return;
+
+	// through opendir() the listing ends up in -o dir_cache
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	if (unionfs_opendir(path, &fi)) return;
+
+	unionfs_readdir(path, (void *)path, walk_fill, 0, &fi);
+	unionfs_releasedir(path, &fi);
+
+	__atomic_add_fetch(&progress.dirs, 1, __ATOMIC_RELAXED);
+}
+
+static void *worker(void *arg) {
+	struct btable *table = arg;
+	btable_adopt(table);
+
+	// the whiteout indexes first, each is read by a single thread
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		int i = __atomic_fetch_add(&next_branch, 1, __ATOMIC_RELAXED);
+		if (i >= NBRANCHES) break;
+
+		long count = windex_warmup(i);
+		if (count > 0) __atomic_add_fetch(&progress.whiteouts, count, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&progress.branches_left, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		// the others might still find sub-directories
+		while (!queue && walking && !stop) pthread_cond_wait(&changed, &lock);
+		if (!queue || stop) break;
+
+		struct warmup_dir *dir = queue;
+		queue = dir->next;
+		walking++;
+		pthread_mutex_unlock(&lock);
+
+		walk(dir->path);
+		free(dir);
+
+		pthread_mutex_lock(&lock);
+		walking--;
+		if (!queue && !walking) pthread_cond_broadcast(&changed);
+	}
+
+	bool last = --threads == 0;
+	if (last) {
+		// what is left after a stop
+		while (queue) {
+			struct warmup_dir *dir = queue;
+			queue = dir->next;
+			free(dir);
+		}
+
+		progress.msecs = msecs_since(&started);
+		progress.state = STATS_WARMUP_DONE;
+	}
+	pthread_cond_broadcast(&changed); // warmup_stop() waits for the last one
+	pthread_mutex_unlock(&lock);
+
+	if (last)
+		USYSLOG(LOG_INFO, "Warm-up done after %llu ms: %llu whiteouts, %llu directories, %llu entries\n",
+			(unsigned long long)progress.msecs, (unsigned long long)progress.whiteouts,
+			(unsigned long long)progress.dirs, (unsigned long long)progress.entries);
+
+	btable_adopt(NULL);
+	btable_unref(table);
+
+	return NULL;
+}
+
+/**
+ * Start the warm-up, called once the file system is mounted and we are in
+ * the chroot (the threads would not survive daemonizing).
+ */
+void warmup_start(void) {
+	if (!uopt.warmup) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	progress.state = STATS_WARMUP_RUNNING;
+	progress.branches_left = NBRANCHES;
+
+	if (uopt.warmup_dirs) {
+		char *dirs = strdup(uopt.warmup_dirs);
+		char *rest = dirs, *dir;
+		while (rest && (dir = strsep(&rest, ":")) != NULL) {
+			if (*dir == '\0') continue;
+			if (*dir != '/') {
+				USYSLOG(LOG_WARNING, "Warm-up directory %s is not absolute, skipped\n", dir);
+				continue;
+			}
+			queue_dir(dir);
+		}
+		free(dirs);
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&lock);
+
+	int i;
+	for (i = 0; i < WARMUP_THREADS; i++) {
+		pthread_t thread;
+		struct btable *table = btable_ref();
+		int res = pthread_create(&thread, &attr, worker, table);
+		if (res) {
+			btable_unref(table);
+			USYSLOG(LOG_WARNING, "Failed to start a warm-up thread: %s\n", strerror(res));
+			break;
+		}
+		threads++;
+	}
+
+	// the whiteouts are still found in METADIR then
+	if (threads == 0) progress.state = STATS_WARMUP_DONE;
+
+	pthread_mutex_unlock(&lock);
+
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Stop the walk on unmount and wait for the threads.
+ */
+void warmup_stop(void) {
+	if (!uopt.warmup) return;
+
+	pthread_mutex_lock(&lock);
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&changed);
+	while (threads) pthread_cond_wait(&changed, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Add the progress of the warm-up to stats.
+ */
+void warmup_get(struct unionfs_stats *stats) {
+	if (!uopt.warmup) return;
+
+	struct unionfs_warmup *w = &stats->warmup;
+
+	pthread_mutex_lock(&lock);
+	w->state = progress.state;
+	w->branches_left = __atomic_load_n(&progress.branches_left, __ATOMIC_RELAXED);
+	w->whiteouts = __atomic_load_n(&progress.whiteouts, __ATOMIC_RELAXED);
+	w->dirs = __atomic_load_n(&progress.dirs, __ATOMIC_RELAXED);
+	w->entries = __atomic_load_n(&progress.entries, __ATOMIC_RELAXED);
+	w->msecs = progress.state == STATS_WARMUP_RUNNING ? msecs_since(&started) : progress.msecs;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,18 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include "stats.h"
+
+#define WARMUP_THREADS 4	// threads of -o warmup
+
+void warmup_start(void);
+void warmup_stop(void);
+void warmup_get(struct unionfs_stats *stats);
+
+#endif
@@ -0,0 +1,806 @@
+/*
+* Description: in-memory index of whiteouts
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	Without the index path_hidden() needs to lstat() a "_HIDDEN~" file for
+*	every path component on every branch it checks. With -o whiteout_index
+*	we scan the METADIR of all branches once on mount and keep the hidden
+*	paths in a hash table per branch. hide_file(), hide_dir() and
+*	remove_hidden() update the index, so afterwards no syscalls at all are
+*	required to check for whiteouts. For readdir() we additionally keep
+*	the names of the whiteouts per directory, so that METADIR does not
+*	need to be read at all.
+*	Whiteouts created or removed directly on the branches (not through
+*	unionfs) are not noticed until the next mount. A branch added while
+*	mounted is scanned when it is added.
+*	With -o whiteout_journal the index is the authority and creating or
+*	removing a whiteout only appends a record to METADIR/.journal of the
+*	rw-branch, a single write instead of the mkdir() chain, open() and
+*	close(). Once WINDEX_JOURNAL_RECORDS are logged the journal is renamed
+*	to .journal.old and a pool job applies it to the "_HIDDEN~" files,
+*	creating each directory of METADIR only once per pass. On unmount the
+*	journals are applied and removed, so the branch looks as if unionfs
+*	had created the whiteouts itself. Journals left by a crash are read on
+*	the next mount with -o whiteout_index; a record cut short ends them.
+*	The journal lives in the page cache like the whiteout files, it is
+*	synced when it is rotated and applied.
+*	With -o warmup the scan of a branch without journals is left to the
+*	warm-up threads (see warmup.c), so that the mount does not wait for
+*	it. Until the branch is loaded windex_ready() is false and the
+*	whiteouts are looked up in METADIR as without the index, and created
+*	there even with -o whiteout_journal. Paths hidden or unhidden in the
+*	mean time are remembered, the scan does not override the index for
+*	them.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "btable.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "smap.h"
+#include "string.h"
+#include "strset.h"
+#include "pool.h"
+#include "windex.h"
+#include "debug.h"
+#include "usyslog.h"
+
+// in METANAME of a branch
+#define JOURNAL_FILE ".journal"
+#define JOURNAL_OLD ".journal.old"	// being compacted
+
+struct windex {
+	pthread_rwlock_t lock;		// writers of paths, and dirs
+	struct smap *paths;		// hidden paths, e.g. "/dir/file", true for directories
+	struct hashtable *dirs;		// struct wdir of a directory with whiteouts
+	int fd;				// of the branch, for the journal
+	pthread_mutex_t journal_lock;	// -o whiteout_journal
+	int journal_fd;			// -1 until the first record
+	unsigned long records;		// in the journal
+	bool compacting;		// JOURNAL_OLD is being applied
+	struct pool_group group;
+	bool loading;			// left to windex_warmup()
+	strset_t touched;		// paths changed while loading
+};
+
+// the whiteouts of a directory, for readdir()
+struct wdir {
+	unsigned int count;
+	unsigned int size;
+	char **names;
+};
+
+// a record of the journal, followed by len bytes of the normalized path
+struct wrecord {
+	uint8_t op;			// WINDEX_ADD_*, WINDEX_REMOVE
+	uint8_t padding;
+	uint16_t len;
+};
+
+#define WINDEX_ADD_FILE 'F'
+#define WINDEX_ADD_DIR 'D'
+#define WINDEX_REMOVE 'R'
+
+static bool enabled = false;
+
+/**
+ * Copy path to dest in the form we use as key: a single leading slash,
+ * no duplicate and no trailing slashes. Root is "/".
+ */
+static int normalize(char *dest, const char *path) {
+	int len = 0;
+
+	while (*path) {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+
+		if (len + 1 >= PATHLEN_MAX) return -ENAMETOOLONG;
+		dest[len++] = '/';
+
+		while (*path && *path != '/') {
+			if (len + 1 >= PATHLEN_MAX) return -ENAMETOOLONG;
+			dest[len++] = *path++;
+		}
+	}
+
+	if (len == 0) dest[len++] = '/';
+	dest[len] = '\0';
+
+	return 0;
+}
+
+/**
+ * Cut off the last path component of a normalized path, in place.
+ */
+static void cut_last(char *path) {
+	char *slash = strrchr(path, '/');
+	if (slash == path)
+		path[1] = '\0';
+	else
+		*slash = '\0';
+}
+
+static struct windex *windex_create(int fd) {
+	struct windex *wi = malloc(sizeof(struct windex));
+	if (!wi) return NULL;
+
+	wi->paths = smap_create(sizeof(bool), 0);
+	wi->dirs = create_hashtable(16, string_hash, string_equal);
+	if (!wi->paths || !wi->dirs) {
+		smap_destroy(wi->paths);
+		if (wi->dirs) hashtable_destroy(wi->dirs, 0);
+		free(wi);
+		return NULL;
+	}
+
+	pthread_rwlock_init(&wi->lock, NULL);
+	wi->fd = fd;
+	pthread_mutex_init(&wi->journal_lock, NULL);
+	wi->journal_fd = -1;
+	wi->records = 0;
+	wi->compacting = false;
+	pool_group_init(&wi->group);
+	wi->loading = false;
+	return wi;
+}
+
+/**
+ * Add a normalized path, the index lock must be held. Returns 0 or -1.
+ */
+static int do_add(struct windex *wi, const char *path, bool dir) {
+	if (smap_get(wi->paths, path, NULL, NULL)) {
+		smap_put(wi->paths, path, &dir, SMAP_NO_TICKET); // e.g. a replayed journal
+		return 0;
+	}
+
+	char parent[PATHLEN_MAX];
+	strcpy(parent, path);
+	cut_last(parent);
+
+	struct wdir *wd = hashtable_search(wi->dirs, parent);
+	if (!wd) {
+		wd = calloc(1, sizeof(struct wdir));
+		char *dkey = strdup(parent);
+		if (!wd || !dkey || !hashtable_insert(wi->dirs, dkey, wd)) {
+			free(wd);
+			free(dkey);
+			return -1;
+		}
+	}
+
+	// make room first, so that the names are never incomplete
+	if (wd->count == wd->size) {
+		unsigned int size = wd->size ? wd->size * 2 : 4;
+		char **names = realloc(wd->names, size * sizeof(char *));
+		if (!names) goto err;
+		wd->names = names;
+		wd->size = size;
+	}
+
+	char *name = strdup(strrchr(path, '/') + 1);
+	if (!name) goto err;
+
+	if (!smap_put(wi->paths, path, &dir, SMAP_NO_TICKET)) {
+		free(name);
+		goto err;
+	}
+
+	wd->names[wd->count++] = name;
+	return 0;
+
+err:
+	if (wd->count == 0) {
+		wd = hashtable_remove(wi->dirs, parent);
+		free(wd->names);
+		free(wd);
+	}
+	return -1;
+}
+
+/**
+ * Remove a normalized path, the index lock must be held. Returns 0 if path
+ * was not hidden, otherwise WINDEX_ADD_FILE or WINDEX_ADD_DIR.
+ */
+static int do_remove(struct windex *wi, char *path) {
+	bool dir;
+	if (!smap_remove(wi->paths, path, &dir)) return 0;
+
+	int res = dir ? WINDEX_ADD_DIR : WINDEX_ADD_FILE;
+	const char *name = strrchr(path, '/') + 1;
+
+	char parent[PATHLEN_MAX];
+	strcpy(parent, path);
+	cut_last(parent);
+
+	struct wdir *wd = hashtable_search(wi->dirs, parent);
+	if (wd) {
+		unsigned int i;
+		for (i = 0; i < wd->count; i++) {
+			if (strcmp(wd->names[i], name) == 0) {
+				free(wd->names[i]);
+				wd->names[i] = wd->names[wd->count - 1];
+				break;
+			}
+		}
+		if (--wd->count == 0) {
+			wd = hashtable_remove(wi->dirs, parent);
+			free(wd->names);
+			free(wd);
+		}
+	}
+
+	return res;
+}
+
+/**
+ * Add a whiteout found by scan_dir(). While the branch is in use the index
+ * knows better about the paths changed in the mean time.
+ */
+static void scan_add(struct windex *wi, const char *path, bool dir) {
+	if (!wi->loading) {
+		do_add(wi, path, dir); // on mount, nobody else looks at wi
+		return;
+	}
+
+	pthread_rwlock_wrlock(&wi->lock);
+	if (!strset_contains(&wi->touched, path)) do_add(wi, path, dir);
+	pthread_rwlock_unlock(&wi->lock);
+}
+
+/**
+ * Recursively read the whiteouts below the meta directory p, which
+ * corresponds to the union directory path.
+ */
+static void scan_dir(struct windex *wi, const char *p, const char *path) {
+	DIR *dp = opendir(p);
+	if (dp == NULL) return;
+
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		char sub[PATHLEN_MAX], subpath[PATHLEN_MAX];
+		if (BUILD_PATH(sub, p, "/", de->d_name)) continue;
+
+		struct stat st;
+		bool dir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN) dir = lstat(sub, &st) == 0 && S_ISDIR(st.st_mode);
+
+		char *tag = whiteout_tag(de->d_name);
+		if (tag) {
+			*tag = '\0'; // this modifies de->d_name!
+			if (BUILD_PATH(subpath, path, "/", de->d_name)) continue;
+			if (normalize(subpath, subpath)) continue;
+			scan_add(wi, subpath, dir);
+			// no need to look into hidden directories
+			continue;
+		}
+
+		if (BUILD_PATH(subpath, path, "/", de->d_name)) continue;
+
+		if (dir) scan_dir(wi, sub, subpath);
+	}
+
+	closedir(dp);
+}
+
+/**
+ * Create the directories of the record path below METADIR, which is open
+ * as metafd. made remembers the ones we already created or found, so a
+ * journal with many whiteouts in the same directories needs one mkdir()
+ * per directory.
+ */
+static int make_parents(int metafd, const char *path, strset_t *made) {
+	char p[PATHLEN_MAX];
+	strcpy(p, path + 1); // relative to metafd
+
+	char *slash = p;
+	while ((slash = strchr(slash, '/')) != NULL) {
+		*slash = '\0';
+		if (!strset_contains(made, p)) {
+			if (mkdirat(metafd, p, S_IRWXU | S_IRWXG) == -1 && errno != EEXIST) return -1;
+			strset_add(made, p);
+		}
+		*slash++ = '/';
+	}
+
+	return 0;
+}
+
+/**
+ * Apply one record to the whiteout files below metafd.
+ */
+static void apply_record(int metafd, int op, const char *path, strset_t *made) {
+	char p[PATHLEN_MAX];
+	if (path[1] == '\0') return;
+	if (snprintf(p, PATHLEN_MAX, "%s%s", path + 1, HIDETAG) >= PATHLEN_MAX) return;
+
+	int res = 0;
+	switch (op) {
+	case WINDEX_ADD_FILE:
+		if (make_parents(metafd, path, made)) break;
+		res = openat(metafd, p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+		if (res != -1) res = close(res);
+		break;
+	case WINDEX_ADD_DIR:
+		if (make_parents(metafd, path, made)) break;
+		res = mkdirat(metafd, p, S_IRWXU);
+		if (res == -1 && errno == EEXIST) res = 0;
+		break;
+	default:
+		res = unlinkat(metafd, p, 0);
+		if (res == -1 && (errno == EISDIR || errno == EPERM)) res = unlinkat(metafd, p, AT_REMOVEDIR);
+		if (res == -1 && errno == ENOENT) res = 0;
+	}
+
+	if (res == -1) USYSLOG(LOG_ERR, "Applying the whiteout journal to %s failed: %s\n", p, strerror(errno));
+}
+
+/**
+ * Read the journal name of METADIR into the index, if wi is given, and
+ * apply it to the whiteout files, if apply is set. A record cut short by a
+ * crash ends the journal. Returns the number of records.
+ */
+static unsigned long replay(struct windex *wi, int metafd, const char *name, bool apply) {
+	int fd = openat(metafd, name, O_RDONLY);
+	if (fd == -1) return 0;
+
+	FILE *f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return 0;
+	}
+
+	strset_t made;
+	if (apply && strset_init(&made)) apply = false;
+
+	unsigned long count = 0;
+	struct wrecord rec;
+	char path[PATHLEN_MAX];
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (rec.len == 0 || rec.len >= PATHLEN_MAX || fread(path, rec.len, 1, f) != 1) break;
+		path[rec.len] = '\0';
+		if (path[0] != '/') break;
+
+		if (wi) {
+			pthread_rwlock_wrlock(&wi->lock);
+			if (rec.op == WINDEX_REMOVE)
+				do_remove(wi, path);
+			else
+				do_add(wi, path, rec.op == WINDEX_ADD_DIR);
+			pthread_rwlock_unlock(&wi->lock);
+		}
+		if (apply) apply_record(metafd, rec.op, path, &made);
+		count++;
+	}
+
+	if (apply) strset_free(&made);
+	fclose(f);
+	return count;
+}
+
+/**
+ * Apply JOURNAL_OLD to the whiteout files and remove it, run by the pool.
+ */
+static int compact_job(void *arg) {
+	struct windex *wi = arg;
+
+	int metafd = openat(wi->fd, METANAME, O_RDONLY | O_DIRECTORY);
+	if (metafd != -1) {
+		unsigned long count = replay(NULL, metafd, JOURNAL_OLD, true);
+		fsync(metafd);
+		unlinkat(metafd, JOURNAL_OLD, 0);
+		close(metafd);
+		DBG("%lu records applied\n", count);
+	}
+
+	pthread_mutex_lock(&wi->journal_lock);
+	wi->compacting = false;
+	pthread_mutex_unlock(&wi->journal_lock);
+
+	return 0;
+}
+
+/**
+ * Write the whiteouts of the journals into the "_HIDDEN~" layout and
+ * remove the journals, so that they are seen without the journal too.
+ * The journal lock must be held and nothing may be compacting.
+ */
+static void compact_now(struct windex *wi) {
+	int metafd = openat(wi->fd, METANAME, O_RDONLY | O_DIRECTORY);
+	if (metafd == -1) return;
+
+	if (wi->journal_fd != -1) {
+		close(wi->journal_fd);
+		wi->journal_fd = -1;
+	}
+
+	replay(NULL, metafd, JOURNAL_OLD, true);
+	replay(NULL, metafd, JOURNAL_FILE, true);
+	fsync(metafd);
+	unlinkat(metafd, JOURNAL_OLD, 0);
+	unlinkat(metafd, JOURNAL_FILE, 0);
+	wi->records = 0;
+
+	close(metafd);
+}
+
+/**
+ * Fill the index of a branch from its METADIR and its journals. p is the
+ * METADIR path as we can reach it now.
+ */
+static void load(struct windex *wi, const char *p, bool rw) {
+	scan_dir(wi, p, "/");
+
+	// journals left of the last mount, -o whiteout_journal or not
+	int metafd = openat(wi->fd, METANAME, O_RDONLY | O_DIRECTORY);
+	if (metafd == -1) return;
+
+	unsigned long count = replay(wi, metafd, JOURNAL_OLD, false);
+	count += replay(wi, metafd, JOURNAL_FILE, false);
+	close(metafd);
+
+	// we may only write to rw-branches
+	if (count && rw) compact_now(wi);
+}
+
+void windex_free(struct windex *wi) {
+	if (!wi) return;
+
+	pool_group_wait(&wi->group);
+	pool_group_destroy(&wi->group);
+	if (wi->loading) strset_free(&wi->touched);
+	if (wi->journal_fd != -1) close(wi->journal_fd);
+	pthread_mutex_destroy(&wi->journal_lock);
+
+	struct hashtable_itr *itr = hashtable_count(wi->dirs) ? hashtable_iterator(wi->dirs) : NULL;
+	if (itr) {
+		do {
+			struct wdir *wd = hashtable_iterator_value(itr);
+			unsigned int i;
+			for (i = 0; i < wd->count; i++) free(wd->names[i]);
+			free(wd->names);
+		} while (hashtable_iterator_advance(itr));
+		free(itr);
+	}
+
+	smap_destroy(wi->paths);
+	hashtable_destroy(wi->dirs, 1);
+	pthread_rwlock_destroy(&wi->lock);
+	free(wi);
+}
+
+/**
+ * Build the index of a branch added while mounted (see btable.c), we are
+ * in the chroot already. Returns 0 or -errno.
+ */
+int windex_branch_load(branch_entry_t *branch) {
+	if (!enabled) return 0;
+
+	struct windex *wi = windex_create(branch->fd);
+	if (!wi) return -ENOMEM;
+
+	char p[PATHLEN_MAX];
+	if (BUILD_PATH(p, branch->path, METADIR) == 0) load(wi, p, branch->rw);
+
+	DBG("%s: %lu whiteouts\n", branch->path, smap_count(wi->paths));
+
+	branch->windex = wi;
+	return 0;
+}
+
+/**
+ * Build the whiteout index of all branches, called once on mount
+ */
+void windex_init(void) {
+	if (!uopt.whiteout_index || !uopt.cow_enabled) return;
+
+	int i;
+	for (i = 0; i < NBRANCHES; i++) {
+		struct windex *wi = windex_create(BRANCH(i).fd);
+		if (!wi) {
+			fprintf(stderr, "%s: Failed to create the whiteout index\n", __func__);
+			exit(1); // still early stage, we can abort
+		}
+
+		// journals need to be applied before the branch is used
+		if (uopt.warmup && faccessat(wi->fd, METANAME "/" JOURNAL_FILE, F_OK, 0) == -1 &&
+		    faccessat(wi->fd, METANAME "/" JOURNAL_OLD, F_OK, 0) == -1) {
+			if (strset_init(&wi->touched)) {
+				fprintf(stderr, "%s: Failed to create the whiteout index\n", __func__);
+				exit(1);
+			}
+			wi->loading = true;
+			BRANCH(i).windex = wi;
+			continue;
+		}
+
+		// we are not in the chroot yet, see unionfs_post_opts()
+		char p[PATHLEN_MAX];
+		int res;
+		if (!uopt.chroot)
+			res = BUILD_PATH(p, BRANCH(i).path, METADIR);
+		else
+			res = BUILD_PATH(p, uopt.chroot, BRANCH(i).path, METADIR);
+		if (res == 0) load(wi, p, BRANCH(i).rw);
+
+		DBG("branch %d: %lu whiteouts\n", i, smap_count(wi->paths));
+
+		BRANCH(i).windex = wi;
+	}
+
+	enabled = true;
+}
+
+/**
+ * -o warmup: read the whiteouts of branch, if this was left to us. Returns
+ * the number of whiteouts of the branch then, otherwise -1.
+ */
+long windex_warmup(int branch) {
+	if (!enabled) return -1;
+
+	struct windex *wi = BRANCH(branch).windex;
+	if (!__atomic_load_n(&wi->loading, __ATOMIC_ACQUIRE)) return -1;
+
+	// in the chroot already, see unionfs_init()
+	char p[PATHLEN_MAX];
+	if (BUILD_PATH(p, BRANCH(branch).path, METADIR) == 0) scan_dir(wi, p, "/");
+
+	pthread_rwlock_wrlock(&wi->lock);
+	strset_free(&wi->touched);
+	__atomic_store_n(&wi->loading, false, __ATOMIC_RELEASE);
+	long count = smap_count(wi->paths);
+	pthread_rwlock_unlock(&wi->lock);
+
+	DBG("branch %d: %ld whiteouts\n", branch, count);
+
+	return count;
+}
+
+/**
+ * Whether the index of branch can be used, it might still be loading.
+ */
+bool windex_ready(int branch) {
+	return enabled && !__atomic_load_n(&BRANCH(branch).windex->loading, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Same as path_hidden(), but served from the index: check if path
+ * or any of its parent directories is hidden on branch.
+ */
+int windex_hidden(int branch, const char *path) {
+	struct windex *wi = BRANCH(branch).windex;
+
+	// the common case, no whiteouts at all
+	if (smap_count(wi->paths) == 0) return 0;
+
+	char *p = scratch_path(SCRATCH_WINDEX);
+	if (normalize(p, path)) return -ENAMETOOLONG;
+
+	// check "/dir1", "/dir1/dir2", ... and finally the full path
+	char *walk = p;
+	while (*walk) {
+		walk++;
+		while (*walk && *walk != '/') walk++;
+
+		char c = *walk;
+		*walk = '\0';
+		bool hidden = smap_get(wi->paths, p, NULL, NULL);
+		*walk = c;
+
+		if (hidden) return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Add the names of the whiteouts of directory path on branch to whiteouts.
+ * Returns false if the index is disabled or still loading, METADIR needs
+ * to be read then.
+ */
+bool windex_dir_whiteouts(int branch, const char *path, strset_t *whiteouts) {
+	if (!windex_ready(branch)) return false;
+
+	struct windex *wi = BRANCH(branch).windex;
+
+	char p[PATHLEN_MAX];
+	if (normalize(p, path)) return false;
+
+	pthread_rwlock_rdlock(&wi->lock);
+	struct wdir *wd = hashtable_search(wi->dirs, p);
+	unsigned int i;
+	for (i = 0; wd && i < wd->count; i++) strset_add(whiteouts, wd->names[i]);
+	pthread_rwlock_unlock(&wi->lock);
+
+	return true;
+}
+
+/**
+ * A whiteout for path was created on branch
+ */
+void windex_add(int branch, const char *path, bool dir) {
+	if (!enabled) return;
+
+	DBG("%s\n", path);
+
+	char p[PATHLEN_MAX];
+	if (normalize(p, path)) return;
+
+	struct windex *wi = BRANCH(branch).windex;
+
+	pthread_rwlock_wrlock(&wi->lock);
+	do_add(wi, p, dir);
+	if (wi->loading) strset_add(&wi->touched, p);
+	pthread_rwlock_unlock(&wi->lock);
+}
+
+/**
+ * The whiteout of path was removed from branch
+ */
+void windex_remove(int branch, const char *path) {
+	if (!enabled) return;
+
+	DBG("%s\n", path);
+
+	char p[PATHLEN_MAX];
+	if (normalize(p, path)) return;
+
+	struct windex *wi = BRANCH(branch).windex;
+
+	pthread_rwlock_wrlock(&wi->lock);
+	do_remove(wi, p);
+	if (wi->loading) strset_add(&wi->touched, p);
+	pthread_rwlock_unlock(&wi->lock);
+}
+
+/**
+ * Append a record to the journal of wi, the journal lock must be held.
+ * Returns 0 or -errno.
+ */
+static int append(struct windex *wi, int op, const char *path) {
+	if (wi->journal_fd == -1) {
+		if (mkdirat(wi->fd, METANAME, 0755) == -1 && errno != EEXIST) return -errno;
+		wi->journal_fd = openat(wi->fd, METANAME "/" JOURNAL_FILE, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+		if (wi->journal_fd == -1) return -errno;
+	}
+
+	struct wrecord rec = { .op = op, .padding = 0, .len = strlen(path) };
+	struct iovec iov[2] = {
+		{ .iov_base = &rec, .iov_len = sizeof(rec) },
+		{ .iov_base = (void *)path, .iov_len = rec.len },
+	};
+
+	// a single write, so that records do not interleave
+	ssize_t res = writev(wi->journal_fd, iov, 2);
+	if (res == -1) return -errno;
+	if ((size_t)res != sizeof(rec) + rec.len) return -ENOSPC;
+
+	wi->records++;
+	return 0;
+}
+
+/**
+ * Start the compaction of the journal once it is long enough, the journal
+ * lock must be held. Returns true if compact_job() needs to be submitted.
+ */
+static bool rotate(struct windex *wi) {
+	if (wi->records < WINDEX_JOURNAL_RECORDS || wi->compacting) return false;
+
+	fdatasync(wi->journal_fd);
+	close(wi->journal_fd);
+	wi->journal_fd = -1;
+	wi->records = 0;
+
+	if (renameat(wi->fd, METANAME "/" JOURNAL_FILE, wi->fd, METANAME "/" JOURNAL_OLD) == -1) {
+		USYSLOG(LOG_ERR, "Rotating the whiteout journal failed: %s\n", strerror(errno));
+		return false; // the next records are appended to it again
+	}
+
+	wi->compacting = true;
+	return true;
+}
+
+/**
+ * -o whiteout_journal: a whiteout for path is to be created on branch, a
+ * directory if dir is set. Instead of creating it in METADIR we append it
+ * to the journal. Returns 0 or -errno.
+ */
+int windex_log_add(int branch, const char *path, bool dir) {
+	DBG("%s\n", path);
+
+	char p[PATHLEN_MAX];
+	if (normalize(p, path)) return -ENAMETOOLONG;
+
+	struct windex *wi = BRANCH(branch).windex;
+
+	// the journal lock keeps the records in the order of the index updates
+	pthread_mutex_lock(&wi->journal_lock);
+
+	int res = append(wi, dir ? WINDEX_ADD_DIR : WINDEX_ADD_FILE, p);
+	if (res == 0) {
+		pthread_rwlock_wrlock(&wi->lock);
+		if (do_add(wi, p, dir)) res = -ENOMEM;
+		pthread_rwlock_unlock(&wi->lock);
+	}
+	bool compact = rotate(wi);
+
+	pthread_mutex_unlock(&wi->journal_lock);
+
+	if (compact) pool_submit(&wi->group, compact_job, wi);
+
+	return res;
+}
+
+/**
+ * -o whiteout_journal: remove the whiteout of path from branch, if there is
+ * one. Returns 0 if there was none, WINDEX_FILE or WINDEX_DIR for the type
+ * of the removed whiteout or -errno.
+ */
+int windex_log_remove(int branch, const char *path) {
+	char p[PATHLEN_MAX];
+	if (normalize(p, path)) return -ENAMETOOLONG;
+
+	struct windex *wi = BRANCH(branch).windex;
+
+	// the common case, no whiteout and nothing to do
+	if (!smap_get(wi->paths, p, NULL, NULL)) return 0;
+
+	DBG("%s\n", path);
+
+	pthread_mutex_lock(&wi->journal_lock);
+
+	// only we change the index, but another remove might have been first
+	bool hidden = smap_get(wi->paths, p, NULL, NULL);
+
+	int res = hidden ? append(wi, WINDEX_REMOVE, p) : 0;
+	if (hidden && res == 0) {
+		pthread_rwlock_wrlock(&wi->lock);
+		res = do_remove(wi, p) == WINDEX_ADD_DIR ? WINDEX_DIR : WINDEX_FILE;
+		pthread_rwlock_unlock(&wi->lock);
+	}
+	bool compact = rotate(wi);
+
+	pthread_mutex_unlock(&wi->journal_lock);
+
+	if (compact) pool_submit(&wi->group, compact_job, wi);
+
+	return res;
+}
+
+/**
+ * Write the journals of all rw-branches into METADIR and remove them, on
+ * unmount.
+ */
+void windex_sync(void) {
+	if (!enabled || !uopt.whiteout_journal) return;
+
+	int i;
+	for (i = 0; i < NBRANCHES; i++) {
+		struct windex *wi = BRANCH(i).windex;
+		if (!BRANCH(i).rw) continue;
+
+		pool_group_wait(&wi->group);
+
+		pthread_mutex_lock(&wi->journal_lock);
+		compact_now(wi);
+		pthread_mutex_unlock(&wi->journal_lock);
+	}
+}
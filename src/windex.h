@@ -0,0 +1,34 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef WINDEX_H
+#define WINDEX_H
+
+#include <stdbool.h>
+
+#include "unionfs.h"
+#include "strset.h"
+
+#define WINDEX_JOURNAL_RECORDS 16384	// -o whiteout_journal, compacted beyond
+
+// results of windex_log_remove()
+#define WINDEX_FILE 1
+#define WINDEX_DIR 2
+
+void windex_init(void);
+long windex_warmup(int branch);
+bool windex_ready(int branch);
+void windex_free(struct windex *wi);
+int windex_branch_load(branch_entry_t *branch);
+int windex_hidden(int branch, const char *path);
+bool windex_dir_whiteouts(int branch, const char *path, strset_t *whiteouts);
+void windex_add(int branch, const char *path, bool dir);
+void windex_remove(int branch, const char *path);
+int windex_log_add(int branch, const char *path, bool dir);
+int windex_log_remove(int branch, const char *path);
+void windex_sync(void);
+
+#endif
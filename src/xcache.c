@@ -0,0 +1,242 @@
+/*
+* Description: cache of missing extended attributes
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* Details:
+*	The kernel asks for security.capability before every write and for
+*	the POSIX ACLs on many opens, almost always the file has none of them.
+*	Each of these getxattr() calls would need to find the branch of the
+*	path and ask it, so with -o xattr_cache we remember for a path which
+*	attributes it does not have (ENOATTR, or ENOTSUP for branches without
+*	extended attributes) and the result of listxattr(). A cached list
+*	also answers getxattr() of all names not in it.
+*	It works like the lookup cache (see lcache.c): a sharded map (see
+*	smap.c), tickets against storing results that raced with an
+*	invalidation, entries valid for -o lookup_cache_ttl and only on the
+*	branch table they were found on.
+*	lcache_invalidate() and lcache_invalidate_all() also invalidate this
+*	cache, which covers creating, removing, renaming and copying up
+*	paths, setxattr() and removexattr() invalidate the path themselves.
+*	Writes and chown() drop security.capability on the branches, so
+*	lists with it are not cached. Values are not cached at all.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "opts.h"
+#include "btable.h"
+#include "smap.h"
+#include "xcache.h"
+#include "stats.h"
+#include "debug.h"
+
+typedef struct {
+	unsigned long table;	// generation of the branch table
+	time_t expires;		// monotonic time in seconds
+	int nmissing;
+	struct {
+		char name[XCACHE_NAME_MAX];
+		int err;
+	} missing[XCACHE_NAMES];
+	ssize_t list_size;	// -1 if the list is not cached
+	char list[XCACHE_LIST_MAX];
+} xcache_entry_t;
+
+static struct smap *map;
+static bool enabled = false;
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * Initialize the cache, must be called after option parsing.
+ */
+void xcache_init(void) {
+	if (uopt.xattr_cache_size == 0) return;
+
+	map = smap_create(sizeof(xcache_entry_t), uopt.xattr_cache_size);
+	if (!map) {
+		fprintf(stderr, "%s: Failed to create the xattr cache\n", __func__);
+		exit(1); // still early stage, we can abort
+	}
+
+	enabled = true;
+}
+
+/**
+ * Copy the entry of path to entry if it is still valid, the ticket of path
+ * goes to *ticket.
+ */
+static bool find_entry(const char *path, xcache_entry_t *entry, unsigned long *ticket) {
+	return smap_get(map, path, entry, ticket) &&
+		entry->table == btable_get()->gen && entry->expires > now();
+}
+
+static bool in_list(const char *list, size_t size, const char *name) {
+	size_t pos = 0;
+	while (pos < size) {
+		if (strcmp(list + pos, name) == 0) return true;
+		pos += strlen(list + pos) + 1;
+	}
+	return false;
+}
+
+/**
+ * Return true if path is known not to have the attribute name, *err is the
+ * errno getxattr() gave then. On a cache miss *ticket needs to be passed to
+ * xcache_insert_missing().
+ */
+bool xcache_missing(const char *path, const char *name, int *err, unsigned long *ticket) {
+	if (!enabled) return false;
+
+	xcache_entry_t entry;
+	bool found = false;
+
+	if (find_entry(path, &entry, ticket)) {
+		if (entry.list_size >= 0 && !in_list(entry.list, entry.list_size, name)) {
+			*err = ENOATTR;
+			found = true;
+		}
+
+		int i;
+		for (i = 0; !found && i < entry.nmissing; i++) {
+			if (strcmp(entry.missing[i].name, name) == 0) {
+				*err = entry.missing[i].err;
+				found = true;
+			}
+		}
+	}
+
+	DBG("%s %s: %s\n", path, name, found ? "hit" : "miss");
+	if (found) stats_xattr_cache_hit();
+	return found;
+}
+
+/**
+ * Start over with entry if it is new or no longer valid.
+ */
+static void renew_entry(xcache_entry_t *entry) {
+	if (entry->table != btable_get()->gen || entry->expires <= now()) {
+		entry->table = btable_get()->gen;
+		entry->expires = now() + uopt.lookup_cache_ttl;
+		entry->nmissing = 0;
+		entry->list_size = -1;
+	}
+}
+
+struct missing {
+	const char *name;
+	int err;
+};
+
+static void add_missing(void *value, bool created, void *arg) {
+	(void)created;
+	xcache_entry_t *entry = value;
+	struct missing *missing = arg;
+
+	renew_entry(entry);
+
+	// a full entry starts over, the names asked for again come back
+	if (entry->nmissing == XCACHE_NAMES) entry->nmissing = 0;
+
+	strcpy(entry->missing[entry->nmissing].name, missing->name);
+	entry->missing[entry->nmissing].err = missing->err;
+	entry->nmissing++;
+}
+
+/**
+ * getxattr() of name on path failed with err (ENOATTR or ENOTSUP).
+ */
+void xcache_insert_missing(const char *path, const char *name, int err, unsigned long ticket) {
+	if (!enabled || strlen(name) >= XCACHE_NAME_MAX) return;
+
+	struct missing missing = { name, err };
+	smap_update(map, path, ticket, SMAP_CREATE, add_missing, &missing); // dropped if invalidated
+}
+
+/**
+ * Return true if the attribute list of path is cached and store the
+ * listxattr() result into *res. On a cache miss *ticket needs to be passed
+ * to xcache_insert_list().
+ */
+bool xcache_list(const char *path, char *list, size_t size, ssize_t *res, unsigned long *ticket) {
+	if (!enabled) return false;
+
+	xcache_entry_t entry;
+	bool found = false;
+
+	if (find_entry(path, &entry, ticket) && entry.list_size >= 0) {
+		if (size == 0) {
+			*res = entry.list_size;
+		} else if (size < (size_t)entry.list_size) {
+			*res = -ERANGE;
+		} else {
+			memcpy(list, entry.list, entry.list_size);
+			*res = entry.list_size;
+		}
+		found = true;
+	}
+
+	DBG("%s: %s\n", path, found ? "hit" : "miss");
+	if (found) stats_xattr_cache_hit();
+	return found;
+}
+
+struct list {
+	const char *list;
+	size_t size;
+};
+
+static void set_list(void *value, bool created, void *arg) {
+	(void)created;
+	xcache_entry_t *entry = value;
+	struct list *list = arg;
+
+	renew_entry(entry);
+	memcpy(entry->list, list->list, list->size);
+	entry->list_size = list->size;
+}
+
+/**
+ * Remember the listxattr() result of path.
+ */
+void xcache_insert_list(const char *path, const char *list, size_t size, unsigned long ticket) {
+	if (!enabled || size > XCACHE_LIST_MAX) return;
+
+	// a write through another handle might remove it any time
+	if (in_list(list, size, "security.capability")) return;
+
+	struct list l = { list, size };
+	smap_update(map, path, ticket, SMAP_CREATE, set_list, &l);
+}
+
+/**
+ * The attributes of path changed or path itself, forget about it.
+ */
+void xcache_invalidate(const char *path) {
+	if (!enabled) return;
+
+	DBG("%s\n", path);
+
+	smap_remove(map, path, NULL);
+}
+
+/**
+ * An entire sub-tree changed, forget about everything.
+ */
+void xcache_invalidate_all(void) {
+	if (!enabled) return;
+
+	DBG_IN();
+
+	smap_clear(map);
+}
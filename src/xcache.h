@@ -0,0 +1,30 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef XCACHE_H
+#define XCACHE_H
+
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#define XCACHE_NAMES 4		// missing attribute names remembered per path
+#define XCACHE_NAME_MAX 48	// longer names are not cached
+#define XCACHE_LIST_MAX 256	// longer listxattr() results are not cached
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA		// Linux
+#endif
+
+void xcache_init(void);
+bool xcache_missing(const char *path, const char *name, int *err, unsigned long *ticket);
+void xcache_insert_missing(const char *path, const char *name, int err, unsigned long ticket);
+bool xcache_list(const char *path, char *list, size_t size, ssize_t *res, unsigned long *ticket);
+void xcache_insert_list(const char *path, const char *list, size_t size, unsigned long ticket);
+void xcache_invalidate(const char *path);
+void xcache_invalidate_all(void);
+
+#endif
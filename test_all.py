@@ -7,6 +7,9 @@ import shutil
 import time
 import tempfile
 import stat
+import struct
+import threading
+import re
 
 
 def call(cmd):
@@ -31,6 +34,9 @@ class Common:
 	def setUp(self):
 		self.unionfs_path = os.path.abspath('src/unionfs')
 		self.unionfsctl_path = os.path.abspath('src/unionfsctl')
+		self.unionfstrace_path = os.path.abspath('src/unionfstrace')
+		self.unionfs_index_path = os.path.abspath('src/unionfs-index')
+		self.unionfs_replay_path = os.path.abspath('src/unionfs-replay')
 
 		self.tmpdir = tempfile.mkdtemp()
 		self.original_cwd = os.getcwd()
@@ -215,6 +221,13 @@ class UnionFS_RW_RO_TestCase(Common, unittest.TestCase):
 		#os.rmdir('union/common_dir')
 		#self.assertFalse(os.path.isdir('union/common_dir'))
 
+	def test_statfs(self):
+		# both branches are on the same file system, which is counted once
+		union = os.statvfs('union')
+		branch = os.statvfs('rw1')
+		self.assertEqual(union.f_blocks * union.f_bsize, branch.f_blocks * branch.f_bsize)
+		self.assertEqual(union.f_files, branch.f_files)
+
 
 class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 	def setUp(self):
@@ -225,6 +238,29 @@ class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 		lst = ['ro1_file', 'rw1_file', 'ro_common_file', 'rw_common_file', 'common_file', 'ro1_dir', 'rw1_dir', 'common_dir', 'common_empty_dir', ]
 		self.assertEqual(set(lst), set(os.listdir('union')))
 
+	def test_large_dir(self):
+		# needs several readdir() calls, entries must neither get lost nor duplicated
+		names = ['file_with_a_long_name_%04d' % i for i in range(2000)]
+		for name in names[::2]:
+			write_to_file('ro1/ro1_dir/%s' % name, 'x')
+		for name in names[1::2]:
+			write_to_file('union/ro1_dir/%s' % name, 'x')
+		lst = os.listdir('union/ro1_dir')
+		self.assertEqual(len(lst), len(set(lst)))
+		self.assertTrue(set(names).issubset(set(lst)))
+
+	def test_large_file(self):
+		# several read and write requests, spliced when the kernel supports it
+		data = ''.join('%07d\n' % i for i in range(200000))
+		write_to_file('ro1/ro1_large', data)
+		self.assertEqual(read_from_file('union/ro1_large'), data)
+		with open('union/ro1_large', 'r+') as f:
+			f.seek(len(data) // 2)
+			f.write(data[:100000])
+		modified = data[:len(data) // 2] + data[:100000] + data[len(data) // 2 + 100000:]
+		self.assertEqual(read_from_file('union/ro1_large'), modified)
+		self.assertEqual(read_from_file('ro1/ro1_large'), data)
+
 	def test_whiteout(self):
 		os.remove('union/ro1_file')
 
@@ -238,6 +274,60 @@ class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
 		self.assertEqual(read_from_file('rw1/ro1_file'), 'something')
 
+	def test_cow_sparse(self):
+		with open('ro1/sparse', 'wb') as f:
+			f.write(b'head')
+			f.seek(16 * 1024 * 1024)
+			f.write(b'data')
+			f.truncate(64 * 1024 * 1024)
+
+		with open('union/sparse', 'r+b') as f:
+			f.write(b'H')
+
+		with open('rw1/sparse', 'rb') as f:
+			data = f.read()
+		self.assertEqual(len(data), 64 * 1024 * 1024)
+		self.assertEqual(data[:4], b'Head')
+		self.assertEqual(data[16 * 1024 * 1024:16 * 1024 * 1024 + 4], b'data')
+		self.assertEqual(data.count(0), len(data) - 8)
+
+	def test_cow_concurrent(self):
+		# all threads write to the same copy, none of the writes may get lost
+		write_to_file('ro1/ro1_big', '.' * (4 * 1024 * 1024))
+		barrier = threading.Barrier(16)
+
+		def writer(i):
+			barrier.wait()
+			fd = os.open('union/ro1_big', os.O_WRONLY)
+			os.pwrite(fd, b'%c' % (ord('A') + i), i)
+			os.close(fd)
+
+		threads = [threading.Thread(target=writer, args=(i,)) for i in range(16)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+
+		self.assertEqual(read_from_file('rw1/ro1_big')[:17], 'ABCDEFGHIJKLMNOP.')
+		self.assertEqual(read_from_file('ro1/ro1_big')[:16], '.' * 16)
+
+	def test_rename_dir_tree(self):
+		# enough entries to keep several copy threads busy
+		for d in ['a', 'a/b', 'a/b/c']:
+			os.makedirs('ro1/tree/%s' % d, exist_ok=True)
+			for i in range(100):
+				write_to_file('ro1/tree/%s/file%d' % (d, i), '%s%d' % (d, i))
+		os.chmod('ro1/tree/a/b/c', 0o555)
+
+		os.rename('union/tree', 'union/tree_renamed')
+
+		self.assertFalse(os.path.exists('union/tree'))
+		self.assertTrue(os.path.isdir('ro1/tree'))
+		for d in ['a', 'a/b', 'a/b/c']:
+			for i in range(100):
+				self.assertEqual(read_from_file('union/tree_renamed/%s/file%d' % (d, i)), '%s%d' % (d, i))
+		self.assertEqual(os.stat('rw1/tree_renamed/a/b/c').st_mode & 0o777, 0o555)
+
 	def test_cow_and_whiteout(self):
 		write_to_file('union/ro1_file', 'something')
 		os.remove('union/ro1_file')
@@ -449,6 +539,554 @@ class UnionFS_RO_RW_COW_TestCase(Common, unittest.TestCase):
 		#self.assertFalse(os.path.isdir('union/common_dir'))
 
 
+class UnionFS_RW_RO_COW_LookupCache_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,lookup_cache=1000,lookup_cache_ttl=60 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_negative_entry(self):
+		self.assertFalse(os.path.exists('union/new_file'))
+		write_to_file('union/new_file', 'something')
+		self.assertEqual(read_from_file('union/new_file'), 'something')
+
+	def test_whiteout_and_recreate(self):
+		self.assertTrue(os.path.isfile('union/ro1_file'))
+		os.remove('union/ro1_file')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+		write_to_file('union/ro1_file', 'again')
+		self.assertEqual(read_from_file('union/ro1_file'), 'again')
+
+	def test_rename_dir(self):
+		self.assertTrue(os.path.isfile('union/ro1_dir/ro1_file'))
+		os.rename('union/ro1_dir', 'union/ro1_dir_renamed')
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+		self.assertEqual(read_from_file('union/ro1_dir_renamed/ro1_file'), 'ro1')
+
+
+class UnionFS_RW_RO_COW_WhiteoutIndex_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		# whiteouts existing before the mount must be read into the index
+		os.makedirs('rw1/.unionfs/ro1_dir')
+		write_to_file('rw1/.unionfs/ro1_dir/ro1_file_HIDDEN~', '')
+		self.mount('%s -o cow,whiteout_index rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_listing(self):
+		lst = ['ro1_file', 'rw1_file', 'ro_common_file', 'rw_common_file', 'common_file', 'ro1_dir', 'rw1_dir', 'common_dir', 'common_empty_dir', '.unionfs', ]
+		self.assertEqual(set(lst), set(os.listdir('union')))
+
+	def test_existing_whiteout(self):
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+		self.assertNotIn('ro1_file', os.listdir('union/ro1_dir'))
+
+	def test_whiteout_and_recreate(self):
+		os.remove('union/ro_common_file')
+		self.assertFalse(os.path.exists('union/ro_common_file'))
+		write_to_file('union/ro_common_file', 'again')
+		self.assertEqual(read_from_file('union/ro_common_file'), 'again')
+
+
+class UnionFS_RW_RO_COW_Warmup_TestCase(UnionFS_RW_RO_COW_WhiteoutIndex_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		# the index is loaded by the warm-up, until then METADIR is used
+		os.makedirs('rw1/.unionfs/ro1_dir')
+		write_to_file('rw1/.unionfs/ro1_dir/ro1_file_HIDDEN~', '')
+		self.mount('%s -o cow,whiteout_index,lookup_cache=1000,warmup_dirs=/common_dir:/rw1_dir rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_progress(self):
+		for i in range(100):
+			stats = call('%s -s union' % self.unionfsctl_path).decode()
+			if re.search(r'^warmup\s+done$', stats, re.M):
+				break
+			time.sleep(0.1)
+		self.assertRegex(stats, r'(?m)^warmup\s+done$')
+		self.assertRegex(stats, r'(?m)^warmup_branches_left\s+0$')
+		self.assertRegex(stats, r'(?m)^warmup_whiteouts\s+1$')
+		self.assertRegex(stats, r'(?m)^warmup_dirs\s+2$')
+		self.assertRegex(stats, r'(?m)^warmup_entries\s+4$')
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+
+
+class UnionFS_RW_RO_COW_WhiteoutJournal_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		# a journal left by a crash is replayed and applied on mount
+		os.mkdir('rw1/.unionfs')
+		path = b'/ro1_dir/ro1_file'
+		with open('rw1/.unionfs/.journal', 'wb') as f:
+			f.write(struct.pack('=BBH', ord('F'), 0, len(path)) + path)
+		self.mount('%s -o cow,whiteout_journal rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_listing(self):
+		lst = ['ro1_file', 'rw1_file', 'ro_common_file', 'rw_common_file', 'common_file', 'ro1_dir', 'rw1_dir', 'common_dir', 'common_empty_dir', '.unionfs', ]
+		self.assertEqual(set(lst), set(os.listdir('union')))
+
+	def test_replayed_journal(self):
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+		self.assertNotIn('ro1_file', os.listdir('union/ro1_dir'))
+		self.assertTrue(os.path.exists('rw1/.unionfs/ro1_dir/ro1_file_HIDDEN~'))
+
+	def test_whiteout_logged(self):
+		os.remove('union/ro_common_file')
+		self.assertFalse(os.path.exists('union/ro_common_file'))
+		self.assertNotIn('ro_common_file', os.listdir('union'))
+		self.assertFalse(os.path.exists('rw1/.unionfs/ro_common_file_HIDDEN~'))
+		self.assertGreater(os.path.getsize('rw1/.unionfs/.journal'), 0)
+
+		write_to_file('union/ro_common_file', 'again')
+		self.assertEqual(read_from_file('union/ro_common_file'), 'again')
+
+	def test_rmdir_logged(self):
+		os.rmdir('union/ro1_dir')
+		self.assertFalse(os.path.exists('union/ro1_dir'))
+		os.mkdir('union/ro1_dir')
+		self.assertEqual(os.listdir('union/ro1_dir'), [])
+
+	def test_negative_entry(self):
+		# the miss is cached by the kernel, the create must replace it
+		self.assertFalse(os.path.exists('union/ro1_dir/new_file'))
+		write_to_file('union/ro1_dir/new_file', 'new')
+		self.assertEqual(read_from_file('union/ro1_dir/new_file'), 'new')
+		os.remove('union/ro1_dir/new_file')
+		self.assertFalse(os.path.exists('union/ro1_dir/new_file'))
+
+
+class UnionFS_RW_RO_COW_Readdirplus_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,readdirplus rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_stat_after_listing(self):
+		for name in os.listdir('union'):
+			self.assertEqual(os.lstat('union/%s' % name).st_mode, os.lstat(self._branch_of(name) + '/' + name).st_mode)
+
+	def test_chmod_after_listing(self):
+		os.listdir('union')
+		os.chmod('union/rw1_file', 0o640)
+		self.assertEqual(os.stat('union/rw1_file').st_mode & 0o777, 0o640)
+
+	def test_write_after_listing(self):
+		os.listdir('union')
+		write_to_file('union/ro1_file', 'something longer')
+		self.assertEqual(os.stat('union/ro1_file').st_size, len('something longer'))
+
+	def _branch_of(self, name):
+		return 'rw1' if os.path.lexists('rw1/%s' % name) else 'ro1'
+
+
+class UnionFS_RW_RO_COW_LowLevel_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,lowlevel rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_rename_dir_children(self):
+		os.rename('union/ro1_dir', 'union/ro1_dir_renamed')
+		self.assertFalse(os.path.exists('union/ro1_dir'))
+		self.assertEqual(read_from_file('union/ro1_dir_renamed/ro1_file'), 'ro1')
+
+	def test_copy_up_visible(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		write_to_file('union/ro1_file', 'changed')
+		self.assertEqual(read_from_file('union/ro1_file'), 'changed')
+		self.assertEqual(read_from_file('rw1/ro1_file'), 'changed')
+
+
+class UnionFS_RW_RO_COW_CacheTimeout_TestCase(UnionFS_RW_RO_COW_LowLevel_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,lowlevel,cache_timeout=60 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_whiteout_visible(self):
+		self.assertTrue(os.path.exists('union/ro1_dir/ro1_file'))
+		shutil.rmtree('union/ro1_dir')
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+		self.assertFalse(os.path.exists('union/ro1_dir'))
+		os.mkdir('union/ro1_dir')
+		self.assertEqual(os.listdir('union/ro1_dir'), [])
+
+
+class UnionFS_RW_RO_COW_Readahead_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,readahead=256 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_sequential_read(self):
+		data = 'x' * (4 * 1024 * 1024)
+		write_to_file('ro1/ro1_large', data)
+		self.assertEqual(read_from_file('union/ro1_large'), data)
+
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, r'\nreadahead_windows +[1-9]\d*\n')
+
+
+class UnionFS_RW_RO_COW_BranchThreads_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,branch_threads=2 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_stats(self):
+		write_to_file('union/ro1_file', 'changed')
+		self.assertEqual(read_from_file('union/ro1_file'), 'changed')
+
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, r'\n1 +0 +0 +no +[1-9]\d* +0 +0\n')
+
+
+class UnionFS_RW_RO_ChangeBranches_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def branches(self):
+		return call('%s -b union' % self.unionfsctl_path).decode()
+
+	def test_add_remove(self):
+		self.assertFalse(os.path.exists('union/ro2_file'))
+
+		call('%s -a ro2 union' % self.unionfsctl_path)
+		self.assertRegex(self.branches(), r'\n2 +RO +/.*/ro2/\n')
+		self.assertEqual(read_from_file('union/ro2_file'), 'ro2')
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro1')
+
+		call('%s -m 2:1 union' % self.unionfsctl_path)
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro2')
+
+		call('%s -r 1 union' % self.unionfsctl_path)
+		time.sleep(1.1) # the kernel caches the entry for a second
+		self.assertFalse(os.path.exists('union/ro2_file'))
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro1')
+
+	def test_mode(self):
+		call('%s -a 0:rw2=rw union' % self.unionfsctl_path)
+		write_to_file('union/new_file', 'new')
+		self.assertEqual(read_from_file('rw2/new_file'), 'new')
+
+		call('%s -f 0=ro union' % self.unionfsctl_path)
+		write_to_file('union/newer_file', 'newer')
+		self.assertEqual(read_from_file('rw1/newer_file'), 'newer')
+		self.assertRegex(self.branches(), r'^0 +RO +/.*/rw2/\n1 +RW ')
+
+
+class UnionFS_RW_RO_COW_DirCache_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,dir_cache=1000 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_rm_tree(self):
+		self.assertEqual(sorted(os.listdir('union/common_dir')), ['common_file', 'ro1_file', 'rw1_file'])
+		with self.assertRaises(OSError):
+			os.rmdir('union/common_dir')
+
+		os.remove('union/common_dir/common_file')
+		os.remove('union/common_dir/ro1_file')
+		self.assertEqual(os.listdir('union/common_dir'), ['rw1_file'])
+		with self.assertRaises(OSError):
+			os.rmdir('union/common_dir')
+
+		os.remove('union/common_dir/rw1_file')
+		os.rmdir('union/common_dir')
+		self.assertFalse(os.path.exists('union/common_dir'))
+
+	def test_created_after_listing(self):
+		self.assertEqual(os.listdir('union/ro1_dir'), ['ro1_file'])
+		os.remove('union/ro1_dir/ro1_file')
+		write_to_file('union/ro1_dir/new_file', 'new')
+		with self.assertRaises(OSError):
+			os.rmdir('union/ro1_dir')
+		self.assertEqual(os.listdir('union/ro1_dir'), ['new_file'])
+
+		os.remove('union/ro1_dir/new_file')
+		os.rmdir('union/ro1_dir')
+		self.assertFalse(os.path.exists('union/ro1_dir'))
+
+	def test_rm_r(self):
+		shutil.rmtree('union/common_dir')
+		self.assertFalse(os.path.exists('union/common_dir'))
+		os.mkdir('union/common_dir')
+		self.assertEqual(os.listdir('union/common_dir'), [])
+
+
+class UnionFS_RW_RO_COW_InodeMap_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,inode_map rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_unique(self):
+		names = ['ro1_file', 'rw1_file', 'common_file', 'ro_common_file', 'rw_common_file', 'ro1_dir', 'rw1_dir', 'common_dir']
+		inos = [os.lstat('union/%s' % n).st_ino for n in names]
+		self.assertEqual(len(set(inos)), len(names))
+
+	def test_readdir_ino(self):
+		for entry in os.scandir('union'):
+			self.assertEqual(entry.inode(), os.lstat(entry.path).st_ino)
+
+	def test_copyup(self):
+		ino = os.lstat('union/ro1_dir/ro1_file').st_ino
+		dir_ino = os.lstat('union/ro1_dir').st_ino
+		os.chmod('union/ro1_dir/ro1_file', 0o600)
+		self.assertTrue(os.path.exists('rw1/ro1_dir/ro1_file'))
+		self.assertEqual(os.lstat('union/ro1_dir/ro1_file').st_ino, ino)
+		self.assertEqual(os.lstat('union/ro1_dir').st_ino, dir_ino)
+
+	def test_remount(self):
+		ino = os.lstat('union/ro1_file').st_ino
+		os.chmod('union/ro1_file', 0o600)
+		self.assertGreater(os.path.getsize('rw1/.unionfs/.inodes'), 0)
+
+		call('fusermount -u union')
+		self.mounted = False
+		self.mount('%s -o cow,inode_map rw1=rw:ro1=ro union' % self.unionfs_path)
+		self.assertEqual(os.lstat('union/ro1_file').st_ino, ino)
+
+
+class UnionFS_RW_RO_COW_XattrCache_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,xattr_cache=1000 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_missing(self):
+		try:
+			os.setxattr('rw1/rw1_file', 'user.probe', b'x')
+			os.listxattr('union/rw1_file')
+		except OSError:
+			self.skipTest('no xattr support')
+
+		for i in range(2):
+			with self.assertRaises(OSError):
+				os.getxattr('union/ro1_file', 'user.test')
+
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, r'\nxattr_cache_hits +[1-9]\d*\n')
+
+		# copied up and no longer missing
+		os.setxattr('union/ro1_file', 'user.test', b'value')
+		self.assertEqual(os.getxattr('union/ro1_file', 'user.test'), b'value')
+		self.assertIn('user.test', os.listxattr('union/ro1_file'))
+
+		os.removexattr('union/ro1_file', 'user.test')
+		self.assertNotIn('user.test', os.listxattr('union/ro1_file'))
+		with self.assertRaises(OSError):
+			os.getxattr('union/ro1_file', 'user.test')
+
+
+class UnionFS_RW_RO_COW_SharedCaches_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,lookup_cache=1000,whiteout_index,xattr_cache=1000 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_concurrent_whiteouts(self):
+		# the caches and the index are read by all threads while others change them
+		for i in range(8):
+			write_to_file('ro1/shared%d' % i, 'ro1')
+		barrier = threading.Barrier(8)
+		errors = []
+
+		def worker(i):
+			barrier.wait()
+			try:
+				for n in range(50):
+					os.remove('union/shared%d' % i)
+					if os.path.exists('union/shared%d' % i):
+						errors.append('shared%d still there' % i)
+					write_to_file('union/shared%d' % i, '%d' % n)
+					for j in range(8):
+						os.path.exists('union/shared%d' % j)
+			except OSError as e:
+				errors.append(str(e))
+
+		threads = [threading.Thread(target=worker, args=(i,)) for i in range(8)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+
+		self.assertEqual(errors, [])
+		for i in range(8):
+			self.assertEqual(read_from_file('union/shared%d' % i), '49')
+		os.remove('union/shared0')
+		self.assertFalse(os.path.exists('union/shared0'))
+		self.assertNotIn('shared0', os.listdir('union'))
+
+
+class UnionFS_RW_RO_COW_Cache_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		os.mkdir('cache')
+		self.mount('%s -o cow,cache_opens=2 rw1=rw:ro1=ro:cache=CACHE union' % self.unionfs_path)
+
+	def cached_files(self):
+		return [f for _, _, files in os.walk('cache') for f in files]
+
+	def wait_cached(self, count):
+		for i in range(50):
+			if len(self.cached_files()) == count: break
+			time.sleep(0.1)
+		self.assertEqual(len(self.cached_files()), count)
+
+	def test_read_through(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		self.assertEqual(self.cached_files(), [])
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		self.wait_cached(1)
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, r'\ncache_hits +[1-9]\d*\n')
+		self.assertRegex(stats, r'\ncache_copies +1\n')
+
+		# not part of the union
+		self.assertNotIn('cache', os.listdir('union'))
+
+	def test_stale_copy(self):
+		read_from_file('union/ro1_file')
+		read_from_file('union/ro1_file')
+		self.wait_cached(1)
+
+		write_to_file('ro1/ro1_file', 'changed')
+		self.assertEqual(read_from_file('union/ro1_file'), 'changed')
+		self.assertEqual(self.cached_files(), [])
+
+	def test_rw_branch_not_cached(self):
+		for i in range(3):
+			self.assertEqual(read_from_file('union/rw1_file'), 'rw1')
+		time.sleep(0.5)
+		self.assertEqual(self.cached_files(), [])
+
+
+class UnionFS_RW_RO_COW_LazyCow_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,lazy_cow rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_open_rdwr_without_write(self):
+		with open('union/ro1_file', 'r+') as f:
+			self.assertEqual(f.read(), 'ro1')
+		self.assertFalse(os.path.exists('rw1/ro1_file'))
+
+	def test_copy_up_on_write(self):
+		with open('union/ro1_file', 'r+') as f:
+			self.assertFalse(os.path.exists('rw1/ro1_file'))
+			f.write('R')
+			f.flush()
+			self.assertTrue(os.path.exists('rw1/ro1_file'))
+			f.seek(0)
+			self.assertEqual(f.read(), 'Ro1')
+		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
+
+	def test_copy_up_on_ftruncate(self):
+		with open('union/ro1_file', 'r+') as f:
+			f.truncate(1)
+		self.assertEqual(read_from_file('union/ro1_file'), 'r')
+		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
+
+
+class UnionFS_RW_RO_COW_PartialCow_TestCase(UnionFS_RW_RO_COW_TestCase):
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,partial_cow=1 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def _make_image(self):
+		# a bit more than 4 chunks
+		self.image = bytes(range(256)) * (4 * 4096 + 17)
+		with open('ro1/image', 'wb') as f:
+			f.write(self.image)
+
+	def test_partial_write(self):
+		self._make_image()
+		with open('union/image', 'r+b') as f:
+			f.seek(1024 * 1024 + 10)
+			f.write(b'patched')
+
+		expected = bytearray(self.image)
+		expected[1024 * 1024 + 10:1024 * 1024 + 17] = b'patched'
+		with open('union/image', 'rb') as f:
+			self.assertEqual(f.read(), bytes(expected))
+		self.assertTrue(os.path.exists('rw1/.unionfs/image_CHUNKS~'))
+		with open('ro1/image', 'rb') as f:
+			self.assertEqual(f.read(), self.image)
+
+	def test_partial_truncate(self):
+		self._make_image()
+		os.truncate('union/image', 1500000)
+		with open('union/image', 'rb') as f:
+			self.assertEqual(f.read(), self.image[:1500000])
+
+	def test_rename_completes(self):
+		self._make_image()
+		with open('union/image', 'r+b') as f:
+			f.write(b'X')
+		os.rename('union/image', 'union/image2')
+		self.assertFalse(os.path.exists('rw1/.unionfs/image_CHUNKS~'))
+		with open('rw1/image2', 'rb') as f:
+			self.assertEqual(f.read(), b'X' + self.image[1:])
+
+
+class UnionFS_RW_RO_RO_Bloom_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		# read-only branches must not change while mounted with bloom
+		os.symlink('%s/ro2/ro2_dir' % self.tmpdir, 'ro1/link_dir')
+		call('%s ro2' % self.unionfs_index_path)
+		self.mount('%s -o cow,bloom rw1=rw:ro1=ro:ro2=ro union' % self.unionfs_path)
+
+	def test_index_file(self):
+		self.assertTrue(os.path.isfile('ro2/.unionfs/.bloom'))
+
+	def test_lookup(self):
+		self.assertEqual(read_from_file('union/ro2_file'), 'ro2')
+		self.assertEqual(read_from_file('union/ro2_dir/ro2_file'), 'ro2')
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro1')
+		self.assertFalse(os.path.exists('union/nonexistent'))
+		self.assertFalse(os.path.exists('union/ro2_dir/nonexistent'))
+
+	def test_symlink(self):
+		self.assertEqual(read_from_file('union/link_dir/ro2_file'), 'ro2')
+
+	def test_listing(self):
+		lst = ['ro1_file', 'ro2_file', 'ro2_dir', 'link_dir', 'common_file']
+		self.assertTrue(set(lst) <= set(os.listdir('union')))
+		self.assertEqual(set(os.listdir('union/ro2_dir')), {'ro2_file'})
+
+	def test_delete(self):
+		os.remove('union/ro2_file')
+		self.assertFalse(os.path.exists('union/ro2_file'))
+		self.assertTrue(os.path.exists('ro2/ro2_file'))
+
+
+class UnionFS_RW_RO_IDX_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.symlink('ro2_file', 'ro2/link_file')
+		call('%s ro2' % self.unionfs_index_path)
+		self.mount('%s -o cow rw1=rw:ro1=ro:ro2=RO+IDX union' % self.unionfs_path)
+
+	def test_index_file(self):
+		self.assertTrue(os.path.isfile('ro2/.unionfs/.index'))
+
+	def test_getattr(self):
+		self.assertEqual(os.stat('union/ro2_dir/ro2_file').st_size, 3)
+		self.assertEqual(read_from_file('union/ro2_dir/ro2_file'), 'ro2')
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro1')
+		self.assertFalse(os.path.exists('union/nonexistent'))
+		self.assertFalse(os.path.exists('union/ro2_dir/nonexistent'))
+
+	def test_readlink(self):
+		self.assertEqual(os.readlink('union/link_file'), 'ro2_file')
+		self.assertEqual(read_from_file('union/link_file'), 'ro2')
+
+	def test_listing(self):
+		lst = ['ro1_file', 'ro2_file', 'ro2_dir', 'link_file', 'common_file']
+		self.assertTrue(set(lst) <= set(os.listdir('union')))
+		self.assertEqual(set(os.listdir('union/ro2_dir')), {'ro2_file'})
+		self.assertEqual(set(os.listdir('union/common_dir')), {'rw1_file', 'ro1_file', 'ro2_file', 'common_file'})
+
+	def test_delete(self):
+		os.remove('union/ro2_file')
+		self.assertFalse(os.path.exists('union/ro2_file'))
+		self.assertTrue(os.path.exists('ro2/ro2_file'))
+
+
 @unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
 class IOCTL_TestCase(Common, unittest.TestCase):
 	def setUp(self):
@@ -469,6 +1107,26 @@ class IOCTL_TestCase(Common, unittest.TestCase):
 		self.assertRegex(read_from_file(debug_fn), 'unionfs_unlink')
 		self.assertTrue(os.stat(debug_fn).st_size > 0)
 
+	def test_stats(self):
+		write_to_file('union/rw_common_file', 'hello')
+		self.assertEqual(read_from_file('union/rw_common_file'), 'hello')
+		self.assertFalse(os.path.exists('union/nonexistent'))
+
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, r'\nwrite +[1-9]\d* +0\n')
+		self.assertRegex(stats, r'\ngetattr +[1-9]\d* +[1-9]\d*\n')
+		self.assertRegex(stats, r'\nbytes_written +5\n')
+		self.assertRegex(stats, r'\nbytes_read +5\n')
+		self.assertRegex(stats, r'\nbranch 0 +[1-9]\d*\n')
+
+	def test_latency(self):
+		write_to_file('union/rw_common_file', 'hello')
+		self.assertEqual(read_from_file('union/rw_common_file'), 'hello')
+
+		latency = call('%s -l union' % self.unionfsctl_path).decode()
+		self.assertRegex(latency, r'\nwrite +[1-9]\d*( +\d+\.\d){5}\n')
+		self.assertRegex(latency, r'\nbranch 0 +[1-9]\d*( +\d+\.\d){5}\n')
+
 	def test_wrong_args(self):
 		with self.assertRaises(subprocess.CalledProcessError) as contextmanager:
 			call('%s -xxxx 2>/dev/null' % self.unionfsctl_path)
@@ -477,6 +1135,44 @@ class IOCTL_TestCase(Common, unittest.TestCase):
 		self.assertEqual(ex.output, b'')
 
 
+class IOCTL_Trace_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.trace_fn = '%s/trace.bin' % self.tmpdir
+		self.mount('%s -o trace_file=%s rw1=rw:ro1=ro union' % (self.unionfs_path, self.trace_fn))
+
+	def test_trace(self):
+		call('%s -t on union' % self.unionfsctl_path)
+		write_to_file('union/rw_common_file', 'hello')
+		self.assertFalse(os.path.exists('union/nonexistent'))
+		call('%s -t off union' % self.unionfsctl_path)
+
+		trace = call('%s %s' % (self.unionfstrace_path, self.trace_fn)).decode()
+		self.assertRegex(trace, r' write +-1 +5 +\d+ /rw_common_file\n')
+		self.assertRegex(trace, r' find_branch +-1 +-2 +\d+ /nonexistent\n')
+
+
+class IOCTL_TraceCapture_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.trace_fn = '%s/trace.bin' % self.tmpdir
+		self.mount('%s -o trace_file=%s,trace_capture rw1=rw:ro1=ro union' % (self.unionfs_path, self.trace_fn))
+
+	def test_replay(self):
+		call('%s -t on union' % self.unionfsctl_path)
+		write_to_file('union/rw_common_file', 'hello')
+		self.assertFalse(os.path.exists('union/nonexistent'))
+		call('%s -t off union' % self.unionfsctl_path)
+
+		trace = call('%s %s' % (self.unionfstrace_path, self.trace_fn)).decode()
+		self.assertRegex(trace, r' args +5 +0 +#[0-9a-f]+\n')
+
+		out = call('%s -j 4 %s union' % (self.unionfs_replay_path, self.trace_fn)).decode()
+		self.assertRegex(out, r'replayed +[1-9]\d*\n')
+		self.assertRegex(out, r'results_differ +0\n')
+		self.assertEqual(read_from_file('union/rw_common_file'), 'hello')
+
+
 class UnionFS_RW_RO_COW_RelaxedPermissions_TestCase(Common, unittest.TestCase):
 	def setUp(self):
 		super().setUp()